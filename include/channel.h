@@ -0,0 +1,138 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Channels multiplexed over a single connection
+ * @file channel.h
+ *
+ * Every FRAME_TYPE_DATA frame belongs to the channel in its header, and the
+ * server relays a message only to the connections that joined its channel,
+ * so a client talks in many rooms through a single connection. Every
+ * connection starts in CHANNEL_DEFAULT, the room of the clients that know
+ * nothing about channels. A client joins a channel with a FRAME_TYPE_JOIN
+ * frame and leaves it with a FRAME_TYPE_LEAVE frame, both with an empty
+ * payload and the channel in the header. The channels of a client with a
+ * session are kept by the session, so they survive the reconnections.
+ *
+ * The chunks of a message are relayed as they arrive, and a channel relays
+ * them one after the other: the other messages of the channel are held
+ * until the last chunk, so that a client never gets two messages mixed up.
+ * The messages held are bounded by the window of the server: past it, the
+ * message is cut short for the client, with an empty last chunk, and the
+ * rest of its chunks are dropped as they come, like the chunks of a message
+ * that began before the client joined the channel.
+ *
+ * The bytes queued for a client are also counted per channel, so that a
+ * busy room can't hold back the rest of the rooms of the same connection:
+ * once the window of a channel is queued or held for a client without
+ * session, the messages of that channel are skipped for it. A client with a
+ * session counts every message it's sent, so once the window of a channel
+ * is queued for it the messages of the channel wait in its backlog, and are
+ * queued and recorded in the session as the channel drains.
+ */
+#ifndef GUARD_CHANNEL_H
+#define GUARD_CHANNEL_H
+
+#include "message.h"
+
+#include <stdint.h>
+
+/** channel every connection starts in */
+#define CHANNEL_DEFAULT 0
+
+/** max number of channels a connection can be in at once */
+#define CHANNEL_MAX_JOINED 32
+
+/**
+ * Channel joined by a connection
+ */
+struct channel_t {
+    uint16_t id;        /**< id of the channel */
+    size_t queued;      /**< bytes of the channel queued for the client */
+    uint64_t chunked;   /**< message being relayed in chunks, 0 if none */
+    int skipping;       /**< 1 while the chunks of the message relayed are
+                             skipped for the client */
+    struct send_queue_t held;   /**< messages held until the last chunk of
+                                     the one being relayed */
+    struct send_queue_t backlog;    /**< messages waiting for the window of
+                                         a client with a session */
+};
+
+/**
+ * Channels joined by a connection
+ */
+struct channel_set_t {
+    struct channel_t channels[CHANNEL_MAX_JOINED]; /**< channels joined */
+    size_t count;       /**< number of channels joined */
+};
+
+/**
+ * Initializes a set holding only CHANNEL_DEFAULT
+ *
+ * @param set set of channels
+ */
+void channel_set_init(struct channel_set_t *set);
+
+/**
+ * Drops the messages held or waiting in the backlog of every channel of the
+ * set
+ *
+ * @param set set of channels
+ */
+void channel_set_clear(struct channel_set_t *set);
+
+/**
+ * Returns a channel of the set
+ *
+ * @param set set of channels
+ * @param id id of the channel
+ * @return the channel, or NULL if it wasn't joined
+ */
+struct channel_t *channel_find(struct channel_set_t *set, uint16_t id);
+
+/**
+ * Adds a channel to the set, if it isn't there already
+ *
+ * @param set set of channels
+ * @param id id of the channel
+ * @return 0 on success, -1 if there are CHANNEL_MAX_JOINED channels already
+ */
+int channel_join(struct channel_set_t *set, uint16_t id);
+
+/**
+ * Removes a channel from the set, if it's there, dropping the messages it
+ * holds or has in its backlog
+ *
+ * @param set set of channels
+ * @param id id of the channel
+ */
+void channel_leave(struct channel_set_t *set, uint16_t id);
+
+/**
+ * Relays a message of the channel, or holds it until the message being
+ * relayed in chunks ends. The messages released are appended to ready, in
+ * the order they are to be sent. When the bytes held exceed the window, the
+ * message being relayed is cut short: an empty last chunk is released in
+ * place of the chunks missing, that are dropped as they come, and the
+ * messages held are released. The chunks of a message whose first chunk the
+ * channel didn't relay are dropped too.
+ *
+ * @param channel channel of the message
+ * @param message message relayed, tagged with the message it is a chunk of
+ * @param window max number of bytes held
+ * @param ready messages released, the caller sends them and clears it
+ * @return 1 if a message was cut short, 0 otherwise, -1 if there was no
+ * memory to cut it short, the message being held nonetheless
+ */
+int channel_relay(struct channel_t *channel, struct message_t *message,
+        size_t window, struct send_queue_t *ready);
+
+/**
+ * Creates a FRAME_TYPE_JOIN or FRAME_TYPE_LEAVE frame
+ *
+ * @param type type of the frame
+ * @param id id of the channel
+ * @return the message or NULL if there's no memory
+ */
+struct message_t *channel_frame(uint8_t type, uint16_t id);
+
+#endif /* ifndef GUARD_CHANNEL_H */
@@ -8,19 +8,79 @@
 #ifndef GUARD_CLIENT_H
 #define GUARD_CLIENT_H
 
+#include "channel.h"
 #include "common.h"
+#include "compress.h"
+#include "history.h"
+#include "output.h"
+#include "pool.h"
+#include "session.h"
+#include "shm.h"
+
+#include <pthread.h>
+
+/** delay before the first reconnection attempt, in milliseconds */
+#define RECONNECT_MIN_DELAY 100
+
+/** max delay between two reconnection attempts, in milliseconds */
+#define RECONNECT_MAX_DELAY 10000
+
+/** number of reconnection attempts before giving up */
+#define RECONNECT_MAX_ATTEMPTS 20
+
+/** seconds of silence before the connection is probed */
+#define KEEPALIVE_IDLE 10
+
+/** seconds between probes of a silent connection */
+#define KEEPALIVE_INTERVAL 5
+
+/** number of unanswered probes after which the connection is dropped */
+#define KEEPALIVE_COUNT 3
+
+/** maximum number of queued frames written by a single sendmsg call */
+#define CLIENT_SEND_BATCH_MAX 64
 
 /**
  * @brief Client structure 
  *
  * Structure that represents the client. It contains the af_family, the
- * connected socket and the buffers for sending and receiving.
+ * connected socket and the buffers for sending and receiving. The buffer of
+ * the messages received is taken from a pool, sized for each message.
+ * A chatting client keeps a session with the server, so that it can reconnect
+ * without losing messages. The main thread sends what is typed while another
+ * one receives and reconnects, so the sends are serialized by lock, unless
+ * the client runs its single threaded event loop. A client
+ * of a shm endpoint exchanges the frames through the rings of a region of
+ * shared memory instead of the socket. Messages longer than send_buffer are
+ * sent in chunks, and the ones received in chunks are shown chunk by chunk,
+ * as they arrive. The client talks in every channel it
+ * joined through the same connection.
  */
 struct client_t {
     int family;         /**< AF_INET or AF_INET6 */
     int socket_connected;   /**< socket connected to server */
-    char recv_buffer[BUFFER_SIZE];   /**< buffer used for messages to receive */
+    struct buffer_pool_t pool;  /**< buffers of the messages received */
+    char *recv_buffer;  /**< message received, NULL when there is none */
+    size_t recv_capacity;   /**< size of recv_buffer */
+    uint32_t recv_length;   /**< number of bytes of the message received */
+    uint8_t recv_type;  /**< type of the frame received */
+    uint8_t recv_flags; /**< flags of the frame received */
+    uint16_t recv_channel;  /**< channel of the frame received */
     char send_buffer[BUFFER_SIZE];   /**< buffer used for messages to send */
+    int send_more;      /**< 1 while the message sent in chunks goes on */
+    uint16_t channel;   /**< channel the messages typed are sent to */
+    struct channel_set_t channels;  /**< channels joined, joined again when
+                                         a session is opened */
+    char *hostname;     /**< server connected to, to reconnect */
+    char *port;         /**< port of the server */
+    struct session_t session;   /**< session kept across reconnections */
+    pthread_mutex_t lock;   /**< protects the session and the sends */
+    int connected;      /**< 0 while the client is reconnecting */
+    struct shm_region_t *shm;   /**< rings of a shm endpoint, NULL for none */
+    uint32_t codec;     /**< compression agreed on, COMPRESS_CODEC_NONE */
+    int queue_sends;    /**< 1 while the frames sent are queued for a
+                             non-blocking socket, in the event loop */
+    struct send_queue_t send_queue; /**< frames waiting for the socket */
 };
 
 /**
@@ -33,6 +93,134 @@ struct client_t {
  */
 int connect_to_server(char *hostname, char *port, struct client_t *client);
 
+/**
+ * Sends the frame held by the message to the server, through the socket or
+ * through the ring of a shm endpoint
+ *
+ * @param client client connected to the server
+ * @param message message holding the frame
+ * @return 1 on success, -1 on error
+ */
+int send_message_frame(struct client_t *client, struct message_t *message);
+
+/**
+ * Sends the frames queued for the server as far as the non-blocking socket
+ * takes them. The lock of the client must be held.
+ *
+ * @param client client running the event loop
+ * @return 1 on success, -1 on error
+ */
+int flush_send_queue(struct client_t *client);
+
+/**
+ * Receives a whole frame from the server, through the socket or through the
+ * ring of a shm endpoint, into the recv_buffer of the client
+ *
+ * @param client client connected to the server
+ * @param h header of the frame received
+ * @return 1 on success, 0 if the server closed the connection, -1 on error
+ */
+int receive_message_frame(struct client_t *client, struct frame_header_t *h);
+
+/**
+ * Takes a frame reassembled by a frame reader as the frame received by the
+ * client: the payload is copied to its recv_buffer, followed by a null
+ * terminator, and handled as receive_message_frame does
+ *
+ * @param client client connected to the server
+ * @param h header of the frame, updated if the payload is decompressed
+ * @param payload payload of the frame
+ * @return 1 if the client holds the frame, 0 if it was the answer to the
+ * compression offer, -1 on error
+ */
+int take_message_frame(struct client_t *client, struct frame_header_t *h,
+        const char *payload);
+
+/**
+ * Opens a session with the server, or resumes the one the client had, and
+ * sends again the messages the server didn't receive. The messages received
+ * before the answer of the server are shown only when opening a new session,
+ * otherwise they are part of the replay. The channels of the client are
+ * joined again, in case the server lost the session.
+ *
+ * @param client client connected to the server, with its lock held when the
+ * receiving thread is running
+ * @param output output stage showing the messages received
+ * @return 1 on success, 0 if the server closed the connection, -1 on error
+ */
+int open_session(struct client_t *client, struct output_t *output);
+
+/**
+ * Asks the server for the messages it relayed since the given one, that are
+ * shown as they arrive, before the messages relayed from then on
+ *
+ * @param client client with a session
+ * @param since sequence of the first message, 1 for all of them
+ * @return 1 on success, -1 on error
+ */
+int request_history(struct client_t *client, uint64_t since);
+
+/**
+ * Sends the message held in send_buffer in the session. It is kept until the
+ * server acknowledges it, so that it's sent again after a reconnection if it
+ * was lost on the way. Text not ending with a newline is a chunk of a longer
+ * message, the next one sent goes on with it.
+ *
+ * @param client client with a session
+ * @return 1 on success, -1 if there's no memory
+ */
+int send_session_message(struct client_t *client);
+
+/**
+ * Runs the command held in send_buffer, if it holds one instead of a
+ * message: "/join N" joins the channel N and sends the messages typed next
+ * to it, "/leave N" leaves the channel N.
+ *
+ * @param client client with a session
+ * @return 1 if it held a command, 0 if it holds a message, -1 on error
+ */
+int run_channel_command(struct client_t *client);
+
+/**
+ * Ends the message sent in chunks, if any, with an empty chunk. It's sent
+ * when the input ends in the middle of a line.
+ *
+ * @param client client with a session
+ * @return 1 on success, -1 if there's no memory
+ */
+int finish_session_message(struct client_t *client);
+
+/**
+ * Handles a frame received in the session: counts the messages, and
+ * acknowledges them every SESSION_ACK_INTERVAL, and drops the messages sent
+ * that the server acknowledges
+ *
+ * @param client client with a session, holding the frame received
+ * @return 1 if the frame is a message to show, 0 otherwise
+ */
+int handle_session_frame(struct client_t *client);
+
+/**
+ * Pushes the message held in the recv_buffer of the client to the output
+ * stage. The chunks of a longer message are pushed as they arrive, flagged
+ * with FRAME_FLAG_MORE but the last one, and shown as a single line.
+ *
+ * @param client client holding a FRAME_TYPE_DATA or FRAME_TYPE_REPLAY frame
+ * @param output output stage showing the messages received
+ */
+void show_received_message(struct client_t *client, struct output_t *output);
+
+/**
+ * Reconnects to the server after the connection was lost, waiting between
+ * attempts an exponentially growing delay with random jitter, so that the
+ * clients dropped at once don't come back at once, and resumes the session.
+ *
+ * @param client client whose connection was lost
+ * @param output output stage showing the messages received
+ * @return 1 if the session was resumed, 0 if the client gave up
+ */
+int reconnect_to_server(struct client_t *client, struct output_t *output);
+
 /**
  * @brief Disconnects the given client 
  *
@@ -0,0 +1,43 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Chat client running in a single thread
+ * @file client_loop.h
+ *
+ * Instead of a thread blocked reading the console and another one blocked
+ * receiving, a single epoll instance multiplexes stdin, the socket and an
+ * eventfd that SIGINT and SIGTERM signal, so that the client shuts down
+ * right away instead of after the next line typed. The frames are
+ * reassembled by a frame reader, so a partial frame never blocks the loop.
+ * The socket is non-blocking too: the frames sent are queued, and the socket
+ * is watched for writing while they wait, the console not being read once
+ * CLIENT_LOOP_QUEUE_LIMIT bytes do, so that a server that stops reading the
+ * client never stops it from reading the server. Only the output stage keeps
+ * a thread of its own.
+ */
+#ifndef GUARD_CLIENT_LOOP_H
+#define GUARD_CLIENT_LOOP_H
+
+#include "client.h"
+#include "output.h"
+
+/** maximum number of events returned by a single epoll_wait call */
+#define CLIENT_LOOP_EVENTS 8
+
+/** bytes queued for the server above which the console isn't read */
+#define CLIENT_LOOP_QUEUE_LIMIT (256 * 1024)
+
+/**
+ * Sends what is typed in the console in the session of the client and pushes
+ * the messages received to the output stage, reconnecting when the
+ * connection is lost, until a shutdown is requested or the server can't be
+ * reached anymore. Once stdin is closed only the messages received are
+ * handled. The frames of a shm endpoint don't wake epoll up, so it can't run
+ * one.
+ *
+ * @param client client with a session, not connected to a shm endpoint
+ * @param output output stage showing the messages received
+ */
+void run_client_loop(struct client_t *client, struct output_t *output);
+
+#endif /* ifndef GUARD_CLIENT_LOOP_H */
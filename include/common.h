@@ -16,11 +16,27 @@
 /** server */
 #define SERVER 1
 
-/** number of maximum incomming connections in backlog */
-#define BACKLOG_CONNECTIONS 20
+/** client measuring the round trip time to the server */
+#define PING 2
 
-/** max size of sending and receive buffers */
-#define BUFFER_SIZE 200
+/** default number of pings sent in ping mode */
+#define PING_DEFAULT_COUNT 1000
+
+/** default number of microseconds between pings in ping mode */
+#define PING_DEFAULT_INTERVAL 1000
+
+/** default number of maximum incomming connections in backlog of a shard */
+#define BACKLOG_CONNECTIONS 1024
+
+/** milliseconds before racing a connection to the next address */
+#define CONNECTION_ATTEMPT_DELAY 250
+
+/** max size of sending and receive buffers, and so of the chunks of a
+ * message */
+#define BUFFER_SIZE 4096
+
+/** default max number of bytes of a channel queued or held for a client */
+#define MESSAGE_WINDOW_DEFAULT (1024 * 1024)
 
 /** max length of hostname */
 #define HOSTNAME_MAX_LENGTH 253
@@ -51,25 +67,59 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "resolver.h"
+#include "trace.h"
+
+/** when 0 the progress of the connection setup is not printed */
+extern int verbose;
+
+/** prints the progress of the connection setup to stdout, if verbose */
+#define print_progress(...) \
+    do { \
+        if (verbose) { \
+            printf(__VA_ARGS__); \
+        } \
+    } while (0)
 
 /**
- * Utility structure used for it as argument to the thread handling the
- * reception of messages. It contains the client structure and the receive
- * status
+ * Arguments given in the command line
  */
-struct client_recv_status_t {
-    struct client_t *client;    /**< client structure */
-    int *recv_status;           /**< reference to the recv status */
+struct options_t {
+    int mode;           /**< CLIENT, SERVER or PING */
+    char *hostname;     /**< hostname or IP of the server (client and ping) */
+    char *port;         /**< port to listen/connect to */
+    long count;         /**< number of pings to send (ping) */
+    long interval;      /**< microseconds between pings (ping) */
+    char *send_path;    /**< file to stream, "-" for stdin (client) */
+    char *output_path;  /**< file where the streams are written (server) */
+    long shards;        /**< number of event loops, 0 for one per core (server) */
+    long backlog;       /**< pending connections per shard (server) */
+    char *metrics_path; /**< unix socket serving the metrics, NULL for none */
+    int compress;       /**< 1 to compress the messages if the peer agrees */
+    char *dictionary_path;  /**< dictionary to compress with, NULL for none */
+    char *history_path; /**< directory of the log of messages (server) */
+    unsigned long long history; /**< first message to replay, 0 for none
+                                  (client) */
+    int event_loop;     /**< 1 to run the client in a single thread (client) */
+    long window;        /**< max bytes of a channel queued or held for a
+                             client (server) */
+    long channel;       /**< channel to talk in besides 0 (client) */
 };
 
 /**
  * Utility structure used for it as argument to the thread handling the
- * reception of messages. It contains the server structure and the receive
- * status
+ * reception of messages. It contains the client structure, the receive
+ * status and the output stage the messages received are pushed to
  */
-struct server_recv_status_t {
-    struct server_t *server;    /**< server structure */
+struct client_recv_status_t {
+    struct client_t *client;    /**< client structure */
     int *recv_status;           /**< reference to the recv status */
+    struct output_t *output;    /**< output stage showing the messages */
 };
 
 /**
@@ -87,6 +137,9 @@ void initialize_hints(struct addrinfo *hints, int flags);
  * Invokes the getaddrinfo function to get the addressinfo structure res
  * obtained for the given hostname, the given port_number and the hints
  * structure passed.
+ * Answers are cached by the resolver, so that opening many connections to the
+ * same server only resolves its name once. The list returned must be freed
+ * with resolver_free.
  * Function fails and the program exits when there's an error with the
  * getaddrinfo function
  *
@@ -103,15 +156,29 @@ void get_addrinfo_list(const char *hostname, const char *port_number, struct
  *
  * Finds and returns the first connectable socket using the addrinfo structure
  * provided.
- * It iterates over the available addrinfo structures pointed by res beginning
- * from res.
+ * It races non-blocking connections to the addresses pointed by res, in the
+ * order of RFC 8305 (Happy Eyeballs): a new attempt is started every
+ * CONNECTION_ATTEMPT_DELAY milliseconds, or as soon as a previous one
+ * failed, and the first connection established wins. The socket returned is
+ * in blocking mode.
+ *
+ * @param res addrinfo structure that includes the family, socket type and
+ * protocol to be used for the socket
+ * @return the connectable socket, or -1 if none could be connected
+ */
+int try_connectable_socket(struct addrinfo *res);
+
+/**
+ * Finds and returns the first connectable socket using the addrinfo structure
+ * provided, racing the addresses as try_connectable_socket does.
  * Function fails and exits the program if it could not find a connectable
+ * socket
  *
- * @param addrinfo addrinfo structure that includes the family, socket type and
+ * @param res addrinfo structure that includes the family, socket type and
  * protocol to be used for the socket
  * @return the connectable socket
  */
-int find_connectable_socket(struct addrinfo *addrinfo);
+int find_connectable_socket(struct addrinfo *res);
 
 /**
  * Finds and returns the first socket found from the addrinfo structure res
@@ -124,12 +191,13 @@ int find_connectable_socket(struct addrinfo *addrinfo);
  */
 int find_socket(struct addrinfo *res);
 
-/** 
- * Tries to connect the given socketfd using the information contained in res
+/**
+ * Starts connecting the given non-blocking socketfd using the information
+ * contained in res. The socket is closed if the connection fails right away.
  *
- * @param socketfd open socket
+ * @param socketfd open non-blocking socket
  * @param res adrinfo structure that holds the connection information
- * @return 0 on success, -1 otherwise
+ * @return 0 if connected, 1 if the connection is in progress, -1 otherwise
  */
 static int connect_through_socket(int socketfd, struct addrinfo *res);
 
@@ -165,20 +233,34 @@ void bind_socket(int socketfd, char *port, struct addrinfo *result);
 void listen_socket(int socketfd, char *port, int backlog);
 
 /**
- * Wrapper for the accept function, that accepts an incoming connections from
+ * Disables Nagle's algorithm on the given socket, so that small messages are
+ * sent right away. Batching of messages is done by the program instead.
+ * Sockets that are not TCP are left untouched.
+ *
+ * @param socketfd connected socket
+ */
+void set_tcp_nodelay(int socketfd);
+
+/**
+ * Wrapper for the accept4 function, that accepts an incoming connections from
  * the queue of incomming connections to socketfd, and stores the address of the
- * client into addr structure. It creates a socket with the accepted connnection
- * and the original socketfd remains open listening for more connections.
+ * client into addr structure. It creates a non-blocking socket with the
+ * accepted connnection and the original socketfd remains open listening for
+ * more connections.
+ * Returns -1 when there are no more pending connections (errno is EAGAIN) or
+ * when the connection could not be accepted, in which case an error message is
+ * printed to stderr.
  *
- * @param socketfd listening socket that has a connection pending from a client
+ * @param socketfd non-blocking listening socket
  * @param addr sockaddr_storage structure used to hold the address of the client 
- * @return the new socket that is connected to the remote socket 
+ * @return the new socket that is connected to the remote socket, or -1
  */
 int accept_connection(int socketfd, struct sockaddr_storage *addr);
 
 /**
- * Handles the reception of messages from a either a client or a server, using a
- * connected socket contained inside object, that is of the given type.
+ * Handles the reception of messages from a client, using the connected socket
+ * contained inside object, that is of the given type. Servers receive their
+ * messages in their event loop instead.
  * In case there's an error, the function prints out an error message to
  * stderr describing the problem.
  *
@@ -191,6 +273,8 @@ static int receive_message(void *object, int type);
 /**
  * Handles the sending of messages from either a client or a server, using a
  * connected socket contained insde boject, that is of the given type.
+ * Only the characters of the message are sent, inside a frame.
+ * A server sends the message to every client connected to it.
  * In case there's an error, the function prints out an error message to
  * stderr describing the problem.
  *
@@ -208,35 +292,29 @@ int send_message(void *object, int type);
  * @param buffer char array where the message is stored
  * @param type CLIENT or SERVER int macros
  */
-static void show_message(char *buffer, int type);
+void show_message(char *buffer, int type);
 
 /**
  * Reads strings from stdin and stores it in a buffer up to the EOF or the
  * newline character, if newline character is inputted it is also included in
- * the message stored in the buffer
+ * the message stored in the buffer. A line longer than BUFFER_SIZE - 1 bytes
+ * is read by several calls.
  *
  * @param buffer char array whre the message is stored
+ * @return 1 if a message was read, 0 when stdin is closed
  */
-void read_stdin_to_buffer(char *buffer);
+int read_stdin_to_buffer(char *buffer);
 
 /**
- * Read strings from stdint and sends them throught the connected socket of the
- * given client. This is the function handled by the recv_thread.
+ * Receives the messages sent through the connected socket of the given client
+ * and pushes them to the output stage, resuming the session when the
+ * connection is lost. This is the function handled by the recv_thread.
  *
  * @param client_param a structure containing the server and the status used to break
  * from the main loop
  */
 void *read_received_message_client(void *client_param);
 
-/**
- * Read strings from stdint and sends them throught the connected socket of the
- * given server. This is the function handled by the recv_thread.
- *
- * @param server_param a structure containing the server and the status used to break
- * from the main loop
- */
-void *read_received_message_server(void *server_param);
-
 /** 
  * Helper function used to create and return a string, which is a copy of the
  * string s but in which all alphabetical characters are lower case
@@ -293,13 +371,14 @@ static void print_cla(int argc, char *argv[]);
 
 /**
  * Checks the command line arguments, validates them, and returns the mode
- * chosen for the current program.
+ * chosen for the current program. The arguments are stored in options.
  *
  * @param argc number of parameters (including executable name)
  * @param argv array of command line parameters
- * @return the mode to use the program (CLIENT or SERVER)
+ * @param options structure where the arguments are stored
+ * @return the mode to use the program (CLIENT, SERVER or PING)
  */
-int handle_input(int argc, char *argv[]);
+int handle_input(int argc, char *argv[], struct options_t *options);
 
 /**
  * Utility function to aid in debugging of the addrinfo structure returned by
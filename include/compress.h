@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Compression of the messages, negotiated with the peer
+ * @file compress.h
+ *
+ * Right after connecting, a client that compresses sends a FRAME_TYPE_CODEC
+ * frame offering the codecs it supports and the id of its dictionary. The
+ * server answers with another one holding the codec both of them support,
+ * or COMPRESS_CODEC_NONE, and its own dictionary id. Compression is only
+ * used when both ends loaded the same dictionary, or none. The payloads are
+ * made of 32 bits fields in network byte order:
+ *
+ *     CODEC | codecs | dictionary id |
+ *
+ * Once agreed, the FRAME_TYPE_DATA frames of at least COMPRESS_MIN_SIZE bytes
+ * that get smaller are sent with FRAME_FLAG_COMPRESSED set, and a payload
+ * made of the size of the original payload, as a 32 bits field, followed by
+ * the zlib stream. The rest of the frames are sent as they are. Each frame is
+ * compressed on its own, so they can be dropped, replayed or relayed to other
+ * peers in any order. The dictionary, a file holding samples of typical
+ * messages, is what makes that pay off for short messages.
+ *
+ * The server compresses a message once, and every connection that agreed on
+ * compressing sends that copy. Every thread has its own zlib streams.
+ */
+#ifndef GUARD_COMPRESS_H
+#define GUARD_COMPRESS_H
+
+#include "message.h"
+
+#include <stdint.h>
+
+/** no compression */
+#define COMPRESS_CODEC_NONE 0
+
+/** zlib (deflate) */
+#define COMPRESS_CODEC_ZLIB 0x01
+
+/** payloads smaller than this are never compressed */
+#define COMPRESS_MIN_SIZE 128
+
+/** zlib compression level, from 1 (fastest) to 9 (smallest) */
+#define COMPRESS_LEVEL 6
+
+/** max number of bytes of a dictionary, the size of the zlib window */
+#define COMPRESS_MAX_DICTIONARY 32768
+
+/** size of the payload of a FRAME_TYPE_CODEC frame */
+#define COMPRESS_CODEC_SIZE 8
+
+/** size of the field holding the size of a payload before compressing it */
+#define COMPRESS_LENGTH_SIZE 4
+
+/**
+ * Enables the compression for the whole process, with the dictionary read
+ * from a file. Exits the program if the dictionary can't be read.
+ *
+ * @param enable 1 to offer and accept compression, 0 not to
+ * @param dictionary_path file holding the dictionary, NULL for none
+ */
+void compress_configure(int enable, const char *dictionary_path);
+
+/**
+ * Returns the codecs this end supports
+ *
+ * @return mask of COMPRESS_CODEC_ values, COMPRESS_CODEC_NONE if the
+ * compression is disabled
+ */
+uint32_t compress_codecs();
+
+/**
+ * Returns the codec to use with a peer that offered, or agreed on, the given
+ * codecs and dictionary
+ *
+ * @param codecs mask of the codecs of the peer
+ * @param peer_dictionary_id id of the dictionary of the peer
+ * @return the codec, COMPRESS_CODEC_NONE if there's none in common or the
+ * dictionaries differ
+ */
+uint32_t compress_agree(uint32_t codecs, uint32_t peer_dictionary_id);
+
+/**
+ * Creates the FRAME_TYPE_CODEC frame offering or agreeing on the given codecs
+ *
+ * @param codecs mask of COMPRESS_CODEC_ values
+ * @return the message or NULL if there's no memory
+ */
+struct message_t *compress_codec_frame(uint32_t codecs);
+
+/**
+ * Decodes the payload of a FRAME_TYPE_CODEC frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param codecs mask of the codecs offered or agreed on
+ * @param peer_dictionary_id id of the dictionary of the peer
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int compress_decode_codec(const char *payload, uint32_t length,
+        uint32_t *codecs, uint32_t *peer_dictionary_id);
+
+/**
+ * Compresses the frame held by a FRAME_TYPE_DATA message
+ *
+ * @param message message to compress
+ * @return a new message with the frame compressed, or NULL if the message
+ * isn't worth compressing, compression is disabled or there's no memory
+ */
+struct message_t *compress_message(const struct message_t *message);
+
+/**
+ * Decompresses the payload of a frame received with FRAME_FLAG_COMPRESSED
+ * into a buffer of the calling thread, valid until its next call
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param out payload decompressed, followed by a null terminator
+ * @param out_length number of bytes of the payload decompressed
+ * @return 0 on success, -1 if the payload is malformed, bigger than
+ * FRAME_MAX_PAYLOAD once decompressed, or there's no memory
+ */
+int compress_inflate(const char *payload, uint32_t length, const char **out,
+        uint32_t *out_length);
+
+#endif /* ifndef GUARD_COMPRESS_H */
@@ -0,0 +1,243 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Wire framing of the messages exchanged between client and server
+ * @file frame.h
+ *
+ * Every message is sent as a frame made of a fixed size header followed by
+ * the payload. All the fields of the header are in network byte order:
+ *
+ *     0        4      5       6         8
+ *     | length | type | flags | channel | payload ...
+ *
+ * length is the number of bytes of the payload, which never exceeds
+ * FRAME_MAX_PAYLOAD except for FRAME_TYPE_STREAM frames. Those carry a chunk
+ * of a byte stream of up to FRAME_MAX_STREAM_CHUNK bytes, that is moved from
+ * socket to file without being buffered.
+ *
+ * A message of any size is sent as FRAME_TYPE_DATA chunks of up to
+ * BUFFER_SIZE bytes, flagged with FRAME_FLAG_MORE but the last one. The
+ * chunks of a message are never interleaved with another message of the
+ * same channel sent through the same connection.
+ *
+ * channel is the conversation a FRAME_TYPE_DATA, FRAME_TYPE_REPLAY,
+ * FRAME_TYPE_JOIN or FRAME_TYPE_LEAVE frame is about, so that many of them
+ * share a connection. It's 0 for the rest of the frames.
+ */
+#ifndef GUARD_FRAME_H
+#define GUARD_FRAME_H
+
+#include "common.h"
+#include "pool.h"
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** size in bytes of the header of a frame on the wire */
+#define FRAME_HEADER_SIZE 8
+
+/** max number of bytes of the payload of a frame, so that a whole frame
+ * fits in the largest buffer of a pool */
+#define FRAME_MAX_PAYLOAD (POOL_MAX_SIZE - FRAME_HEADER_SIZE)
+
+/** frame carrying a chat message */
+#define FRAME_TYPE_DATA 0
+
+/** frame that the server echoes back as FRAME_TYPE_PONG */
+#define FRAME_TYPE_PING 1
+
+/** echo of a FRAME_TYPE_PING, with the same payload */
+#define FRAME_TYPE_PONG 2
+
+/** chunk of a byte stream, an empty one marks the end of the stream */
+#define FRAME_TYPE_STREAM 3
+
+/** opens or resumes a session, see session.h */
+#define FRAME_TYPE_HELLO 4
+
+/** acknowledges the FRAME_TYPE_DATA frames received in a session */
+#define FRAME_TYPE_ACK 5
+
+/** offers or agrees on the compression of the frames, see compress.h */
+#define FRAME_TYPE_CODEC 6
+
+/** asks for the messages relayed since a sequence, or ends their replay,
+ * see history.h */
+#define FRAME_TYPE_HISTORY 7
+
+/** message of the history replayed */
+#define FRAME_TYPE_REPLAY 8
+
+/** joins the channel of the frame, see channel.h */
+#define FRAME_TYPE_JOIN 9
+
+/** leaves the channel of the frame */
+#define FRAME_TYPE_LEAVE 10
+
+/** the payload is compressed with the codec agreed with the peer */
+#define FRAME_FLAG_COMPRESSED 0x01
+
+/** more FRAME_TYPE_DATA frames follow with the rest of the same message */
+#define FRAME_FLAG_MORE 0x02
+
+/** max number of bytes of the payload of a FRAME_TYPE_STREAM frame */
+#define FRAME_MAX_STREAM_CHUNK (1U << 30)
+
+/**
+ * Header of a frame, in host byte order
+ */
+struct frame_header_t {
+    uint32_t length;    /**< number of bytes of the payload */
+    uint8_t type;       /**< type of frame i.e: FRAME_TYPE_DATA */
+    uint8_t flags;      /**< flags that modify the meaning of the payload */
+    uint16_t channel;   /**< channel of the frame, see channel.h */
+};
+
+/**
+ * Reassembles the frames received on a non-blocking stream socket, which may
+ * deliver them partially or several of them coalesced in a single read. The
+ * buffer is taken from a pool when bytes arrive, grown to the size of the
+ * frame being received and given back once every frame has been handled.
+ */
+struct frame_reader_t {
+    char *buffer;       /**< received bytes, NULL while the reader is empty */
+    size_t capacity;    /**< size of buffer */
+    size_t used;        /**< number of bytes stored in buffer */
+    size_t consumed;    /**< number of bytes of buffer already returned */
+    struct buffer_pool_t *pool; /**< pool the buffer is taken from */
+};
+
+/**
+ * Writes the header h in wire format into out, that must have room for
+ * FRAME_HEADER_SIZE bytes
+ *
+ * @param h header to encode
+ * @param out buffer where the header is written
+ */
+void frame_encode_header(const struct frame_header_t *h, char *out);
+
+/**
+ * Reads a header in wire format from in
+ *
+ * @param in buffer holding FRAME_HEADER_SIZE bytes of a header
+ * @param h header decoded
+ */
+void frame_decode_header(const char *in, struct frame_header_t *h);
+
+/**
+ * Writes all the bytes described by iov to the blocking socket socketfd,
+ * resuming after short writes. The iov array is modified.
+ *
+ * @param socketfd connected socket
+ * @param iov array of buffers to send
+ * @param iovcnt number of elements of iov
+ * @return 1 on success, -1 on error
+ */
+int send_all(int socketfd, struct iovec *iov, int iovcnt);
+
+/**
+ * Reads exactly length bytes from the blocking socket socketfd
+ *
+ * @param socketfd connected socket
+ * @param buffer where the bytes are stored
+ * @param length number of bytes to read
+ * @return 1 on success, 0 if the peer closed the connection, -1 on error
+ */
+int recv_all(int socketfd, void *buffer, size_t length);
+
+/**
+ * Receives a whole frame from the blocking socket socketfd. The payload is
+ * stored in *payload, which is replaced by a bigger buffer of the pool when
+ * the frame doesn't fit in it, and is followed by a null terminator.
+ *
+ * @param socketfd connected socket
+ * @param h header of the frame received
+ * @param pool pool the buffers are taken from
+ * @param payload buffer of the pool where the payload is stored, or NULL
+ * @param capacity size of *payload
+ * @return 1 on success, 0 if the peer closed the connection, -1 on error or
+ * if the frame is bigger than FRAME_MAX_PAYLOAD
+ */
+int recv_frame_pooled(int socketfd, struct frame_header_t *h,
+        struct buffer_pool_t *pool, char **payload, size_t *capacity);
+
+/**
+ * Initializes an empty frame reader, that holds no buffer until bytes arrive
+ *
+ * @param reader frame reader
+ * @param pool pool the buffers of the reader are taken from
+ */
+void frame_reader_init(struct frame_reader_t *reader,
+        struct buffer_pool_t *pool);
+
+/**
+ * Reads from the non-blocking socket socketfd as many bytes as fit in the
+ * reader, growing it to the size of the frame being received
+ *
+ * @param reader frame reader
+ * @param socketfd connected non-blocking socket
+ * @return number of bytes read, 0 if the peer closed the connection, -1 on
+ * error (errno is EAGAIN when there is nothing else to read, ENOMEM if the
+ * buffer couldn't be grown)
+ */
+ssize_t frame_reader_read(struct frame_reader_t *reader, int socketfd);
+
+/**
+ * Copies into the reader as many of the given bytes, received by other means,
+ * as fit in it, growing it to the size of the frame being received
+ *
+ * @param reader frame reader
+ * @param bytes bytes received
+ * @param length number of bytes received
+ * @return number of bytes copied, 0 if there's no memory
+ */
+size_t frame_reader_feed(struct frame_reader_t *reader, const char *bytes,
+        size_t length);
+
+/**
+ * Returns the next complete frame stored in the reader. The payload points
+ * into the reader and is valid until the next call to frame_reader_read or
+ * frame_reader_feed. For FRAME_TYPE_STREAM frames only the header is returned
+ * and payload is set to NULL: the payload follows and has to be taken with
+ * frame_reader_take or read from the socket by the caller.
+ *
+ * @param reader frame reader
+ * @param h header of the frame
+ * @param payload set to the first byte of the payload
+ * @return 1 if a frame was returned, 0 if more bytes are needed, -1 if the
+ * frame is malformed
+ */
+int frame_reader_next(struct frame_reader_t *reader, struct frame_header_t *h,
+        const char **payload);
+
+/**
+ * Gives the buffer of the reader back to its pool if every byte received has
+ * been handled, so that idle connections hold no buffer
+ *
+ * @param reader frame reader
+ */
+void frame_reader_shrink(struct frame_reader_t *reader);
+
+/**
+ * Gives the buffer of the reader back to its pool, dropping any byte that
+ * wasn't handled
+ *
+ * @param reader frame reader
+ */
+void frame_reader_free(struct frame_reader_t *reader);
+
+/**
+ * Takes up to max of the bytes stored in the reader that haven't been
+ * returned as part of a frame yet, i.e. the payload of a FRAME_TYPE_STREAM
+ * frame. The bytes point into the reader and are valid until the next call
+ * to frame_reader_read or frame_reader_feed.
+ *
+ * @param reader frame reader
+ * @param bytes set to the first byte taken
+ * @param max max number of bytes to take
+ * @return number of bytes taken, 0 if the reader is empty
+ */
+size_t frame_reader_take(struct frame_reader_t *reader, const char **bytes,
+        size_t max);
+
+#endif /* ifndef GUARD_FRAME_H */
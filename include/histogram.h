@@ -0,0 +1,90 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Log-bucketed histogram of latencies
+ * @file histogram.h
+ *
+ * Values below 2 * HISTOGRAM_SUB_BUCKETS have a bucket each. Every power of 2
+ * above that is split in HISTOGRAM_SUB_BUCKETS linear buckets, so the
+ * relative error of any value reported is below 1 / HISTOGRAM_SUB_BUCKETS
+ * while the whole uint64_t range fits in a fixed number of buckets.
+ *
+ * A histogram is recorded by a single thread, but any other thread may merge
+ * it into another one at the same time: the values are stored with relaxed
+ * atomic stores, which cost the same as plain ones.
+ */
+#ifndef GUARD_HISTOGRAM_H
+#define GUARD_HISTOGRAM_H
+
+#include <stdint.h>
+
+/** log2 of the number of sub-buckets of every power of 2 */
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+
+/** number of sub-buckets of every power of 2 */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/** number of buckets needed to hold any uint64_t value */
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BUCKET_BITS) * \
+        HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Histogram of values, usually latencies in nanoseconds
+ */
+struct histogram_t {
+    uint64_t counts[HISTOGRAM_BUCKETS];  /**< number of values per bucket */
+    uint64_t total;     /**< number of values recorded */
+    uint64_t sum;       /**< sum of the values recorded */
+    uint64_t min;       /**< smallest value recorded */
+    uint64_t max;       /**< largest value recorded */
+};
+
+/**
+ * Initializes an empty histogram
+ *
+ * @param histogram histogram
+ */
+void histogram_init(struct histogram_t *histogram);
+
+/**
+ * Records a value in the histogram
+ *
+ * @param histogram histogram
+ * @param value value to record
+ */
+void histogram_record(struct histogram_t *histogram, uint64_t value);
+
+/**
+ * Returns the value below which the given percentage of the values recorded
+ * fall. The value returned is the highest one of its bucket.
+ *
+ * @param histogram histogram
+ * @param percentile percentage between 0 and 100
+ * @return the value at the percentile, or 0 if the histogram is empty
+ */
+uint64_t histogram_percentile(const struct histogram_t *histogram,
+        double percentile);
+
+/**
+ * Adds the values recorded in src to dst. src may be being recorded by
+ * another thread, in which case the values recorded meanwhile may be left
+ * out of some of the fields.
+ *
+ * @param dst histogram the values are added to
+ * @param src histogram whose values are added
+ */
+void histogram_merge(struct histogram_t *dst, const struct histogram_t *src);
+
+/**
+ * Returns the number of values recorded that are at most value. The values
+ * are counted by bucket, so the ones in the bucket of value are counted if
+ * the highest value of the bucket is at most value.
+ *
+ * @param histogram histogram
+ * @param value upper bound
+ * @return number of values counted
+ */
+uint64_t histogram_count_at_most(const struct histogram_t *histogram,
+        uint64_t value);
+
+#endif /* ifndef GUARD_HISTOGRAM_H */
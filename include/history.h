@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Append-only log of the messages relayed, replayed to the clients
+ * @file history.h
+ *
+ * Every message the server relays gets the next sequence number, starting at
+ * 1, or one per chunk for the messages sent in chunks, and is appended to the
+ * log as a FRAME_TYPE_REPLAY frame on the channel it was relayed on, so that
+ * it can be sent back as it is stored. The log is a directory of segments of
+ * HISTORY_SEGMENT_SIZE bytes, each one named after the sequence of its first
+ * message and mapped in memory, so appending is a copy and replaying a
+ * message never reads the file: the messages replayed point into the
+ * mapping, the pages coming straight from the page cache, and pin their
+ * segment until they're sent. Next to every segment, a sparse index holds
+ * the offset of every HISTORY_INDEX_INTERVAL-th message, so that a sequence
+ * is found walking at most that many headers. Only the last
+ * HISTORY_SEGMENTS_MAX segments are kept, the oldest one being deleted when
+ * another one is started.
+ *
+ * The unused end of a segment is zeroed, and a header of type 0 can't be a
+ * FRAME_TYPE_REPLAY one, so the log is recovered after a restart by walking
+ * the frames after the last offset indexed. The payload of a frame is copied
+ * before its header, so a server killed while appending leaves no partial
+ * frame behind. The pages are written back by the kernel: the log survives
+ * the server, not the machine.
+ *
+ * A client asks for the messages since a sequence with a FRAME_TYPE_HISTORY
+ * frame. The server replays the messages logged until then, and ends with a
+ * FRAME_TYPE_HISTORY frame holding the sequence of the next message, that is
+ * relayed as usual. The payloads are a 64 bits field in network byte order:
+ *
+ *     HISTORY | since | (client)
+ *     HISTORY | next  | (server)
+ */
+#ifndef GUARD_HISTORY_H
+#define GUARD_HISTORY_H
+
+#include "channel.h"
+#include "message.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/** number of bytes of a segment of the log */
+#define HISTORY_SEGMENT_SIZE (64U << 20)
+
+/** number of segments kept, the oldest ones being deleted */
+#define HISTORY_SEGMENTS_MAX 16
+
+/** number of messages between two entries of the index of a segment */
+#define HISTORY_INDEX_INTERVAL 256
+
+/** max number of bytes of frames replayed in a single message */
+#define HISTORY_REPLAY_BATCH (64 * 1024)
+
+/** size of the payload of a FRAME_TYPE_HISTORY frame */
+#define HISTORY_REQUEST_SIZE 8
+
+/**
+ * Segment of the log, with its sparse index
+ */
+struct history_segment_t {
+    uint64_t first;     /**< sequence of the first message */
+    uint64_t count;     /**< number of messages */
+    char *data;         /**< mapping of the segment */
+    size_t length;      /**< number of bytes used */
+    uint64_t *index;    /**< offset of every HISTORY_INDEX_INTERVAL-th one */
+    size_t index_count; /**< number of entries of index */
+    size_t index_capacity;  /**< number of slots of index */
+    int index_fd;       /**< file the index is appended to */
+    unsigned int refcount;  /**< the log while it keeps the segment, and
+                                 every message replayed from it */
+};
+
+/**
+ * Log of the messages, shared by every shard of the server
+ */
+struct history_t {
+    char *path;         /**< directory holding the segments */
+    pthread_mutex_t lock;   /**< serializes the appends and the replays */
+    struct history_segment_t **segments;    /**< segments, oldest first */
+    size_t segments_count;  /**< number of segments */
+    size_t segments_capacity;   /**< number of slots of segments */
+    uint64_t next;      /**< sequence of the next message */
+    struct channel_set_t channels;  /**< channels with a message being
+                                         appended in chunks */
+    size_t window;      /**< max bytes held by a channel */
+};
+
+/**
+ * Opens the log in a directory, creating it if needed, and recovers the
+ * messages it holds. Exits the program on failure.
+ *
+ * @param history log
+ * @param path directory of the log
+ * @param window max bytes of the messages held by a channel while another
+ * one is appended in chunks
+ */
+void history_open(struct history_t *history, const char *path,
+        size_t window);
+
+/**
+ * Appends a chunk of a FRAME_TYPE_DATA message to the log, with a sequence
+ * of its own. The chunks of a message are appended one after the other,
+ * the other messages of its channel are held until its last chunk, as
+ * channel_relay does for the clients.
+ *
+ * @param history log
+ * @param message chunk relayed
+ * @return the sequence of the last message appended, 0 if none was
+ */
+uint64_t history_append(struct history_t *history,
+        struct message_t *message);
+
+/**
+ * Returns the sequence of the next message appended
+ *
+ * @param history log
+ * @return the sequence
+ */
+uint64_t history_next(struct history_t *history);
+
+/**
+ * Returns a message pointing to the frames logged from a sequence on, up to
+ * HISTORY_REPLAY_BATCH bytes but at least one of them, in the mapping of
+ * their segment, that is kept until the message is freed
+ *
+ * @param history log
+ * @param sequence first message to replay, updated to the one after the last
+ * message replayed. Messages no longer logged are skipped.
+ * @param end sequence of the first message not to replay
+ * @return the message or NULL if there's none to replay or no memory
+ */
+struct message_t *history_read(struct history_t *history, uint64_t *sequence,
+        uint64_t end);
+
+/**
+ * Creates a FRAME_TYPE_HISTORY frame
+ *
+ * @param sequence first message asked for by a client, next message for the
+ * server
+ * @return the message or NULL if there's no memory
+ */
+struct message_t *history_frame(uint64_t sequence);
+
+/**
+ * Decodes the payload of a FRAME_TYPE_HISTORY frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param sequence sequence it holds
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int history_decode(const char *payload, uint32_t length, uint64_t *sequence);
+
+#endif /* ifndef GUARD_HISTORY_H */
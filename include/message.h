@@ -0,0 +1,213 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Reference counted messages and the queues of messages to send
+ * @file message.h
+ *
+ * A message holds a whole frame ready to be written to a socket. When a
+ * message is sent to many connections every send queue points to the same
+ * message, which is freed once the last connection has sent it. The
+ * connections may belong to different shards of the server, so the reference
+ * count is updated atomically.
+ *
+ * A message longer than a frame is split into chunks, every one of them but
+ * the last flagged with FRAME_FLAG_MORE. The chunks are relayed and shown as
+ * they arrive, so a message is never held whole in memory. The server tags
+ * the chunks of a message with an id of its own, so that they're kept
+ * together when they are relayed.
+ *
+ * A message may also borrow frames it doesn't hold, such as the ones of the
+ * history mapped in memory, releasing them once it's freed.
+ */
+#ifndef GUARD_MESSAGE_H
+#define GUARD_MESSAGE_H
+
+#include "frame.h"
+
+/** initial number of messages a send queue has room for */
+#define SEND_QUEUE_INITIAL_CAPACITY 4
+
+/**
+ * Reference counted frame
+ */
+struct message_t {
+    unsigned int refcount;  /**< number of holders of the message */
+    uint32_t length;        /**< number of bytes of frame */
+    uint64_t created;       /**< metrics_now() when it was created */
+    struct message_t *compressed;   /**< same frame compressed, or NULL */
+    uint64_t chunked;       /**< server: id of the message it is a chunk of,
+                                 0 if none */
+    int continued;          /**< server: 1 for the chunks but the first */
+    char *frame;            /**< header and payload, followed by a '\0'
+                                 unless borrowed */
+    void (*release)(void *);    /**< releases the frames borrowed, or NULL */
+    void *owner;            /**< holder of the frames borrowed */
+    char data[];            /**< frame of the messages that own it */
+};
+
+/**
+ * Queue of the messages waiting to be sent through a connection. It is a
+ * circular buffer of references to messages.
+ */
+struct send_queue_t {
+    struct message_t **messages;    /**< circular buffer of messages */
+    size_t capacity;    /**< number of slots of messages */
+    size_t head;        /**< index of the first message */
+    size_t count;       /**< number of messages queued */
+    size_t offset;      /**< number of bytes of the first message sent */
+    size_t bytes;       /**< number of bytes queued that weren't sent yet */
+};
+
+/**
+ * Creates a message with a reference count of 1 holding a frame of the given
+ * type and payload. The payload is followed by a null terminator, that is not
+ * part of the frame, so that text messages can be printed directly.
+ *
+ * @param type type of the frame
+ * @param payload bytes of the payload
+ * @param length number of bytes of the payload
+ * @return the new message or NULL if there's no memory
+ */
+struct message_t *message_create(uint8_t type, const char *payload,
+        uint32_t length);
+
+/**
+ * Creates a message with a reference count of 1 pointing to frames already
+ * encoded that it doesn't own, i.e. in a mapped file, instead of copying
+ * them. The frames aren't followed by a null terminator. Their owner is
+ * released once the message is freed.
+ *
+ * @param frames bytes of the frames, headers included, kept until the owner
+ * is released
+ * @param length number of bytes of the frames
+ * @param release function releasing the owner
+ * @param owner holder of the frames
+ * @return the new message or NULL if there's no memory
+ */
+struct message_t *message_borrow_frames(const char *frames, uint32_t length,
+        void (*release)(void *), void *owner);
+
+/**
+ * Returns the payload of the message
+ *
+ * @param message message
+ * @return first byte of the payload, null terminated
+ */
+char *message_payload(struct message_t *message);
+
+/**
+ * Tells whether more chunks of the same message follow the message
+ *
+ * @param message message
+ * @return 1 if its frame is flagged with FRAME_FLAG_MORE, 0 otherwise
+ */
+int message_has_more(const struct message_t *message);
+
+/**
+ * Flags the frame of the message with FRAME_FLAG_MORE
+ *
+ * @param message message
+ */
+void message_set_more(struct message_t *message);
+
+/**
+ * Returns the channel of the frame of the message
+ *
+ * @param message message
+ * @return id of the channel
+ */
+uint16_t message_channel(const struct message_t *message);
+
+/**
+ * Sets the channel of the frame of the message
+ *
+ * @param message message
+ * @param channel id of the channel
+ */
+void message_set_channel(struct message_t *message, uint16_t channel);
+
+/**
+ * Takes a new reference to the message. References can be taken and dropped
+ * from any thread.
+ *
+ * @param message message
+ * @return the message
+ */
+struct message_t *message_ref(struct message_t *message);
+
+/**
+ * Drops a reference to the message, freeing it when it was the last one
+ *
+ * @param message message
+ */
+void message_unref(struct message_t *message);
+
+/**
+ * Initializes an empty send queue. No memory is allocated until the first
+ * message is pushed.
+ *
+ * @param queue send queue
+ */
+void send_queue_init(struct send_queue_t *queue);
+
+/**
+ * Appends a reference to the message at the end of the queue
+ *
+ * @param queue send queue
+ * @param message message, the queue takes a new reference to it
+ * @return 0 on success, -1 if there's no memory
+ */
+int send_queue_push(struct send_queue_t *queue, struct message_t *message);
+
+/**
+ * Returns the first message of the queue
+ *
+ * @param queue send queue
+ * @return the first message, or NULL if the queue is empty
+ */
+struct message_t *send_queue_front(struct send_queue_t *queue);
+
+/**
+ * Returns the message at the given position of the queue
+ *
+ * @param queue send queue
+ * @param index position of the message, 0 being the first one
+ * @return the message
+ */
+struct message_t *send_queue_at(struct send_queue_t *queue, size_t index);
+
+/**
+ * Removes the first message of the queue, dropping the reference to it
+ *
+ * @param queue send queue
+ */
+void send_queue_pop(struct send_queue_t *queue);
+
+/**
+ * Fills iov with the bytes of the queued messages that haven't been sent yet,
+ * so that several messages can be written with a single system call
+ *
+ * @param queue send queue
+ * @param iov array of buffers to fill
+ * @param max number of elements of iov
+ * @return number of elements of iov filled
+ */
+int send_queue_iov(struct send_queue_t *queue, struct iovec *iov, int max);
+
+/**
+ * Marks the first bytes of the queue as sent, removing the messages that were
+ * sent completely
+ *
+ * @param queue send queue
+ * @param bytes number of bytes sent
+ */
+void send_queue_consume(struct send_queue_t *queue, size_t bytes);
+
+/**
+ * Drops every message of the queue and frees its memory
+ *
+ * @param queue send queue
+ */
+void send_queue_clear(struct send_queue_t *queue);
+
+#endif /* ifndef GUARD_MESSAGE_H */
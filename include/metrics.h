@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Runtime counters, gauges and latency histograms
+ * @file metrics.h
+ *
+ * Every thread updates a block of metrics of its own, registered the first
+ * time it updates one. Only the owning thread writes to a block, with
+ * relaxed atomic stores, so updating a metric takes no lock nor atomic
+ * read-modify-write. The admin thread started by metrics_serve merges all
+ * the blocks into a snapshot whenever one is asked for through its unix
+ * socket, and writes it in the Prometheus text format.
+ */
+#ifndef GUARD_METRICS_H
+#define GUARD_METRICS_H
+
+#include "histogram.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** bytes written to sockets */
+#define METRIC_BYTES_SENT 0
+
+/** bytes read from sockets */
+#define METRIC_BYTES_RECEIVED 1
+
+/** messages written completely to sockets */
+#define METRIC_MESSAGES_SENT 2
+
+/** frames received */
+#define METRIC_MESSAGES_RECEIVED 3
+
+/** errors sending, other than the socket being full */
+#define METRIC_SEND_ERRORS 4
+
+/** errors receiving, other than the socket being empty */
+#define METRIC_RECEIVE_ERRORS 5
+
+/** connections established to a server */
+#define METRIC_CONNECTS 6
+
+/** connections to a server that couldn't be established */
+#define METRIC_CONNECT_ERRORS 7
+
+/** connections accepted */
+#define METRIC_ACCEPTS 8
+
+/** errors accepting, other than the queue being empty */
+#define METRIC_ACCEPT_ERRORS 9
+
+/** bytes of the payloads compressed */
+#define METRIC_COMPRESS_INPUT 10
+
+/** bytes the payloads compressed were turned into */
+#define METRIC_COMPRESS_OUTPUT 11
+
+/** messages not relayed to a client that didn't keep up */
+#define METRIC_MESSAGES_SKIPPED 12
+
+/** clients evicted because they didn't keep up */
+#define METRIC_SLOW_EVICTIONS 13
+
+/** messages cut short for a client because they exceeded the window */
+#define METRIC_MESSAGES_CUT 14
+
+/** number of counters */
+#define METRIC_COUNTERS 15
+
+/** connections open */
+#define METRIC_CONNECTIONS 0
+
+/** messages queued for sending */
+#define METRIC_SEND_QUEUE_DEPTH 1
+
+/** number of gauges */
+#define METRIC_GAUGES 2
+
+/** nanoseconds from the creation of a message until it was sent */
+#define METRIC_SEND_QUEUE_WAIT 0
+
+/** nanoseconds taken to handle a message received */
+#define METRIC_PROCESSING_TIME 1
+
+/** number of histograms */
+#define METRIC_HISTOGRAMS 2
+
+/** max number of pending connections to the admin socket */
+#define METRICS_BACKLOG 16
+
+/** seconds the admin thread waits for a request before answering anyway */
+#define METRICS_TIMEOUT 1
+
+/** max number of bytes of a request read by the admin thread */
+#define METRICS_REQUEST_SIZE 4096
+
+/**
+ * Metrics updated by a single thread
+ */
+struct metrics_t {
+    uint64_t counters[METRIC_COUNTERS];     /**< monotonic counters */
+    int64_t gauges[METRIC_GAUGES];  /**< changes of the gauges */
+    struct histogram_t histograms[METRIC_HISTOGRAMS];   /**< latencies */
+    struct metrics_t *next;     /**< next block registered */
+};
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ *
+ * @return nanoseconds
+ */
+uint64_t metrics_now();
+
+/**
+ * Adds value to a counter of the calling thread
+ *
+ * @param counter one of the METRIC_ counters
+ * @param value value added
+ */
+void metrics_count(unsigned counter, uint64_t value);
+
+/**
+ * Adds delta to a gauge. A gauge may go up in a thread and down in another
+ * one, only the sum of all the threads is meaningful.
+ *
+ * @param gauge one of the METRIC_ gauges
+ * @param delta value added
+ */
+void metrics_gauge(unsigned gauge, int64_t delta);
+
+/**
+ * Records a value in a histogram of the calling thread
+ *
+ * @param histogram one of the METRIC_ histograms
+ * @param value value recorded, in nanoseconds
+ */
+void metrics_record(unsigned histogram, uint64_t value);
+
+/**
+ * Merges the metrics of every thread and writes them to out in the
+ * Prometheus text format
+ *
+ * @param out stream the snapshot is written to
+ */
+void metrics_write(FILE *out);
+
+/**
+ * Starts the admin thread, that listens on the unix socket at path and
+ * answers every connection with a snapshot of the metrics, as an HTTP
+ * response so that it can be scraped with curl --unix-socket as well as read
+ * with socat. Exits the program if the socket can't be created.
+ *
+ * @param path path of the unix socket, replaced if it exists
+ */
+void metrics_serve(const char *path);
+
+#endif /* ifndef GUARD_METRICS_H */
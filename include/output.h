@@ -0,0 +1,91 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Output stage showing the messages received in the console
+ * @file output.h
+ *
+ * The threads draining the sockets never write to the terminal themselves:
+ * they push the messages received into a bounded lock-free ring each, and
+ * the output thread drains all the rings into a terminal renderer, that draws
+ * everything that arrived since its last frame with a single write. When a
+ * ring is full the message is not shown rather than blocking the producer,
+ * and the number of messages skipped is reported.
+ */
+#ifndef GUARD_OUTPUT_H
+#define GUARD_OUTPUT_H
+
+#include "message.h"
+#include "spsc.h"
+#include "terminal.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/** number of messages each producer can have waiting to be shown */
+#define OUTPUT_RING_CAPACITY 4096
+
+/** max number of messages popped from a ring at once */
+#define OUTPUT_BATCH_MAX 256
+
+/** size of the notice of the messages not shown */
+#define OUTPUT_NOTICE_SIZE 64
+
+/**
+ * Ring of one producer, with the count of the messages it couldn't push
+ */
+struct output_ring_t {
+    struct spsc_ring_t ring;    /**< messages waiting to be shown */
+    uint64_t dropped;   /**< messages skipped because the ring was full */
+};
+
+/**
+ * Output stage, with a ring per producer and the thread draining them
+ */
+struct output_t {
+    struct output_ring_t *rings;    /**< ring of every producer */
+    size_t ring_count;  /**< number of producers */
+    int type;           /**< CLIENT or SERVER, selects the prefix shown */
+    int wakeup_fd;      /**< eventfd the output thread sleeps on */
+    int sleeping;       /**< 1 while the output thread waits for messages */
+    int stopping;       /**< 1 once output_stop was called */
+    pthread_t thread;   /**< output thread */
+    struct terminal_t terminal; /**< renderer, only used by the thread */
+};
+
+/**
+ * Creates the rings of the given number of producers and starts the output
+ * thread. Fails and exits the program if it can't be started.
+ *
+ * @param output output stage
+ * @param producers number of threads that push messages
+ * @param type CLIENT or SERVER, the program showing the messages
+ */
+void output_start(struct output_t *output, size_t producers, int type);
+
+/**
+ * Queues the message to be shown. Never blocks: if the ring of the producer
+ * is full the message is skipped.
+ *
+ * @param output output stage
+ * @param producer index of the ring of the calling thread
+ * @param message message, the output stage takes a new reference to it
+ * @return 0 on success, -1 if the message was skipped
+ */
+int output_push(struct output_t *output, size_t producer,
+        struct message_t *message);
+
+/**
+ * Clears the line typed by the user, once it was read
+ *
+ * @param output output stage
+ */
+void output_clear_input(struct output_t *output);
+
+/**
+ * Shows every message still queued and stops the output thread
+ *
+ * @param output output stage
+ */
+void output_stop(struct output_t *output);
+
+#endif /* ifndef GUARD_OUTPUT_H */
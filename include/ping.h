@@ -0,0 +1,24 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Ping mode: round trip time measurement of the messaging path
+ * @file ping.h
+ */
+#ifndef GUARD_PING_H
+#define GUARD_PING_H
+
+#include "client.h"
+
+/**
+ * Sends options->count pings to the server through the connected client, one
+ * every options->interval microseconds, timestamping each of them with
+ * CLOCK_MONOTONIC. The round trip times of the echoes are recorded in a
+ * histogram, whose percentiles are printed when all the pings were answered
+ * or the program is interrupted.
+ *
+ * @param client client connected to the server
+ * @param options arguments given in the command line
+ */
+void run_ping(struct client_t *client, struct options_t *options);
+
+#endif /* ifndef GUARD_PING_H */
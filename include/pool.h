@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Size-classed pool of buffers
+ * @file pool.h
+ *
+ * Buffers are handed out in power of 2 size classes, from POOL_MIN_SIZE to
+ * POOL_MAX_SIZE bytes. A buffer given back to the pool is kept in the free
+ * list of its class, up to POOL_MAX_FREE of them, so that connections can
+ * take a buffer when data arrives and give it back as soon as it is drained
+ * without going through malloc every time. A pool is not thread safe: every
+ * thread uses its own one.
+ */
+#ifndef GUARD_POOL_H
+#define GUARD_POOL_H
+
+#include <stddef.h>
+
+/** log2 of the size of the smallest buffers */
+#define POOL_MIN_SHIFT 8
+
+/** number of size classes */
+#define POOL_CLASSES 9
+
+/** size of the smallest buffers */
+#define POOL_MIN_SIZE ((size_t) 1 << POOL_MIN_SHIFT)
+
+/** size of the largest buffers */
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+
+/** max number of free buffers kept per size class */
+#define POOL_MAX_FREE 1024
+
+/**
+ * Pool of buffers, with a free list per size class. The free buffers are
+ * linked through their first bytes.
+ */
+struct buffer_pool_t {
+    void *free[POOL_CLASSES];   /**< first free buffer of every class */
+    size_t free_count[POOL_CLASSES];    /**< number of free buffers */
+};
+
+/**
+ * Initializes an empty pool
+ *
+ * @param pool pool
+ */
+void pool_init(struct buffer_pool_t *pool);
+
+/**
+ * Takes a buffer of at least size bytes from the pool
+ *
+ * @param pool pool
+ * @param size number of bytes needed, at most POOL_MAX_SIZE
+ * @param capacity set to the actual size of the buffer
+ * @return the buffer, or NULL if size is too big or there's no memory
+ */
+void *pool_alloc(struct buffer_pool_t *pool, size_t size, size_t *capacity);
+
+/**
+ * Gives a buffer back to the pool
+ *
+ * @param pool pool the buffer was taken from
+ * @param buffer buffer, NULL is ignored
+ * @param capacity size of the buffer returned by pool_alloc
+ */
+void pool_free(struct buffer_pool_t *pool, void *buffer, size_t capacity);
+
+/**
+ * Frees every buffer kept in the pool
+ *
+ * @param pool pool
+ */
+void pool_destroy(struct buffer_pool_t *pool);
+
+#endif /* ifndef GUARD_POOL_H */
@@ -0,0 +1,128 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Name resolution with an in-process cache
+ * @file resolver.h
+ *
+ * getaddrinfo blocks for as long as the DNS servers take to answer and clients
+ * opening many connections, or reconnecting, ask for the same name over and
+ * over. The answers are kept in a cache keyed by the hostname, the port and
+ * the hints for RESOLVER_TTL seconds, and failures for RESOLVER_NEGATIVE_TTL
+ * seconds so that a name that doesn't resolve isn't looked up in a loop.
+ *
+ * Event loops that must not block submit a query instead: queries missing
+ * the cache are resolved by a resolver thread, that writes to the eventfd of
+ * the query once it's done.
+ *
+ * A hostname of the form unix:/path, or unix:@name for the abstract
+ * namespace, resolves right away to the AF_UNIX stream address, whatever the
+ * port, so that the sockets of the same host go through the same helpers.
+ * So does shm:NAME, to the abstract unix socket that the shared memory
+ * endpoint NAME is reached through (see shm.h).
+ */
+#ifndef GUARD_RESOLVER_H
+#define GUARD_RESOLVER_H
+
+#include <netdb.h>
+#include <stdint.h>
+
+/** seconds an answer is kept in the cache */
+#define RESOLVER_TTL 60
+
+/** seconds a failure is kept in the cache */
+#define RESOLVER_NEGATIVE_TTL 5
+
+/** number of buckets of the cache */
+#define RESOLVER_BUCKETS 64
+
+/** number of entries of the cache above which expired ones are removed */
+#define RESOLVER_MAX_ENTRIES 1024
+
+/** prefix of the hostnames that are unix socket paths */
+#define RESOLVER_UNIX_PREFIX "unix:"
+
+/** first character of the unix socket names in the abstract namespace */
+#define RESOLVER_ABSTRACT_PREFIX '@'
+
+/** prefix of the hostnames that are shared memory endpoints */
+#define RESOLVER_SHM_PREFIX "shm:"
+
+/** abstract unix socket name a shared memory endpoint is reached through,
+ * followed by its name */
+#define RESOLVER_SHM_SOCKET "@client_server-shm-"
+
+/**
+ * Query resolved by the resolver thread
+ */
+struct resolver_query_t {
+    const char *hostname;   /**< hostname or IP address, NULL for passive */
+    const char *port;       /**< port number or service name */
+    struct addrinfo hints;  /**< hints given to getaddrinfo */
+    int notify_fd;          /**< eventfd written once done, -1 for none */
+    int status;     /**< 0 or the EAI_* error, valid once done */
+    struct addrinfo *result;    /**< answer, free with resolver_free */
+    int done;       /**< set to 1 by the resolver thread when resolved */
+    struct resolver_query_t *next;  /**< next query waiting to be resolved */
+};
+
+/**
+ * Resolves the hostname and port with the given hints, taking the answer from
+ * the cache when it has one that hasn't expired and calling getaddrinfo in
+ * the calling thread otherwise. Safe to call from any thread.
+ *
+ * @param hostname hostname or IP address, NULL for a passive address
+ * @param port port number or service name
+ * @param hints hints given to getaddrinfo
+ * @param res resulting addrinfo list, to be freed with resolver_free
+ * @return 0 on success or the EAI_* error returned by getaddrinfo
+ */
+int resolver_resolve(const char *hostname, const char *port,
+        const struct addrinfo *hints, struct addrinfo **res);
+
+/**
+ * Submits a query without blocking. When the cache has an answer the query is
+ * done when this function returns; otherwise it's queued for the resolver
+ * thread, started on the first call, and notify_fd is written when it's done.
+ * The strings of the query must stay valid until it's done, and notify_fd
+ * until it's written.
+ *
+ * @param query query with hostname, port, hints and notify_fd set
+ * @return 1 if the query is already done, 0 if it was queued, -1 if the
+ * resolver thread couldn't be started
+ */
+int resolver_submit(struct resolver_query_t *query);
+
+/**
+ * Returns whether the resolver thread is done with a submitted query
+ *
+ * @param query query submitted
+ * @return 1 if status and result are valid, 0 otherwise
+ */
+int resolver_done(struct resolver_query_t *query);
+
+/**
+ * Returns whether the hostname is a unix socket endpoint, unix:/path or
+ * unix:@name, or a shared memory endpoint shm:NAME, that is reached through
+ * a unix socket too
+ *
+ * @param hostname hostname, may be NULL
+ * @return 1 if it is, 0 otherwise
+ */
+int resolver_is_unix(const char *hostname);
+
+/**
+ * Returns whether the hostname is a shared memory endpoint, shm:NAME
+ *
+ * @param hostname hostname, may be NULL
+ * @return 1 if it is, 0 otherwise
+ */
+int resolver_is_shm(const char *hostname);
+
+/**
+ * Frees an addrinfo list returned by the resolver
+ *
+ * @param res addrinfo list, may be NULL
+ */
+void resolver_free(struct addrinfo *res);
+
+#endif /* ifndef GUARD_RESOLVER_H */
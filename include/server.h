@@ -7,29 +7,388 @@
 #ifndef GUARD_SERVER
 #define GUARD_SERVER
 
+#include "channel.h"
 #include "common.h"
+#include "compress.h"
+#include "frame.h"
+#include "history.h"
+#include "message.h"
+#include "output.h"
+#include "pool.h"
+#include "session.h"
+#include "shm.h"
+#include "stream.h"
+
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#ifdef USE_IO_URING
+#include "uring.h"
+
+/** number of entries of the submission ring of the server */
+#define URING_ENTRIES 4096
+
+/** number of buffers provided to the kernel for receiving */
+#define URING_BUFFERS 1024
+
+/** size of each buffer provided to the kernel for receiving */
+#define URING_BUFFER_SIZE 4096
+
+/** buffer group id of the buffers provided for receiving */
+#define URING_BUFFER_GROUP 0
+
+/** max number of messages written to a connection by a single sendmsg */
+#define URING_SEND_BATCH_MAX 8
+#endif
+
+/** maximum number of events returned by a single epoll_wait call */
+#define MAX_EPOLL_EVENTS 256
+
+/** initial number of slots of the connection table */
+#define INITIAL_CONNECTIONS_CAPACITY 64
+
+/** max number of messages written to a connection with a single sendmsg */
+#define SEND_BATCH_MAX 64
+
+/** bytes queued for a connection above which its client is slow */
+#define SEND_QUEUE_HIGH_WATERMARK (1024 * 1024)
+
+/** bytes queued for a connection below which its client caught up */
+#define SEND_QUEUE_LOW_WATERMARK (256 * 1024)
+
+/** bytes queued for a connection above which its client is evicted */
+#define SEND_QUEUE_LIMIT (8 * 1024 * 1024)
+
+/** seconds a client can stay above the high watermark before it's evicted */
+#define SLOW_CONSUMER_TIMEOUT 10
+
+/**
+ * Structure that represents a single connection accepted by the server. It
+ * contains the connected socket, the address of the peer, the reader that
+ * reassembles the frames received and the messages that couldn't be sent yet.
+ * The bytes queued are bounded: above SEND_QUEUE_HIGH_WATERMARK the client
+ * isn't read from until they drain below SEND_QUEUE_LOW_WATERMARK, and the
+ * messages relayed from the other clients are skipped meanwhile unless the
+ * client resumes a session. A client above the high watermark for longer
+ * than SLOW_CONSUMER_TIMEOUT, or above SEND_QUEUE_LIMIT, is evicted. The
+ * bytes queued and held of each channel are bounded the same way by the
+ * window of the server, the messages of a channel above it waiting in the
+ * backlog of the channel for a client with a session.
+ */
+struct connection_t {
+    int socket_connected;   /**< socket connected to client */
+    struct sockaddr_storage addr;   /**< address of the client */
+    struct frame_reader_t reader;   /**< frames received from the client */
+    struct send_queue_t send_queue; /**< messages waiting for the socket */
+    uint32_t stream_remaining;  /**< bytes of the stream chunk not received */
+    uint64_t stream_received;   /**< bytes of the current stream received */
+    int flush_scheduled;    /**< 1 if messages were queued since the last flush */
+    int closing;        /**< 1 once the connection is being closed */
+    struct session_t *session;  /**< session resumed, NULL if none */
+    struct server_t *handoff_to;    /**< shard the connection moves to */
+    uint64_t hello_id;  /**< session asked for by the HELLO handed over */
+    uint64_t hello_received;    /**< frames received told by that HELLO */
+    struct connection_t *next_handoff;  /**< next connection handed over */
+    struct shm_region_t *shm;   /**< rings of a shm client, NULL for none */
+    uint32_t codec;     /**< compression agreed on, COMPRESS_CODEC_NONE */
+    uint64_t history_next;  /**< next message of the history to replay */
+    uint64_t history_end;   /**< message the replay stops at, 0 if none */
+    struct message_t *history_batch;    /**< last replayed batch queued */
+    int paused;         /**< 1 while the client isn't read from */
+    int lossy;          /**< 1 while the messages relayed are skipped */
+    time_t congested_since; /**< when the high watermark was crossed, 0 if not */
+    uint64_t chunked;   /**< message being received in chunks, 0 if none,
+                             the session keeps it if any */
+    uint16_t chunked_channel;   /**< channel of that message */
+    struct channel_set_t channels;  /**< channels joined, the session keeps
+                                         them if any */
+#ifdef USE_IO_URING
+    int recv_armed;     /**< 1 while a multishot recv is in flight */
+    int send_in_flight; /**< 1 while a sendmsg is in flight */
+    struct msghdr send_msg; /**< sendmsg in flight */
+    struct iovec send_iov[URING_SEND_BATCH_MAX];   /**< messages in flight */
+#endif
+};
 
 /**
- * Structure that represents the server. It contains the af_family, the
- * listening socket, the connected socket and the buffers for sending and
- * receiving.
+ * Structure that represents the server, or one of its shards when it runs
+ * several event loops. It contains the af_family, the listening socket, the
+ * epoll instance, the table of connections and the buffer of the messages
+ * typed in the console. All the connections of all the shards are members of
+ * the same chat room: every shard relays the messages it receives to the
+ * other ones through their inboxes.
  */
 struct server_t {
-    int family;         /**< AF_INET or AF_INET6 */
+    int family;         /**< AF_INET, AF_INET6 or AF_UNIX */
+    int shm;            /**< 1 if the clients exchange frames through shm */
     int socket_listening;   /**< socket listening to port */
-    int socket_connected;   /**< socket connected to client */
-    char recv_buffer[BUFFER_SIZE];   /**< buffer used for messages to receive */
+    int epoll_fd;       /**< epoll instance multiplexing all the sockets */
+    struct connection_t **connections;  /**< connection table indexed by socket */
+    size_t connections_capacity;    /**< number of slots in the table */
+    size_t connections_count;   /**< number of open connections */
+    int spare_fd;       /**< reserved to shed connections when out of fds */
+    struct buffer_pool_t pool;  /**< buffers of the frame readers */
+    int *flush_list;    /**< sockets of the connections to flush */
+    size_t flush_count; /**< number of sockets in flush_list */
+    size_t flush_capacity;  /**< number of slots of flush_list */
     char send_buffer[BUFFER_SIZE];   /**< buffer used for messages to send */
+    int stream_fd;      /**< where the streams received are written */
+    int stream_pipe[2]; /**< pipe splicing the streams from socket to file */
+    size_t shard_id;    /**< index of the shard, shard 0 owns the console */
+    size_t shard_count; /**< number of shards of the server */
+    struct server_t **shards;   /**< every shard, shared by all of them */
+    pthread_t thread;   /**< thread running the event loop of the shard */
+    struct output_t *output;    /**< shows the messages, a ring per shard */
+    struct history_t *history;  /**< log of the messages, NULL for none */
+    size_t window;      /**< max bytes of a channel queued or held for a
+                             client */
+    int inbox_fd;       /**< eventfd signaled when the inbox gets messages */
+    pthread_mutex_t inbox_lock; /**< protects inbox and handoffs */
+    struct send_queue_t inbox;  /**< messages broadcast by other shards */
+    struct connection_t *handoffs;  /**< connections handed over to the shard */
+    struct send_queue_t ended;  /**< last chunks of the messages left
+                                     unfinished by clients that went away */
+    struct session_t **sessions;    /**< sessions owned by the shard */
+    size_t sessions_count;  /**< number of sessions owned */
+    size_t sessions_capacity;   /**< number of slots of sessions */
+#ifdef USE_IO_URING
+    struct uring_t uring;   /**< io_uring instance doing all the I/O */
+    struct uring_buf_ring_t buf_ring;   /**< buffers provided for recv */
+    uint64_t inbox_counter; /**< value read from inbox_fd */
+#endif
 };
 
 /**
- * Starts the server, listening for connections until one is
- * accepted. The server structure passed is initialized and contains all the
- * relevant information.
+ * Starts the server, creating options->shards non-blocking listening sockets
+ * bound to the same port with SO_REUSEPORT, so that the kernel balances the
+ * new connections among them, each one with its own epoll instance that
+ * multiplexes it together with every connection it accepts later on. The
+ * first shard also watches stdin. The server structure passed is initialized
+ * as the first shard and holds the rest of them. The streams sent by the
+ * clients are written to options->output_path, or discarded if there is none.
  *
+ * @param options arguments given in the command line, with the port number
+ * to listen to, the number of shards and the backlog of each of them
  * @param server server_t instance that holds all the information to maintain
- * the communication and transmission of messages to/from the client
+ * the communication and transmission of messages to/from the clients
+ */
+void start_server(struct options_t *options, struct server_t *server);
+
+/**
+ * Runs the event loop of the server: accepts new connections, shows the
+ * messages received from every client and sends what is typed in stdin to all
+ * of them. Every shard but the first one runs its event loop in a thread of
+ * its own, the first one runs in the calling thread. It never returns.
+ *
+ * @param server server started with start_server
+ */
+void run_server(struct server_t *server);
+
+/**
+ * Sends the message to every member of the chat room except the connection on
+ * the socket except_fd. Every connection queues a reference to the same
+ * message, that is written when the event loop flushes the connection. The
+ * message is posted to the inbox of every other shard, that sends it to its
+ * own connections. When compression is enabled it is compressed once, before
+ * any other thread can see it, for the connections that agreed on it. The
+ * message is appended to the history first, if the server keeps one. The
+ * chunks of a message are relayed one by one, as they arrive.
+ *
+ * @param server server holding the connections
+ * @param message message to send
+ * @param except_fd socket of the connection that sent the message, or -1 to
+ * send it to everybody
+ */
+void broadcast_message(struct server_t *server, struct message_t *message,
+        int except_fd);
+
+/**
+ * Adds the connection accepted on the socket fd to the connection table
+ *
+ * @param server server holding the connection table
+ * @param fd socket of the accepted connection
+ * @param addr address of the client
+ * @return 0 on success, -1 if there's no memory, in which case the socket is
+ * closed
+ */
+int add_connection(struct server_t *server, int fd,
+        struct sockaddr_storage *addr);
+
+/**
+ * Accepts a connection pending in the queue of the listening socket and
+ * closes it right away, when the process ran out of file descriptors. The
+ * spare descriptor is closed to make room for it and opened again, so that
+ * the client is turned away instead of waiting in the queue.
+ *
+ * @param server server out of file descriptors
+ * @return 0 if a connection was shed, -1 if there was none or no descriptor
+ * could be freed
+ */
+int shed_connection(struct server_t *server);
+
+/**
+ * Closes the connection on the socket fd and frees its slot in the table
+ *
+ * @param server server holding the connection table
+ * @param fd socket of the connection
+ */
+void close_connection(struct server_t *server, int fd);
+
+/**
+ * Handles every complete frame stored in the reader of the connection,
+ * showing each message received and relaying it to the rest of the chat room,
+ * echoing the pings back and writing the stream chunks to the stream output
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success, -1 if the connection was closed because a frame was
+ * malformed or the echo of a ping couldn't be sent, or if it was handed over
+ * to the shard owning the session it resumes
+ */
+int process_frames(struct server_t *server, int fd);
+
+/**
+ * Writes bytes of the stream chunk being received on the connection, that
+ * were already read into user space, to the stream output of the server
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param bytes bytes received
+ * @param length number of bytes received
+ * @return number of bytes that belonged to the chunk, -1 if the connection
+ * was closed because the output failed
+ */
+ssize_t consume_stream(struct server_t *server, int fd, const char *bytes,
+        size_t length);
+
+/**
+ * Sends the messages posted to the inbox of the shard by the other shards to
+ * all its connections, and adopts the connections they handed over
+ *
+ * @param server shard whose inbox_fd was signaled
+ */
+void drain_inbox(struct server_t *server);
+
+/**
+ * Removes the connection from the shard and posts it to the shard set in
+ * handoff_to, that owns the session the client wants to resume. It's called
+ * once no operation of the shard refers to the connection anymore.
+ *
+ * @param server shard holding the connection
+ * @param fd socket of the connection
+ */
+void release_handoff(struct server_t *server, int fd);
+
+/**
+ * Handles every frame the client of a shm connection wrote to its ring, and
+ * arms the waiter of the ring before returning, so that the client wakes the
+ * shard up through the socket once it writes again. The messages queued for
+ * the connection are flushed as well, as the client may have made room for
+ * them. While reading is paused the frames are left in the ring, and the
+ * client blocks once it's full.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success, -1 if the connection was closed or handed over to
+ * another shard
+ */
+int process_shm(struct server_t *server, int fd);
+
+/**
+ * Drops the bytes sent from the send queue of the connection, accounting for
+ * the bytes and the messages sent and for how long the messages sent
+ * completely waited since they were created. Once a batch of the history
+ * replayed is sent the next one is queued.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param bytes number of bytes sent
+ */
+void consume_sent(struct server_t *server, int fd, size_t bytes);
+
+/**
+ * Tells whether the client of the connection must not be read from, because
+ * it doesn't read what it's sent: reading pauses once the bytes queued for it
+ * reach SEND_QUEUE_HIGH_WATERMARK, and resumes once they drain below
+ * SEND_QUEUE_LOW_WATERMARK.
+ *
+ * @param connection connection
+ * @return 1 if reading is paused, 0 otherwise
+ */
+int pause_input(struct connection_t *connection);
+
+/**
+ * Flushes every connection that had messages queued since the last call. It
+ * is called once per iteration of the event loop, so all the messages queued
+ * for a connection while handling a burst are written together. The messages
+ * left unfinished by the clients that went away are ended first.
+ *
+ * @param server server holding the connections
+ */
+void flush_scheduled_connections(struct server_t *server);
+
+#ifdef USE_IO_URING
+/**
+ * Creates the io_uring instance of the shard, provides it the buffers for
+ * receiving and arms the multishot accept, the read of the inbox and, in the
+ * first shard, the read of the console. It must be called by the thread that
+ * runs the event loop of the shard, as the ring only accepts submissions from
+ * the thread that created it. Fails and exits the program if io_uring is not
+ * available.
+ *
+ * @param server shard with its listening socket ready
+ */
+void start_server_uring(struct server_t *server);
+
+/**
+ * Runs the event loop of the server on io_uring. It never returns.
+ *
+ * @param server server started with start_server
+ */
+void run_server_uring(struct server_t *server);
+
+/**
+ * Submits a sendmsg of the first URING_SEND_BATCH_MAX queued messages of the
+ * connection, unless one is already in flight. The submission is batched with
+ * every other one prepared in the same iteration of the event loop.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success, -1 if the connection was closed
+ */
+int uring_flush_connection(struct server_t *server, int fd);
+
+/**
+ * Starts closing the connection: the socket is shut down so that the
+ * operations in flight complete, and the connection is released when the
+ * last one does.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 if operations are still in flight, -1 if the connection can be
+ * released right away
+ */
+int uring_close_connection(struct server_t *server, int fd);
+
+/**
+ * Starts handing the connection over to another shard: its multishot recv is
+ * cancelled, and the connection is released when the operations in flight
+ * complete.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 if operations are still in flight, -1 if the connection can be
+ * released right away
+ */
+int uring_handoff_connection(struct server_t *server, int fd);
+
+/**
+ * Starts receiving on a connection handed over by another shard
+ *
+ * @param server shard adopting the connection
+ * @param fd socket of the connection
  */
-void start_server(char *port, struct server_t *server);
+void uring_adopt_connection(struct server_t *server, int fd);
+#endif
 
 #endif /* ifndef GUARD_SERVER */
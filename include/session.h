@@ -0,0 +1,164 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Resumable sessions: sequencing and replay of the chat messages
+ * @file session.h
+ *
+ * A client that opens a session with a FRAME_TYPE_HELLO frame can reconnect
+ * and resume it without losing messages. Both ends number the
+ * FRAME_TYPE_DATA frames they send in the session, starting at 1. As TCP
+ * delivers them in order the numbers don't travel in the frames: the peer
+ * counts the frames it receives, and acknowledges that count with a
+ * FRAME_TYPE_ACK frame every SESSION_ACK_INTERVAL frames. The sender keeps a
+ * reference to the last SESSION_REPLAY_MAX frames not acknowledged.
+ *
+ * On reconnection the client sends a HELLO with the id of the session and the
+ * number of frames it received. The server answers with a HELLO holding the
+ * same fields and the number of frames it can't replay anymore, and then each
+ * end resends the frames the other one is missing. The payloads are made of
+ * 64 bits fields in network byte order:
+ *
+ *     HELLO | session id | received | lost |
+ *     ACK   | received |
+ *
+ * A session id of 0, or one the server doesn't know, opens a new session.
+ */
+#ifndef GUARD_SESSION_H
+#define GUARD_SESSION_H
+
+#include "channel.h"
+#include "message.h"
+
+#include <time.h>
+
+/** max number of frames not acknowledged kept for replay */
+#define SESSION_REPLAY_MAX 4096
+
+/** number of frames received between acknowledgements */
+#define SESSION_ACK_INTERVAL 32
+
+/** seconds the server keeps a session whose client went away */
+#define SESSION_TIMEOUT 120
+
+/** size of the payload of a FRAME_TYPE_HELLO frame */
+#define SESSION_HELLO_SIZE 24
+
+/** size of the payload of a FRAME_TYPE_ACK frame */
+#define SESSION_ACK_SIZE 8
+
+/** bits of the session id holding the shard that owns the session */
+#define SESSION_SHARD_MASK 0xffff
+
+/**
+ * One end of a session
+ */
+struct session_t {
+    uint64_t id;        /**< id of the session, 0 until the server gives one */
+    uint64_t sent;      /**< number of frames sent in the session */
+    uint64_t received;  /**< number of frames received in the session */
+    uint64_t acked;     /**< value of received last acknowledged */
+    struct send_queue_t unacked;    /**< last frames sent not acknowledged */
+    uint64_t chunked;   /**< server: message being received in chunks, 0 if
+                             none */
+    uint16_t chunked_channel;   /**< server: channel of that message */
+    struct channel_set_t channels;  /**< server: channels joined */
+    int fd;             /**< server: socket of the connection, -1 if none */
+    time_t detached_at; /**< server: second the connection was lost at */
+};
+
+/**
+ * Initializes a session with nothing sent nor received
+ *
+ * @param session session
+ * @param id id of the session
+ */
+void session_init(struct session_t *session, uint64_t id);
+
+/**
+ * Keeps a reference to a frame sent in the session until the peer
+ * acknowledges it. The oldest frame is dropped when there are already
+ * SESSION_REPLAY_MAX of them.
+ *
+ * @param session session
+ * @param message frame sent
+ * @return 0 on success, -1 if there's no memory
+ */
+int session_record(struct session_t *session, struct message_t *message);
+
+/**
+ * Counts a frame received in the session
+ *
+ * @param session session
+ * @return 1 if it's time to acknowledge the frames received, 0 otherwise
+ */
+int session_received(struct session_t *session);
+
+/**
+ * Drops the frames the peer acknowledged having received
+ *
+ * @param session session
+ * @param received number of frames received by the peer
+ */
+void session_acked(struct session_t *session, uint64_t received);
+
+/**
+ * Prepares the replay after the peer reconnected: the frames it received are
+ * dropped, and the ones left in unacked are those to send again.
+ *
+ * @param session session
+ * @param received number of frames received by the peer
+ * @return number of frames the peer is missing that can't be replayed
+ */
+uint64_t session_resume(struct session_t *session, uint64_t received);
+
+/**
+ * Drops every frame kept by the session, and the messages held by its
+ * channels
+ *
+ * @param session session
+ */
+void session_clear(struct session_t *session);
+
+/**
+ * Creates the FRAME_TYPE_HELLO frame that opens or resumes the session
+ *
+ * @param session session
+ * @param lost number of frames that can't be replayed
+ * @return the frame, or NULL if there's no memory
+ */
+struct message_t *session_hello(const struct session_t *session,
+        uint64_t lost);
+
+/**
+ * Creates the FRAME_TYPE_ACK frame acknowledging the frames received
+ *
+ * @param session session, whose received count is marked as acknowledged
+ * @return the frame, or NULL if there's no memory
+ */
+struct message_t *session_ack(struct session_t *session);
+
+/**
+ * Decodes the payload of a FRAME_TYPE_HELLO frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param id id of the session
+ * @param received number of frames received by the sender
+ * @param lost number of frames the sender can't replay
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int session_decode_hello(const char *payload, uint32_t length, uint64_t *id,
+        uint64_t *received, uint64_t *lost);
+
+/**
+ * Decodes the payload of a FRAME_TYPE_ACK frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param received number of frames received by the sender
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int session_decode_ack(const char *payload, uint32_t length,
+        uint64_t *received);
+
+#endif /* ifndef GUARD_SESSION_H */
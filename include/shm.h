@@ -0,0 +1,204 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Shared memory transport between processes of the same host
+ * @file shm.h
+ *
+ * A shm:NAME endpoint is reached through the unix socket NAME of the abstract
+ * namespace, but the frames don't go through it. On accepting a connection
+ * the server creates a region of shared memory holding a ring of bytes for
+ * each direction, and passes its file descriptor to the client through the
+ * socket. The frames are then written to the rings, exactly as they would be
+ * to a socket. The socket stays open: closing it is how a peer goes away.
+ *
+ * Each ring has a single producer and a single consumer. A side that finds a
+ * ring empty, or full, arms a waiter word before going to sleep, and the
+ * other side wakes it up only when it finds the waiter armed, so a busy ring
+ * costs no system call. The client sleeps on a futex of the waiter word. The
+ * server can't, its event loop sleeps on the socket, so the client wakes it
+ * up by writing a byte to the socket.
+ */
+#ifndef GUARD_SHM_H
+#define GUARD_SHM_H
+
+#include "frame.h"
+#include "pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** number of bytes of each ring, a power of 2 */
+#define SHM_RING_SIZE (1 << 20)
+
+/** identifies a region and the version of its layout */
+#define SHM_MAGIC 0x43534d31
+
+/** size of a cache line, to keep the indexes of both sides apart */
+#define SHM_CACHE_LINE 64
+
+/** milliseconds the client sleeps before checking if the server is gone */
+#define SHM_WAIT_TIMEOUT 100
+
+/** times the client checks a ring before arming a waiter and sleeping */
+#define SHM_SPIN_COUNT 2000
+
+/**
+ * Ring of bytes in shared memory, written by one process and read by another
+ */
+struct shm_ring_t {
+    /** number of bytes ever read, written by the consumer */
+    uint64_t head __attribute__((aligned(SHM_CACHE_LINE)));
+    uint32_t data_waiter;   /**< 1 while the consumer waits for bytes */
+    /** number of bytes ever written, written by the producer */
+    uint64_t tail __attribute__((aligned(SHM_CACHE_LINE)));
+    uint32_t space_waiter;  /**< 1 while the producer waits for room */
+    /** bytes of the ring */
+    char bytes[SHM_RING_SIZE] __attribute__((aligned(SHM_CACHE_LINE)));
+};
+
+/**
+ * Region of shared memory of a connection
+ */
+struct shm_region_t {
+    uint32_t magic;     /**< SHM_MAGIC */
+    struct shm_ring_t to_server;    /**< frames sent by the client */
+    struct shm_ring_t to_client;    /**< frames sent by the server */
+};
+
+/**
+ * Creates a region of shared memory with empty rings, backed by an anonymous
+ * file
+ *
+ * @param fd file descriptor of the region, to be passed to the client and
+ * closed
+ * @return the region mapped, or NULL on error
+ */
+struct shm_region_t *shm_create(int *fd);
+
+/**
+ * Maps a region created by the server
+ *
+ * @param fd file descriptor of the region, can be closed afterwards
+ * @return the region mapped, or NULL on error or if it isn't a region
+ */
+struct shm_region_t *shm_map(int fd);
+
+/**
+ * Unmaps a region
+ *
+ * @param region region, may be NULL
+ */
+void shm_unmap(struct shm_region_t *region);
+
+/**
+ * Passes the file descriptor of a region through a unix socket
+ *
+ * @param socketfd connected unix socket
+ * @param fd file descriptor passed
+ * @return 0 on success, -1 on error
+ */
+int shm_send_fd(int socketfd, int fd);
+
+/**
+ * Receives the file descriptor of a region passed through a unix socket
+ *
+ * @param socketfd connected blocking unix socket
+ * @return the file descriptor received, or -1 on error
+ */
+int shm_recv_fd(int socketfd);
+
+/**
+ * Returns the bytes of the ring that can be read without wrapping around.
+ * Only called by the consumer.
+ *
+ * @param ring ring
+ * @param bytes first byte that can be read
+ * @return number of bytes that can be read from bytes
+ */
+size_t shm_ring_peek(struct shm_ring_t *ring, const char **bytes);
+
+/**
+ * Marks bytes returned by shm_ring_peek as read. Only called by the consumer.
+ *
+ * @param ring ring
+ * @param length number of bytes read
+ */
+void shm_ring_consume(struct shm_ring_t *ring, size_t length);
+
+/**
+ * Copies as many bytes of iov as fit in the ring. Only called by the
+ * producer.
+ *
+ * @param ring ring
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @return number of bytes written
+ */
+size_t shm_ring_write(struct shm_ring_t *ring, const struct iovec *iov,
+        int iovcnt);
+
+/**
+ * Arms the waiter of the consumer unless the ring has bytes to read. Called
+ * by a consumer that found the ring empty before it sleeps.
+ *
+ * @param ring ring
+ * @return 1 if the waiter is armed, 0 if there are bytes to read after all
+ */
+int shm_ring_arm_data(struct shm_ring_t *ring);
+
+/**
+ * Arms the waiter of the producer unless the ring has room. Called by a
+ * producer that found the ring full before it sleeps.
+ *
+ * @param ring ring
+ * @return 1 if the waiter is armed, 0 if there's room after all
+ */
+int shm_ring_arm_space(struct shm_ring_t *ring);
+
+/**
+ * Disarms a waiter after the ring changed under it
+ *
+ * @param waiter data_waiter or space_waiter of a ring
+ * @return 1 if it was armed and its side has to be woken up, 0 otherwise
+ */
+int shm_take_waiter(uint32_t *waiter);
+
+/**
+ * Wakes up the client sleeping on a waiter, if it's armed
+ *
+ * @param waiter data_waiter or space_waiter of a ring
+ */
+void shm_futex_wake(uint32_t *waiter);
+
+/**
+ * Writes all the bytes to the ring of the client, sleeping while it's full,
+ * and wakes up the server through socketfd when it waits for them
+ *
+ * @param ring to_server ring
+ * @param socketfd socket connected to the server
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @return 1 on success, -1 if the server is gone
+ */
+int shm_send_all(struct shm_ring_t *ring, int socketfd, struct iovec *iov,
+        int iovcnt);
+
+/**
+ * Receives a whole frame from the ring of the client, sleeping while it's
+ * empty, as recv_frame_pooled does from a socket
+ *
+ * @param ring to_client ring
+ * @param socketfd socket connected to the server
+ * @param h header of the frame received
+ * @param pool pool the buffers are taken from
+ * @param payload buffer of the pool where the payload is stored, or NULL
+ * @param capacity size of *payload
+ * @return 1 on success, 0 if the server is gone, -1 on error or if the frame
+ * is bigger than FRAME_MAX_PAYLOAD
+ */
+int shm_recv_frame_pooled(struct shm_ring_t *ring, int socketfd,
+        struct frame_header_t *h, struct buffer_pool_t *pool, char **payload,
+        size_t *capacity);
+
+#endif /* ifndef GUARD_SHM_H */
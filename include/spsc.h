@@ -0,0 +1,78 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Bounded lock-free single-producer/single-consumer ring of pointers
+ * @file spsc.h
+ *
+ * One thread pushes and another one pops, without locks: the producer only
+ * writes tail and the consumer only writes head. Each of them keeps a cached
+ * copy of the index written by the other one, so that the cache line holding
+ * it is only read when the ring looks full or empty.
+ */
+#ifndef GUARD_SPSC_H
+#define GUARD_SPSC_H
+
+#include <stddef.h>
+
+/** size of a cache line, to keep the indexes of both threads apart */
+#define SPSC_CACHE_LINE 64
+
+/**
+ * Ring of pointers shared by a producer and a consumer thread
+ */
+struct spsc_ring_t {
+    void **slots;       /**< items, capacity is a power of 2 */
+    size_t mask;        /**< capacity - 1 */
+    /** next slot read, written by the consumer */
+    size_t head __attribute__((aligned(SPSC_CACHE_LINE)));
+    size_t cached_tail; /**< tail last seen by the consumer */
+    /** next slot written, written by the producer */
+    size_t tail __attribute__((aligned(SPSC_CACHE_LINE)));
+    size_t cached_head; /**< head last seen by the producer */
+};
+
+/**
+ * Initializes an empty ring
+ *
+ * @param ring ring
+ * @param capacity max number of items, a power of 2
+ * @return 0 on success, -1 if there's no memory
+ */
+int spsc_ring_init(struct spsc_ring_t *ring, size_t capacity);
+
+/**
+ * Frees the slots of the ring. The items still in it are not freed.
+ *
+ * @param ring ring
+ */
+void spsc_ring_destroy(struct spsc_ring_t *ring);
+
+/**
+ * Appends an item to the ring. Only called by the producer.
+ *
+ * @param ring ring
+ * @param item item
+ * @return 1 if the item was pushed, 0 if the ring is full
+ */
+int spsc_ring_push(struct spsc_ring_t *ring, void *item);
+
+/**
+ * Removes up to max items from the front of the ring. Only called by the
+ * consumer.
+ *
+ * @param ring ring
+ * @param items where the items are stored
+ * @param max max number of items to remove
+ * @return number of items removed
+ */
+size_t spsc_ring_pop(struct spsc_ring_t *ring, void **items, size_t max);
+
+/**
+ * Tells whether the ring is empty. Only called by the consumer.
+ *
+ * @param ring ring
+ * @return 1 if empty, 0 otherwise
+ */
+int spsc_ring_empty(struct spsc_ring_t *ring);
+
+#endif /* ifndef GUARD_SPSC_H */
@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Streaming of files and pipes without copying through user space
+ * @file stream.h
+ *
+ * A stream is sent as a sequence of FRAME_TYPE_STREAM frames followed by an
+ * empty one. The payload of regular files is written to the socket with
+ * sendfile, and the payload of pipes is spliced into the socket through an
+ * intermediate pipe, so that the length of each chunk is known before its
+ * header is sent. The receiving side splices the payload from the socket
+ * into a file descriptor the same way.
+ */
+#ifndef GUARD_STREAM_H
+#define GUARD_STREAM_H
+
+#include "client.h"
+
+#include <stdint.h>
+
+/** size requested for the pipes used to splice a stream */
+#define STREAM_PIPE_SIZE (1 << 20)
+
+/** size of the buffer used when a descriptor can't be spliced */
+#define STREAM_COPY_SIZE (1 << 16)
+
+/**
+ * Streams the file options->send_path, or stdin if it is "-", to the server
+ * through the connected client and prints the number of bytes sent. Exits
+ * the program if the file can't be opened or the stream fails.
+ *
+ * @param client client connected to the server
+ * @param options arguments given in the command line
+ */
+void run_send(struct client_t *client, struct options_t *options);
+
+/**
+ * Sends everything that can be read from fd through the blocking socket
+ * socketfd as a stream, ending it with an empty FRAME_TYPE_STREAM frame
+ *
+ * @param socketfd connected socket
+ * @param fd regular file, pipe or any other readable descriptor
+ * @param sent set to the number of bytes of the stream sent
+ * @return 1 on success, -1 on error
+ */
+int send_stream(int socketfd, int fd, uint64_t *sent);
+
+/**
+ * Writes all the bytes to the blocking descriptor fd, resuming after short
+ * writes
+ *
+ * @param fd descriptor
+ * @param bytes bytes to write
+ * @param length number of bytes to write
+ * @return 1 on success, -1 on error
+ */
+int write_all(int fd, const char *bytes, size_t length);
+
+/**
+ * Moves exactly length bytes out of the pipe pipefd into the blocking
+ * descriptor fd with splice, copying them through user space only if fd
+ * can't be spliced (i.e. a terminal)
+ *
+ * @param pipefd read end of a pipe holding at least length bytes
+ * @param fd descriptor to write to
+ * @param length number of bytes to move
+ * @return 1 on success, -1 on error
+ */
+int drain_pipe(int pipefd, int fd, size_t length);
+
+#endif /* ifndef GUARD_STREAM_H */
@@ -0,0 +1,124 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Renderer of the messages shown in the console
+ * @file terminal.h
+ *
+ * The messages are kept in a scrollback of the last TERMINAL_SCROLLBACK
+ * lines, and drawn in frames: everything added since the last frame is
+ * written with a single write, at most once every TERMINAL_FRAME_INTERVAL.
+ * On a terminal the ANSI sequences are written directly. The messages scroll
+ * in a region above the last row, which is left to the line being typed, and
+ * only the lines that fit in the region are drawn, however many arrived since
+ * the last frame; the scrollback redraws the screen when it's resized. The
+ * control characters of the messages are replaced, so that a peer can't
+ * drive the terminal. When the output isn't a terminal every line is written
+ * as it was received. The messages of a channel other than CHANNEL_DEFAULT
+ * are labeled with it. The chunks of a message are shown as they arrive, the
+ * ones after the first going on with it without prefix nor label.
+ */
+#ifndef GUARD_TERMINAL_H
+#define GUARD_TERMINAL_H
+
+#include "channel.h"
+#include "message.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** number of lines kept to redraw the screen */
+#define TERMINAL_SCROLLBACK 1024
+
+/** min nanoseconds between two frames, 60 frames per second */
+#define TERMINAL_FRAME_INTERVAL 16666667
+
+/** initial size of the buffer where the frames are composed */
+#define TERMINAL_FRAME_SIZE 4096
+
+/**
+ * Line of the scrollback
+ */
+struct terminal_line_t {
+    struct message_t *message;  /**< message holding the text */
+    const char *prefix;         /**< shown before the text */
+    int continued;              /**< 1 if it goes on with the line before */
+};
+
+/**
+ * Renderer writing the lines added to a file descriptor
+ */
+struct terminal_t {
+    int fd;             /**< where the frames are written */
+    int ansi;           /**< 1 if fd is a terminal drawn with ANSI sequences */
+    unsigned short rows;    /**< rows of the terminal */
+    unsigned short cols;    /**< columns of the terminal */
+    struct terminal_line_t lines[TERMINAL_SCROLLBACK]; /**< scrollback */
+    size_t first;       /**< index of the oldest line of the scrollback */
+    size_t count;       /**< number of lines of the scrollback */
+    size_t pending;     /**< lines added since the last frame */
+    int more;           /**< 1 if the last line added goes on in the next */
+    uint16_t channel;   /**< channel of the last line added */
+    const char *prefix; /**< prefix of the last line added */
+    int open;           /**< 1 if the last line written without ANSI
+                             sequences didn't end with a newline */
+    int redraw;         /**< 1 if the next frame draws the whole screen */
+    uint64_t last_frame;    /**< metrics_now() when the last frame was drawn */
+    char *frame;        /**< buffer where the frames are composed */
+    size_t frame_capacity;  /**< size of frame */
+    size_t frame_length;    /**< number of bytes of the frame composed */
+};
+
+/**
+ * Initializes a renderer with an empty scrollback. ANSI sequences are only
+ * used when asked to and fd is a terminal.
+ *
+ * @param terminal renderer
+ * @param fd where the frames are written
+ * @param ansi 1 to draw with ANSI sequences if fd is a terminal, 0 not to
+ */
+void terminal_init(struct terminal_t *terminal, int fd, int ansi);
+
+/**
+ * Adds a line to the scrollback, to be drawn by the next frame. When the
+ * output isn't a terminal, the lines are written before the scrollback drops
+ * any of them. A chunk going on with the message of the line before is
+ * drawn without prefix, and not at all if it's empty.
+ *
+ * @param terminal renderer
+ * @param message message holding the text, the renderer takes the reference
+ * @param prefix shown before the text, must outlive the renderer
+ */
+void terminal_add(struct terminal_t *terminal, struct message_t *message,
+        const char *prefix);
+
+/**
+ * Returns how long to wait before the next frame can be drawn
+ *
+ * @param terminal renderer with lines pending
+ * @return nanoseconds, 0 if it can be drawn now
+ */
+uint64_t terminal_frame_wait(struct terminal_t *terminal);
+
+/**
+ * Draws the lines added since the last frame with a single write
+ *
+ * @param terminal renderer
+ * @return 1 on success, -1 on error
+ */
+int terminal_render(struct terminal_t *terminal);
+
+/**
+ * Clears the last row, once the line typed there was read
+ *
+ * @param terminal renderer
+ */
+void terminal_clear_input(struct terminal_t *terminal);
+
+/**
+ * Gives the whole screen back to the terminal and frees the scrollback
+ *
+ * @param terminal renderer
+ */
+void terminal_destroy(struct terminal_t *terminal);
+
+#endif /* ifndef GUARD_TERMINAL_H */
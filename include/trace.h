@@ -0,0 +1,154 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Hot path tracepoints recorded in per-thread rings
+ * @file trace.h
+ *
+ * The tracepoints compile to nothing unless the program is built with the
+ * USE_TRACING CMake option. When it is, every thread records its events in a
+ * ring of its own, registered the first time it records one, that keeps the
+ * last TRACE_RING_SIZE events. Only the owning thread writes to a ring, so
+ * recording an event takes two reads of the clock and no lock.
+ *
+ * The rings are dumped when the process gets TRACE_SIGNAL, to the file
+ * client_server-PID.trace in the working directory, or when the trace is
+ * asked for through the admin socket (-m PATH) at /trace. A dump is made of
+ * a struct trace_dump_header_t, followed by a struct trace_ring_header_t and
+ * its events for every ring. client_server_trace converts a dump to the JSON
+ * format of the Chrome trace viewer (chrome://tracing or Perfetto).
+ */
+#ifndef GUARD_TRACE_H
+#define GUARD_TRACE_H
+
+#include <signal.h>
+#include <stdint.h>
+
+/** a connection accepted, arg is the socket or -1 */
+#define TRACE_ACCEPT 0
+
+/** a read of a socket, arg is the number of bytes read or -1 */
+#define TRACE_RECV 1
+
+/** a write to a socket, arg is the number of bytes written or -1 */
+#define TRACE_SEND 2
+
+/** a message queued for sending, arg is the depth of the queue */
+#define TRACE_ENQUEUE 3
+
+/** messages sent dropped from the queue, arg is the number of them */
+#define TRACE_DEQUEUE 4
+
+/** number of kinds of events */
+#define TRACE_EVENTS 5
+
+/** number of events kept by the ring of a thread, a power of two */
+#define TRACE_RING_SIZE 16384
+
+/** signal that makes the process dump its trace */
+#define TRACE_SIGNAL SIGUSR1
+
+/** identifies a trace dump, and the version of its format */
+#define TRACE_MAGIC "CSTRACE1"
+
+/**
+ * Event recorded by a tracepoint
+ */
+struct trace_event_t {
+    uint64_t start;     /**< monotonic nanoseconds the event started at */
+    uint64_t duration;  /**< nanoseconds it lasted, 0 for an instant */
+    int64_t arg;        /**< value that depends on the kind of event */
+    int32_t fd;         /**< socket the event happened on, -1 if none */
+    uint32_t type;      /**< one of the TRACE_ events */
+};
+
+/**
+ * Header of a trace dump
+ */
+struct trace_dump_header_t {
+    char magic[8];      /**< TRACE_MAGIC, not null terminated */
+    uint32_t pid;       /**< process traced */
+    uint32_t rings;     /**< number of rings dumped */
+};
+
+/**
+ * Header of the events of a ring in a trace dump
+ */
+struct trace_ring_header_t {
+    uint32_t tid;       /**< thread that recorded the events */
+    uint32_t count;     /**< number of events that follow, oldest first */
+};
+
+/**
+ * Ring of the events recorded by a thread
+ */
+struct trace_ring_t {
+    uint32_t tid;       /**< thread owning the ring */
+    uint64_t head;      /**< number of events ever recorded */
+    struct trace_event_t events[TRACE_RING_SIZE];   /**< last events */
+    struct trace_ring_t *next;  /**< next ring registered */
+};
+
+#ifdef USE_TRACING
+
+/** starts the span of an event, held in the variable span */
+#define TRACE_BEGIN(span) uint64_t span = trace_now()
+
+/** ends the span started by TRACE_BEGIN and records its event */
+#define TRACE_END(span, type, fd, arg) \
+    trace_record((type), (span), trace_now() - (span), (fd), (arg))
+
+/** records an event without duration */
+#define TRACE_INSTANT(type, fd, arg) \
+    trace_record((type), trace_now(), 0, (fd), (arg))
+
+/** dumps the trace on TRACE_SIGNAL from now on */
+#define TRACE_START() trace_start()
+
+#else
+
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, type, fd, arg) ((void) 0)
+#define TRACE_INSTANT(type, fd, arg) ((void) 0)
+#define TRACE_START() ((void) 0)
+
+#endif /* ifdef USE_TRACING */
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ *
+ * @return nanoseconds
+ */
+uint64_t trace_now();
+
+/**
+ * Records an event in the ring of the calling thread, overwriting the oldest
+ * one when it's full
+ *
+ * @param type one of the TRACE_ events
+ * @param start monotonic nanoseconds the event started at
+ * @param duration nanoseconds it lasted, 0 for an instant
+ * @param fd socket the event happened on, -1 if none
+ * @param arg value that depends on the kind of event
+ */
+void trace_record(uint32_t type, uint64_t start, uint64_t duration, int fd,
+        int64_t arg);
+
+/**
+ * Writes a dump of the rings of every thread to fd. The events a thread
+ * records while its ring is being dumped may overwrite the oldest ones, that
+ * are left out of the dump then.
+ *
+ * @param fd file or socket the dump is written to
+ * @return 0 on success, -1 on error
+ */
+int trace_dump(int fd);
+
+/**
+ * Starts the thread that dumps the trace every time the process gets
+ * TRACE_SIGNAL. The signal is blocked in the calling thread and in every
+ * thread created afterwards, so it must be called before creating any.
+ * Exits the program on failure.
+ */
+void trace_start();
+
+#endif /* ifndef GUARD_TRACE_H */
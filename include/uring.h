@@ -0,0 +1,136 @@
+/**
+ * Copyright (C) 2016 Antonio Gutierrez
+ *
+ * @brief Minimal io_uring wrapper built on top of the raw system calls
+ * @file uring.h
+ *
+ * Only the small subset of io_uring needed by the server is wrapped: the
+ * submission and completion rings, batched submission and provided buffer
+ * rings. It talks to the kernel directly, so no liburing is required.
+ */
+#ifndef GUARD_URING_H
+#define GUARD_URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * io_uring instance with its submission and completion rings mapped
+ */
+struct uring_t {
+    int ring_fd;            /**< file descriptor of the io_uring instance */
+    unsigned *sq_head;      /**< head of the submission ring (kernel) */
+    unsigned *sq_tail;      /**< tail of the submission ring (us) */
+    unsigned sq_mask;       /**< mask to index the submission ring */
+    unsigned sq_entries;    /**< number of entries of the submission ring */
+    unsigned sqe_tail;      /**< tail of the entries prepared, not published */
+    struct io_uring_sqe *sqes;  /**< submission queue entries */
+    unsigned *cq_head;      /**< head of the completion ring (us) */
+    unsigned *cq_tail;      /**< tail of the completion ring (kernel) */
+    unsigned cq_mask;       /**< mask to index the completion ring */
+    struct io_uring_cqe *cqes;  /**< completion queue entries */
+    void *sq_ring;          /**< mapping of the submission ring */
+    size_t sq_ring_size;    /**< size of the mapping of the submission ring */
+    void *cq_ring;          /**< mapping of the completion ring */
+    size_t cq_ring_size;    /**< size of the mapping of the completion ring */
+    size_t sqes_size;       /**< size of the mapping of sqes */
+};
+
+/**
+ * Ring of buffers provided to the kernel, from which it picks a buffer for
+ * each completion of a recv that has IOSQE_BUFFER_SELECT set
+ */
+struct uring_buf_ring_t {
+    struct io_uring_buf_ring *ring;     /**< ring shared with the kernel */
+    char *buffers;          /**< memory of all the buffers */
+    unsigned entries;       /**< number of buffers, a power of 2 */
+    unsigned buffer_size;   /**< size of each buffer */
+    uint16_t group_id;      /**< buffer group id used in the sqes */
+    uint16_t tail;          /**< local copy of the tail of the ring */
+};
+
+/**
+ * Creates an io_uring instance with room for entries submissions
+ *
+ * @param uring io_uring instance
+ * @param entries number of entries of the submission ring
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int uring_init(struct uring_t *uring, unsigned entries);
+
+/**
+ * Unmaps the rings and closes the io_uring instance
+ *
+ * @param uring io_uring instance
+ */
+void uring_exit(struct uring_t *uring);
+
+/**
+ * Returns a zeroed submission entry to prepare. When the submission ring is
+ * full the entries prepared so far are submitted first.
+ *
+ * @param uring io_uring instance
+ * @return the submission entry, or NULL if the ring couldn't be submitted
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *uring);
+
+/**
+ * Submits all the entries prepared with a single system call and waits until
+ * at least wait_nr completions are available
+ *
+ * @param uring io_uring instance
+ * @param wait_nr number of completions to wait for
+ * @return number of entries submitted, or -1 on error (errno is set)
+ */
+int uring_submit_and_wait(struct uring_t *uring, unsigned wait_nr);
+
+/**
+ * Returns the next completion without waiting
+ *
+ * @param uring io_uring instance
+ * @return the completion, or NULL if there are none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *uring);
+
+/**
+ * Marks the completion returned by uring_peek_cqe as consumed
+ *
+ * @param uring io_uring instance
+ */
+void uring_cqe_seen(struct uring_t *uring);
+
+/**
+ * Allocates entries buffers of buffer_size bytes and registers them as the
+ * provided buffer group group_id
+ *
+ * @param uring io_uring instance
+ * @param buf_ring buffer ring
+ * @param group_id buffer group id
+ * @param entries number of buffers, a power of 2
+ * @param buffer_size size of each buffer
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int uring_buf_ring_init(struct uring_t *uring, struct uring_buf_ring_t
+        *buf_ring, uint16_t group_id, unsigned entries, unsigned buffer_size);
+
+/**
+ * Returns the buffer with id buffer_id to the kernel
+ *
+ * @param buf_ring buffer ring
+ * @param buffer_id id of the buffer, taken from the flags of the completion
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring_t *buf_ring,
+        uint16_t buffer_id);
+
+/**
+ * Returns the memory of the buffer with id buffer_id
+ *
+ * @param buf_ring buffer ring
+ * @param buffer_id id of the buffer
+ * @return first byte of the buffer
+ */
+char *uring_buf_ring_buffer(struct uring_buf_ring_t *buf_ring,
+        uint16_t buffer_id);
+
+#endif /* ifndef GUARD_URING_H */
@@ -0,0 +1,354 @@
+#include "common.h"
+#include "client.h"
+#include "frame.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+/** default number of concurrent connections */
+#define BENCH_DEFAULT_CONNECTIONS 10
+
+/** default number of messages per second sent, 0 means as fast as possible */
+#define BENCH_DEFAULT_RATE 0
+
+/** default number of bytes of the payload of each message */
+#define BENCH_DEFAULT_SIZE 64
+
+/** default duration of the benchmark in seconds */
+#define BENCH_DEFAULT_DURATION 10
+
+/** maximum number of events returned by a single epoll_wait call */
+#define BENCH_MAX_EVENTS 256
+
+/**
+ * Parameters of the benchmark given in the command line
+ */
+struct bench_options_t {
+    char *hostname;     /**< hostname or IP of the server */
+    char *port;         /**< port of the server */
+    int connections;    /**< number of concurrent connections */
+    long rate;          /**< messages per second, 0 means unlimited */
+    uint32_t size;      /**< bytes of the payload of each message */
+    double duration;    /**< seconds the benchmark runs */
+};
+
+/**
+ * A connection of the load generator, with the progress of the message that
+ * is being sent and the frames being received
+ */
+struct bench_connection_t {
+    struct client_t client;     /**< connected client */
+    struct frame_reader_t reader;   /**< frames received from the server */
+    size_t send_offset;     /**< bytes of the message being sent, 0 if none */
+};
+
+/**
+ * Counters accumulated during the benchmark
+ */
+struct bench_stats_t {
+    uint64_t messages_sent;     /**< messages completely sent */
+    uint64_t bytes_sent;        /**< bytes sent, headers included */
+    uint64_t messages_received; /**< messages completely received */
+    uint64_t bytes_received;    /**< bytes received, headers included */
+    uint64_t syscalls;          /**< send, recv and epoll_wait calls */
+};
+
+/**
+ * Returns the seconds elapsed since start using the monotonic clock
+ *
+ * @param start time the benchmark started
+ * @return seconds elapsed
+ */
+static double seconds_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) /
+        1e9;
+}
+
+/**
+ * Prints the usage of the benchmark on stderr and exits
+ */
+static void print_usage_exit()
+{
+    fprintf(stderr,
+            "Usage: client_server_bench [OPTIONS] IP [PORT]\n"
+            "IP: IP or hostname of the server\n"
+            "PORT: port of the server, else default port is 10000\n"
+            "OPTIONS:\n"
+            "  -c, --connections N  concurrent connections (default %d)\n"
+            "  -r, --rate N         messages per second, 0 is unlimited "
+            "(default %d)\n"
+            "  -s, --size N         bytes of each message, up to %zu "
+            "(default %d)\n"
+            "  -d, --duration N     seconds to run (default %d)\n",
+            BENCH_DEFAULT_CONNECTIONS, BENCH_DEFAULT_RATE,
+            (size_t) FRAME_MAX_PAYLOAD,
+            BENCH_DEFAULT_SIZE, BENCH_DEFAULT_DURATION);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Parses the command line arguments of the benchmark
+ *
+ * @param argc number of parameters (including executable name)
+ * @param argv array of command line parameters
+ * @param options parameters of the benchmark
+ */
+static void parse_options(int argc, char *argv[],
+        struct bench_options_t *options)
+{
+    static struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"rate", required_argument, NULL, 'r'},
+        {"size", required_argument, NULL, 's'},
+        {"duration", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0}
+    };
+    options->connections = BENCH_DEFAULT_CONNECTIONS;
+    options->rate = BENCH_DEFAULT_RATE;
+    options->size = BENCH_DEFAULT_SIZE;
+    options->duration = BENCH_DEFAULT_DURATION;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:r:s:d:", long_options, NULL))
+            != -1) {
+        switch (opt) {
+            case 'c':
+                options->connections = atoi(optarg);
+                break;
+            case 'r':
+                options->rate = atol(optarg);
+                break;
+            case 's':
+                options->size = atoi(optarg);
+                break;
+            case 'd':
+                options->duration = atof(optarg);
+                break;
+            default:
+                print_usage_exit();
+        }
+    }
+    if (optind >= argc || argc - optind > 2 || options->connections <= 0 ||
+            options->rate < 0 || options->size == 0 ||
+            options->size > FRAME_MAX_PAYLOAD || options->duration <= 0) {
+        print_usage_exit();
+    }
+    options->hostname = argv[optind];
+    options->port = optind + 1 < argc ? argv[optind + 1] : DEFAULT_PORT_NUMBER;
+    // the load is generated with non-blocking sends to the sockets
+    if (resolver_is_shm(options->hostname)) {
+        fprintf(stderr, "shm endpoints can't be benchmarked\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Sends the rest of the message being sent through the connection, or a new
+ * one if none was being sent
+ *
+ * @param connection connection of the load generator
+ * @param message whole frame of the message
+ * @param length number of bytes of the frame
+ * @param stats counters of the benchmark
+ * @return 1 if the message was completely sent, 0 if the socket is full, -1
+ * on error
+ */
+static int send_bench_message(struct bench_connection_t *connection,
+        const char *message, size_t length, struct bench_stats_t *stats)
+{
+    while (connection->send_offset < length) {
+        stats->syscalls++;
+        ssize_t sent = send(connection->client.socket_connected, message +
+                connection->send_offset, length - connection->send_offset,
+                MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send_bench_message-send()");
+            return -1;
+        }
+        connection->send_offset += sent;
+        stats->bytes_sent += sent;
+    }
+    connection->send_offset = 0;
+    stats->messages_sent++;
+    return 1;
+}
+
+/**
+ * Reads everything available on the connection, counting the messages
+ * received
+ *
+ * @param connection connection of the load generator
+ * @param stats counters of the benchmark
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int receive_bench_messages(struct bench_connection_t *connection,
+        struct bench_stats_t *stats)
+{
+    for (;;) {
+        stats->syscalls++;
+        ssize_t status = frame_reader_read(&connection->reader,
+                connection->client.socket_connected);
+        if (status > 0) {
+            stats->bytes_received += status;
+            struct frame_header_t h;
+            const char *payload;
+            int ret;
+            while ((ret = frame_reader_next(&connection->reader, &h,
+                            &payload)) == 1) {
+                stats->messages_received++;
+            }
+            if (ret == -1) {
+                fprintf(stderr, "receive_bench_messages: malformed frame\n");
+                return -1;
+            }
+            continue;
+        }
+        if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (status == -1) {
+            perror("receive_bench_messages-recv()");
+        }
+        return -1;
+    }
+}
+
+/**
+ * Prints the results of the benchmark to stdout
+ *
+ * @param options parameters of the benchmark
+ * @param stats counters of the benchmark
+ * @param elapsed seconds the benchmark run
+ */
+static void print_results(struct bench_options_t *options,
+        struct bench_stats_t *stats, double elapsed)
+{
+    uint64_t messages = stats->messages_sent + stats->messages_received;
+    printf("connections: %d\n", options->connections);
+    printf("message size: %u bytes (%u on the wire)\n", options->size,
+            options->size + FRAME_HEADER_SIZE);
+    printf("duration: %.2f s\n", elapsed);
+    printf("sent: %llu messages, %.0f msg/s, %.0f bytes/s\n",
+            (unsigned long long) stats->messages_sent,
+            stats->messages_sent / elapsed, stats->bytes_sent / elapsed);
+    printf("received: %llu messages, %.0f msg/s, %.0f bytes/s\n",
+            (unsigned long long) stats->messages_received,
+            stats->messages_received / elapsed,
+            stats->bytes_received / elapsed);
+    printf("syscalls: %llu, %.2f per message\n",
+            (unsigned long long) stats->syscalls, messages > 0 ?
+            (double) stats->syscalls / messages : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options_t options;
+    parse_options(argc, argv, &options);
+
+    // the whole frame is the same for every message
+    size_t length = FRAME_HEADER_SIZE + options.size;
+    char *message = (char *) malloc(length);
+    struct frame_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.length = options.size;
+    h.type = FRAME_TYPE_DATA;
+    frame_encode_header(&h, message);
+    memset(message + FRAME_HEADER_SIZE, 'x', options.size - 1);
+    message[length - 1] = '\n';
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct bench_connection_t *connections = (struct bench_connection_t *)
+        calloc(options.connections, sizeof(*connections));
+    if (message == NULL || connections == NULL || epoll_fd == -1) {
+        perror("main");
+        exit(EXIT_FAILURE);
+    }
+    printf("opening %d connections to %s in port %s\n", options.connections,
+            options.hostname, options.port);
+    verbose = 0;
+    for (int i = 0; i < options.connections; ++i) {
+        struct bench_connection_t *connection = &connections[i];
+        int fd = connect_to_server(options.hostname, options.port,
+                &connection->client);
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        frame_reader_init(&connection->reader, &connection->client.pool);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("main-epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct bench_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double elapsed = 0;
+    int next = 0;
+    while ((elapsed = seconds_since(&start)) < options.duration) {
+        // with a rate, send what is due by now; without it, try to send one
+        // message through every connection
+        uint64_t due = options.connections;
+        if (options.rate > 0) {
+            uint64_t target = (uint64_t) (options.rate * elapsed);
+            due = target > stats.messages_sent ? target - stats.messages_sent :
+                0;
+        }
+        int blocked = 0;
+        for (uint64_t i = 0; i < due && blocked < options.connections; ++i) {
+            struct bench_connection_t *connection = &connections[next];
+            next = (next + 1) % options.connections;
+            // a connection still sending a message waits for EPOLLOUT
+            if (connection->send_offset > 0 ||
+                    send_bench_message(connection, message, length, &stats)
+                    == 0) {
+                blocked++;
+                i--;
+                continue;
+            }
+        }
+
+        // only sleep when there's nothing to send right away
+        int timeout = options.rate > 0 || blocked > 0 ? 1 : 0;
+        stats.syscalls++;
+        int n = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, timeout);
+        for (int i = 0; i < n; ++i) {
+            struct bench_connection_t *connection = (struct
+                    bench_connection_t *) events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && connection->send_offset > 0) {
+                send_bench_message(connection, message, length, &stats);
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                            EPOLLERR)) &&
+                    receive_bench_messages(connection, &stats) == -1) {
+                fprintf(stderr, "connection closed by the server\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    print_results(&options, &stats, elapsed);
+
+    for (int i = 0; i < options.connections; ++i) {
+        disconnect(&connections[i].client);
+    }
+    free(connections);
+    free(message);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,231 @@
+#include "channel.h"
+
+/**
+ * Initializes a channel with nothing queued nor held
+ *
+ * @param channel channel
+ * @param id id of the channel
+ */
+static void channel_init(struct channel_t *channel, uint16_t id)
+{
+    channel->id = id;
+    channel->queued = 0;
+    channel->chunked = 0;
+    channel->skipping = 0;
+    send_queue_init(&channel->held);
+    send_queue_init(&channel->backlog);
+}
+
+/**
+ * Initializes a set holding only CHANNEL_DEFAULT
+ *
+ * @param set set of channels
+ */
+void channel_set_init(struct channel_set_t *set)
+{
+    channel_init(&set->channels[0], CHANNEL_DEFAULT);
+    set->count = 1;
+}
+
+/**
+ * Drops the messages held or waiting in the backlog of every channel of the
+ * set
+ *
+ * @param set set of channels
+ */
+void channel_set_clear(struct channel_set_t *set)
+{
+    for (size_t i = 0; i < set->count; ++i) {
+        send_queue_clear(&set->channels[i].held);
+        send_queue_clear(&set->channels[i].backlog);
+    }
+}
+
+/**
+ * Returns a channel of the set
+ *
+ * @param set set of channels
+ * @param id id of the channel
+ * @return the channel, or NULL if it wasn't joined
+ */
+struct channel_t *channel_find(struct channel_set_t *set, uint16_t id)
+{
+    for (size_t i = 0; i < set->count; ++i) {
+        if (set->channels[i].id == id) {
+            return &set->channels[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Adds a channel to the set, if it isn't there already
+ *
+ * @param set set of channels
+ * @param id id of the channel
+ * @return 0 on success, -1 if there are CHANNEL_MAX_JOINED channels already
+ */
+int channel_join(struct channel_set_t *set, uint16_t id)
+{
+    if (channel_find(set, id) != NULL) {
+        return 0;
+    }
+    if (set->count == CHANNEL_MAX_JOINED) {
+        return -1;
+    }
+    channel_init(&set->channels[set->count], id);
+    set->count++;
+    return 0;
+}
+
+/**
+ * Removes a channel from the set, if it's there, dropping the messages it
+ * holds or has in its backlog
+ *
+ * @param set set of channels
+ * @param id id of the channel
+ */
+void channel_leave(struct channel_set_t *set, uint16_t id)
+{
+    struct channel_t *channel = channel_find(set, id);
+    if (channel != NULL) {
+        send_queue_clear(&channel->held);
+        send_queue_clear(&channel->backlog);
+        // the order of the channels doesn't matter
+        *channel = set->channels[--set->count];
+    }
+}
+
+/**
+ * Appends a message to the ones released, and keeps track of the message
+ * being relayed in chunks
+ *
+ * @param channel channel of the message
+ * @param message message released
+ * @param ready messages released
+ */
+static void release(struct channel_t *channel, struct message_t *message,
+        struct send_queue_t *ready)
+{
+    if (send_queue_push(ready, message) == -1) {
+        fprintf(stderr, "channel_relay: out of memory\n");
+    }
+    channel->chunked = message_has_more(message) ? message->chunked : 0;
+}
+
+/**
+ * Tells whether the channel holds chunks of a message
+ *
+ * @param channel channel
+ * @param chunked id of the message
+ * @return 1 if it holds any, 0 otherwise
+ */
+static int holds(struct channel_t *channel, uint64_t chunked)
+{
+    for (size_t i = 0; i < channel->held.count; ++i) {
+        if (send_queue_at(&channel->held, i)->chunked == chunked) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Releases the messages held once the message relayed in chunks ended, in
+ * the order they came. The chunks of a message released among them are
+ * released as well, the rest waits for its last chunk again.
+ *
+ * @param channel channel holding messages
+ * @param ready messages released
+ */
+static void release_held(struct channel_t *channel,
+        struct send_queue_t *ready)
+{
+    while (channel->chunked == 0 && channel->held.count > 0) {
+        struct send_queue_t held = channel->held;
+        send_queue_init(&channel->held);
+        // a message held can't overtake the ones held before it
+        int kept = 0;
+        for (size_t i = 0; i < held.count; ++i) {
+            struct message_t *message = send_queue_at(&held, i);
+            if (channel->chunked == 0 ? !kept :
+                    message->chunked == channel->chunked) {
+                release(channel, message, ready);
+            } else if (send_queue_push(&channel->held, message) == 0) {
+                kept = 1;
+            } else {
+                fprintf(stderr, "channel_relay: out of memory\n");
+            }
+        }
+        send_queue_clear(&held);
+    }
+}
+
+/**
+ * Relays a message of the channel, or holds it until the message being
+ * relayed in chunks ends. The messages released are appended to ready, in
+ * the order they are to be sent. When the bytes held exceed the window, the
+ * message being relayed is cut short: an empty last chunk is released in
+ * place of the chunks missing, that are dropped as they come, and the
+ * messages held are released. The chunks of a message whose first chunk the
+ * channel didn't relay are dropped too.
+ *
+ * @param channel channel of the message
+ * @param message message relayed, tagged with the message it is a chunk of
+ * @param window max number of bytes held
+ * @param ready messages released, the caller sends them and clears it
+ * @return 1 if a message was cut short, 0 otherwise, -1 if there was no
+ * memory to cut it short, the message being held nonetheless
+ */
+int channel_relay(struct channel_t *channel, struct message_t *message,
+        size_t window, struct send_queue_t *ready)
+{
+    // the rest of a message cut short, or begun before the channel was
+    // joined
+    if (message->continued && message->chunked != channel->chunked &&
+            !holds(channel, message->chunked)) {
+        return 0;
+    }
+    if (channel->chunked == 0 || message->chunked == channel->chunked) {
+        release(channel, message, ready);
+        release_held(channel, ready);
+        return 0;
+    }
+    if (send_queue_push(&channel->held, message) == -1) {
+        fprintf(stderr, "channel_relay: out of memory\n");
+        return 0;
+    }
+    if (channel->held.bytes <= window) {
+        return 0;
+    }
+    // without the last chunk the client would wait for the rest forever
+    struct message_t *last = message_create(FRAME_TYPE_DATA, "", 0);
+    if (last == NULL) {
+        fprintf(stderr, "channel_relay: out of memory\n");
+        return -1;
+    }
+    message_set_channel(last, channel->id);
+    last->chunked = channel->chunked;
+    last->continued = 1;
+    release(channel, last, ready);
+    message_unref(last);
+    channel->chunked = 0;
+    release_held(channel, ready);
+    return 1;
+}
+
+/**
+ * Creates a FRAME_TYPE_JOIN or FRAME_TYPE_LEAVE frame
+ *
+ * @param type type of the frame
+ * @param id id of the channel
+ * @return the message or NULL if there's no memory
+ */
+struct message_t *channel_frame(uint8_t type, uint16_t id)
+{
+    struct message_t *message = message_create(type, "", 0);
+    if (message != NULL) {
+        message_set_channel(message, id);
+    }
+    return message;
+}
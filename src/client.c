@@ -1,5 +1,296 @@
 #include "client.h"
 
+#include <time.h>
+
+/**
+ * Enables TCP keepalive on the socket, so that a connection that died
+ * silently, i.e. because of a network outage, is noticed and reconnected
+ *
+ * @param socketfd connected socket
+ */
+static void set_keepalive(int socketfd)
+{
+    int yes = 1;
+    int idle = KEEPALIVE_IDLE;
+    int interval = KEEPALIVE_INTERVAL;
+    int count = KEEPALIVE_COUNT;
+    if (setsockopt(socketfd, SOL_SOCKET, SO_KEEPALIVE, &yes,
+                sizeof(yes)) == -1 ||
+            setsockopt(socketfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle,
+                sizeof(idle)) == -1 ||
+            setsockopt(socketfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                sizeof(interval)) == -1 ||
+            setsockopt(socketfd, IPPROTO_TCP, TCP_KEEPCNT, &count,
+                sizeof(count)) == -1) {
+        // unix sockets learn about a dead peer right away
+        if (errno != EOPNOTSUPP) {
+            perror("set_keepalive-setsockopt()");
+        }
+    }
+}
+
+/**
+ * Sends the frames queued for the server as far as the non-blocking socket
+ * takes them. The lock of the client must be held.
+ *
+ * @param client client running the event loop
+ * @return 1 on success, -1 on error
+ */
+int flush_send_queue(struct client_t *client)
+{
+    struct send_queue_t *queue = &client->send_queue;
+    struct iovec iov[CLIENT_SEND_BATCH_MAX];
+    while (queue->count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = send_queue_iov(queue, iov, CLIENT_SEND_BATCH_MAX);
+        TRACE_BEGIN(span);
+        ssize_t sent = sendmsg(client->socket_connected, &msg, MSG_NOSIGNAL);
+        TRACE_END(span, TRACE_SEND, client->socket_connected, sent);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            metrics_count(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+        metrics_count(METRIC_BYTES_SENT, sent);
+        send_queue_consume(queue, sent);
+    }
+    return 1;
+}
+
+/**
+ * Sends the frame held by the message to the server, through the socket or
+ * through the ring of a shm endpoint. In the event loop the frame is queued
+ * instead, and sent as far as the socket takes it without blocking.
+ *
+ * @param client client connected to the server
+ * @param message message holding the frame
+ * @return 1 on success, -1 on error
+ */
+int send_message_frame(struct client_t *client, struct message_t *message)
+{
+    // the receiving thread stores the codec once the server agrees on it
+    struct message_t *compressed = NULL;
+    if (__atomic_load_n(&client->codec, __ATOMIC_RELAXED) !=
+            COMPRESS_CODEC_NONE &&
+            (compressed = compress_message(message)) != NULL) {
+        message = compressed;
+    }
+    // the session is opened with blocking sends while reconnecting
+    if (client->queue_sends && client->connected) {
+        int status = send_queue_push(&client->send_queue, message);
+        if (status == -1) {
+            errno = ENOMEM;
+        } else {
+            metrics_count(METRIC_MESSAGES_SENT, 1);
+            status = flush_send_queue(client);
+        }
+        if (compressed != NULL) {
+            message_unref(compressed);
+        }
+        return status;
+    }
+    struct iovec iov;
+    iov.iov_base = message->frame;
+    iov.iov_len = message->length;
+    TRACE_BEGIN(span);
+    int status = client->shm != NULL ?
+        shm_send_all(&client->shm->to_server, client->socket_connected,
+                &iov, 1) :
+        send_all(client->socket_connected, &iov, 1);
+    TRACE_END(span, TRACE_SEND, client->socket_connected, status == -1 ?
+            (int64_t) -1 : (int64_t) message->length);
+    if (status == -1) {
+        metrics_count(METRIC_SEND_ERRORS, 1);
+    } else {
+        metrics_count(METRIC_MESSAGES_SENT, 1);
+        metrics_count(METRIC_BYTES_SENT, message->length);
+    }
+    if (compressed != NULL) {
+        message_unref(compressed);
+    }
+    return status;
+}
+
+/**
+ * Replaces the payload held in the recv_buffer of the client with the payload
+ * it holds compressed
+ *
+ * @param client client holding a frame received with FRAME_FLAG_COMPRESSED
+ * @param h header of the frame, updated to describe the payload decompressed
+ * @return 1 on success, -1 on error
+ */
+static int inflate_recv_buffer(struct client_t *client,
+        struct frame_header_t *h)
+{
+    const char *payload;
+    uint32_t length;
+    if (client->codec == COMPRESS_CODEC_NONE || compress_inflate(
+                client->recv_buffer, h->length, &payload, &length) == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (client->recv_capacity < length + 1) {
+        pool_free(&client->pool, client->recv_buffer, client->recv_capacity);
+        client->recv_buffer = (char *) pool_alloc(&client->pool, length + 1,
+                &client->recv_capacity);
+        if (client->recv_buffer == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    memcpy(client->recv_buffer, payload, length + 1);
+    h->length = length;
+    h->flags &= ~FRAME_FLAG_COMPRESSED;
+    return 1;
+}
+
+/**
+ * Handles the frame held in the recv_buffer of the client if it's the answer
+ * to the compression offer, or decompresses its payload
+ *
+ * @param client client holding a frame received
+ * @param h header of the frame, updated if the payload is decompressed
+ * @return 1 if the client holds a frame for the caller, 0 if the frame was
+ * the answer, -1 on error
+ */
+static int accept_frame(struct client_t *client, struct frame_header_t *h)
+{
+    if (h->flags & FRAME_FLAG_COMPRESSED) {
+        return inflate_recv_buffer(client, h);
+    }
+    if (h->type != FRAME_TYPE_CODEC) {
+        return 1;
+    }
+    uint32_t codecs, dictionary_id;
+    if (compress_decode_codec(client->recv_buffer, h->length, &codecs,
+                &dictionary_id) == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+    __atomic_store_n(&client->codec, compress_agree(codecs, dictionary_id),
+            __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Receives a whole frame from the server, through the socket or through the
+ * ring of a shm endpoint, into the recv_buffer of the client. The answers to
+ * the compression offer are handled here, and the compressed payloads are
+ * decompressed, so that the callers never see either of them.
+ *
+ * @param client client connected to the server
+ * @param h header of the frame received
+ * @return 1 on success, 0 if the server closed the connection, -1 on error
+ */
+int receive_message_frame(struct client_t *client, struct frame_header_t *h)
+{
+    for (;;) {
+        int status = client->shm != NULL ?
+            shm_recv_frame_pooled(&client->shm->to_client,
+                    client->socket_connected, h, &client->pool,
+                    &client->recv_buffer, &client->recv_capacity) :
+            recv_frame_pooled(client->socket_connected, h, &client->pool,
+                    &client->recv_buffer, &client->recv_capacity);
+        if (status <= 0) {
+            return status;
+        }
+        status = accept_frame(client, h);
+        if (status != 0) {
+            return status;
+        }
+    }
+}
+
+/**
+ * Takes a frame reassembled by a frame reader as the frame received by the
+ * client: the payload is copied to its recv_buffer, followed by a null
+ * terminator, and handled as receive_message_frame does
+ *
+ * @param client client connected to the server
+ * @param h header of the frame, updated if the payload is decompressed
+ * @param payload payload of the frame
+ * @return 1 if the client holds the frame, 0 if it was the answer to the
+ * compression offer, -1 on error
+ */
+int take_message_frame(struct client_t *client, struct frame_header_t *h,
+        const char *payload)
+{
+    if (client->recv_buffer == NULL ||
+            client->recv_capacity < (size_t) h->length + 1) {
+        pool_free(&client->pool, client->recv_buffer, client->recv_capacity);
+        client->recv_buffer = (char *) pool_alloc(&client->pool,
+                (size_t) h->length + 1, &client->recv_capacity);
+        if (client->recv_buffer == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    memcpy(client->recv_buffer, payload, h->length);
+    client->recv_buffer[h->length] = '\0';
+    return accept_frame(client, h);
+}
+
+/**
+ * Offers the server to compress the messages, if enabled. The messages are
+ * sent as they are until the server agrees, receive_message_frame handles
+ * its answer.
+ *
+ * @param client client connected to the server
+ * @return 1 on success, -1 on error
+ */
+static int offer_compression(struct client_t *client)
+{
+    __atomic_store_n(&client->codec, COMPRESS_CODEC_NONE, __ATOMIC_RELAXED);
+    // copying to a ring is cheaper than compressing
+    if (compress_codecs() == COMPRESS_CODEC_NONE || client->shm != NULL) {
+        return 1;
+    }
+    struct message_t *offer = compress_codec_frame(compress_codecs());
+    if (offer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int status = send_message_frame(client, offer);
+    message_unref(offer);
+    return status;
+}
+
+/**
+ * Maps the region of shared memory that the server of a shm endpoint passes
+ * through the socket right after accepting the connection
+ *
+ * @param socketfd socket connected to the server
+ * @return the region mapped, or NULL on error
+ */
+static struct shm_region_t *attach_shm(int socketfd)
+{
+    int fd = shm_recv_fd(socketfd);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct shm_region_t *region = shm_map(fd);
+    close(fd);
+    return region;
+}
+
+/**
+ * Gives the buffer of the message received back to the pool
+ *
+ * @param client client holding the message received
+ */
+static void release_recv_buffer(struct client_t *client)
+{
+    pool_free(&client->pool, client->recv_buffer, client->recv_capacity);
+    client->recv_buffer = NULL;
+}
+
 /**
  * Connects the given client to a server on the given hostname/IP
  *
@@ -13,18 +304,455 @@ int connect_to_server(char *hostname, char *port, struct client_t *client)
 
     // getaddrinfo
     struct addrinfo *result;
-    printf("connecting to %s in port %s\n", hostname, port);
+    print_progress("connecting to %s in port %s\n", hostname, port);
     get_addrinfo_list(hostname, port, &hints, &result);
 
+    pool_init(&client->pool);
+    client->recv_buffer = NULL;
+    client->recv_capacity = 0;
+    client->hostname = hostname;
+    client->port = port;
+    session_init(&client->session, 0);
+    pthread_mutex_init(&client->lock, NULL);
+    client->queue_sends = 0;
+    send_queue_init(&client->send_queue);
+    client->send_more = 0;
+    client->channel = CHANNEL_DEFAULT;
+    channel_set_init(&client->channels);
+
     // socket
     client->socket_connected = find_connectable_socket(result);
+    client->connected = 1;
+    client->shm = NULL;
+    if (resolver_is_shm(hostname)) {
+        client->shm = attach_shm(client->socket_connected);
+        if (client->shm == NULL) {
+            fprintf(stderr, "Couldn't map the shared memory of %s\n",
+                    hostname);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // messages are typed by a person, they must not wait for more to come
+    set_tcp_nodelay(client->socket_connected);
+    set_keepalive(client->socket_connected);
+    if (offer_compression(client) == -1) {
+        perror("connect_to_server-offer_compression()");
+        exit(EXIT_FAILURE);
+    }
 
     // free structrure returned
-    freeaddrinfo(result);
+    resolver_free(result);
 
     return client->socket_connected;
 }
 
+/**
+ * Sends the server the frames that make it agree on the channels the client
+ * is in, which are CHANNEL_DEFAULT alone for a new session
+ *
+ * @param client client connected to the server
+ * @return 1 on success, -1 on error
+ */
+static int join_channels(struct client_t *client)
+{
+    int status = 1;
+    if (channel_find(&client->channels, CHANNEL_DEFAULT) == NULL) {
+        struct message_t *leave = channel_frame(FRAME_TYPE_LEAVE,
+                CHANNEL_DEFAULT);
+        status = leave == NULL ? -1 : send_message_frame(client, leave);
+        if (leave != NULL) {
+            message_unref(leave);
+        }
+    }
+    for (size_t i = 0; status == 1 && i < client->channels.count; ++i) {
+        uint16_t id = client->channels.channels[i].id;
+        if (id == CHANNEL_DEFAULT) {
+            continue;
+        }
+        struct message_t *join = channel_frame(FRAME_TYPE_JOIN, id);
+        if (join == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        status = send_message_frame(client, join);
+        message_unref(join);
+    }
+    return status;
+}
+
+/**
+ * Opens a session with the server, or resumes the one the client had, and
+ * sends again the messages the server didn't receive. The messages received
+ * before the answer of the server are shown only when opening a new session,
+ * otherwise they are part of the replay. The channels of the client are
+ * joined again, in case the server lost the session.
+ *
+ * @param client client connected to the server, with its lock held when the
+ * receiving thread is running
+ * @param output output stage showing the messages received
+ * @return 1 on success, 0 if the server closed the connection, -1 on error
+ */
+int open_session(struct client_t *client, struct output_t *output)
+{
+    struct session_t *session = &client->session;
+    struct message_t *hello = session_hello(session, 0);
+    if (hello == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int status = send_message_frame(client, hello);
+    message_unref(hello);
+    if (status == -1) {
+        return -1;
+    }
+
+    // wait for the answer of the server
+    struct frame_header_t h;
+    for (;;) {
+        status = receive_message_frame(client, &h);
+        if (status <= 0) {
+            return status;
+        }
+        if (h.type == FRAME_TYPE_HELLO) {
+            break;
+        }
+        if (h.type == FRAME_TYPE_DATA && session->id == 0) {
+            client->recv_length = h.length;
+            client->recv_type = h.type;
+            client->recv_flags = h.flags;
+            client->recv_channel = h.channel;
+            show_received_message(client, output);
+        }
+        release_recv_buffer(client);
+    }
+    uint64_t id, received, lost;
+    status = session_decode_hello(client->recv_buffer, h.length, &id,
+            &received, &lost);
+    release_recv_buffer(client);
+    if (status == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (id != session->id) {
+        // the server doesn't know the session anymore, it starts over
+        if (session->id != 0) {
+            fprintf(stderr, "session expired, %zu messages sent may be "
+                    "lost\n", session->unacked.count);
+        }
+        session_clear(session);
+        session_init(session, id);
+        return join_channels(client);
+    }
+    lost += session_resume(session, received);
+    for (size_t i = 0; i < session->unacked.count; ++i) {
+        if (send_message_frame(client, send_queue_at(&session->unacked,
+                        i)) == -1) {
+            return -1;
+        }
+    }
+    if (lost > 0) {
+        fprintf(stderr, "%llu messages lost while reconnecting\n",
+                (unsigned long long) lost);
+    }
+    return join_channels(client);
+}
+
+/**
+ * Asks the server for the messages it relayed since the given one, that are
+ * shown as they arrive, before the messages relayed from then on
+ *
+ * @param client client with a session
+ * @param since sequence of the first message, 1 for all of them
+ * @return 1 on success, -1 on error
+ */
+int request_history(struct client_t *client, uint64_t since)
+{
+    struct message_t *request = history_frame(since);
+    if (request == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_lock(&client->lock);
+    int status = send_message_frame(client, request);
+    pthread_mutex_unlock(&client->lock);
+    message_unref(request);
+    return status;
+}
+
+/**
+ * Sends the message held in send_buffer in the session. It is kept until the
+ * server acknowledges it, so that it's sent again after a reconnection if it
+ * was lost on the way.
+ *
+ * @param client client with a session
+ * @return 1 on success, -1 if there's no memory
+ */
+int send_session_message(struct client_t *client)
+{
+    size_t length = strlen(client->send_buffer);
+    struct message_t *message = message_create(FRAME_TYPE_DATA,
+            client->send_buffer, length);
+    if (message == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // fgets stops at BUFFER_SIZE - 1 bytes in the middle of a long line
+    client->send_more = length > 0 && client->send_buffer[length - 1] !=
+        '\n';
+    if (client->send_more) {
+        message_set_more(message);
+    }
+    message_set_channel(message, client->channel);
+    pthread_mutex_lock(&client->lock);
+    session_record(&client->session, message);
+    // while reconnecting the message is only kept, it's sent when the
+    // session is resumed
+    if (client->connected && send_message_frame(client, message) == -1) {
+        // the receiving thread finds the connection closed and reconnects
+        shutdown(client->socket_connected, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&client->lock);
+    message_unref(message);
+    return 1;
+}
+
+/**
+ * Runs the command held in send_buffer, if it holds one instead of a
+ * message: "/join N" joins the channel N and sends the messages typed next
+ * to it, "/leave N" leaves the channel N.
+ *
+ * @param client client with a session
+ * @return 1 if it held a command, 0 if it holds a message, -1 on error
+ */
+int run_channel_command(struct client_t *client)
+{
+    char command[8];
+    unsigned int id;
+    // a line continuing a message sent in chunks is never a command
+    if (client->send_more || client->send_buffer[0] != '/' ||
+            sscanf(client->send_buffer, "/%7s %u", command, &id) != 2 ||
+            id > UINT16_MAX) {
+        return 0;
+    }
+    uint8_t type;
+    if (strcmp(command, "join") == 0) {
+        type = FRAME_TYPE_JOIN;
+    } else if (strcmp(command, "leave") == 0) {
+        type = FRAME_TYPE_LEAVE;
+    } else {
+        return 0;
+    }
+    struct message_t *frame = channel_frame(type, id);
+    if (frame == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_lock(&client->lock);
+    int status = 0;
+    if (type == FRAME_TYPE_JOIN) {
+        status = channel_join(&client->channels, id);
+        if (status == 0) {
+            client->channel = id;
+        }
+    } else {
+        channel_leave(&client->channels, id);
+        if (client->channel == id) {
+            client->channel = CHANNEL_DEFAULT;
+        }
+    }
+    // while reconnecting the channels are joined once the session is open
+    if (status == 0 && client->connected &&
+            send_message_frame(client, frame) == -1) {
+        shutdown(client->socket_connected, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&client->lock);
+    message_unref(frame);
+    if (status == -1) {
+        fprintf(stderr, "can't be in more than %d channels\n",
+                CHANNEL_MAX_JOINED);
+    } else if (type == FRAME_TYPE_JOIN) {
+        fprintf(stderr, "talking in channel %u\n", id);
+    } else {
+        fprintf(stderr, "left channel %u\n", id);
+    }
+    return 1;
+}
+
+/**
+ * Ends the message sent in chunks, if any, with an empty chunk. It's sent
+ * when the input ends in the middle of a line.
+ *
+ * @param client client with a session
+ * @return 1 on success, -1 if there's no memory
+ */
+int finish_session_message(struct client_t *client)
+{
+    if (!client->send_more) {
+        return 1;
+    }
+    client->send_buffer[0] = '\0';
+    return send_session_message(client);
+}
+
+/**
+ * Handles a frame received in the session: counts the messages, and
+ * acknowledges them every SESSION_ACK_INTERVAL, and drops the messages sent
+ * that the server acknowledges
+ *
+ * @param client client with a session, holding the frame received
+ * @return 1 if the frame is a message to show, 0 otherwise
+ */
+int handle_session_frame(struct client_t *client)
+{
+    uint64_t received;
+    switch (client->recv_type) {
+        case FRAME_TYPE_DATA:
+            pthread_mutex_lock(&client->lock);
+            if (session_received(&client->session)) {
+                struct message_t *ack = session_ack(&client->session);
+                if (ack != NULL) {
+                    if (send_message_frame(client, ack) == -1) {
+                        shutdown(client->socket_connected, SHUT_RDWR);
+                    }
+                    message_unref(ack);
+                }
+            }
+            pthread_mutex_unlock(&client->lock);
+            return 1;
+        case FRAME_TYPE_REPLAY:
+            // replayed outside of the session, they aren't counted
+            return 1;
+        case FRAME_TYPE_HISTORY:
+            if (history_decode(client->recv_buffer, client->recv_length,
+                        &received) == 0) {
+                if (received == 0) {
+                    fprintf(stderr, "the server keeps no history\n");
+                } else {
+                    fprintf(stderr, "history replayed, the next message is "
+                            "#%llu\n", (unsigned long long) received);
+                }
+            }
+            return 0;
+        case FRAME_TYPE_ACK:
+            if (session_decode_ack(client->recv_buffer, client->recv_length,
+                        &received) == 0) {
+                pthread_mutex_lock(&client->lock);
+                session_acked(&client->session, received);
+                pthread_mutex_unlock(&client->lock);
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Pushes the message held in the recv_buffer of the client to the output
+ * stage. The chunks of a longer message are pushed as they arrive, flagged
+ * with FRAME_FLAG_MORE but the last one, and shown as a single line.
+ *
+ * @param client client holding a FRAME_TYPE_DATA or FRAME_TYPE_REPLAY frame
+ * @param output output stage showing the messages received
+ */
+void show_received_message(struct client_t *client, struct output_t *output)
+{
+    struct message_t *message = message_create(FRAME_TYPE_DATA,
+            client->recv_buffer, client->recv_length);
+    if (message == NULL) {
+        fprintf(stderr, "show_received_message: out of memory\n");
+        return;
+    }
+    if (client->recv_flags & FRAME_FLAG_MORE) {
+        message_set_more(message);
+    }
+    message_set_channel(message, client->recv_channel);
+    output_push(output, 0, message);
+    message_unref(message);
+}
+
+/**
+ * Reconnects to the server after the connection was lost, waiting between
+ * attempts an exponentially growing delay with random jitter, so that the
+ * clients dropped at once don't come back at once, and resumes the session.
+ *
+ * @param client client whose connection was lost
+ * @param output output stage showing the messages received
+ * @return 1 if the session was resumed, 0 if the client gave up
+ */
+int reconnect_to_server(struct client_t *client, struct output_t *output)
+{
+    // wakes up the main thread if it's blocked sending to the dead connection
+    shutdown(client->socket_connected, SHUT_RDWR);
+    pthread_mutex_lock(&client->lock);
+    close(client->socket_connected);
+    client->socket_connected = -1;
+    client->connected = 0;
+    // the main thread gave up sending to the ring once the socket was shut
+    // down, as the lock shows
+    shm_unmap(client->shm);
+    client->shm = NULL;
+    pthread_mutex_unlock(&client->lock);
+    fprintf(stderr, "connection lost, reconnecting...\n");
+
+    unsigned seed = (unsigned) time(NULL) ^ (unsigned) getpid();
+    long delay = RECONNECT_MIN_DELAY;
+    for (int attempt = 0; attempt < RECONNECT_MAX_ATTEMPTS; ++attempt) {
+        // half of the delay is fixed and the other half random
+        long wait = delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+        struct timespec ts;
+        ts.tv_sec = wait / 1000;
+        ts.tv_nsec = wait % 1000 * 1000000;
+        nanosleep(&ts, NULL);
+        delay = delay * 2 > RECONNECT_MAX_DELAY ? RECONNECT_MAX_DELAY :
+            delay * 2;
+
+        // the name is resolved again, the server may have moved
+        struct addrinfo hints;
+        struct addrinfo *result;
+        initialize_hints(&hints, CLIENT);
+        if (resolver_resolve(client->hostname, client->port, &hints,
+                    &result) != 0) {
+            continue;
+        }
+        int socketfd = try_connectable_socket(result);
+        resolver_free(result);
+        if (socketfd == -1) {
+            continue;
+        }
+        set_tcp_nodelay(socketfd);
+        set_keepalive(socketfd);
+        struct shm_region_t *region = NULL;
+        if (resolver_is_shm(client->hostname) &&
+                (region = attach_shm(socketfd)) == NULL) {
+            close(socketfd);
+            continue;
+        }
+
+        pthread_mutex_lock(&client->lock);
+        client->socket_connected = socketfd;
+        client->shm = region;
+        int status = offer_compression(client);
+        if (status == 1) {
+            status = open_session(client, output);
+        }
+        if (status == 1) {
+            client->connected = 1;
+        } else {
+            close(socketfd);
+            client->socket_connected = -1;
+            shm_unmap(client->shm);
+            client->shm = NULL;
+        }
+        pthread_mutex_unlock(&client->lock);
+        if (status == 1) {
+            fprintf(stderr, "reconnected\n");
+            return 1;
+        }
+    }
+    fprintf(stderr, "couldn't reconnect, giving up\n");
+    return 0;
+}
 
 /**
  * Disconnects the given client 
@@ -34,4 +762,12 @@ int connect_to_server(char *hostname, char *port, struct client_t *client)
 void disconnect(struct client_t *client)
 {
     close(client->socket_connected);
+    shm_unmap(client->shm);
+    client->shm = NULL;
+    pool_free(&client->pool, client->recv_buffer, client->recv_capacity);
+    client->recv_buffer = NULL;
+    pool_destroy(&client->pool);
+    session_clear(&client->session);
+    send_queue_clear(&client->send_queue);
+    pthread_mutex_destroy(&client->lock);
 }
@@ -0,0 +1,377 @@
+#include "client_loop.h"
+#include "frame.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/** eventfd signaled to shut the loop down, -1 while none is running */
+static int shutdown_fd = -1;
+
+/**
+ * Handler of SIGINT and SIGTERM, that wakes the loop up to shut it down
+ *
+ * @param signum signal number
+ */
+static void request_shutdown(int signum)
+{
+    (void) signum;
+    // the code interrupted may be about to check errno
+    int saved_errno = errno;
+    uint64_t one = 1;
+    ssize_t written = write(shutdown_fd, &one, sizeof(one));
+    (void) written;
+    errno = saved_errno;
+}
+
+/**
+ * Installs the handler of the signals that shut the loop down
+ *
+ * @param handler request_shutdown, or SIG_DFL once the loop is done
+ */
+static void handle_shutdown_signals(void (*handler)(int))
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    // no SA_RESTART, so that whatever the loop waits for is interrupted and
+    // the shutdown is seen right away
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/**
+ * Adds the file descriptor to the epoll instance, watching it for reading
+ *
+ * @param epoll_fd epoll instance
+ * @param fd file descriptor to watch
+ * @return 0 on success, -1 on error
+ */
+static int watch_fd(int epoll_fd, int fd)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * Changes the events watched for a file descriptor of the epoll instance.
+ * Fails and exits the program if they could not be changed.
+ *
+ * @param epoll_fd epoll instance
+ * @param fd file descriptor watched
+ * @param events events to watch, 0 for none
+ */
+static void rewatch_fd(int epoll_fd, int fd, uint32_t events)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        perror("rewatch_fd-epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Sets the O_NONBLOCK flag on the socket connected to the server, so that
+ * the frames sent are queued instead of blocking the loop. Fails and exits
+ * the program if the flag could not be set.
+ *
+ * @param fd connected socket
+ */
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("set_nonblocking-fcntl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Sends a line typed in the console in the session, or the start of a line
+ * too long for the console buffer
+ *
+ * @param client client with a session
+ * @param output output stage, whose input line is cleared
+ * @param line text to send
+ * @param length number of bytes of line, less than BUFFER_SIZE
+ */
+static void send_line(struct client_t *client, struct output_t *output,
+        const char *line, size_t length)
+{
+    memcpy(client->send_buffer, line, length);
+    client->send_buffer[length] = '\0';
+    output_clear_input(output);
+    send_message(client, CLIENT);
+}
+
+/**
+ * Reads what was typed in the console and sends every line completed in the
+ * session as a message of its own, as if typed one by one. The start of a
+ * line is kept in input until the rest of it is read, unless it fills the
+ * buffer, in which case it is sent as the first chunk of a longer message.
+ *
+ * @param client client with a session
+ * @param output output stage, whose input line is cleared
+ * @param input console buffer of BUFFER_SIZE bytes
+ * @param kept number of bytes of a line kept at the start of input
+ * @return 1 if stdin is still open, 0 once it's closed
+ */
+static int read_console(struct client_t *client, struct output_t *output,
+        char *input, size_t *kept)
+{
+    ssize_t status = read(STDIN_FILENO, input + *kept,
+            BUFFER_SIZE - 1 - *kept);
+    if (status == -1 && errno == EINTR) {
+        return 1;
+    }
+    if (status <= 0) {
+        // the last line has no newline
+        if (*kept > 0) {
+            send_line(client, output, input, *kept);
+            *kept = 0;
+        }
+        finish_session_message(client);
+        return 0;
+    }
+    size_t length = *kept + status;
+    size_t start = 0;
+    // the bytes kept hold no newline
+    for (size_t i = *kept; i < length; ++i) {
+        if (input[i] == '\n') {
+            send_line(client, output, input + start, i + 1 - start);
+            start = i + 1;
+        }
+    }
+    if (start == 0 && length == BUFFER_SIZE - 1) {
+        send_line(client, output, input, length);
+        start = length;
+    }
+    *kept = length - start;
+    memmove(input, input + start, *kept);
+    return 1;
+}
+
+/**
+ * Handles every complete frame stored in the reader, pushing the messages to
+ * the output stage
+ *
+ * @param client client with a session
+ * @param reader frame reader of the socket
+ * @param output output stage showing the messages received
+ * @return 0 on success, -1 if a frame is malformed or couldn't be handled
+ */
+static int process_frames(struct client_t *client,
+        struct frame_reader_t *reader, struct output_t *output)
+{
+    struct frame_header_t h;
+    const char *payload;
+    int status;
+    while ((status = frame_reader_next(reader, &h, &payload)) == 1) {
+        // the server never streams to its clients
+        if (payload == NULL) {
+            errno = EPROTO;
+            return -1;
+        }
+        status = take_message_frame(client, &h, payload);
+        if (status == -1) {
+            return -1;
+        }
+        if (status == 0) {
+            continue;
+        }
+        metrics_count(METRIC_MESSAGES_RECEIVED, 1);
+        client->recv_length = h.length;
+        client->recv_type = h.type;
+        client->recv_flags = h.flags;
+        client->recv_channel = h.channel;
+        if (handle_session_frame(client)) {
+            // the message is shown by the output thread, a slow terminal
+            // never delays the draining of the socket
+            show_received_message(client, output);
+        }
+    }
+    if (status == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads what the socket has available and handles the frames completed. As
+ * the socket is watched in level-triggered mode, a single read never blocks.
+ * When the connection is lost the frames queued for it are dropped, the
+ * session sending its messages again, and the session is resumed on a new
+ * connection, that is watched instead.
+ *
+ * @param client client with a session
+ * @param reader frame reader of the socket
+ * @param output output stage showing the messages received
+ * @param epoll_fd epoll instance watching the socket
+ * @return 1 on success, 0 if the client reconnected, -1 if the server can't
+ * be reached anymore
+ */
+static int read_socket(struct client_t *client, struct frame_reader_t *reader,
+        struct output_t *output, int epoll_fd)
+{
+    TRACE_BEGIN(span);
+    ssize_t status = frame_reader_read(reader, client->socket_connected);
+    TRACE_END(span, TRACE_RECV, client->socket_connected, status);
+    if (status > 0) {
+        metrics_count(METRIC_BYTES_RECEIVED, status);
+        if (process_frames(client, reader, output) == 0) {
+            frame_reader_shrink(reader);
+            return 1;
+        }
+        perror("read_socket-process_frames()");
+    } else if (status == -1 && (errno == EINTR || errno == EAGAIN ||
+                errno == EWOULDBLOCK)) {
+        return 1;
+    } else if (status == -1) {
+        metrics_count(METRIC_RECEIVE_ERRORS, 1);
+        // a reset is just the server going away
+        if (errno != ECONNRESET) {
+            perror("read_socket-recv()");
+        }
+    }
+    // the bytes received are of no use to the next connection
+    frame_reader_free(reader);
+    send_queue_clear(&client->send_queue);
+    // closing the socket also removes it from the epoll instance
+    if (reconnect_to_server(client, output) == 0) {
+        return -1;
+    }
+    set_nonblocking(client->socket_connected);
+    if (watch_fd(epoll_fd, client->socket_connected) == -1) {
+        perror("read_socket-epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/**
+ * Sends what is typed in the console in the session of the client and pushes
+ * the messages received to the output stage, reconnecting when the
+ * connection is lost, until a shutdown is requested or the server can't be
+ * reached anymore. Once stdin is closed only the messages received are
+ * handled. The frames of a shm endpoint don't wake epoll up, so it can't run
+ * one.
+ *
+ * @param client client with a session, not connected to a shm endpoint
+ * @param output output stage showing the messages received
+ */
+void run_client_loop(struct client_t *client, struct output_t *output)
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("run_client_loop-epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shutdown_fd == -1) {
+        perror("run_client_loop-eventfd()");
+        exit(EXIT_FAILURE);
+    }
+    if (watch_fd(epoll_fd, shutdown_fd) == -1 ||
+            watch_fd(epoll_fd, client->socket_connected) == -1) {
+        perror("run_client_loop-epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+    handle_shutdown_signals(request_shutdown);
+    set_nonblocking(client->socket_connected);
+    pthread_mutex_lock(&client->lock);
+    client->queue_sends = 1;
+    pthread_mutex_unlock(&client->lock);
+    char input[BUFFER_SIZE];
+    size_t kept = 0;
+    // regular files can't be watched, but reading them never blocks, so a
+    // batch of them is read at every turn of the loop instead
+    int file = watch_fd(epoll_fd, STDIN_FILENO) == -1;
+    int console_open = 1;
+    int console_paused = 0;
+    int writing = 0;
+
+    struct frame_reader_t reader;
+    frame_reader_init(&reader, &client->pool);
+    struct epoll_event events[CLIENT_LOOP_EVENTS];
+    int running = 1;
+    while (running) {
+        // the console waits while the server doesn't take what it sent
+        int full = client->send_queue.bytes >= CLIENT_LOOP_QUEUE_LIMIT;
+        if (console_open && file && !full) {
+            console_open = read_console(client, output, input, &kept);
+            full = client->send_queue.bytes >= CLIENT_LOOP_QUEUE_LIMIT;
+        } else if (console_open && !file && full != console_paused) {
+            // a hang up is reported even with no event watched
+            if (full) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            } else {
+                watch_fd(epoll_fd, STDIN_FILENO);
+            }
+            console_paused = full;
+        }
+        if ((client->send_queue.count > 0) != writing) {
+            writing = !writing;
+            rewatch_fd(epoll_fd, client->socket_connected, writing ?
+                    EPOLLIN | EPOLLOUT : EPOLLIN);
+        }
+        int timeout = console_open && file && !full ? 0 : -1;
+        int n = epoll_wait(epoll_fd, events, CLIENT_LOOP_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("run_client_loop-epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == shutdown_fd) {
+                running = 0;
+                break;
+            } else if (fd == STDIN_FILENO) {
+                if (!read_console(client, output, input, &kept)) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    console_open = 0;
+                }
+            } else if (fd == client->socket_connected) {
+                if (events[i].events & EPOLLOUT) {
+                    pthread_mutex_lock(&client->lock);
+                    int status = flush_send_queue(client);
+                    pthread_mutex_unlock(&client->lock);
+                    // the read finds the connection closed and reconnects
+                    if (status == -1) {
+                        shutdown(client->socket_connected, SHUT_RDWR);
+                    }
+                }
+                if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                    continue;
+                }
+                int status = read_socket(client, &reader, output, epoll_fd);
+                // the events left may be about the socket closed, whose
+                // number the new one may have reused
+                if (status != 1) {
+                    // the new socket is only watched for reading
+                    writing = 0;
+                    running = status == 0;
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_lock(&client->lock);
+    client->queue_sends = 0;
+    pthread_mutex_unlock(&client->lock);
+    frame_reader_free(&reader);
+    handle_shutdown_signals(SIG_DFL);
+    close(shutdown_fd);
+    shutdown_fd = -1;
+    close(epoll_fd);
+}
@@ -1,6 +1,10 @@
 #include "common.h"
 #include "client.h"
+#include "client_loop.h"
 #include "server.h"
+#include "ping.h"
+#include "stream.h"
+#include "output.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,20 +12,41 @@
 
 int main(int argc, char *argv[])
 {
-    int mode = handle_input(argc, argv);
+    // before any thread is created, so that all of them block the signal
+    TRACE_START();
+    struct options_t options;
+    int mode = handle_input(argc, argv, &options);
     struct client_t *client;
     struct server_t *server;
-    char *port;
-    if (mode == CLIENT) {
-        port = argv[3] == NULL ? DEFAULT_PORT_NUMBER : argv[3];
+    if (options.metrics_path != NULL) {
+        metrics_serve(options.metrics_path);
+    }
+    compress_configure(options.compress, options.dictionary_path);
+    if (mode == CLIENT || mode == PING) {
         client = (struct client_t *) malloc(sizeof(struct client_t));
-            connect_to_server(argv[2], port, client);
+        connect_to_server(options.hostname, options.port, client);
+        if (options.channel != CHANNEL_DEFAULT) {
+            channel_join(&client->channels, options.channel);
+            client->channel = options.channel;
+        }
+        if (mode == PING) {
+            run_ping(client, &options);
+            disconnect(client);
+            return 0;
+        }
+        if (options.send_path != NULL) {
+            run_send(client, &options);
+            disconnect(client);
+            return 0;
+        }
     } else {
-        port = argv[2] == NULL ? DEFAULT_PORT_NUMBER : argv[2];
         server = (struct server_t *) malloc(sizeof(struct server_t));
-        start_server(port, server);
+        start_server(&options, server);
+        // the server handles all its clients and the console in its own
+        // event loop
+        run_server(server);
     }
-    printf("Made a connection/Started server\n");
+    printf("Made a connection\n");
 
     int send_status;
     // initialize recv_status, because we don't want to leave the loop if we are
@@ -30,41 +55,51 @@ int main(int argc, char *argv[])
     clear_screen();
     move_cursor_to_last_row();
     pthread_t recv_thread;
-    if (mode == CLIENT) {
-        // create a structure that holds the client and a pointer to recv_status
-        struct client_recv_status_t client_recv_status;
-        client_recv_status.client = client;
-        client_recv_status.recv_status = &recv_status;
+    // create a structure that holds the client and a pointer to recv_status
+    struct client_recv_status_t client_recv_status;
+    client_recv_status.client = client;
+    client_recv_status.recv_status = &recv_status;
 
-        // run the reading of incomming messages on a separate thread
-        if (pthread_create(&recv_thread, NULL, read_received_message_client,
-                    (void *) &client_recv_status) != 0) {
-            perror("pthread_create");
-            exit(EXIT_FAILURE);
-        }
-        // run the sending of outgoing messages in the main thread
-        do {
-            read_stdin_to_buffer(client->send_buffer);
-            send_status = send_message(client, CLIENT);
-        } while (send_status > 0 && recv_status > 0);
-    } else {
-        // create a structure that holds the server and a pointer to recv_status
-        struct server_recv_status_t server_recv_status;
-        server_recv_status.server = server;
-        server_recv_status.recv_status = &recv_status;
+    // the messages received are shown by a thread of their own
+    struct output_t output;
+    output_start(&output, 1, CLIENT);
+    client_recv_status.output = &output;
 
-        // run the reading of incomming messages on a separate thread
-        if (pthread_create(&recv_thread, NULL, read_received_message_server,
-                    (void *) &server_recv_status) != 0) {
-            perror("pthread_create");
-            exit(EXIT_FAILURE);
-        }
-        // run the sending of outgoing messages in the main thread
-        do {
-            read_stdin_to_buffer(server->send_buffer);
-            send_status = send_message(server, SERVER);
-        } while (send_status > 0 && recv_status > 0);
+    // the session lets the client reconnect without losing messages
+    if (open_session(client, &output) != 1) {
+        fprintf(stderr, "Couldn't open a session\n");
+        exit(EXIT_FAILURE);
     }
+    if (options.history > 0 && request_history(client, options.history) ==
+            -1) {
+        perror("request_history");
+        exit(EXIT_FAILURE);
+    }
+
+    // stdin, the socket and the shutdown are multiplexed in this thread
+    if (options.event_loop && client->shm == NULL) {
+        run_client_loop(client, &output);
+        output_stop(&output);
+        return 0;
+    }
+
+    // run the reading of incomming messages on a separate thread
+    if (pthread_create(&recv_thread, NULL, read_received_message_client,
+                (void *) &client_recv_status) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    // run the sending of outgoing messages in the main thread
+    do {
+        if (!read_stdin_to_buffer(client->send_buffer)) {
+            finish_session_message(client);
+            break;
+        }
+        output_clear_input(&output);
+        send_status = send_message(client, CLIENT);
+    } while (send_status > 0 &&
+            __atomic_load_n(&recv_status, __ATOMIC_ACQUIRE) > 0);
     pthread_join(recv_thread, NULL);
+    output_stop(&output);
     return 0;
 }
@@ -1,6 +1,8 @@
 #include "common.h"
 #include "client.h"
 #include "server.h"
+#include "frame.h"
+#include "output.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -8,6 +10,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+int verbose = 1;
 
 /**
  * Initializes the hints structure passed as parameters. according to the flag
@@ -34,6 +42,9 @@ void initialize_hints(struct addrinfo *hints, int flag)
  * Invokes the getaddrinfo function to get the addressinfo structure res
  * obtained for the given hostname, the given port_number and the hints
  * structure passed.
+ * Answers are cached by the resolver, so that opening many connections to the
+ * same server only resolves its name once. The list returned must be freed
+ * with resolver_free.
  * Function fails and the program exits when there's an error with the
  * getaddrinfo function
  *
@@ -47,9 +58,10 @@ void get_addrinfo_list(const char *hostname, const char *port_number, struct
         addrinfo *hints, struct addrinfo **res)
 {
     assert(hostname != "");
-    printf("preparing addrinfo struct...\n");
-    // get the addrinfo structures list with the hints criteria
-    int status = getaddrinfo(hostname, port_number, hints, res);
+    print_progress("preparing addrinfo struct...\n");
+    // get the addrinfo structures list with the hints criteria, the same
+    // names are asked for again and again when opening many connections
+    int status = resolver_resolve(hostname, port_number, hints, res);
     if (status != 0) {
         fprintf(stderr, "get_addrinfo_list: %s\n", gai_strerror(status));
         exit(EXIT_FAILURE);
@@ -57,41 +69,201 @@ void get_addrinfo_list(const char *hostname, const char *port_number, struct
     assert(status == 0);
 }
 
+/**
+ * Returns the current monotonic time in milliseconds
+ *
+ * @return milliseconds
+ */
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Orders the addresses to connect to as RFC 8305 recommends: the first
+ * address returned by getaddrinfo goes first, and the following ones
+ * alternate between address families, so that a family that doesn't work
+ * only delays the connection once.
+ *
+ * @param res list of addresses returned by getaddrinfo
+ * @param candidates where the addresses are stored in the order to try them
+ * @param count number of addresses in res
+ */
+static void order_candidates(struct addrinfo *res, struct addrinfo
+        **candidates, size_t count)
+{
+    int family = res->ai_family;
+    size_t ordered = 0;
+    struct addrinfo *same = res;
+    struct addrinfo *other = res;
+    int want_same = 1;
+    while (ordered < count) {
+        // advance to the next unused address of the family wanted, or of any
+        // family when the wanted one is exhausted
+        struct addrinfo **cursor = want_same ? &same : &other;
+        while (*cursor != NULL && (((*cursor)->ai_family == family) !=
+                    want_same)) {
+            *cursor = (*cursor)->ai_next;
+        }
+        if (*cursor == NULL) {
+            cursor = want_same ? &other : &same;
+            while (*cursor != NULL && (((*cursor)->ai_family == family) ==
+                        want_same)) {
+                *cursor = (*cursor)->ai_next;
+            }
+        }
+        candidates[ordered++] = *cursor;
+        *cursor = (*cursor)->ai_next;
+        want_same = !want_same;
+    }
+}
+
 /**
  *
  * Finds and returns the first connectable socket using the addrinfo structure
  * provided.
- * It iterates over the available addrinfo structures pointed by res beginning
- * from res.
- * Function fails and exits the program if it could not find a connectable
+ * It races non-blocking connections to the addresses pointed by res, in the
+ * order of RFC 8305 (Happy Eyeballs): a new attempt is started every
+ * CONNECTION_ATTEMPT_DELAY milliseconds, or as soon as a previous one
+ * failed, and the first connection established wins. The socket returned is
+ * in blocking mode.
  *
  * @param res addrinfo structure that includes the family, socket type and
  * protocol to be used for the socket
- * @return the connectable socket
+ * @return the connectable socket, or -1 if none could be connected
  */
-int find_connectable_socket(struct addrinfo *res)
+int try_connectable_socket(struct addrinfo *res)
 {
     assert(res != NULL);
-    printf("creating socket...\n");
-    int socketfd;
-    // iterate over the list of addrinfo structure until we find an addressinfo
-    // that we can create a socket from and connect to its address.
-    for (struct addrinfo *ai = res;  ai != NULL; ai = ai->ai_next) {
-        socketfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-
-        // if the socket wasn't created, try with another addrinfo structure
-        if (socketfd == -1) {
-            perror("find_usable_socket-socket()");
-            continue;
+    print_progress("creating socket...\n");
+    size_t count = 0;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        count++;
+    }
+    struct addrinfo **candidates = (struct addrinfo **) malloc(count *
+            sizeof(*candidates));
+    struct pollfd *attempts = (struct pollfd *) malloc(count *
+            sizeof(*attempts));
+    if (candidates == NULL || attempts == NULL) {
+        perror("try_connectable_socket-malloc()");
+        free(candidates);
+        free(attempts);
+        return -1;
+    }
+    order_candidates(res, candidates, count);
+
+    size_t next = 0;
+    nfds_t pending = 0;
+    int socketfd = -1;
+    // the next address is due then, right away once an attempt failed
+    int64_t next_at = 0;
+    while (socketfd == -1 && (next < count || pending > 0)) {
+        if (next < count && (pending == 0 || monotonic_ms() >= next_at)) {
+            int fd = socket(candidates[next]->ai_family,
+                    candidates[next]->ai_socktype | SOCK_NONBLOCK |
+                    SOCK_CLOEXEC, candidates[next]->ai_protocol);
+            // if the socket wasn't created, try with another addrinfo
+            // structure right away
+            if (fd == -1) {
+                perror("try_connectable_socket-socket()");
+                next++;
+                next_at = 0;
+                continue;
+            }
+            int ret = connect_through_socket(fd, candidates[next]);
+            next++;
+            if (ret == 0) {
+                socketfd = fd;
+                break;
+            }
+            if (ret == -1) {
+                next_at = 0;
+                continue;
+            }
+            attempts[pending].fd = fd;
+            attempts[pending].events = POLLOUT;
+            attempts[pending].revents = 0;
+            pending++;
+            next_at = monotonic_ms() + CONNECTION_ATTEMPT_DELAY;
         }
+        // the next address is tried when the attempts in flight haven't
+        // succeeded after the delay, or as soon as one of them fails
+        int timeout = -1;
+        if (next < count) {
+            int64_t left = next_at - monotonic_ms();
+            timeout = left > 0 ? (int) left : 0;
+        }
+        int ready = poll(attempts, pending, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("try_connectable_socket-poll()");
+            break;
+        }
+        for (nfds_t k = 0; k < pending && ready > 0; ++k) {
+            if (attempts[k].revents == 0) {
+                continue;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(attempts[k].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error == 0) {
+                // first one wins
+                socketfd = attempts[k].fd;
+                attempts[k] = attempts[--pending];
+                break;
+            }
+            errno = error;
+            perror("try_connectable_socket-connect()");
+            close(attempts[k].fd);
+            attempts[k--] = attempts[--pending];
+            ready--;
+            next_at = 0;
+        }
+    }
+    // the attempts that lost the race are abandoned
+    for (nfds_t k = 0; k < pending; ++k) {
+        close(attempts[k].fd);
+    }
+    free(candidates);
+    free(attempts);
+    if (socketfd == -1) {
+        metrics_count(METRIC_CONNECT_ERRORS, 1);
+        return -1;
+    }
+    // the client sends and receives with blocking calls
+    int flags = fcntl(socketfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(socketfd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        perror("try_connectable_socket-fcntl()");
+        close(socketfd);
+        metrics_count(METRIC_CONNECT_ERRORS, 1);
+        return -1;
+    }
+    metrics_count(METRIC_CONNECTS, 1);
+    return socketfd;
+}
 
-        if (connect_through_socket(socketfd, ai) == 0) {
-            return socketfd;
-        } 
+/**
+ * Finds and returns the first connectable socket using the addrinfo structure
+ * provided, racing the addresses as try_connectable_socket does.
+ * Function fails and exits the program if it could not find a connectable
+ * socket
+ *
+ * @param res addrinfo structure that includes the family, socket type and
+ * protocol to be used for the socket
+ * @return the connectable socket
+ */
+int find_connectable_socket(struct addrinfo *res)
+{
+    int socketfd = try_connectable_socket(res);
+    if (socketfd == -1) {
+        fprintf(stderr, "Couldn't find a socket\n");
+        exit(EXIT_FAILURE);
     }
-    assert(socketfd == -1);
-    fprintf(stderr, "Couldn't find a socket\n");
-    exit(EXIT_FAILURE);
+    return socketfd;
 }
 
 /**
@@ -106,7 +278,7 @@ int find_connectable_socket(struct addrinfo *res)
 int find_socket(struct addrinfo *res)
 {
     assert(res != NULL);
-    printf("creating socket...\n");
+    print_progress("creating socket...\n");
     int socketfd;
     /**
      * iterate over the list of addrinfo structure until we find an addressinfo
@@ -128,32 +300,32 @@ int find_socket(struct addrinfo *res)
     exit(EXIT_FAILURE);
 }
 
-/** 
- * Tries to connect the given socketfd using the information contained in res
- * 
- * @return 0 on success, -1 otherwise
+/**
+ * Starts connecting the given non-blocking socketfd using the information
+ * contained in res. The socket is closed if the connection fails right away.
+ *
+ * @param socketfd open non-blocking socket
+ * @param res adrinfo structure that holds the connection information
+ * @return 0 if connected, 1 if the connection is in progress, -1 otherwise
  */
 static int connect_through_socket(int socketfd, struct addrinfo *res)
 {
     assert(socketfd != -1);
     assert(res != NULL);
     int ret = connect(socketfd, res->ai_addr, res->ai_addrlen);
-    /**
-     * if the socket was successfully connected we stop looking through the
-     * list
-     */
     if (ret == 0) {
         return 0;
-    } else {
-        perror("connect_through_socket-connect()");
-        /** 
-         * close the file descriptor (socket is a file descriptor), as we
-         * couldn't connect through it
-         */
-        close(socketfd);
-        return -1;
     }
-
+    if (errno == EINPROGRESS) {
+        return 1;
+    }
+    perror("connect_through_socket-connect()");
+    /** 
+     * close the file descriptor (socket is a file descriptor), as we
+     * couldn't connect through it
+     */
+    close(socketfd);
+    return -1;
 }
 
 /**
@@ -164,6 +336,13 @@ static int connect_through_socket(int socketfd, struct addrinfo *res)
 static void print_ip(struct addrinfo *res)
 {
     char ipstr[INET6_ADDRSTRLEN];
+    if (res->ai_family == AF_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *) res->ai_addr;
+        // an abstract name starts with a null byte
+        fprintf(stderr, "unix:%s\n", un->sun_path[0] != '\0' ? un->sun_path :
+                un->sun_path + 1);
+        return;
+    }
     if (res->ai_family ==  AF_INET) {
         struct sockaddr_in *ipv4 = (struct sockaddr_in *) res->ai_addr;
         inet_ntop(AF_INET, &(ipv4->sin_addr), ipstr, sizeof(ipstr));
@@ -174,9 +353,34 @@ static void print_ip(struct addrinfo *res)
     fprintf(stderr, "%s\n", ipstr);
 }
 
+/**
+ * Removes the file of a unix socket left behind by a server that is gone, so
+ * that the path can be bound again. A socket that still accepts connections
+ * is left alone.
+ *
+ * @param res address of the unix socket
+ * @return 1 if the file was removed, 0 otherwise
+ */
+static int unlink_stale_socket(struct addrinfo *res)
+{
+    struct sockaddr_un *un = (struct sockaddr_un *) res->ai_addr;
+    // abstract names go away with the last socket bound to them
+    if (un->sun_path[0] == '\0') {
+        return 0;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    int stale = connect(fd, res->ai_addr, res->ai_addrlen) == -1 &&
+        errno == ECONNREFUSED;
+    close(fd);
+    return stale && unlink(un->sun_path) == 0;
+}
+
 /**
  * Binds the given socket to the port PORT_NUMBER, that was specifed when
- * obtaining the res structure.
+ * obtaining the res structure, or to the path of a unix socket.
  * This function is mostly used when want to create a server, as it is necessary
  * to bind the socket before starting to listen to incomming connections.
  * Fails and exits the program if an error occure while calling the bind
@@ -189,21 +393,30 @@ void bind_socket(int socketfd, char *port, struct addrinfo *res)
 {
     assert(socketfd != -1);
     assert(res != NULL);
-    printf("binding socket to port %s\n", port);
+    print_progress("binding socket to port %s\n", port);
     int ret = bind(socketfd, res->ai_addr, res->ai_addrlen);
+    if (ret == -1 && errno == EADDRINUSE && res->ai_family == AF_UNIX &&
+            unlink_stale_socket(res)) {
+        print_progress("removed stale socket %s\n", port);
+        ret = bind(socketfd, res->ai_addr, res->ai_addrlen);
+    }
     if (ret == -1) {
         perror("bind_socket-bind()");
         // if the port is not in use for we get from the kernel that it is in
         // use, it is because it takes a while for the kernel to release the
         // port again, but this forces it to release it
-        if (errno == EADDRINUSE) {
+        if (errno == EADDRINUSE && res->ai_family != AF_UNIX) {
             int yes = 1;
             if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &yes,
                         sizeof(int)) == -1) {
                 perror("setsockopt");
                 exit(1);
             }
-            printf("freeing port %s...\n", port);
+            print_progress("freeing port %s...\n", port);
+            if (bind(socketfd, res->ai_addr, res->ai_addrlen) == -1) {
+                perror("bind_socket-bind()");
+                exit(EXIT_FAILURE);
+            }
         } else {
             exit(EXIT_FAILURE);
         }
@@ -222,7 +435,7 @@ void bind_socket(int socketfd, char *port, struct addrinfo *res)
 void listen_socket(int socketfd, char *port, int backlog)
 {
     assert(socketfd != -1);
-    printf("listening to port: %s\n", port);
+    print_progress("listening to port: %s\n", port);
     int ret = listen(socketfd, backlog);
     if (ret == -1) {
         perror("listen_socket-listen()");
@@ -231,33 +444,56 @@ void listen_socket(int socketfd, char *port, int backlog)
 }
 
 /**
- * Wrapper for the accept function, that accepts an incoming connections from
+ * Disables Nagle's algorithm on the given socket, so that small messages are
+ * sent right away. Batching of messages is done by the program instead.
+ * Sockets that are not TCP are left untouched.
+ *
+ * @param socketfd connected socket
+ */
+void set_tcp_nodelay(int socketfd)
+{
+    int yes = 1;
+    if (setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) ==
+            -1 && errno != EOPNOTSUPP) {
+        perror("set_tcp_nodelay-setsockopt()");
+    }
+}
+
+/**
+ * Wrapper for the accept4 function, that accepts an incoming connections from
  * the queue of incomming connections to socketfd, and stores the address of the
- * client into addr structure. It creates a socket with the accepted connnection
- * and the original socketfd remains open listening for more connections.
+ * client into addr structure. It creates a non-blocking socket with the
+ * accepted connnection and the original socketfd remains open listening for
+ * more connections.
+ * Returns -1 when there are no more pending connections (errno is EAGAIN) or
+ * when the connection could not be accepted, in which case an error message is
+ * printed to stderr.
  *
- * @param socketfd listening socket that has a connection pending from a client
+ * @param socketfd non-blocking listening socket
  * @param addr sockaddr_storage structure used to hold the address of the client 
- * @return the new socket that is connected to the remote socket 
+ * @return the new socket that is connected to the remote socket, or -1
  */
 int accept_connection(int socketfd, struct sockaddr_storage *addr)
 {
     assert(socketfd != -1);
-    printf("accepting connections...\n");
     socklen_t addr_size = sizeof(*addr);
-    int new_socket = accept(socketfd, (struct sockaddr *)addr, &addr_size);
-    if (new_socket == -1) {
-        assert(errno == ENOTSOCK);
-        perror("accept_connection-accept()");
-        exit(EXIT_FAILURE);
+    TRACE_BEGIN(span);
+    int new_socket = accept4(socketfd, (struct sockaddr *)addr, &addr_size,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+    TRACE_END(span, TRACE_ACCEPT, socketfd, new_socket);
+    if (new_socket != -1) {
+        metrics_count(METRIC_ACCEPTS, 1);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept_connection-accept4()");
+        metrics_count(METRIC_ACCEPT_ERRORS, 1);
     }
-    assert(new_socket != -1);
     return new_socket;
 }
 
 /**
- * Handles the reception of messages from a either a client or a server, using a
- * connected socket contained inside object, that is of the given type.
+ * Handles the reception of messages from a client, using the connected socket
+ * contained inside object, that is of the given type. Servers receive their
+ * messages in their event loop instead.
  * In case there's an error, the function prints out an error message to
  * stderr describing the problem.
  *
@@ -269,24 +505,30 @@ static int receive_message(void *object, int type)
 {
     int status = 0;
     struct client_t *client;
-    struct server_t *server;
+    struct frame_header_t h;
     switch (type) {
         case CLIENT:
             client = (struct client_t *) object;
-            status = recv(client->socket_connected, &(client->recv_buffer),
-                    BUFFER_SIZE, 0);
-            break;
-        case SERVER:
-            server = (struct server_t *) object;
-            status = recv(server->socket_connected, &(server->recv_buffer),
-                    BUFFER_SIZE, 0);
+            TRACE_BEGIN(span);
+            status = receive_message_frame(client, &h);
+            TRACE_END(span, TRACE_RECV, client->socket_connected,
+                    status == 1 ? (int64_t) (FRAME_HEADER_SIZE + h.length) :
+                    (int64_t) status);
+            client->recv_length = h.length;
+            client->recv_type = h.type;
+            client->recv_flags = h.flags;
+            client->recv_channel = h.channel;
             break;
         default:
             fprintf(stderr, "This is an unsupported mode of operation\n");
             exit(EXIT_FAILURE);
     }
-    if (status == -1) {
+    if (status == 1) {
+        metrics_count(METRIC_MESSAGES_RECEIVED, 1);
+        metrics_count(METRIC_BYTES_RECEIVED, FRAME_HEADER_SIZE + h.length);
+    } else if (status == -1) {
         perror("receive_message-recv()");
+        metrics_count(METRIC_RECEIVE_ERRORS, 1);
     }
     return status;
 }
@@ -294,6 +536,8 @@ static int receive_message(void *object, int type)
 /**
  * Handles the sending of messages from either a client or a server, using a
  * connected socket contained insde boject, that is of the given type.
+ * Only the characters of the message are sent, inside a frame.
+ * A server sends the message to every client connected to it.
  * In case there's an error, the function prints out an error message to
  * stderr describing the problem.
  *
@@ -306,16 +550,30 @@ int send_message(void *object, int type)
     int status;
     struct client_t *client;
     struct server_t *server;
+    struct message_t *message;
     switch (type) {
         case CLIENT:
             client = (struct client_t *) object;
-            status = send(client->socket_connected, &(client->send_buffer),
-                    BUFFER_SIZE, 0);
+            // "/join N" and "/leave N" aren't sent as messages
+            status = run_channel_command(client);
+            if (status == 0) {
+                // sent in the session, to be sent again if the connection
+                // is lost before the server gets it
+                status = send_session_message(client);
+            }
             break;
         case SERVER:
             server = (struct server_t *) object;
-            status = send(server->socket_connected, &(server->send_buffer),
-                    BUFFER_SIZE, 0);
+            message = message_create(FRAME_TYPE_DATA, server->send_buffer,
+                    strlen(server->send_buffer));
+            if (message == NULL) {
+                errno = ENOMEM;
+                status = -1;
+                break;
+            }
+            broadcast_message(server, message, -1);
+            message_unref(message);
+            status = 1;
             break;
         default:
             fprintf(stderr, "This is an unsupported mode of operation\n");
@@ -335,7 +593,7 @@ int send_message(void *object, int type)
  * @param buffer char array where the message is stored
  * @param type CLIENT or SERVER int macros
  */
-static void show_message(char *buffer, int type)
+void show_message(char *buffer, int type)
 {
     printf("%s %s", type == CLIENT ? "From server:" : "From client:", buffer);
 }
@@ -343,18 +601,25 @@ static void show_message(char *buffer, int type)
 /**
  * Reads strings from stdin and stores it in a buffer up to the EOF or the
  * newline character, if newline character is inputted it is also included in
- * the message stored in the buffer
+ * the message stored in the buffer. A line longer than BUFFER_SIZE - 1 bytes
+ * is read by several calls.
  *
  * @param buffer char array whre the message is stored
+ * @return 1 if a message was read, 0 when stdin is closed
  */
-void read_stdin_to_buffer(char *buffer)
+int read_stdin_to_buffer(char *buffer)
 {
-    fgets(buffer, BUFFER_SIZE, stdin);
+    if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    return 1;
 }
 
 /**
- * Read strings from stdint and sends them throught the connected socket of the
- * given client. This is the function handled by the recv_thread.
+ * Receives the messages sent through the connected socket of the given client
+ * and pushes them to the output stage, resuming the session when the
+ * connection is lost. This is the function handled by the recv_thread.
  *
  * @param client a structure containing the server and the status used to break
  * from the main loop
@@ -365,31 +630,26 @@ void *read_received_message_client(void *client_param)
         client_param;
     struct client_t *client = client_recv_status->client;
     int *status = client_recv_status->recv_status;
-    do {
-        *status = receive_message(client, CLIENT);
-        show_message(client->recv_buffer, CLIENT);
-    } while (*status > 0);
-    return NULL;
-}
-
-/**
- * Read strings from stdint and sends them throught the connected socket of the
- * given server. This is the function handled by the recv_thread.
- *
- * @param server a structure containing the server and the status used to break
- * from the main loop
- */
-void *read_received_message_server(void *server_param)
-{
-
-    struct server_recv_status_t *server_recv_status = (struct
-            server_recv_status_t *) server_param;
-    struct server_t *server = server_recv_status->server;
-    int *status = server_recv_status->recv_status;
-    do {
-        *status = receive_message(server, SERVER);
-        show_message(server->recv_buffer, SERVER);
-    } while (*status > 0);
+    struct output_t *output = client_recv_status->output;
+    for (;;) {
+        if (receive_message(client, CLIENT) <= 0) {
+            // the session survives the connection, the main loop only stops
+            // if the server can't be reached anymore
+            if (reconnect_to_server(client, output) == 1) {
+                continue;
+            }
+            __atomic_store_n(status, 0, __ATOMIC_RELEASE);
+            break;
+        }
+        if (handle_session_frame(client)) {
+            // the message is shown by the output thread, a slow terminal
+            // never delays the draining of the socket
+            show_received_message(client, output);
+        }
+        // the buffer goes back to the pool while waiting for the next one
+        pool_free(&client->pool, client->recv_buffer, client->recv_capacity);
+        client->recv_buffer = NULL;
+    }
     return NULL;
 }
 
@@ -416,10 +676,40 @@ static char *convert_to_lowercase(char *s)
 static void print_error_exit()
 {
     fprintf(stderr, 
-            "Usage: client_server MODE [IP] [PORT]\nMODE: \"client\" or "
-            "\"server\"\nIP: only used and required for client mode (could "
-            "be IP or hostname)\nPORT: to select a specific port, else "
-            "default port is 10000\n");
+            "Usage: client_server MODE [IP] [PORT] [OPTIONS]\nMODE: \"client\","
+            " \"server\" or \"ping\"\nIP: only used and required for client "
+            "and ping modes (could be IP or hostname)\nPORT: to select a "
+            "specific port, else default port is 10000\nIP of a client or PORT "
+            "of a server may be unix:/path, or unix:@name\nin the abstract "
+            "namespace, to use a unix socket instead, or shm:NAME to use\n"
+            "shared memory\nOPTIONS (ping mode):\n"
+            "  -n, --count N      number of pings to send (default %d)\n"
+            "  -i, --interval N   microseconds between pings (default %d)\n"
+            "OPTIONS (client mode):\n"
+            "  -s, --send FILE    stream FILE to the server, - for stdin\n"
+            "  -H, --history SEQ  replay the messages relayed since the "
+            "message SEQ, 1 for\n                     all of them\n"
+            "  -e, --event-loop   send and receive in a single thread, "
+            "except through shm\n"
+            "  -c, --channel N    talk in the channel N, besides 0, type "
+            "/join N or\n                     /leave N to switch\n"
+            "OPTIONS (server mode):\n"
+            "  -o, --output FILE  write the streams received to FILE\n"
+            "  -k, --shards N     event loops accepting connections, 0 for "
+            "one per core\n                     (default 1)\n"
+            "  -b, --backlog N    pending connections per shard (default %d)\n"
+            "  -l, --log DIR      keep the messages relayed in DIR, for the "
+            "clients to\n                     replay them\n"
+            "OPTIONS (all modes):\n"
+            "  -m, --metrics PATH serve the metrics on the unix socket PATH\n"
+            "  -z, --compress     compress the messages when the peer agrees\n"
+            "  -d, --dictionary FILE\n"
+            "                     compress with the dictionary in FILE, the "
+            "peer needs the\n                     same one (implies -z)\n"
+            "  -w, --window BYTES max bytes of a channel queued or held for "
+            "a client, server\n                     only (default %d)\n",
+            PING_DEFAULT_COUNT, PING_DEFAULT_INTERVAL, BACKLOG_CONNECTIONS,
+            MESSAGE_WINDOW_DEFAULT);
     exit(EXIT_FAILURE);
 
 }
@@ -505,27 +795,116 @@ static void print_cla(int argc, char *argv[])
 
 /**
  * Checks the command line arguments, validates them, and returns the mode
- * chosen for the current program.
+ * chosen for the current program. The arguments are stored in options.
  *
  * @param argc number of parameters (including executable name)
  * @param argv array of command line parameters
- * @return the mode to use the program (CLIENT or SERVER)
+ * @param options structure where the arguments are stored
+ * @return the mode to use the program (CLIENT, SERVER or PING)
  */
-int handle_input(int argc, char *argv[])
+int handle_input(int argc, char *argv[], struct options_t *options)
 {
+    static struct option long_options[] = {
+        {"count", required_argument, NULL, 'n'},
+        {"interval", required_argument, NULL, 'i'},
+        {"send", required_argument, NULL, 's'},
+        {"output", required_argument, NULL, 'o'},
+        {"shards", required_argument, NULL, 'k'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"metrics", required_argument, NULL, 'm'},
+        {"compress", no_argument, NULL, 'z'},
+        {"dictionary", required_argument, NULL, 'd'},
+        {"log", required_argument, NULL, 'l'},
+        {"history", required_argument, NULL, 'H'},
+        {"event-loop", no_argument, NULL, 'e'},
+        {"window", required_argument, NULL, 'w'},
+        {"channel", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    memset(options, 0, sizeof(*options));
+    options->count = PING_DEFAULT_COUNT;
+    options->interval = PING_DEFAULT_INTERVAL;
+    options->shards = 1;
+    options->backlog = BACKLOG_CONNECTIONS;
+    options->window = MESSAGE_WINDOW_DEFAULT;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:i:s:o:k:b:m:zd:l:H:ew:c:",
+                    long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                options->count = atol(optarg);
+                break;
+            case 'i':
+                options->interval = atol(optarg);
+                break;
+            case 's':
+                options->send_path = optarg;
+                break;
+            case 'o':
+                options->output_path = optarg;
+                break;
+            case 'k':
+                options->shards = atol(optarg);
+                break;
+            case 'b':
+                options->backlog = atol(optarg);
+                break;
+            case 'm':
+                options->metrics_path = optarg;
+                break;
+            case 'z':
+                options->compress = 1;
+                break;
+            case 'd':
+                options->compress = 1;
+                options->dictionary_path = optarg;
+                break;
+            case 'l':
+                options->history_path = optarg;
+                break;
+            case 'H':
+                options->history = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                options->event_loop = 1;
+                break;
+            case 'w':
+                options->window = atol(optarg);
+                break;
+            case 'c':
+                options->channel = atol(optarg);
+                break;
+            default:
+                print_error_exit();
+        }
+    }
+    if (options->count <= 0 || options->interval < 0 || options->shards < 0
+            || options->backlog <= 0 || options->window <= 0 ||
+            options->channel < 0 || options->channel > UINT16_MAX) {
+        print_error_exit();
+    }
+    // getopt_long leaves the MODE, IP and PORT at the end of argv, so that
+    // they can be checked as if there were no options
+    argc -= optind - 1;
+    argv += optind - 1;
+
     int mode;
     if (argc < 2 || argc > 4) {
         print_cla(argc, argv);
         print_error_exit();
     } else {
-        if (strcmp("client", convert_to_lowercase(argv[1])) == 0) {
-            mode = CLIENT;
+        if (strcmp("client", convert_to_lowercase(argv[1])) == 0 ||
+                strcmp("ping", convert_to_lowercase(argv[1])) == 0) {
+            mode = strcmp("ping", convert_to_lowercase(argv[1])) == 0 ? PING :
+                CLIENT;
             if (argc == 3) {
-                if (!is_valid_ip(argv[2]) && !is_valid_hostname(argv[2])) {
+                if (!is_valid_ip(argv[2]) && !is_valid_hostname(argv[2]) &&
+                        !resolver_is_unix(argv[2])) {
                     fprintf(stderr, "Not valid IP or hostname: %s\n", argv[2]);
                     print_error_exit();
                 }
             } else if (argc == 4) {
+                // a unix socket has no port
                 if (!is_valid_ip(argv[2]) && !is_valid_hostname(argv[2])) {
                     fprintf(stderr, "Not valid IP or hostname: %s\n", argv[2]);
                     print_error_exit();
@@ -542,7 +921,8 @@ int handle_input(int argc, char *argv[])
             }
         } else if (strcmp("server", convert_to_lowercase(argv[1])) == 0) {
             mode = SERVER;
-            if (argc == 3  && !is_valid_port(argv[2])) {
+            if (argc == 3  && !is_valid_port(argv[2]) &&
+                    !resolver_is_unix(argv[2])) {
                 fprintf(stderr, "Not valid port number: %s. Enter port "
                         "number in range: %d - %d\n", argv[2],
                         MIN_PORT_NUMBER, MAX_PORT_NUMBER);
@@ -553,6 +933,16 @@ int handle_input(int argc, char *argv[])
             print_error_exit();
         }
     }
+    options->mode = mode;
+    if (mode == SERVER && argc == 3 && resolver_is_unix(argv[2])) {
+        options->hostname = argv[2];
+        options->port = DEFAULT_PORT_NUMBER;
+    } else if (mode == SERVER) {
+        options->port = argc == 3 ? argv[2] : DEFAULT_PORT_NUMBER;
+    } else {
+        options->hostname = argv[2];
+        options->port = argc == 4 ? argv[3] : DEFAULT_PORT_NUMBER;
+    }
     return mode;
 }
 
@@ -592,8 +982,11 @@ static int is_valid_port(char *s)
  */
 void clear_screen()
 {
-    /* printf("\033c"); */
-    system("tput clear");
+    static const char clear[] = "\033[H\033[2J";
+    if (isatty(STDOUT_FILENO) && write(STDOUT_FILENO, clear,
+                sizeof(clear) - 1) == -1) {
+        perror("clear_screen-write()");
+    }
 }
 
 /**
@@ -602,11 +995,14 @@ void clear_screen()
 void move_cursor_to_last_row()
 {
     struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    char command[20];
-    strncpy(command, "tput cup ", 10);
-    char buffer[10];
-    snprintf(buffer, 10, "%d %d", w.ws_row - 1, 0);
-    strncat(command, buffer, 20);
-    system(command);
+    if (!isatty(STDOUT_FILENO) || ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) ==
+            -1) {
+        return;
+    }
+    char sequence[20];
+    int length = snprintf(sequence, sizeof(sequence), "\033[%d;1H",
+            w.ws_row);
+    if (write(STDOUT_FILENO, sequence, length) == -1) {
+        perror("move_cursor_to_last_row-write()");
+    }
 }
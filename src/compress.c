@@ -0,0 +1,321 @@
+#include "compress.h"
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+/** 1 if the compression is offered and accepted */
+static int enabled;
+
+/** adler32 of the dictionary, as zlib identifies it, 0 for none */
+static uint32_t dictionary_id;
+
+#ifdef USE_ZLIB
+/** dictionary loaded, NULL for none */
+static char *dictionary;
+
+/** number of bytes of the dictionary */
+static uint32_t dictionary_length;
+
+/** stream compressing the messages of the calling thread */
+static __thread z_stream *deflater;
+
+/** stream decompressing the payloads received by the calling thread */
+static __thread z_stream *inflater;
+
+/** buffer where the calling thread compresses messages */
+static __thread char *deflate_buffer;
+
+/** size of deflate_buffer */
+static __thread size_t deflate_capacity;
+
+/** buffer where the calling thread decompresses payloads */
+static __thread char *inflate_buffer;
+
+/** size of inflate_buffer */
+static __thread size_t inflate_capacity;
+
+/**
+ * Reads the dictionary from a file. Exits the program on failure.
+ *
+ * @param path file holding the dictionary
+ */
+static void load_dictionary(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("load_dictionary-fopen()");
+        exit(EXIT_FAILURE);
+    }
+    dictionary = (char *) malloc(COMPRESS_MAX_DICTIONARY);
+    if (dictionary == NULL) {
+        perror("load_dictionary-malloc()");
+        exit(EXIT_FAILURE);
+    }
+    // zlib only uses the last window of a longer dictionary anyway
+    dictionary_length = fread(dictionary, 1, COMPRESS_MAX_DICTIONARY, file);
+    if (ferror(file) || dictionary_length == 0) {
+        fprintf(stderr, "load_dictionary: couldn't read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (!feof(file) && fgetc(file) != EOF) {
+        fprintf(stderr, "load_dictionary: only the first %d bytes of %s are "
+                "used\n", COMPRESS_MAX_DICTIONARY, path);
+    }
+    fclose(file);
+}
+#endif
+
+/**
+ * Enables the compression for the whole process, with the dictionary read
+ * from a file. Exits the program if the dictionary can't be read.
+ *
+ * @param enable 1 to offer and accept compression, 0 not to
+ * @param dictionary_path file holding the dictionary, NULL for none
+ */
+void compress_configure(int enable, const char *dictionary_path)
+{
+    if (!enable) {
+        return;
+    }
+#ifdef USE_ZLIB
+    enabled = 1;
+    if (dictionary_path != NULL) {
+        load_dictionary(dictionary_path);
+        dictionary_id = adler32(adler32(0, Z_NULL, 0),
+                (const Bytef *) dictionary, dictionary_length);
+    }
+#else
+    (void) dictionary_path;
+    fprintf(stderr, "built without zlib, the messages aren't compressed\n");
+#endif
+}
+
+/**
+ * Returns the codecs this end supports
+ *
+ * @return mask of COMPRESS_CODEC_ values, COMPRESS_CODEC_NONE if the
+ * compression is disabled
+ */
+uint32_t compress_codecs()
+{
+    return enabled ? COMPRESS_CODEC_ZLIB : COMPRESS_CODEC_NONE;
+}
+
+/**
+ * Returns the codec to use with a peer that offered, or agreed on, the given
+ * codecs and dictionary
+ *
+ * @param codecs mask of the codecs of the peer
+ * @param peer_dictionary_id id of the dictionary of the peer
+ * @return the codec, COMPRESS_CODEC_NONE if there's none in common or the
+ * dictionaries differ
+ */
+uint32_t compress_agree(uint32_t codecs, uint32_t peer_dictionary_id)
+{
+    if (peer_dictionary_id != dictionary_id) {
+        return COMPRESS_CODEC_NONE;
+    }
+    return codecs & compress_codecs() & COMPRESS_CODEC_ZLIB;
+}
+
+/**
+ * Creates the FRAME_TYPE_CODEC frame offering or agreeing on the given codecs
+ *
+ * @param codecs mask of COMPRESS_CODEC_ values
+ * @return the message or NULL if there's no memory
+ */
+struct message_t *compress_codec_frame(uint32_t codecs)
+{
+    char payload[COMPRESS_CODEC_SIZE];
+    uint32_t fields[2];
+    fields[0] = htonl(codecs);
+    fields[1] = htonl(dictionary_id);
+    memcpy(payload, fields, sizeof(fields));
+    return message_create(FRAME_TYPE_CODEC, payload, sizeof(payload));
+}
+
+/**
+ * Decodes the payload of a FRAME_TYPE_CODEC frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param codecs mask of the codecs offered or agreed on
+ * @param peer_dictionary_id id of the dictionary of the peer
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int compress_decode_codec(const char *payload, uint32_t length,
+        uint32_t *codecs, uint32_t *peer_dictionary_id)
+{
+    if (length != COMPRESS_CODEC_SIZE) {
+        return -1;
+    }
+    uint32_t fields[2];
+    memcpy(fields, payload, sizeof(fields));
+    *codecs = ntohl(fields[0]);
+    *peer_dictionary_id = ntohl(fields[1]);
+    return 0;
+}
+
+#ifdef USE_ZLIB
+/**
+ * Makes sure that a buffer of the calling thread has room for size bytes
+ *
+ * @param buffer buffer, NULL until first used
+ * @param capacity size of buffer
+ * @param size number of bytes needed
+ * @return 0 on success, -1 if there's no memory
+ */
+static int reserve(char **buffer, size_t *capacity, size_t size)
+{
+    if (*capacity >= size) {
+        return 0;
+    }
+    char *grown = (char *) realloc(*buffer, size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = size;
+    return 0;
+}
+#endif
+
+/**
+ * Compresses the frame held by a FRAME_TYPE_DATA message
+ *
+ * @param message message to compress
+ * @return a new message with the frame compressed, or NULL if the message
+ * isn't worth compressing, compression is disabled or there's no memory
+ */
+struct message_t *compress_message(const struct message_t *message)
+{
+#ifdef USE_ZLIB
+    struct frame_header_t h;
+    frame_decode_header(message->frame, &h);
+    if (!enabled || h.type != FRAME_TYPE_DATA ||
+            (h.flags & FRAME_FLAG_COMPRESSED) ||
+            h.length < COMPRESS_MIN_SIZE) {
+        return NULL;
+    }
+    if (deflater == NULL) {
+        // streams live as long as their thread, the threads of the program
+        // only finish when it exits
+        deflater = (z_stream *) calloc(1, sizeof(*deflater));
+        if (deflater == NULL || deflateInit(deflater, COMPRESS_LEVEL) !=
+                Z_OK) {
+            free(deflater);
+            deflater = NULL;
+            return NULL;
+        }
+    } else {
+        deflateReset(deflater);
+    }
+    if (dictionary != NULL) {
+        deflateSetDictionary(deflater, (const Bytef *) dictionary,
+                dictionary_length);
+    }
+    size_t bound = COMPRESS_LENGTH_SIZE + deflateBound(deflater, h.length);
+    if (reserve(&deflate_buffer, &deflate_capacity, bound) == -1) {
+        return NULL;
+    }
+    uint32_t length = htonl(h.length);
+    memcpy(deflate_buffer, &length, sizeof(length));
+    deflater->next_in = (Bytef *) message->frame + FRAME_HEADER_SIZE;
+    deflater->avail_in = h.length;
+    deflater->next_out = (Bytef *) deflate_buffer + COMPRESS_LENGTH_SIZE;
+    deflater->avail_out = bound - COMPRESS_LENGTH_SIZE;
+    if (deflate(deflater, Z_FINISH) != Z_STREAM_END) {
+        return NULL;
+    }
+    size_t compressed = COMPRESS_LENGTH_SIZE + deflater->total_out;
+    metrics_count(METRIC_COMPRESS_INPUT, h.length);
+    metrics_count(METRIC_COMPRESS_OUTPUT, compressed);
+    if (compressed >= h.length) {
+        return NULL;
+    }
+    struct message_t *result = message_create(FRAME_TYPE_DATA,
+            deflate_buffer, compressed);
+    if (result == NULL) {
+        return NULL;
+    }
+    h.length = compressed;
+    h.flags |= FRAME_FLAG_COMPRESSED;
+    frame_encode_header(&h, result->frame);
+    // it waits in the send queues on behalf of the original
+    result->created = message->created;
+    return result;
+#else
+    (void) message;
+    return NULL;
+#endif
+}
+
+/**
+ * Decompresses the payload of a frame received with FRAME_FLAG_COMPRESSED
+ * into a buffer of the calling thread, valid until its next call
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param out payload decompressed, followed by a null terminator
+ * @param out_length number of bytes of the payload decompressed
+ * @return 0 on success, -1 if the payload is malformed, bigger than
+ * FRAME_MAX_PAYLOAD once decompressed, or there's no memory
+ */
+int compress_inflate(const char *payload, uint32_t length, const char **out,
+        uint32_t *out_length)
+{
+#ifdef USE_ZLIB
+    uint32_t original;
+    if (length < COMPRESS_LENGTH_SIZE) {
+        return -1;
+    }
+    memcpy(&original, payload, sizeof(original));
+    original = ntohl(original);
+    if (original > FRAME_MAX_PAYLOAD || reserve(&inflate_buffer,
+                &inflate_capacity, original + 1) == -1) {
+        return -1;
+    }
+    if (inflater == NULL) {
+        inflater = (z_stream *) calloc(1, sizeof(*inflater));
+        if (inflater == NULL || inflateInit(inflater) != Z_OK) {
+            free(inflater);
+            inflater = NULL;
+            return -1;
+        }
+    } else {
+        inflateReset(inflater);
+    }
+    inflater->next_in = (Bytef *) payload + COMPRESS_LENGTH_SIZE;
+    inflater->avail_in = length - COMPRESS_LENGTH_SIZE;
+    inflater->next_out = (Bytef *) inflate_buffer;
+    inflater->avail_out = original;
+    int status = inflate(inflater, Z_FINISH);
+    // the stream tells the dictionary it was compressed with
+    if (status == Z_NEED_DICT && dictionary != NULL &&
+            inflater->adler == dictionary_id) {
+        inflateSetDictionary(inflater, (const Bytef *) dictionary,
+                dictionary_length);
+        status = inflate(inflater, Z_FINISH);
+    }
+    if (status != Z_STREAM_END || inflater->total_out != original) {
+        return -1;
+    }
+    inflate_buffer[original] = '\0';
+    *out = inflate_buffer;
+    *out_length = original;
+    return 0;
+#else
+    (void) payload;
+    (void) length;
+    (void) out;
+    (void) out_length;
+    return -1;
+#endif
+}
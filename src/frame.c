@@ -0,0 +1,346 @@
+#include "frame.h"
+
+/**
+ * Writes the header h in wire format into out, that must have room for
+ * FRAME_HEADER_SIZE bytes
+ *
+ * @param h header to encode
+ * @param out buffer where the header is written
+ */
+void frame_encode_header(const struct frame_header_t *h, char *out)
+{
+    uint32_t length = htonl(h->length);
+    uint16_t channel = htons(h->channel);
+    memcpy(out, &length, sizeof(length));
+    out[4] = (char) h->type;
+    out[5] = (char) h->flags;
+    memcpy(out + 6, &channel, sizeof(channel));
+}
+
+/**
+ * Reads a header in wire format from in
+ *
+ * @param in buffer holding FRAME_HEADER_SIZE bytes of a header
+ * @param h header decoded
+ */
+void frame_decode_header(const char *in, struct frame_header_t *h)
+{
+    uint32_t length;
+    uint16_t channel;
+    memcpy(&length, in, sizeof(length));
+    memcpy(&channel, in + 6, sizeof(channel));
+    h->length = ntohl(length);
+    h->type = (uint8_t) in[4];
+    h->flags = (uint8_t) in[5];
+    h->channel = ntohs(channel);
+}
+
+/**
+ * Writes all the bytes described by iov to the blocking socket socketfd,
+ * resuming after short writes. The iov array is modified.
+ *
+ * @param socketfd connected socket
+ * @param iov array of buffers to send
+ * @param iovcnt number of elements of iov
+ * @return 1 on success, -1 on error
+ */
+int send_all(int socketfd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(socketfd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // skip the buffers that were completely sent and advance into the
+        // first one that was sent partially
+        while (msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Reads exactly length bytes from the blocking socket socketfd
+ *
+ * @param socketfd connected socket
+ * @param buffer where the bytes are stored
+ * @param length number of bytes to read
+ * @return 1 on success, 0 if the peer closed the connection, -1 on error
+ */
+int recv_all(int socketfd, void *buffer, size_t length)
+{
+    size_t received = 0;
+    while (received < length) {
+        ssize_t status = recv(socketfd, (char *) buffer + received,
+                length - received, 0);
+        if (status == 0) {
+            return 0;
+        }
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        received += status;
+    }
+    return 1;
+}
+
+/**
+ * Receives a whole frame from the blocking socket socketfd. The payload is
+ * stored in *payload, which is replaced by a bigger buffer of the pool when
+ * the frame doesn't fit in it, and is followed by a null terminator.
+ *
+ * @param socketfd connected socket
+ * @param h header of the frame received
+ * @param pool pool the buffers are taken from
+ * @param payload buffer of the pool where the payload is stored, or NULL
+ * @param capacity size of *payload
+ * @return 1 on success, 0 if the peer closed the connection, -1 on error or
+ * if the frame is bigger than FRAME_MAX_PAYLOAD
+ */
+int recv_frame_pooled(int socketfd, struct frame_header_t *h,
+        struct buffer_pool_t *pool, char **payload, size_t *capacity)
+{
+    char header[FRAME_HEADER_SIZE];
+    int status = recv_all(socketfd, header, FRAME_HEADER_SIZE);
+    if (status <= 0) {
+        return status;
+    }
+    frame_decode_header(header, h);
+    if (h->length > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (*payload == NULL || *capacity < h->length + 1) {
+        pool_free(pool, *payload, *capacity);
+        *payload = (char *) pool_alloc(pool, h->length + 1, capacity);
+        if (*payload == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    (*payload)[h->length] = '\0';
+    return h->length > 0 ? recv_all(socketfd, *payload, h->length) : 1;
+}
+
+/**
+ * Initializes an empty frame reader, that holds no buffer until bytes arrive
+ *
+ * @param reader frame reader
+ * @param pool pool the buffers of the reader are taken from
+ */
+void frame_reader_init(struct frame_reader_t *reader,
+        struct buffer_pool_t *pool)
+{
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->used = 0;
+    reader->consumed = 0;
+    reader->pool = pool;
+}
+
+/**
+ * Moves the bytes of the incomplete frame to the beginning of the reader, so
+ * that there is always room for at least a whole frame
+ *
+ * @param reader frame reader
+ */
+static void compact_reader(struct frame_reader_t *reader)
+{
+    if (reader->consumed > 0) {
+        memmove(reader->buffer, reader->buffer + reader->consumed,
+                reader->used - reader->consumed);
+        reader->used -= reader->consumed;
+        reader->consumed = 0;
+    }
+}
+
+/**
+ * Makes sure that the buffer of the reader has room for the whole frame at
+ * its beginning, or for a header if it isn't known yet, taking a bigger
+ * buffer from the pool if needed
+ *
+ * @param reader frame reader
+ * @return 0 on success, -1 if there's no memory
+ */
+static int reserve_reader(struct frame_reader_t *reader)
+{
+    compact_reader(reader);
+    size_t needed = POOL_MIN_SIZE;
+    if (reader->used >= FRAME_HEADER_SIZE) {
+        struct frame_header_t h;
+        frame_decode_header(reader->buffer, &h);
+        // a malformed length is reported by frame_reader_next
+        if (h.type != FRAME_TYPE_STREAM && h.length <= FRAME_MAX_PAYLOAD &&
+                FRAME_HEADER_SIZE + h.length > needed) {
+            needed = FRAME_HEADER_SIZE + h.length;
+        }
+    }
+    if (reader->buffer != NULL && reader->capacity >= needed) {
+        return 0;
+    }
+    size_t capacity;
+    char *buffer = (char *) pool_alloc(reader->pool, needed, &capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+    if (reader->used > 0) {
+        memcpy(buffer, reader->buffer, reader->used);
+    }
+    pool_free(reader->pool, reader->buffer, reader->capacity);
+    reader->buffer = buffer;
+    reader->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Reads from the non-blocking socket socketfd as many bytes as fit in the
+ * reader, growing it to the size of the frame being received
+ *
+ * @param reader frame reader
+ * @param socketfd connected non-blocking socket
+ * @return number of bytes read, 0 if the peer closed the connection, -1 on
+ * error (errno is EAGAIN when there is nothing else to read, ENOMEM if the
+ * buffer couldn't be grown)
+ */
+ssize_t frame_reader_read(struct frame_reader_t *reader, int socketfd)
+{
+    if (reserve_reader(reader) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t status = recv(socketfd, reader->buffer + reader->used,
+            reader->capacity - reader->used, 0);
+    if (status > 0) {
+        reader->used += status;
+    }
+    return status;
+}
+
+/**
+ * Copies into the reader as many of the given bytes, received by other means,
+ * as fit in it, growing it to the size of the frame being received
+ *
+ * @param reader frame reader
+ * @param bytes bytes received
+ * @param length number of bytes received
+ * @return number of bytes copied, 0 if there's no memory
+ */
+size_t frame_reader_feed(struct frame_reader_t *reader, const char *bytes,
+        size_t length)
+{
+    if (reserve_reader(reader) == -1) {
+        return 0;
+    }
+    size_t room = reader->capacity - reader->used;
+    if (length > room) {
+        length = room;
+    }
+    memcpy(reader->buffer + reader->used, bytes, length);
+    reader->used += length;
+    return length;
+}
+
+/**
+ * Returns the next complete frame stored in the reader. The payload points
+ * into the reader and is valid until the next call to frame_reader_read or
+ * frame_reader_feed. For FRAME_TYPE_STREAM frames only the header is returned
+ * and payload is set to NULL: the payload follows and has to be taken with
+ * frame_reader_take or read from the socket by the caller.
+ *
+ * @param reader frame reader
+ * @param h header of the frame
+ * @param payload set to the first byte of the payload
+ * @return 1 if a frame was returned, 0 if more bytes are needed, -1 if the
+ * frame is malformed
+ */
+int frame_reader_next(struct frame_reader_t *reader, struct frame_header_t *h,
+        const char **payload)
+{
+    size_t available = reader->used - reader->consumed;
+    if (available < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    frame_decode_header(reader->buffer + reader->consumed, h);
+    if (h->type == FRAME_TYPE_STREAM) {
+        if (h->length > FRAME_MAX_STREAM_CHUNK) {
+            return -1;
+        }
+        *payload = NULL;
+        reader->consumed += FRAME_HEADER_SIZE;
+        return 1;
+    }
+    if (h->length > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    if (available < FRAME_HEADER_SIZE + h->length) {
+        return 0;
+    }
+    *payload = reader->buffer + reader->consumed + FRAME_HEADER_SIZE;
+    reader->consumed += FRAME_HEADER_SIZE + h->length;
+    return 1;
+}
+
+/**
+ * Takes up to max of the bytes stored in the reader that haven't been
+ * returned as part of a frame yet, i.e. the payload of a FRAME_TYPE_STREAM
+ * frame. The bytes point into the reader and are valid until the next call
+ * to frame_reader_read or frame_reader_feed.
+ *
+ * @param reader frame reader
+ * @param bytes set to the first byte taken
+ * @param max max number of bytes to take
+ * @return number of bytes taken, 0 if the reader is empty
+ */
+size_t frame_reader_take(struct frame_reader_t *reader, const char **bytes,
+        size_t max)
+{
+    size_t available = reader->used - reader->consumed;
+    if (max > available) {
+        max = available;
+    }
+    *bytes = reader->buffer + reader->consumed;
+    reader->consumed += max;
+    return max;
+}
+
+/**
+ * Gives the buffer of the reader back to its pool if every byte received has
+ * been handled, so that idle connections hold no buffer
+ *
+ * @param reader frame reader
+ */
+void frame_reader_shrink(struct frame_reader_t *reader)
+{
+    if (reader->used == reader->consumed) {
+        frame_reader_free(reader);
+    }
+}
+
+/**
+ * Gives the buffer of the reader back to its pool, dropping any byte that
+ * wasn't handled
+ *
+ * @param reader frame reader
+ */
+void frame_reader_free(struct frame_reader_t *reader)
+{
+    pool_free(reader->pool, reader->buffer, reader->capacity);
+    frame_reader_init(reader, reader->pool);
+}
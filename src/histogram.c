@@ -0,0 +1,147 @@
+#include "histogram.h"
+
+#include <string.h>
+
+/**
+ * Returns the index of the bucket where value is counted
+ *
+ * @param value value
+ * @return index of the bucket
+ */
+static unsigned bucket_index(uint64_t value)
+{
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    unsigned shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+    unsigned sub_bucket = (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/**
+ * Returns the highest value counted in the bucket with the given index
+ *
+ * @param index index of the bucket
+ * @return highest value of the bucket
+ */
+static uint64_t bucket_highest_value(unsigned index)
+{
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t mantissa = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * Initializes an empty histogram
+ *
+ * @param histogram histogram
+ */
+void histogram_init(struct histogram_t *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+/**
+ * Records a value in the histogram
+ *
+ * @param histogram histogram
+ * @param value value to record
+ */
+void histogram_record(struct histogram_t *histogram, uint64_t value)
+{
+    // only this thread writes, the stores just have to be untorn for the
+    // threads merging the histogram
+    uint64_t *count = &histogram->counts[bucket_index(value)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->total, histogram->total + 1,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value,
+            __ATOMIC_RELAXED);
+    if (value < histogram->min) {
+        __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > histogram->max) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Returns the value below which the given percentage of the values recorded
+ * fall. The value returned is the highest one of its bucket.
+ *
+ * @param histogram histogram
+ * @param percentile percentage between 0 and 100
+ * @return the value at the percentile, or 0 if the histogram is empty
+ */
+uint64_t histogram_percentile(const struct histogram_t *histogram,
+        double percentile)
+{
+    if (histogram->total == 0) {
+        return 0;
+    }
+    // number of values that have to be at or below the one returned
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_highest_value(i);
+            // never report beyond what was actually recorded
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Adds the values recorded in src to dst. src may be being recorded by
+ * another thread, in which case the values recorded meanwhile may be left
+ * out of some of the fields.
+ *
+ * @param dst histogram the values are added to
+ * @param src histogram whose values are added
+ */
+void histogram_merge(struct histogram_t *dst, const struct histogram_t *src)
+{
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (min < dst->min) {
+        dst->min = min;
+    }
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+/**
+ * Returns the number of values recorded that are at most value. The values
+ * are counted by bucket, so the ones in the bucket of value are counted if
+ * the highest value of the bucket is at most value.
+ *
+ * @param histogram histogram
+ * @param value upper bound
+ * @return number of values counted
+ */
+uint64_t histogram_count_at_most(const struct histogram_t *histogram,
+        uint64_t value)
+{
+    uint64_t count = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS &&
+            bucket_highest_value(i) <= value; ++i) {
+        count += histogram->counts[i];
+    }
+    return count;
+}
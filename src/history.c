@@ -0,0 +1,563 @@
+#include "history.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** extension of the segments */
+#define SEGMENT_EXTENSION ".log"
+
+/** extension of the indexes */
+#define INDEX_EXTENSION ".idx"
+
+/**
+ * Builds the path of the segment, or of its index, starting at a sequence
+ *
+ * @param history log
+ * @param first sequence of the first message of the segment
+ * @param extension SEGMENT_EXTENSION or INDEX_EXTENSION
+ * @param path where the path is written, PATH_MAX bytes
+ */
+static void segment_path(struct history_t *history, uint64_t first,
+        const char *extension, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%020llu%s", history->path,
+            (unsigned long long) first, extension);
+}
+
+/**
+ * Appends the offset of a message to the index of the segment in memory
+ *
+ * @param segment segment
+ * @param offset offset of the message in the segment
+ * @return 0 on success, -1 if there's no memory
+ */
+static int push_index(struct history_segment_t *segment, uint64_t offset)
+{
+    if (segment->index_count == segment->index_capacity) {
+        size_t capacity = segment->index_capacity > 0 ?
+            2 * segment->index_capacity : HISTORY_INDEX_INTERVAL;
+        uint64_t *index = (uint64_t *) realloc(segment->index, capacity *
+                sizeof(*index));
+        if (index == NULL) {
+            fprintf(stderr, "push_index: out of memory\n");
+            return -1;
+        }
+        segment->index = index;
+        segment->index_capacity = capacity;
+    }
+    segment->index[segment->index_count++] = offset;
+    return 0;
+}
+
+/**
+ * Appends the offset of a message to the index of the segment, unless it's
+ * already there, in memory and in its file
+ *
+ * @param segment segment
+ * @param offset offset of the message in the segment
+ * @return 0 on success, -1 on error
+ */
+static int add_index(struct history_segment_t *segment, uint64_t offset)
+{
+    // a server killed while appending may have indexed the message already
+    if (segment->count / HISTORY_INDEX_INTERVAL < segment->index_count) {
+        return 0;
+    }
+    if (write(segment->index_fd, &offset, sizeof(offset)) !=
+            sizeof(offset)) {
+        perror("add_index-write()");
+        return -1;
+    }
+    return push_index(segment, offset);
+}
+
+/**
+ * Reads the index of a segment, and walks the frames after the last offset
+ * indexed to find where the segment ends, indexing them on the way
+ *
+ * @param segment segment mapped, with its index file open
+ * @return 0 on success, -1 on error
+ */
+static int recover_segment(struct history_segment_t *segment)
+{
+    uint64_t offset;
+    ssize_t status;
+    while ((status = read(segment->index_fd, &offset, sizeof(offset))) ==
+            sizeof(offset)) {
+        if (offset >= HISTORY_SEGMENT_SIZE) {
+            break;
+        }
+        if (push_index(segment, offset) == -1) {
+            return -1;
+        }
+    }
+    if (status == -1) {
+        perror("recover_segment-read()");
+        return -1;
+    }
+    // a partial entry is overwritten by the next one
+    if (ftruncate(segment->index_fd, segment->index_count *
+                sizeof(offset)) == -1) {
+        perror("recover_segment-ftruncate()");
+        return -1;
+    }
+    offset = 0;
+    segment->count = 0;
+    if (segment->index_count > 0) {
+        offset = segment->index[segment->index_count - 1];
+        segment->count = (segment->index_count - 1) * HISTORY_INDEX_INTERVAL;
+    }
+    struct frame_header_t h;
+    while (offset + FRAME_HEADER_SIZE <= HISTORY_SEGMENT_SIZE) {
+        frame_decode_header(segment->data + offset, &h);
+        if (h.type != FRAME_TYPE_REPLAY || h.length > HISTORY_SEGMENT_SIZE -
+                offset - FRAME_HEADER_SIZE) {
+            break;
+        }
+        if (segment->count % HISTORY_INDEX_INTERVAL == 0 &&
+                add_index(segment, offset) == -1) {
+            return -1;
+        }
+        offset += FRAME_HEADER_SIZE + h.length;
+        segment->count++;
+    }
+    segment->length = offset;
+    return 0;
+}
+
+/**
+ * Drops a reference to a segment, unmapping it and freeing its index once
+ * neither the log nor a message replayed holds it anymore
+ *
+ * @param object segment
+ */
+static void segment_unref(void *object)
+{
+    struct history_segment_t *segment = (struct history_segment_t *) object;
+    // the messages replayed are freed by the shard that sent them last
+    if (__atomic_sub_fetch(&segment->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(segment->data, HISTORY_SEGMENT_SIZE);
+        close(segment->index_fd);
+        free(segment->index);
+        free(segment);
+    }
+}
+
+/**
+ * Deletes the oldest segments and their indexes past HISTORY_SEGMENTS_MAX.
+ * The mapping of a segment is kept until the messages replayed from it are
+ * sent.
+ *
+ * @param history log, with its lock held
+ */
+static void retire_segments(struct history_t *history)
+{
+    while (history->segments_count > HISTORY_SEGMENTS_MAX) {
+        struct history_segment_t *segment = history->segments[0];
+        char path[PATH_MAX];
+        segment_path(history, segment->first, SEGMENT_EXTENSION, path);
+        if (unlink(path) == -1) {
+            perror("retire_segments-unlink()");
+        }
+        segment_path(history, segment->first, INDEX_EXTENSION, path);
+        if (unlink(path) == -1) {
+            perror("retire_segments-unlink()");
+        }
+        history->segments_count--;
+        memmove(history->segments, history->segments + 1,
+                history->segments_count * sizeof(*history->segments));
+        segment_unref(segment);
+    }
+}
+
+/**
+ * Maps a segment and opens its index, creating both if needed
+ *
+ * @param history log
+ * @param first sequence of the first message of the segment
+ * @return 0 on success, -1 on error
+ */
+static int open_segment(struct history_t *history, uint64_t first)
+{
+    if (history->segments_count == history->segments_capacity) {
+        size_t capacity = history->segments_capacity > 0 ?
+            2 * history->segments_capacity : 16;
+        struct history_segment_t **segments = (struct history_segment_t **)
+            realloc(history->segments, capacity * sizeof(*segments));
+        if (segments == NULL) {
+            fprintf(stderr, "open_segment: out of memory\n");
+            return -1;
+        }
+        history->segments = segments;
+        history->segments_capacity = capacity;
+    }
+    struct history_segment_t *segment = (struct history_segment_t *) calloc(1,
+            sizeof(*segment));
+    if (segment == NULL) {
+        fprintf(stderr, "open_segment: out of memory\n");
+        return -1;
+    }
+    segment->first = first;
+    segment->refcount = 1;
+
+    char path[PATH_MAX];
+    segment_path(history, first, SEGMENT_EXTENSION, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // the file is sparse, the disk is used as the segment fills
+    if (fd == -1 || ftruncate(fd, HISTORY_SEGMENT_SIZE) == -1) {
+        perror("open_segment-open()");
+        if (fd != -1) {
+            close(fd);
+        }
+        free(segment);
+        return -1;
+    }
+    segment->data = (char *) mmap(NULL, HISTORY_SEGMENT_SIZE,
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment->data == MAP_FAILED) {
+        perror("open_segment-mmap()");
+        free(segment);
+        return -1;
+    }
+    segment_path(history, first, INDEX_EXTENSION, path);
+    segment->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+    if (segment->index_fd == -1) {
+        perror("open_segment-open()");
+    }
+    if (segment->index_fd == -1 || recover_segment(segment) == -1) {
+        if (segment->index_fd != -1) {
+            close(segment->index_fd);
+        }
+        free(segment->index);
+        munmap(segment->data, HISTORY_SEGMENT_SIZE);
+        free(segment);
+        return -1;
+    }
+    history->segments[history->segments_count++] = segment;
+    return 0;
+}
+
+/**
+ * Orders the sequences of the segments found in the directory
+ *
+ * @param a first sequence
+ * @param b second sequence
+ * @return less than, equal to or greater than 0 if a is lower, equal or
+ * greater than b
+ */
+static int compare_sequences(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Opens the log in a directory, creating it if needed, and recovers the
+ * messages it holds. Exits the program on failure.
+ *
+ * @param history log
+ * @param path directory of the log
+ * @param window max bytes of the messages held by a channel while another
+ * one is appended in chunks
+ */
+void history_open(struct history_t *history, const char *path,
+        size_t window)
+{
+    history->path = strdup(path);
+    history->segments = NULL;
+    history->segments_count = 0;
+    history->segments_capacity = 0;
+    history->next = 1;
+    channel_set_init(&history->channels);
+    history->window = window;
+    pthread_mutex_init(&history->lock, NULL);
+    if (history->path == NULL) {
+        perror("history_open-strdup()");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("history_open-mkdir()");
+        exit(EXIT_FAILURE);
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror("history_open-opendir()");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t *firsts = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long long first = strtoull(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, SEGMENT_EXTENSION) != 0 ||
+                first == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 16;
+            firsts = (uint64_t *) realloc(firsts, capacity *
+                    sizeof(*firsts));
+            if (firsts == NULL) {
+                perror("history_open-realloc()");
+                exit(EXIT_FAILURE);
+            }
+        }
+        firsts[count++] = first;
+    }
+    closedir(dir);
+    qsort(firsts, count, sizeof(*firsts), compare_sequences);
+    for (size_t i = 0; i < count; ++i) {
+        if (open_segment(history, firsts[i]) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(firsts);
+    retire_segments(history);
+    if (history->segments_count > 0) {
+        struct history_segment_t *last =
+            history->segments[history->segments_count - 1];
+        history->next = last->first + last->count;
+    }
+    print_progress("history in %s, next message is #%llu\n", path,
+            (unsigned long long) history->next);
+}
+
+/**
+ * Appends a chunk of a FRAME_TYPE_DATA message to the log
+ *
+ * @param history log, with its lock held
+ * @param message chunk relayed
+ * @return the sequence of the chunk, 0 if it couldn't be appended
+ */
+static uint64_t append_chunk(struct history_t *history,
+        const struct message_t *message)
+{
+    if (message->length > HISTORY_SEGMENT_SIZE) {
+        return 0;
+    }
+    struct history_segment_t *segment = history->segments_count > 0 ?
+        history->segments[history->segments_count - 1] : NULL;
+    if (segment == NULL || segment->length + message->length >
+            HISTORY_SEGMENT_SIZE) {
+        if (open_segment(history, history->next) == -1) {
+            return 0;
+        }
+        retire_segments(history);
+        segment = history->segments[history->segments_count - 1];
+    }
+    if (segment->count % HISTORY_INDEX_INTERVAL == 0 &&
+            add_index(segment, segment->length) == -1) {
+        return 0;
+    }
+    char *frame = segment->data + segment->length;
+    memcpy(frame + FRAME_HEADER_SIZE, message->frame + FRAME_HEADER_SIZE,
+            message->length - FRAME_HEADER_SIZE);
+    // the header is what makes the frame part of the log when recovering
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    struct frame_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.length = message->length - FRAME_HEADER_SIZE;
+    h.type = FRAME_TYPE_REPLAY;
+    // the chunks of a message are replayed as they were relayed
+    h.flags = message_has_more(message) ? FRAME_FLAG_MORE : 0;
+    h.channel = message_channel(message);
+    frame_encode_header(&h, frame);
+    segment->length += message->length;
+    segment->count++;
+    return history->next++;
+}
+
+/**
+ * Appends a chunk of a FRAME_TYPE_DATA message to the log, with a sequence
+ * of its own. The chunks of a message are appended one after the other,
+ * the other messages of its channel are held until its last chunk, as
+ * channel_relay does for the clients.
+ *
+ * @param history log
+ * @param message chunk relayed
+ * @return the sequence of the last message appended, 0 if none was
+ */
+uint64_t history_append(struct history_t *history,
+        struct message_t *message)
+{
+    pthread_mutex_lock(&history->lock);
+    uint16_t id = message_channel(message);
+    struct channel_t *channel = channel_find(&history->channels, id);
+    if (channel == NULL && channel_join(&history->channels, id) == 0) {
+        channel = channel_find(&history->channels, id);
+    }
+    uint64_t sequence = 0;
+    if (channel == NULL) {
+        // too many messages in chunks at once, logged as they come
+        sequence = append_chunk(history, message);
+    } else {
+        struct send_queue_t ready;
+        send_queue_init(&ready);
+        // a message that couldn't be cut short is cut by the next one
+        channel_relay(channel, message, history->window, &ready);
+        for (size_t i = 0; i < ready.count; ++i) {
+            sequence = append_chunk(history, send_queue_at(&ready, i));
+        }
+        send_queue_clear(&ready);
+        // only the channels in the middle of a message are kept
+        if (channel->chunked == 0 && channel->held.count == 0) {
+            channel_leave(&history->channels, id);
+        }
+    }
+    pthread_mutex_unlock(&history->lock);
+    return sequence;
+}
+
+/**
+ * Returns the sequence of the next message appended
+ *
+ * @param history log
+ * @return the sequence
+ */
+uint64_t history_next(struct history_t *history)
+{
+    pthread_mutex_lock(&history->lock);
+    uint64_t next = history->next;
+    pthread_mutex_unlock(&history->lock);
+    return next;
+}
+
+/**
+ * Finds the segment holding a message, or the first one after it
+ *
+ * @param history log, with its lock held
+ * @param sequence sequence of the message
+ * @return the index of the segment, segments_count if there's none
+ */
+static size_t find_segment(struct history_t *history, uint64_t sequence)
+{
+    // the last segment starting at or before the sequence
+    size_t low = 0;
+    size_t high = history->segments_count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (history->segments[middle]->first <= sequence) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < history->segments_count) {
+        struct history_segment_t *segment = history->segments[low];
+        if (sequence >= segment->first + segment->count) {
+            low++;
+        }
+    }
+    return low;
+}
+
+/**
+ * Returns a message pointing to the frames logged from a sequence on, up to
+ * HISTORY_REPLAY_BATCH bytes but at least one of them, in the mapping of
+ * their segment, that is kept until the message is freed
+ *
+ * @param history log
+ * @param sequence first message to replay, updated to the one after the last
+ * message replayed. Messages no longer logged are skipped.
+ * @param end sequence of the first message not to replay
+ * @return the message or NULL if there's none to replay or no memory
+ */
+struct message_t *history_read(struct history_t *history, uint64_t *sequence,
+        uint64_t end)
+{
+    pthread_mutex_lock(&history->lock);
+    size_t i = find_segment(history, *sequence);
+    if (i == history->segments_count) {
+        pthread_mutex_unlock(&history->lock);
+        return NULL;
+    }
+    struct history_segment_t *segment = history->segments[i];
+    if (segment->count == 0) {
+        pthread_mutex_unlock(&history->lock);
+        return NULL;
+    }
+    if (*sequence < segment->first) {
+        *sequence = segment->first;
+    }
+    // the index gets close, the headers are walked from there
+    uint64_t position = *sequence - segment->first;
+    size_t entry = position / HISTORY_INDEX_INTERVAL;
+    if (entry >= segment->index_count) {
+        entry = segment->index_count - 1;
+    }
+    size_t offset = segment->index[entry];
+    struct frame_header_t h;
+    for (uint64_t j = entry * HISTORY_INDEX_INTERVAL; j < position; ++j) {
+        frame_decode_header(segment->data + offset, &h);
+        offset += FRAME_HEADER_SIZE + h.length;
+    }
+    size_t start = offset;
+    uint64_t last = segment->first + segment->count;
+    if (end < last) {
+        last = end;
+    }
+    while (*sequence < last) {
+        frame_decode_header(segment->data + offset, &h);
+        size_t length = FRAME_HEADER_SIZE + h.length;
+        if (offset > start && offset - start + length > HISTORY_REPLAY_BATCH) {
+            break;
+        }
+        offset += length;
+        (*sequence)++;
+    }
+    struct message_t *message = NULL;
+    if (offset > start) {
+        // the segment may be retired while the message waits to be sent
+        __atomic_add_fetch(&segment->refcount, 1, __ATOMIC_RELAXED);
+        message = message_borrow_frames(segment->data + start,
+                offset - start, segment_unref, segment);
+        if (message == NULL) {
+            segment_unref(segment);
+        }
+    }
+    pthread_mutex_unlock(&history->lock);
+    return message;
+}
+
+/**
+ * Creates a FRAME_TYPE_HISTORY frame
+ *
+ * @param sequence first message asked for by a client, next message for the
+ * server
+ * @return the message or NULL if there's no memory
+ */
+struct message_t *history_frame(uint64_t sequence)
+{
+    char payload[HISTORY_REQUEST_SIZE];
+    uint64_t value = htobe64(sequence);
+    memcpy(payload, &value, sizeof(value));
+    return message_create(FRAME_TYPE_HISTORY, payload, sizeof(payload));
+}
+
+/**
+ * Decodes the payload of a FRAME_TYPE_HISTORY frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param sequence sequence it holds
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int history_decode(const char *payload, uint32_t length, uint64_t *sequence)
+{
+    uint64_t value;
+    if (length != HISTORY_REQUEST_SIZE) {
+        return -1;
+    }
+    memcpy(&value, payload, sizeof(value));
+    *sequence = be64toh(value);
+    return 0;
+}
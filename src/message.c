@@ -0,0 +1,317 @@
+#include "message.h"
+#include "metrics.h"
+
+/**
+ * Creates a message with a reference count of 1 holding a frame of the given
+ * type and payload. The payload is followed by a null terminator, that is not
+ * part of the frame, so that text messages can be printed directly.
+ *
+ * @param type type of the frame
+ * @param payload bytes of the payload
+ * @param length number of bytes of the payload
+ * @return the new message or NULL if there's no memory
+ */
+struct message_t *message_create(uint8_t type, const char *payload,
+        uint32_t length)
+{
+    struct message_t *message = (struct message_t *) malloc(sizeof(*message)
+            + FRAME_HEADER_SIZE + length + 1);
+    if (message == NULL) {
+        return NULL;
+    }
+    message->frame = message->data;
+    message->release = NULL;
+    message->owner = NULL;
+    struct frame_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.length = length;
+    h.type = type;
+    frame_encode_header(&h, message->frame);
+    memcpy(message->frame + FRAME_HEADER_SIZE, payload, length);
+    message->frame[FRAME_HEADER_SIZE + length] = '\0';
+    message->length = FRAME_HEADER_SIZE + length;
+    message->refcount = 1;
+    message->created = metrics_now();
+    message->compressed = NULL;
+    message->chunked = 0;
+    message->continued = 0;
+    return message;
+}
+
+/**
+ * Creates a message with a reference count of 1 pointing to frames already
+ * encoded that it doesn't own, i.e. in a mapped file, instead of copying
+ * them. The frames aren't followed by a null terminator. Their owner is
+ * released once the message is freed.
+ *
+ * @param frames bytes of the frames, headers included, kept until the owner
+ * is released
+ * @param length number of bytes of the frames
+ * @param release function releasing the owner
+ * @param owner holder of the frames
+ * @return the new message or NULL if there's no memory
+ */
+struct message_t *message_borrow_frames(const char *frames, uint32_t length,
+        void (*release)(void *), void *owner)
+{
+    struct message_t *message = (struct message_t *) malloc(
+            sizeof(*message));
+    if (message == NULL) {
+        return NULL;
+    }
+    message->frame = (char *) frames;
+    message->release = release;
+    message->owner = owner;
+    message->length = length;
+    message->refcount = 1;
+    message->created = metrics_now();
+    message->compressed = NULL;
+    message->chunked = 0;
+    message->continued = 0;
+    return message;
+}
+
+/**
+ * Returns the payload of the message
+ *
+ * @param message message
+ * @return first byte of the payload, null terminated
+ */
+char *message_payload(struct message_t *message)
+{
+    return message->frame + FRAME_HEADER_SIZE;
+}
+
+/**
+ * Tells whether more chunks of the same message follow the message
+ *
+ * @param message message
+ * @return 1 if its frame is flagged with FRAME_FLAG_MORE, 0 otherwise
+ */
+int message_has_more(const struct message_t *message)
+{
+    struct frame_header_t h;
+    frame_decode_header(message->frame, &h);
+    return (h.flags & FRAME_FLAG_MORE) != 0;
+}
+
+/**
+ * Flags the frame of the message with FRAME_FLAG_MORE
+ *
+ * @param message message
+ */
+void message_set_more(struct message_t *message)
+{
+    struct frame_header_t h;
+    frame_decode_header(message->frame, &h);
+    h.flags |= FRAME_FLAG_MORE;
+    frame_encode_header(&h, message->frame);
+}
+
+/**
+ * Returns the channel of the frame of the message
+ *
+ * @param message message
+ * @return id of the channel
+ */
+uint16_t message_channel(const struct message_t *message)
+{
+    struct frame_header_t h;
+    frame_decode_header(message->frame, &h);
+    return h.channel;
+}
+
+/**
+ * Sets the channel of the frame of the message
+ *
+ * @param message message
+ * @param channel id of the channel
+ */
+void message_set_channel(struct message_t *message, uint16_t channel)
+{
+    struct frame_header_t h;
+    frame_decode_header(message->frame, &h);
+    h.channel = channel;
+    frame_encode_header(&h, message->frame);
+}
+
+/**
+ * Takes a new reference to the message. References can be taken and dropped
+ * from any thread.
+ *
+ * @param message message
+ * @return the message
+ */
+struct message_t *message_ref(struct message_t *message)
+{
+    __atomic_fetch_add(&message->refcount, 1, __ATOMIC_RELAXED);
+    return message;
+}
+
+/**
+ * Drops a reference to the message, freeing it when it was the last one
+ *
+ * @param message message
+ */
+void message_unref(struct message_t *message)
+{
+    assert(message->refcount > 0);
+    // the release orders every use of the message by this thread before the
+    // free done by the thread dropping the last reference
+    if (__atomic_sub_fetch(&message->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (message->compressed != NULL) {
+            message_unref(message->compressed);
+        }
+        if (message->release != NULL) {
+            message->release(message->owner);
+        }
+        free(message);
+    }
+}
+
+/**
+ * Initializes an empty send queue. No memory is allocated until the first
+ * message is pushed.
+ *
+ * @param queue send queue
+ */
+void send_queue_init(struct send_queue_t *queue)
+{
+    queue->messages = NULL;
+    queue->capacity = 0;
+    queue->head = 0;
+    queue->count = 0;
+    queue->offset = 0;
+    queue->bytes = 0;
+}
+
+/**
+ * Appends a reference to the message at the end of the queue
+ *
+ * @param queue send queue
+ * @param message message, the queue takes a new reference to it
+ * @return 0 on success, -1 if there's no memory
+ */
+int send_queue_push(struct send_queue_t *queue, struct message_t *message)
+{
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity == 0 ? SEND_QUEUE_INITIAL_CAPACITY :
+            queue->capacity * 2;
+        struct message_t **messages = (struct message_t **) malloc(capacity *
+                sizeof(*messages));
+        if (messages == NULL) {
+            return -1;
+        }
+        // unwrap the circular buffer into the new one
+        for (size_t i = 0; i < queue->count; ++i) {
+            messages[i] = queue->messages[(queue->head + i) % queue->capacity];
+        }
+        free(queue->messages);
+        queue->messages = messages;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    queue->messages[(queue->head + queue->count) % queue->capacity] =
+        message_ref(message);
+    queue->count++;
+    queue->bytes += message->length;
+    return 0;
+}
+
+/**
+ * Returns the first message of the queue
+ *
+ * @param queue send queue
+ * @return the first message, or NULL if the queue is empty
+ */
+struct message_t *send_queue_front(struct send_queue_t *queue)
+{
+    return queue->count == 0 ? NULL : queue->messages[queue->head];
+}
+
+/**
+ * Returns the message at the given position of the queue
+ *
+ * @param queue send queue
+ * @param index position of the message, 0 being the first one
+ * @return the message
+ */
+struct message_t *send_queue_at(struct send_queue_t *queue, size_t index)
+{
+    assert(index < queue->count);
+    return queue->messages[(queue->head + index) % queue->capacity];
+}
+
+/**
+ * Removes the first message of the queue, dropping the reference to it
+ *
+ * @param queue send queue
+ */
+void send_queue_pop(struct send_queue_t *queue)
+{
+    assert(queue->count > 0);
+    queue->bytes -= queue->messages[queue->head]->length - queue->offset;
+    message_unref(queue->messages[queue->head]);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->offset = 0;
+}
+
+/**
+ * Fills iov with the bytes of the queued messages that haven't been sent yet,
+ * so that several messages can be written with a single system call
+ *
+ * @param queue send queue
+ * @param iov array of buffers to fill
+ * @param max number of elements of iov
+ * @return number of elements of iov filled
+ */
+int send_queue_iov(struct send_queue_t *queue, struct iovec *iov, int max)
+{
+    int count = 0;
+    for (size_t i = 0; i < queue->count && count < max; ++i, ++count) {
+        struct message_t *message = queue->messages[(queue->head + i) %
+            queue->capacity];
+        size_t offset = i == 0 ? queue->offset : 0;
+        iov[count].iov_base = message->frame + offset;
+        iov[count].iov_len = message->length - offset;
+    }
+    return count;
+}
+
+/**
+ * Marks the first bytes of the queue as sent, removing the messages that were
+ * sent completely
+ *
+ * @param queue send queue
+ * @param bytes number of bytes sent
+ */
+void send_queue_consume(struct send_queue_t *queue, size_t bytes)
+{
+    while (bytes > 0) {
+        struct message_t *message = send_queue_front(queue);
+        assert(message != NULL);
+        size_t remaining = message->length - queue->offset;
+        if (bytes < remaining) {
+            queue->offset += bytes;
+            queue->bytes -= bytes;
+            return;
+        }
+        bytes -= remaining;
+        send_queue_pop(queue);
+    }
+}
+
+/**
+ * Drops every message of the queue and frees its memory
+ *
+ * @param queue send queue
+ */
+void send_queue_clear(struct send_queue_t *queue)
+{
+    while (queue->count > 0) {
+        send_queue_pop(queue);
+    }
+    free(queue->messages);
+    send_queue_init(queue);
+}
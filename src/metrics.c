@@ -0,0 +1,340 @@
+#include "metrics.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/** bounds of the buckets of the histograms exported, in seconds */
+static const double bucket_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3,
+    2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+/** names and descriptions of the counters, indexed by METRIC_ */
+static const char *counter_names[METRIC_COUNTERS][2] = {
+    {"bytes_sent_total", "Bytes written to sockets"},
+    {"bytes_received_total", "Bytes read from sockets"},
+    {"messages_sent_total", "Messages written completely to sockets"},
+    {"messages_received_total", "Frames received"},
+    {"send_errors_total", "Errors sending"},
+    {"receive_errors_total", "Errors receiving"},
+    {"connects_total", "Connections established to a server"},
+    {"connect_errors_total", "Connections to a server that failed"},
+    {"accepts_total", "Connections accepted"},
+    {"accept_errors_total", "Errors accepting connections"},
+    {"compress_input_bytes_total", "Bytes of the payloads compressed"},
+    {"compress_output_bytes_total", "Bytes the payloads compressed were "
+        "turned into"},
+    {"messages_skipped_total", "Messages not relayed to slow clients"},
+    {"slow_evictions_total", "Slow clients evicted"},
+    {"messages_cut_total", "Messages cut short for exceeding the window"}
+};
+
+/** names and descriptions of the gauges, indexed by METRIC_ */
+static const char *gauge_names[METRIC_GAUGES][2] = {
+    {"connections", "Connections open"},
+    {"send_queue_depth", "Messages queued for sending"}
+};
+
+/** names and descriptions of the histograms, indexed by METRIC_ */
+static const char *histogram_names[METRIC_HISTOGRAMS][2] = {
+    {"send_queue_wait_seconds", "Time from the creation of a message until "
+        "it was sent"},
+    {"processing_seconds", "Time taken to handle a message received"}
+};
+
+/** prefix of the names of all the metrics */
+static const char prefix[] = "client_server_";
+
+/** protects the list of blocks */
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** blocks of every thread that updated a metric */
+static struct metrics_t *blocks;
+
+/** block of the calling thread, NULL until it updates a metric */
+static __thread struct metrics_t *local_block;
+
+/**
+ * Returns the block of the calling thread, registering it on first use. A
+ * block is never freed, so that the counters of the threads that finished
+ * are still part of the snapshots.
+ *
+ * @return the block, or NULL if there's no memory
+ */
+static struct metrics_t *local_metrics()
+{
+    if (local_block != NULL) {
+        return local_block;
+    }
+    struct metrics_t *metrics = (struct metrics_t *) calloc(1,
+            sizeof(*metrics));
+    if (metrics == NULL) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < METRIC_HISTOGRAMS; ++i) {
+        histogram_init(&metrics->histograms[i]);
+    }
+    pthread_mutex_lock(&blocks_lock);
+    metrics->next = blocks;
+    blocks = metrics;
+    pthread_mutex_unlock(&blocks_lock);
+    local_block = metrics;
+    return metrics;
+}
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ *
+ * @return nanoseconds
+ */
+uint64_t metrics_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Adds value to a counter of the calling thread
+ *
+ * @param counter one of the METRIC_ counters
+ * @param value value added
+ */
+void metrics_count(unsigned counter, uint64_t value)
+{
+    struct metrics_t *metrics = local_metrics();
+    if (metrics != NULL) {
+        __atomic_store_n(&metrics->counters[counter],
+                metrics->counters[counter] + value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Adds delta to a gauge. A gauge may go up in a thread and down in another
+ * one, only the sum of all the threads is meaningful.
+ *
+ * @param gauge one of the METRIC_ gauges
+ * @param delta value added
+ */
+void metrics_gauge(unsigned gauge, int64_t delta)
+{
+    struct metrics_t *metrics = local_metrics();
+    if (metrics != NULL) {
+        __atomic_store_n(&metrics->gauges[gauge], metrics->gauges[gauge] +
+                delta, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Records a value in a histogram of the calling thread
+ *
+ * @param histogram one of the METRIC_ histograms
+ * @param value value recorded, in nanoseconds
+ */
+void metrics_record(unsigned histogram, uint64_t value)
+{
+    struct metrics_t *metrics = local_metrics();
+    if (metrics != NULL) {
+        histogram_record(&metrics->histograms[histogram], value);
+    }
+}
+
+/**
+ * Writes the HELP and TYPE lines of a metric
+ *
+ * @param out stream the snapshot is written to
+ * @param name name and description of the metric
+ * @param type counter, gauge or histogram
+ */
+static void write_header(FILE *out, const char *name[2], const char *type)
+{
+    fprintf(out, "# HELP %s%s %s\n# TYPE %s%s %s\n", prefix, name[0],
+            name[1], prefix, name[0], type);
+}
+
+/**
+ * Merges the metrics of every thread and writes them to out in the
+ * Prometheus text format
+ *
+ * @param out stream the snapshot is written to
+ */
+void metrics_write(FILE *out)
+{
+    uint64_t counters[METRIC_COUNTERS] = {0};
+    int64_t gauges[METRIC_GAUGES] = {0};
+    struct histogram_t *histograms = (struct histogram_t *) malloc(
+            METRIC_HISTOGRAMS * sizeof(*histograms));
+    if (histograms == NULL) {
+        return;
+    }
+    for (unsigned i = 0; i < METRIC_HISTOGRAMS; ++i) {
+        histogram_init(&histograms[i]);
+    }
+    pthread_mutex_lock(&blocks_lock);
+    for (struct metrics_t *metrics = blocks; metrics != NULL;
+            metrics = metrics->next) {
+        for (unsigned i = 0; i < METRIC_COUNTERS; ++i) {
+            counters[i] += __atomic_load_n(&metrics->counters[i],
+                    __ATOMIC_RELAXED);
+        }
+        for (unsigned i = 0; i < METRIC_GAUGES; ++i) {
+            gauges[i] += __atomic_load_n(&metrics->gauges[i],
+                    __ATOMIC_RELAXED);
+        }
+        for (unsigned i = 0; i < METRIC_HISTOGRAMS; ++i) {
+            histogram_merge(&histograms[i], &metrics->histograms[i]);
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    for (unsigned i = 0; i < METRIC_COUNTERS; ++i) {
+        write_header(out, counter_names[i], "counter");
+        fprintf(out, "%s%s %llu\n", prefix, counter_names[i][0],
+                (unsigned long long) counters[i]);
+    }
+    for (unsigned i = 0; i < METRIC_GAUGES; ++i) {
+        write_header(out, gauge_names[i], "gauge");
+        fprintf(out, "%s%s %lld\n", prefix, gauge_names[i][0],
+                (long long) gauges[i]);
+    }
+    for (unsigned i = 0; i < METRIC_HISTOGRAMS; ++i) {
+        const char *name = histogram_names[i][0];
+        write_header(out, histogram_names[i], "histogram");
+        for (size_t k = 0; k < sizeof(bucket_bounds) /
+                sizeof(*bucket_bounds); ++k) {
+            uint64_t bound = (uint64_t) (bucket_bounds[k] * 1e9 + 0.5);
+            fprintf(out, "%s%s_bucket{le=\"%g\"} %llu\n", prefix, name,
+                    bucket_bounds[k], (unsigned long long)
+                    histogram_count_at_most(&histograms[i], bound));
+        }
+        fprintf(out, "%s%s_bucket{le=\"+Inf\"} %llu\n", prefix, name,
+                (unsigned long long) histograms[i].total);
+        fprintf(out, "%s%s_sum %.9f\n", prefix, name, histograms[i].sum /
+                1e9);
+        fprintf(out, "%s%s_count %llu\n", prefix, name,
+                (unsigned long long) histograms[i].total);
+    }
+    free(histograms);
+}
+
+/**
+ * Reads the request sent to the admin socket, up to the blank line ending
+ * its headers. Only its first line matters, but closing the socket with the
+ * request unread would make the peer see a reset instead of the answer.
+ *
+ * @param fd connection to the admin socket
+ * @param request where the request is stored, METRICS_REQUEST_SIZE bytes,
+ * empty if nothing was sent
+ */
+static void read_request(int fd, char *request)
+{
+    struct timeval timeout = {METRICS_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    size_t length = 0;
+    request[0] = '\0';
+    while (length < METRICS_REQUEST_SIZE - 1) {
+        ssize_t status = recv(fd, request + length, METRICS_REQUEST_SIZE - 1
+                - length, 0);
+        if (status <= 0) {
+            return;
+        }
+        length += status;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL ||
+                strstr(request, "\n\n") != NULL) {
+            return;
+        }
+    }
+}
+
+/**
+ * Body of the admin thread: answers every connection to the admin socket
+ * with a snapshot of the metrics, or with a dump of the trace if it asks for
+ * /trace and the program is built with USE_TRACING
+ *
+ * @param arg listening unix socket
+ * @return never returns
+ */
+static void *run_metrics(void *arg)
+{
+    int socketfd = (int) (intptr_t) arg;
+    for (;;) {
+        int fd = accept4(socketfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        char request[METRICS_REQUEST_SIZE];
+        read_request(fd, request);
+#ifdef USE_TRACING
+        if (strncmp(request, "GET /trace ", 11) == 0) {
+            dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: "
+                    "application/octet-stream\r\n\r\n");
+            trace_dump(fd);
+            close(fd);
+            continue;
+        }
+#endif
+        char *body = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&body, &length);
+        if (out != NULL) {
+            metrics_write(out);
+            fclose(out);
+            dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                    "version=0.0.4\r\nContent-Length: %zu\r\n\r\n%s", length,
+                    body);
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the admin thread, that listens on the unix socket at path and
+ * answers every connection with a snapshot of the metrics, as an HTTP
+ * response so that it can be scraped with curl --unix-socket as well as read
+ * with socat. Exits the program if the socket can't be created.
+ *
+ * @param path path of the unix socket, replaced if it exists
+ */
+void metrics_serve(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics_serve: path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    int socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketfd == -1) {
+        perror("metrics_serve-socket()");
+        exit(EXIT_FAILURE);
+    }
+    // a socket left behind by a previous run would make bind fail
+    unlink(path);
+    if (bind(socketfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+            listen(socketfd, METRICS_BACKLOG) == -1) {
+        perror("metrics_serve-bind()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, run_metrics,
+                (void *) (intptr_t) socketfd) != 0) {
+        perror("metrics_serve-pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&attr);
+}
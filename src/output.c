@@ -0,0 +1,222 @@
+#include "output.h"
+
+#include <sys/eventfd.h>
+#include <time.h>
+
+/**
+ * Hands everything queued in the rings to the renderer, with the number of
+ * messages skipped. Each ring is drained at most once, so that a flood
+ * doesn't keep the frames from being drawn.
+ *
+ * @param output output stage
+ * @return number of messages taken
+ */
+static size_t drain_rings(struct output_t *output)
+{
+    const char *prefix = output->type == CLIENT ? "From server: " :
+        "From client: ";
+    struct message_t *messages[OUTPUT_BATCH_MAX];
+    size_t total = 0;
+    for (size_t i = 0; i < output->ring_count; ++i) {
+        struct output_ring_t *ring = &output->rings[i];
+        size_t count;
+        size_t taken = 0;
+        while (taken < OUTPUT_RING_CAPACITY &&
+                (count = spsc_ring_pop(&ring->ring, (void **) messages,
+                                       OUTPUT_BATCH_MAX)) > 0) {
+            for (size_t j = 0; j < count; ++j) {
+                terminal_add(&output->terminal, messages[j], prefix);
+            }
+            taken += count;
+        }
+        total += taken;
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0,
+                __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            char notice[OUTPUT_NOTICE_SIZE];
+            int length = snprintf(notice, sizeof(notice), "[%llu messages "
+                    "not shown, the output is too slow]\n",
+                    (unsigned long long) dropped);
+            struct message_t *message = message_create(FRAME_TYPE_DATA,
+                    notice, length);
+            if (message != NULL) {
+                terminal_add(&output->terminal, message, "");
+            }
+        }
+    }
+    return total;
+}
+
+/**
+ * Tells whether every ring is empty
+ *
+ * @param output output stage
+ * @return 1 if there are no messages to show, 0 otherwise
+ */
+static int rings_empty(struct output_t *output)
+{
+    for (size_t i = 0; i < output->ring_count; ++i) {
+        if (!spsc_ring_empty(&output->rings[i].ring)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Body of the output thread: shows the messages queued until output_stop is
+ * called, sleeping on wakeup_fd while there are none
+ *
+ * @param arg output stage
+ * @return NULL
+ */
+static void *run_output(void *arg)
+{
+    struct output_t *output = (struct output_t *) arg;
+    for (;;) {
+        drain_rings(output);
+        if (output->terminal.pending > 0) {
+            // the messages arriving until the next frame wait in the rings,
+            // without waking this thread up
+            uint64_t wait = terminal_frame_wait(&output->terminal);
+            if (wait > 0) {
+                struct timespec ts;
+                ts.tv_sec = wait / 1000000000;
+                ts.tv_nsec = wait % 1000000000;
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            // whatever was printed with stdio must come out first
+            fflush(stdout);
+            terminal_render(&output->terminal);
+            continue;
+        }
+        __atomic_store_n(&output->sleeping, 1, __ATOMIC_RELAXED);
+        // pairs with the fence of output_push: either the producer sees
+        // sleeping set and wakes us up, or we see its message here
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!rings_empty(output)) {
+            __atomic_store_n(&output->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_load_n(&output->stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        uint64_t counter;
+        if (read(output->wakeup_fd, &counter, sizeof(counter)) == -1 &&
+                errno != EINTR) {
+            perror("run_output-read()");
+            break;
+        }
+        __atomic_store_n(&output->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/**
+ * Wakes up the output thread
+ *
+ * @param output output stage
+ */
+static void wake_output(struct output_t *output)
+{
+    uint64_t one = 1;
+    if (write(output->wakeup_fd, &one, sizeof(one)) == -1) {
+        perror("wake_output-write()");
+    }
+}
+
+/**
+ * Creates the rings of the given number of producers and starts the output
+ * thread. Fails and exits the program if it can't be started.
+ *
+ * @param output output stage
+ * @param producers number of threads that push messages
+ * @param type CLIENT or SERVER, the program showing the messages
+ */
+void output_start(struct output_t *output, size_t producers, int type)
+{
+    output->ring_count = producers;
+    output->type = type;
+    output->sleeping = 0;
+    output->stopping = 0;
+    // the rings are aligned so that the indexes of different threads never
+    // share a cache line
+    if (posix_memalign((void **) &output->rings, SPSC_CACHE_LINE, producers *
+                sizeof(*output->rings)) != 0) {
+        fprintf(stderr, "output_start: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < producers; ++i) {
+        if (spsc_ring_init(&output->rings[i].ring, OUTPUT_RING_CAPACITY) ==
+                -1) {
+            fprintf(stderr, "output_start: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        output->rings[i].dropped = 0;
+    }
+    // only the client leaves the last row to the line being typed
+    terminal_init(&output->terminal, STDOUT_FILENO, type == CLIENT);
+    output->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (output->wakeup_fd == -1) {
+        perror("output_start-eventfd()");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&output->thread, NULL, run_output, output) != 0) {
+        perror("output_start-pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Queues the message to be shown. Never blocks: if the ring of the producer
+ * is full the message is skipped.
+ *
+ * @param output output stage
+ * @param producer index of the ring of the calling thread
+ * @param message message, the output stage takes a new reference to it
+ * @return 0 on success, -1 if the message was skipped
+ */
+int output_push(struct output_t *output, size_t producer,
+        struct message_t *message)
+{
+    struct output_ring_t *ring = &output->rings[producer];
+    if (!spsc_ring_push(&ring->ring, message_ref(message))) {
+        message_unref(message);
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&output->sleeping, __ATOMIC_RELAXED)) {
+        wake_output(output);
+    }
+    return 0;
+}
+
+/**
+ * Clears the line typed by the user, once it was read
+ *
+ * @param output output stage
+ */
+void output_clear_input(struct output_t *output)
+{
+    terminal_clear_input(&output->terminal);
+}
+
+/**
+ * Shows every message still queued and stops the output thread
+ *
+ * @param output output stage
+ */
+void output_stop(struct output_t *output)
+{
+    __atomic_store_n(&output->stopping, 1, __ATOMIC_RELEASE);
+    wake_output(output);
+    pthread_join(output->thread, NULL);
+    for (size_t i = 0; i < output->ring_count; ++i) {
+        spsc_ring_destroy(&output->rings[i].ring);
+    }
+    free(output->rings);
+    close(output->wakeup_fd);
+    terminal_destroy(&output->terminal);
+}
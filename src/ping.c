@@ -0,0 +1,124 @@
+#include "ping.h"
+#include "frame.h"
+#include "histogram.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+/** set by the SIGINT handler to stop sending pings */
+static volatile sig_atomic_t interrupted = 0;
+
+/**
+ * Handler of SIGINT, that stops the ping mode after the ping in flight
+ *
+ * @param signum signal number
+ */
+static void handle_interrupt(int signum)
+{
+    (void) signum;
+    interrupted = 1;
+}
+
+/**
+ * Returns the current time of CLOCK_MONOTONIC in nanoseconds
+ *
+ * @return nanoseconds
+ */
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Prints the round trip times recorded in the histogram in microseconds
+ *
+ * @param rtt histogram of the round trip times in nanoseconds
+ * @param sent number of pings sent
+ */
+static void print_rtt(struct histogram_t *rtt, long sent)
+{
+    printf("%ld pings sent, %llu answered\n", sent,
+            (unsigned long long) rtt->total);
+    if (rtt->total == 0) {
+        return;
+    }
+    printf("rtt min/p50/p99/p99.9/max = %.1f/%.1f/%.1f/%.1f/%.1f us\n",
+            rtt->min / 1000.0, histogram_percentile(rtt, 50) / 1000.0,
+            histogram_percentile(rtt, 99) / 1000.0,
+            histogram_percentile(rtt, 99.9) / 1000.0, rtt->max / 1000.0);
+}
+
+/**
+ * Sends options->count pings to the server through the connected client, one
+ * every options->interval microseconds, timestamping each of them with
+ * CLOCK_MONOTONIC. The round trip times of the echoes are recorded in a
+ * histogram, whose percentiles are printed when all the pings were answered
+ * or the program is interrupted.
+ *
+ * @param client client connected to the server
+ * @param options arguments given in the command line
+ */
+void run_ping(struct client_t *client, struct options_t *options)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &action, NULL);
+
+    struct histogram_t *rtt = (struct histogram_t *) malloc(sizeof(*rtt));
+    if (rtt == NULL) {
+        perror("run_ping-malloc()");
+        exit(EXIT_FAILURE);
+    }
+    histogram_init(rtt);
+    struct timespec interval;
+    interval.tv_sec = options->interval / 1000000;
+    interval.tv_nsec = (options->interval % 1000000) * 1000;
+
+    long sent;
+    for (sent = 0; sent < options->count && !interrupted; ) {
+        // the payload is the sequence number and the time it was sent, the
+        // server echoes it back untouched
+        uint64_t payload[2];
+        payload[0] = sent;
+        payload[1] = monotonic_ns();
+        struct message_t *ping = message_create(FRAME_TYPE_PING,
+                (const char *) payload, sizeof(payload));
+        if (ping == NULL) {
+            fprintf(stderr, "run_ping: out of memory\n");
+            break;
+        }
+        int status = send_message_frame(client, ping);
+        message_unref(ping);
+        if (status == -1) {
+            perror("run_ping-send()");
+            break;
+        }
+        sent++;
+
+        // chat messages relayed meanwhile are skipped
+        struct frame_header_t h;
+        while ((status = receive_message_frame(client, &h)) > 0) {
+            if (h.type == FRAME_TYPE_PONG && h.length == sizeof(payload) &&
+                    memcmp(client->recv_buffer, payload, sizeof(payload)) ==
+                    0) {
+                histogram_record(rtt, monotonic_ns() - payload[1]);
+                break;
+            }
+        }
+        if (status <= 0) {
+            if (status == -1) {
+                perror("run_ping-recv()");
+            }
+            break;
+        }
+        if (options->interval > 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    print_rtt(rtt, sent);
+    free(rtt);
+}
@@ -0,0 +1,95 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Returns the size class of the buffers that hold size bytes
+ *
+ * @param size number of bytes, at most POOL_MAX_SIZE
+ * @return index of the size class
+ */
+static unsigned size_class(size_t size)
+{
+    if (size <= POOL_MIN_SIZE) {
+        return 0;
+    }
+    // index of the highest bit of size - 1 gives the next power of 2
+    return (sizeof(unsigned long) * 8 - __builtin_clzl(size - 1)) -
+        POOL_MIN_SHIFT;
+}
+
+/**
+ * Initializes an empty pool
+ *
+ * @param pool pool
+ */
+void pool_init(struct buffer_pool_t *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Takes a buffer of at least size bytes from the pool
+ *
+ * @param pool pool
+ * @param size number of bytes needed, at most POOL_MAX_SIZE
+ * @param capacity set to the actual size of the buffer
+ * @return the buffer, or NULL if size is too big or there's no memory
+ */
+void *pool_alloc(struct buffer_pool_t *pool, size_t size, size_t *capacity)
+{
+    if (size > POOL_MAX_SIZE) {
+        return NULL;
+    }
+    unsigned index = size_class(size);
+    *capacity = POOL_MIN_SIZE << index;
+    void *buffer = pool->free[index];
+    if (buffer == NULL) {
+        return malloc(*capacity);
+    }
+    memcpy(&pool->free[index], buffer, sizeof(void *));
+    pool->free_count[index]--;
+    return buffer;
+}
+
+/**
+ * Gives a buffer back to the pool
+ *
+ * @param pool pool the buffer was taken from
+ * @param buffer buffer, NULL is ignored
+ * @param capacity size of the buffer returned by pool_alloc
+ */
+void pool_free(struct buffer_pool_t *pool, void *buffer, size_t capacity)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    unsigned index = size_class(capacity);
+    assert(capacity == POOL_MIN_SIZE << index);
+    if (pool->free_count[index] == POOL_MAX_FREE) {
+        free(buffer);
+        return;
+    }
+    memcpy(buffer, &pool->free[index], sizeof(void *));
+    pool->free[index] = buffer;
+    pool->free_count[index]++;
+}
+
+/**
+ * Frees every buffer kept in the pool
+ *
+ * @param pool pool
+ */
+void pool_destroy(struct buffer_pool_t *pool)
+{
+    for (unsigned i = 0; i < POOL_CLASSES; ++i) {
+        while (pool->free[i] != NULL) {
+            void *buffer = pool->free[i];
+            memcpy(&pool->free[i], buffer, sizeof(void *));
+            free(buffer);
+        }
+    }
+    pool_init(pool);
+}
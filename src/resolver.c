@@ -0,0 +1,482 @@
+#include "resolver.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Answer of the cache for a hostname, port and hints
+ */
+struct cache_entry_t {
+    char *key;          /**< hostname, port and hints */
+    int status;         /**< 0 or the EAI_* error cached */
+    struct addrinfo *result;    /**< answer when status is 0 */
+    time_t expires;     /**< monotonic second the entry expires at */
+    struct cache_entry_t *next; /**< next entry of the bucket */
+};
+
+/** guards the cache */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** buckets of the cache */
+static struct cache_entry_t *cache[RESOLVER_BUCKETS];
+
+/** number of entries of the cache */
+static size_t cache_count;
+
+/** guards the queue of the resolver thread */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** signaled when a query is queued */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/** first and last queries waiting to be resolved */
+static struct resolver_query_t *queue_head, *queue_tail;
+
+/** whether the resolver thread is running */
+static int resolver_started;
+
+/**
+ * Returns the current monotonic time in seconds
+ *
+ * @return seconds
+ */
+static time_t now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Builds the key of the cache for a hostname, port and hints
+ *
+ * @param hostname hostname or IP address, may be NULL
+ * @param port port number or service name, may be NULL
+ * @param hints hints given to getaddrinfo
+ * @return key allocated with malloc, or NULL if there's no memory
+ */
+static char *make_key(const char *hostname, const char *port,
+        const struct addrinfo *hints)
+{
+    char *key;
+    if (asprintf(&key, "%s|%s|%d|%d|%d|%d", hostname ? hostname : "",
+                port ? port : "", hints->ai_family, hints->ai_socktype,
+                hints->ai_protocol, hints->ai_flags) == -1) {
+        return NULL;
+    }
+    return key;
+}
+
+/**
+ * Returns the bucket of the cache for the key (FNV-1a hash)
+ *
+ * @param key key
+ * @return index of the bucket
+ */
+static size_t bucket_of(const char *key)
+{
+    uint32_t hash = 2166136261u;
+    for (; *key != '\0'; ++key) {
+        hash = (hash ^ (unsigned char) *key) * 16777619u;
+    }
+    return hash % RESOLVER_BUCKETS;
+}
+
+/**
+ * Frees an addrinfo list returned by the resolver
+ *
+ * @param res addrinfo list, may be NULL
+ */
+void resolver_free(struct addrinfo *res)
+{
+    while (res != NULL) {
+        struct addrinfo *next = res->ai_next;
+        free(res->ai_canonname);
+        free(res);
+        res = next;
+    }
+}
+
+/**
+ * Copies an addrinfo list. Every element is allocated along with its address,
+ * so the copy doesn't depend on the allocator used by getaddrinfo.
+ *
+ * @param list addrinfo list
+ * @param copy resulting copy, to be freed with resolver_free
+ * @return 0 on success, EAI_MEMORY if there's no memory
+ */
+static int copy_addrinfo(const struct addrinfo *list, struct addrinfo **copy)
+{
+    struct addrinfo **last = copy;
+    *copy = NULL;
+    for (; list != NULL; list = list->ai_next) {
+        struct addrinfo *ai = (struct addrinfo *) malloc(sizeof(*ai) +
+                list->ai_addrlen);
+        if (ai == NULL) {
+            resolver_free(*copy);
+            *copy = NULL;
+            return EAI_MEMORY;
+        }
+        *ai = *list;
+        ai->ai_addr = (struct sockaddr *) (ai + 1);
+        memcpy(ai->ai_addr, list->ai_addr, list->ai_addrlen);
+        ai->ai_canonname = list->ai_canonname ? strdup(list->ai_canonname) :
+            NULL;
+        ai->ai_next = NULL;
+        *last = ai;
+        last = &ai->ai_next;
+    }
+    return 0;
+}
+
+/**
+ * Returns whether the hostname is a unix socket endpoint, unix:/path or
+ * unix:@name, or a shared memory endpoint shm:NAME, that is reached through
+ * a unix socket too
+ *
+ * @param hostname hostname, may be NULL
+ * @return 1 if it is, 0 otherwise
+ */
+int resolver_is_unix(const char *hostname)
+{
+    return resolver_is_shm(hostname) || (hostname != NULL &&
+            strncmp(hostname, RESOLVER_UNIX_PREFIX,
+                strlen(RESOLVER_UNIX_PREFIX)) == 0);
+}
+
+/**
+ * Returns whether the hostname is a shared memory endpoint, shm:NAME
+ *
+ * @param hostname hostname, may be NULL
+ * @return 1 if it is, 0 otherwise
+ */
+int resolver_is_shm(const char *hostname)
+{
+    return hostname != NULL && strncmp(hostname, RESOLVER_SHM_PREFIX,
+            strlen(RESOLVER_SHM_PREFIX)) == 0;
+}
+
+/**
+ * Builds the address of a unix socket endpoint. A name starting with
+ * RESOLVER_ABSTRACT_PREFIX is in the abstract namespace: its address starts
+ * with a null byte and isn't null terminated. shm:NAME is the abstract name
+ * RESOLVER_SHM_SOCKET followed by NAME.
+ *
+ * @param hostname unix:/path, unix:@name or shm:NAME
+ * @param hints hints given to getaddrinfo, only the flags are kept
+ * @param res resulting addrinfo, to be freed with resolver_free
+ * @return 0 on success, EAI_NONAME if the path is empty or too long,
+ * EAI_MEMORY if there's no memory
+ */
+static int resolve_unix(const char *hostname, const struct addrinfo *hints,
+        struct addrinfo **res)
+{
+    struct sockaddr_un *addr;
+    char name[sizeof(addr->sun_path) + 1];
+    const char *path = hostname + strlen(RESOLVER_UNIX_PREFIX);
+    if (resolver_is_shm(hostname)) {
+        const char *shm_name = hostname + strlen(RESOLVER_SHM_PREFIX);
+        if (shm_name[0] == '\0') {
+            return EAI_NONAME;
+        }
+        snprintf(name, sizeof(name), "%s%s", RESOLVER_SHM_SOCKET, shm_name);
+        path = name;
+    }
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(addr->sun_path)) {
+        return EAI_NONAME;
+    }
+    struct addrinfo *ai = (struct addrinfo *) calloc(1, sizeof(*ai) +
+            sizeof(*addr));
+    if (ai == NULL) {
+        return EAI_MEMORY;
+    }
+    addr = (struct sockaddr_un *) (ai + 1);
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, length);
+    ai->ai_addrlen = offsetof(struct sockaddr_un, sun_path) + length;
+    if (path[0] == RESOLVER_ABSTRACT_PREFIX) {
+        addr->sun_path[0] = '\0';
+    } else {
+        ai->ai_addrlen++;
+    }
+    ai->ai_flags = hints->ai_flags;
+    ai->ai_family = AF_UNIX;
+    ai->ai_socktype = SOCK_STREAM;
+    ai->ai_addr = (struct sockaddr *) addr;
+    *res = ai;
+    return 0;
+}
+
+/**
+ * Frees an entry of the cache
+ *
+ * @param entry entry
+ */
+static void free_entry(struct cache_entry_t *entry)
+{
+    resolver_free(entry->result);
+    free(entry->key);
+    free(entry);
+}
+
+/**
+ * Removes the expired entries of the cache, or all of them if there are still
+ * too many. Called with cache_lock held.
+ *
+ * @param now current monotonic second
+ */
+static void evict_entries(time_t now)
+{
+    int all = 0;
+    for (int pass = 0; pass < 2 && cache_count > RESOLVER_MAX_ENTRIES;
+            ++pass) {
+        for (size_t i = 0; i < RESOLVER_BUCKETS; ++i) {
+            struct cache_entry_t **link = &cache[i];
+            while (*link != NULL) {
+                struct cache_entry_t *entry = *link;
+                if (all || entry->expires <= now) {
+                    *link = entry->next;
+                    free_entry(entry);
+                    cache_count--;
+                } else {
+                    link = &entry->next;
+                }
+            }
+        }
+        all = 1;
+    }
+}
+
+/**
+ * Looks the key up in the cache
+ *
+ * @param key key
+ * @param res copy of the answer cached, when there's one
+ * @param status status cached, when there's one
+ * @return 1 if the cache had an entry that hasn't expired, 0 otherwise
+ */
+static int cache_lookup(const char *key, struct addrinfo **res, int *status)
+{
+    int found = 0;
+    time_t now = now_seconds();
+    pthread_mutex_lock(&cache_lock);
+    for (struct cache_entry_t *entry = cache[bucket_of(key)]; entry != NULL;
+            entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            if (entry->expires > now) {
+                *status = entry->status == 0 ?
+                    copy_addrinfo(entry->result, res) : entry->status;
+                found = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+/**
+ * Stores an answer in the cache, replacing the previous one for the key.
+ * Failures are cached for a shorter time, and only those telling that the
+ * name doesn't exist: transient ones are left for the next lookup to retry.
+ *
+ * @param key key, owned by the cache from now on
+ * @param status 0 or the EAI_* error returned by getaddrinfo
+ * @param result copy of the answer, owned by the cache from now on
+ */
+static void cache_store(char *key, int status, struct addrinfo *result)
+{
+    time_t now = now_seconds();
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry_t **link = &cache[bucket_of(key)];
+    while (*link != NULL && strcmp((*link)->key, key) != 0) {
+        link = &(*link)->next;
+    }
+    struct cache_entry_t *entry = *link;
+    if (entry == NULL) {
+        entry = (struct cache_entry_t *) malloc(sizeof(*entry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            resolver_free(result);
+            free(key);
+            return;
+        }
+        entry->next = NULL;
+        *link = entry;
+        cache_count++;
+    } else {
+        resolver_free(entry->result);
+        free(entry->key);
+    }
+    entry->key = key;
+    entry->status = status;
+    entry->result = result;
+    entry->expires = now + (status == 0 ? RESOLVER_TTL :
+            RESOLVER_NEGATIVE_TTL);
+    if (cache_count > RESOLVER_MAX_ENTRIES) {
+        evict_entries(now);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Resolves the hostname and port with the given hints, taking the answer from
+ * the cache when it has one that hasn't expired and calling getaddrinfo in
+ * the calling thread otherwise. Safe to call from any thread.
+ *
+ * @param hostname hostname or IP address, NULL for a passive address
+ * @param port port number or service name
+ * @param hints hints given to getaddrinfo
+ * @param res resulting addrinfo list, to be freed with resolver_free
+ * @return 0 on success or the EAI_* error returned by getaddrinfo
+ */
+int resolver_resolve(const char *hostname, const char *port,
+        const struct addrinfo *hints, struct addrinfo **res)
+{
+    *res = NULL;
+    // nothing to look up, nor to cache
+    if (resolver_is_unix(hostname)) {
+        return resolve_unix(hostname, hints, res);
+    }
+    char *key = make_key(hostname, port, hints);
+    if (key == NULL) {
+        return EAI_MEMORY;
+    }
+    int status;
+    if (cache_lookup(key, res, &status)) {
+        free(key);
+        return status;
+    }
+
+    struct addrinfo *list;
+    status = getaddrinfo(hostname, port, hints, &list);
+    if (status == 0) {
+        struct addrinfo *cached;
+        status = copy_addrinfo(list, res);
+        if (status == 0 && copy_addrinfo(list, &cached) == 0) {
+            cache_store(key, 0, cached);
+            key = NULL;
+        }
+        freeaddrinfo(list);
+    } else if (status == EAI_NONAME || status == EAI_NODATA ||
+            status == EAI_SERVICE) {
+        cache_store(key, status, NULL);
+        key = NULL;
+    }
+    free(key);
+    return status;
+}
+
+/**
+ * Body of the resolver thread: resolves the queued queries one after the
+ * other, so queries for the same name queued while the first one was being
+ * resolved are answered by the cache.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *run_resolver(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        struct resolver_query_t *query = queue_head;
+        queue_head = query->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        // the query may be freed as soon as done is set, so keep the fd
+        int notify_fd = query->notify_fd;
+        query->status = resolver_resolve(query->hostname, query->port,
+                &query->hints, &query->result);
+        __atomic_store_n(&query->done, 1, __ATOMIC_RELEASE);
+        if (notify_fd != -1) {
+            uint64_t one = 1;
+            if (write(notify_fd, &one, sizeof(one)) == -1) {
+                perror("run_resolver-write()");
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Submits a query without blocking. When the cache has an answer the query is
+ * done when this function returns; otherwise it's queued for the resolver
+ * thread, started on the first call, and notify_fd is written when it's done.
+ * The strings of the query must stay valid until it's done, and notify_fd
+ * until it's written.
+ *
+ * @param query query with hostname, port, hints and notify_fd set
+ * @return 1 if the query is already done, 0 if it was queued, -1 if the
+ * resolver thread couldn't be started
+ */
+int resolver_submit(struct resolver_query_t *query)
+{
+    query->result = NULL;
+    query->done = 0;
+    query->next = NULL;
+    if (resolver_is_unix(query->hostname)) {
+        query->status = resolve_unix(query->hostname, &query->hints,
+                &query->result);
+        query->done = 1;
+        return 1;
+    }
+    char *key = make_key(query->hostname, query->port, &query->hints);
+    if (key != NULL && cache_lookup(key, &query->result, &query->status)) {
+        free(key);
+        query->done = 1;
+        return 1;
+    }
+    free(key);
+
+    pthread_mutex_lock(&queue_lock);
+    if (!resolver_started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int error = pthread_create(&thread, &attr, run_resolver, NULL);
+        pthread_attr_destroy(&attr);
+        if (error != 0) {
+            pthread_mutex_unlock(&queue_lock);
+            fprintf(stderr, "resolver_submit-pthread_create(): %s\n",
+                    strerror(error));
+            return -1;
+        }
+        resolver_started = 1;
+    }
+    if (queue_tail == NULL) {
+        queue_head = query;
+    } else {
+        queue_tail->next = query;
+    }
+    queue_tail = query;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+/**
+ * Returns whether the resolver thread is done with a submitted query
+ *
+ * @param query query submitted
+ * @return 1 if status and result are valid, 0 otherwise
+ */
+int resolver_done(struct resolver_query_t *query)
+{
+    return __atomic_load_n(&query->done, __ATOMIC_ACQUIRE);
+}
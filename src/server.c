@@ -1,36 +1,2111 @@
 #include "server.h"
 
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+
+/** serializes the writes of all the shards to the stream output */
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** id of the last message received in chunks, shared by all the shards */
+static uint64_t last_chunked = 0;
+
+/**
+ * Raises the soft limit of open file descriptors up to the hard limit, as
+ * every connection held by the server consumes a file descriptor.
+ */
+static void raise_file_limit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("raise_file_limit-getrlimit()");
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            perror("raise_file_limit-setrlimit()");
+        }
+    }
+}
+
 /**
- * Starts the server, listening for connections until one is
- * accepted. The server structure passed is initialized and contains all the
- * relevant information.
+ * Sets the O_NONBLOCK flag on the given file descriptor.
+ * Fails and exits the program if the flag could not be set.
  *
- * @param server server_t instance that holds all the information to maintain
- * the communication and transmission of messages to/from the client
+ * @param fd file descriptor
+ */
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("set_nonblocking-fcntl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Registers fd in the epoll instance of the server for the given events.
+ * Fails and exits the program if it could not be registered.
+ *
+ * @param server server holding the epoll instance
+ * @param fd file descriptor to watch
+ * @param events epoll events to watch for
+ */
+static void watch_fd(struct server_t *server, int fd, uint32_t events)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("watch_fd-epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Grows the connection table so that it has a slot for the socket fd
+ *
+ * @param server server holding the connection table
+ * @param fd socket that is going to be stored in the table
+ * @return 0 on success, -1 if the table could not be grown
+ */
+static int reserve_connection_slot(struct server_t *server, int fd)
+{
+    size_t capacity = server->connections_capacity;
+    if ((size_t) fd < capacity) {
+        return 0;
+    }
+    while ((size_t) fd >= capacity) {
+        capacity *= 2;
+    }
+    struct connection_t **connections = (struct connection_t **)
+        realloc(server->connections, capacity * sizeof(*connections));
+    if (connections == NULL) {
+        perror("reserve_connection_slot-realloc()");
+        return -1;
+    }
+    memset(connections + server->connections_capacity, 0, (capacity -
+                server->connections_capacity) * sizeof(*connections));
+    server->connections = connections;
+    server->connections_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Returns the current monotonic time in seconds
+ *
+ * @return seconds
+ */
+static time_t monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Ends the message a client was sending in chunks when it went away with an
+ * empty last chunk, so that its channel relays the messages it held back. It
+ * is broadcast by flush_scheduled_connections, never while relaying another
+ * message.
+ *
+ * @param server shard the client was connected to
+ * @param chunked id of the message
+ * @param channel channel of the message
+ */
+static void end_chunked(struct server_t *server, uint64_t chunked,
+        uint16_t channel)
+{
+    struct message_t *last = message_create(FRAME_TYPE_DATA, "", 0);
+    if (last == NULL) {
+        fprintf(stderr, "end_chunked: out of memory\n");
+        return;
+    }
+    message_set_channel(last, channel);
+    last->chunked = chunked;
+    last->continued = 1;
+    if (send_queue_push(&server->ended, last) == -1) {
+        fprintf(stderr, "end_chunked: out of memory\n");
+    }
+    message_unref(last);
+}
+
+/**
+ * Frees the sessions of the shard whose client went away more than
+ * SESSION_TIMEOUT seconds ago
+ *
+ * @param server shard owning the sessions
+ */
+static void expire_sessions(struct server_t *server)
+{
+    time_t now = monotonic_seconds();
+    size_t i = 0;
+    while (i < server->sessions_count) {
+        struct session_t *session = server->sessions[i];
+        if (session->fd == -1 && now - session->detached_at >
+                SESSION_TIMEOUT) {
+            uint64_t chunked = session->chunked;
+            uint16_t channel = session->chunked_channel;
+            session_clear(session);
+            free(session);
+            server->sessions[i] = server->sessions[--server->sessions_count];
+            // the sessions may change meanwhile, i is checked again
+            if (chunked != 0) {
+                end_chunked(server, chunked, channel);
+            }
+        } else {
+            ++i;
+        }
+    }
+}
+
+/**
+ * Records the messages waiting in the backlogs of the channels of a session
+ * whose connection goes away, so that they are replayed after the ones
+ * queued, and forgets what was queued for it
+ *
+ * @param session session losing its connection
+ */
+static void record_backlogs(struct session_t *session)
+{
+    struct channel_set_t *channels = &session->channels;
+    for (size_t i = 0; i < channels->count; ++i) {
+        struct channel_t *channel = &channels->channels[i];
+        while (channel->backlog.count > 0) {
+            session_record(session, send_queue_front(&channel->backlog));
+            send_queue_pop(&channel->backlog);
+        }
+        channel->queued = 0;
+    }
+}
+
+/**
+ * Closes the connection on the socket fd and frees its slot in the table
+ *
+ * @param server server holding the connection table
+ * @param fd socket of the connection
+ */
+void close_connection(struct server_t *server, int fd)
+{
+#ifdef USE_IO_URING
+    // operations in flight still refer to the socket, the connection is
+    // released once they complete
+    if (uring_close_connection(server, fd) == 0) {
+        return;
+    }
+#endif
+    // the session outlives the connection, the client may come back for it
+    struct session_t *session = server->connections[fd]->session;
+    if (session != NULL) {
+        session->fd = -1;
+        session->detached_at = monotonic_seconds();
+        record_backlogs(session);
+    }
+    uint64_t chunked = server->connections[fd]->chunked;
+    uint16_t channel = server->connections[fd]->chunked_channel;
+    metrics_gauge(METRIC_CONNECTIONS, -1);
+    metrics_gauge(METRIC_SEND_QUEUE_DEPTH,
+            -(int64_t) server->connections[fd]->send_queue.count);
+    // closing the socket also removes it from the epoll instance
+    close(fd);
+    shm_unmap(server->connections[fd]->shm);
+    frame_reader_free(&server->connections[fd]->reader);
+    send_queue_clear(&server->connections[fd]->send_queue);
+    channel_set_clear(&server->connections[fd]->channels);
+    free(server->connections[fd]);
+    server->connections[fd] = NULL;
+    server->connections_count--;
+    if (session != NULL) {
+        expire_sessions(server);
+    } else if (chunked != 0) {
+        end_chunked(server, chunked, channel);
+    }
+}
+
+/**
+ * Adds the connection accepted on the socket fd to the connection table
+ *
+ * @param server server holding the connection table
+ * @param fd socket of the accepted connection
+ * @param addr address of the client
+ * @return 0 on success, -1 if there's no memory, in which case the socket is
+ * closed
+ */
+int add_connection(struct server_t *server, int fd,
+        struct sockaddr_storage *addr)
+{
+    struct connection_t *connection = NULL;
+    if (reserve_connection_slot(server, fd) == 0) {
+        connection = (struct connection_t *) calloc(1, sizeof(*connection));
+    }
+    if (connection == NULL) {
+        fprintf(stderr, "add_connection: out of memory\n");
+        close(fd);
+        return -1;
+    }
+    connection->socket_connected = fd;
+    connection->addr = *addr;
+    if (server->shm) {
+        // the client maps the region through the file descriptor, which
+        // isn't needed anymore once passed
+        int shm_fd;
+        connection->shm = shm_create(&shm_fd);
+        if (connection->shm == NULL) {
+            free(connection);
+            close(fd);
+            return -1;
+        }
+        int passed = shm_send_fd(fd, shm_fd);
+        close(shm_fd);
+        if (passed == -1) {
+            shm_unmap(connection->shm);
+            free(connection);
+            close(fd);
+            return -1;
+        }
+    }
+    set_tcp_nodelay(fd);
+    frame_reader_init(&connection->reader, &server->pool);
+    send_queue_init(&connection->send_queue);
+    connection->chunked = 0;
+    connection->chunked_channel = CHANNEL_DEFAULT;
+    channel_set_init(&connection->channels);
+    server->connections[fd] = connection;
+    server->connections_count++;
+    metrics_gauge(METRIC_CONNECTIONS, 1);
+    return 0;
+}
+
+/**
+ * Accepts a connection pending in the queue of the listening socket and
+ * closes it right away, when the process ran out of file descriptors. The
+ * spare descriptor is closed to make room for it and opened again, so that
+ * the client is turned away instead of waiting in the queue.
+ *
+ * @param server server out of file descriptors
+ * @return 0 if a connection was shed, -1 if there was none or no descriptor
+ * could be freed
+ */
+int shed_connection(struct server_t *server)
+{
+    // another shard may have taken the descriptor freed last time
+    if (server->spare_fd == -1) {
+        server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (server->spare_fd == -1) {
+            return -1;
+        }
+    }
+    close(server->spare_fd);
+    int fd = accept4(server->socket_listening, NULL, NULL, SOCK_CLOEXEC);
+    if (fd != -1) {
+        close(fd);
+    }
+    server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd == -1 ? -1 : 0;
+}
+
+/**
+ * Accepts every connection pending in the queue of the listening socket. As
+ * the listening socket is watched in edge-triggered mode, the queue has to be
+ * drained completely on every wakeup.
+ *
+ * @param server server with pending connections
+ */
+static void accept_pending_connections(struct server_t *server)
+{
+    for (;;) {
+        struct sockaddr_storage addr;
+        int fd = accept_connection(server->socket_listening, &addr);
+        if (fd == -1) {
+            // EAGAIN means that the queue is drained, any other error only
+            // affects the connection that couldn't be accepted
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            // out of descriptors, the connections pending are shed, as the
+            // edge that would accept them later may never come
+            if ((errno == EMFILE || errno == ENFILE) &&
+                    shed_connection(server) == -1) {
+                return;
+            }
+            continue;
+        }
+        if (add_connection(server, fd, &addr) == -1) {
+            continue;
+        }
+        // EPOLLOUT in edge-triggered mode only wakes us up when the socket
+        // becomes writable again after a short write
+        watch_fd(server, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+}
+
+static int send_to_connection(struct server_t *server, int fd,
+        struct message_t *message);
+
+/**
+ * Opens the file where the streams received by all the shards are written.
+ * Exits the program on failure.
+ *
+ * @param path file to write the streams to, NULL to discard them
+ * @return the file descriptor opened
+ */
+static int open_stream_output(const char *path)
+{
+    // O_APPEND can't be used, splice refuses to write to such files
+    int fd = path == NULL ? open("/dev/null", O_WRONLY | O_CLOEXEC) :
+        open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open_stream_output-open()");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/**
+ * Creates the pipe used by the shard to splice the streams into the stream
+ * output. Exits the program on failure.
+ *
+ * @param server shard being started
+ */
+static void open_stream_pipe(struct server_t *server)
+{
+    if (pipe2(server->stream_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("open_stream_pipe-pipe2()");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(server->stream_pipe[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+}
+
+/**
+ * Accounts for length bytes of the stream chunk being received on the
+ * connection
+ *
+ * @param connection connection receiving a stream
+ * @param length number of bytes of the chunk received
+ */
+static void advance_stream(struct connection_t *connection, size_t length)
+{
+    connection->stream_remaining -= length;
+    connection->stream_received += length;
+}
+
+/**
+ * Writes bytes of the stream chunk being received on the connection, that
+ * were already read into user space, to the stream output of the server
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param bytes bytes received
+ * @param length number of bytes received
+ * @return number of bytes that belonged to the chunk, -1 if the connection
+ * was closed because the output failed
+ */
+ssize_t consume_stream(struct server_t *server, int fd, const char *bytes,
+        size_t length)
+{
+    struct connection_t *connection = server->connections[fd];
+    if (length > connection->stream_remaining) {
+        length = connection->stream_remaining;
+    }
+    pthread_mutex_lock(&stream_lock);
+    int status = write_all(server->stream_fd, bytes, length);
+    pthread_mutex_unlock(&stream_lock);
+    if (status == -1) {
+        perror("consume_stream-write()");
+        close_connection(server, fd);
+        return -1;
+    }
+    advance_stream(connection, length);
+    return length;
+}
+
+/**
+ * Moves the stream chunk being received on the connection from the socket to
+ * the stream output of the server through the pipe of the server, without
+ * copying it to user space. The frame reader of the connection must be empty.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return number of bytes moved, 0 if the peer closed the connection, -1 on
+ * error (errno is EAGAIN when there is nothing else to read)
+ */
+static ssize_t splice_stream(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    ssize_t length = splice(fd, NULL, server->stream_pipe[1], NULL,
+            connection->stream_remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (length <= 0) {
+        return length;
+    }
+    pthread_mutex_lock(&stream_lock);
+    int status = drain_pipe(server->stream_pipe[0], server->stream_fd, length);
+    pthread_mutex_unlock(&stream_lock);
+    if (status == -1) {
+        perror("splice_stream-splice()");
+        // whatever the output didn't take would end up in the next stream
+        char buffer[4096];
+        while (read(server->stream_pipe[0], buffer, sizeof(buffer)) > 0) {
+        }
+        errno = EIO;
+        return -1;
+    }
+    advance_stream(connection, length);
+    return length;
+}
+
+/**
+ * Creates a new session owned by the shard. The id is random, so that it
+ * can't be guessed, and its low bits hold the index of the shard.
+ *
+ * @param server shard owning the session
+ * @return the session, or NULL if it couldn't be created
+ */
+static struct session_t *create_session(struct server_t *server)
+{
+    if (server->sessions_count == server->sessions_capacity) {
+        size_t capacity = server->sessions_capacity == 0 ?
+            INITIAL_CONNECTIONS_CAPACITY : server->sessions_capacity * 2;
+        struct session_t **sessions = (struct session_t **) realloc(
+                server->sessions, capacity * sizeof(*sessions));
+        if (sessions == NULL) {
+            perror("create_session-realloc()");
+            return NULL;
+        }
+        server->sessions = sessions;
+        server->sessions_capacity = capacity;
+    }
+    uint64_t random;
+    if (getrandom(&random, sizeof(random), 0) != sizeof(random)) {
+        perror("create_session-getrandom()");
+        return NULL;
+    }
+    struct session_t *session = (struct session_t *) malloc(sizeof(*session));
+    if (session == NULL) {
+        perror("create_session-malloc()");
+        return NULL;
+    }
+    session_init(session, ((random | 1) << 16) | server->shard_id);
+    server->sessions[server->sessions_count++] = session;
+    return session;
+}
+
+/**
+ * Returns the session of the shard with the given id
+ *
+ * @param server shard owning the sessions
+ * @param id id of the session
+ * @return the session, or NULL if the shard has none with that id
+ */
+static struct session_t *find_session(struct server_t *server, uint64_t id)
+{
+    for (size_t i = 0; i < server->sessions_count; ++i) {
+        if (server->sessions[i]->id == id) {
+            return server->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Attaches the connection to the session with the given id, or to a new one
+ * if the shard doesn't have it, answers the HELLO of the client and queues
+ * the frames the client missed while it was away
+ *
+ * @param server shard owning the session
+ * @param fd socket of the connection
+ * @param id id of the session, 0 for a new one
+ * @param received number of frames of the session received by the client
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int attach_session(struct server_t *server, int fd, uint64_t id,
+        uint64_t received)
+{
+    struct connection_t *connection = server->connections[fd];
+    expire_sessions(server);
+    struct session_t *session = id == 0 ? NULL : find_session(server, id);
+    uint64_t lost = 0;
+    if (session == NULL) {
+        session = create_session(server);
+        if (session == NULL) {
+            close_connection(server, fd);
+            return -1;
+        }
+    } else {
+        if (session->fd != -1) {
+            // the client came back before its old connection was found dead
+            record_backlogs(session);
+            server->connections[session->fd]->session = NULL;
+            close_connection(server, session->fd);
+        }
+        lost = session_resume(session, received);
+        print_progress("session resumed: %zu messages replayed, %llu lost\n",
+                session->unacked.count, (unsigned long long) lost);
+    }
+    session->fd = fd;
+    connection->session = session;
+    struct message_t *hello = session_hello(session, lost);
+    if (hello == NULL) {
+        fprintf(stderr, "attach_session: out of memory\n");
+        close_connection(server, fd);
+        return -1;
+    }
+    int closed = send_to_connection(server, fd, hello) == -1;
+    message_unref(hello);
+    for (size_t i = 0; !closed && i < session->unacked.count; ++i) {
+        closed = send_to_connection(server, fd,
+                send_queue_at(&session->unacked, i)) == -1;
+    }
+    return closed ? -1 : 0;
+}
+
+/**
+ * Removes the connection from the shard and posts it to the shard set in
+ * handoff_to, that owns the session the client wants to resume. It's called
+ * once no operation of the shard refers to the connection anymore.
+ *
+ * @param server shard holding the connection
+ * @param fd socket of the connection
+ */
+void release_handoff(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct server_t *owner = connection->handoff_to;
+    // the buffer belongs to the pool of this shard, and the client sends
+    // nothing else until its HELLO is answered
+    frame_reader_free(&connection->reader);
+    server->connections[fd] = NULL;
+    server->connections_count--;
+    pthread_mutex_lock(&owner->inbox_lock);
+    connection->next_handoff = owner->handoffs;
+    owner->handoffs = connection;
+    pthread_mutex_unlock(&owner->inbox_lock);
+    uint64_t one = 1;
+    if (write(owner->inbox_fd, &one, sizeof(one)) == -1) {
+        perror("release_handoff-write()");
+    }
+}
+
+/**
+ * Hands the connection over to the shard owning the session it resumes, as a
+ * session is only ever touched by the thread of its shard. Whatever is left
+ * in the send queue of the connection goes along with it.
+ *
+ * @param server shard holding the connection
+ * @param fd socket of the connection
+ * @param owner shard owning the session
+ */
+static void handoff_connection(struct server_t *server, int fd,
+        struct server_t *owner)
+{
+    server->connections[fd]->handoff_to = owner;
+#ifdef USE_IO_URING
+    if (uring_handoff_connection(server, fd) == 0) {
+        return;
+    }
+#else
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    release_handoff(server, fd);
+}
+
+/**
+ * Handles the HELLO of a client opening or resuming a session
+ *
+ * @param server shard holding the connection
+ * @param fd socket of the connection
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @return 0 on success, -1 if the connection was closed or handed over to
+ * another shard
+ */
+static int handle_hello(struct server_t *server, int fd, const char *payload,
+        uint32_t length)
+{
+    struct connection_t *connection = server->connections[fd];
+    uint64_t id, received, lost;
+    if (connection->session != NULL || session_decode_hello(payload, length,
+                &id, &received, &lost) == -1) {
+        fprintf(stderr, "handle_hello: malformed hello\n");
+        close_connection(server, fd);
+        return -1;
+    }
+    size_t owner = id & SESSION_SHARD_MASK;
+    if (id != 0 && owner < server->shard_count &&
+            owner != server->shard_id) {
+        connection->hello_id = id;
+        connection->hello_received = received;
+        handoff_connection(server, fd, server->shards[owner]);
+        return -1;
+    }
+    return attach_session(server, fd, id, received);
+}
+
+/**
+ * Adds a connection handed over by another shard to the shard, and attaches
+ * it to the session its client resumes
+ *
+ * @param server shard owning the session
+ * @param connection connection handed over
+ */
+static void adopt_connection(struct server_t *server,
+        struct connection_t *connection)
+{
+    int fd = connection->socket_connected;
+    if (reserve_connection_slot(server, fd) == -1) {
+        metrics_gauge(METRIC_CONNECTIONS, -1);
+        metrics_gauge(METRIC_SEND_QUEUE_DEPTH,
+                -(int64_t) connection->send_queue.count);
+        close(fd);
+        send_queue_clear(&connection->send_queue);
+        channel_set_clear(&connection->channels);
+        free(connection);
+        return;
+    }
+    frame_reader_init(&connection->reader, &server->pool);
+    connection->handoff_to = NULL;
+    connection->closing = 0;
+    connection->flush_scheduled = 0;
+    server->connections[fd] = connection;
+    server->connections_count++;
+#ifdef USE_IO_URING
+    uring_adopt_connection(server, fd);
+#else
+    watch_fd(server, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+#endif
+    if (attach_session(server, fd, connection->hello_id,
+                connection->hello_received) == 0 && connection->shm != NULL) {
+        // the previous shard left the ring as it was after the HELLO
+        process_shm(server, fd);
+    }
+}
+
+/**
+ * Returns the next message of the history replay of the connection: a batch
+ * of the messages logged, or the FRAME_TYPE_HISTORY frame ending it
+ *
+ * @param server server holding the connection
+ * @param connection connection replaying the history
+ * @return the message, or NULL if there's no memory
+ */
+static struct message_t *next_replay(struct server_t *server,
+        struct connection_t *connection)
+{
+    struct message_t *batch = server->history == NULL ? NULL :
+        history_read(server->history, &connection->history_next,
+                connection->history_end);
+    if (batch != NULL) {
+        connection->history_batch = batch;
+        return batch;
+    }
+    // without a log there's nothing to replay, and no next message
+    struct message_t *end = history_frame(server->history == NULL ? 0 :
+            connection->history_end);
+    connection->history_end = 0;
+    connection->history_batch = NULL;
+    return end;
+}
+
+/**
+ * Starts replaying to the client of the connection the messages logged since
+ * the sequence asked for by its FRAME_TYPE_HISTORY frame. The messages are
+ * queued a batch at a time, pointing into the mapping of the log, the next
+ * one being queued once the previous one was sent, so that a long history
+ * never sits in memory.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int handle_history(struct server_t *server, int fd,
+        const char *payload, uint32_t length)
+{
+    struct connection_t *connection = server->connections[fd];
+    uint64_t since;
+    if (history_decode(payload, length, &since) == -1) {
+        fprintf(stderr, "handle_history: malformed history request\n");
+        close_connection(server, fd);
+        return -1;
+    }
+    // a replay already going on carries on from there
+    if (connection->history_end != 0) {
+        return 0;
+    }
+    connection->history_next = since > 0 ? since : 1;
+    connection->history_end = server->history == NULL ? 0 :
+        history_next(server->history);
+    struct message_t *message = next_replay(server, connection);
+    if (message == NULL) {
+        connection->history_end = 0;
+        return 0;
+    }
+    int closed = send_to_connection(server, fd, message) == -1;
+    message_unref(message);
+    return closed ? -1 : 0;
+}
+
+/**
+ * Agrees on the compression with the client of the connection, answering the
+ * FRAME_TYPE_CODEC frame it offered the codecs with
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int handle_codec(struct server_t *server, int fd, const char *payload,
+        uint32_t length)
+{
+    struct connection_t *connection = server->connections[fd];
+    uint32_t codecs, dictionary_id;
+    if (compress_decode_codec(payload, length, &codecs, &dictionary_id) ==
+            -1) {
+        fprintf(stderr, "handle_codec: malformed codec frame\n");
+        close_connection(server, fd);
+        return -1;
+    }
+    connection->codec = compress_agree(codecs, dictionary_id);
+    struct message_t *answer = compress_codec_frame(connection->codec);
+    if (answer == NULL) {
+        return 0;
+    }
+    int closed = send_to_connection(server, fd, answer) == -1;
+    message_unref(answer);
+    return closed ? -1 : 0;
+}
+
+/**
+ * Returns the channels joined by the client of the connection, which its
+ * session keeps if it has one
+ *
+ * @param connection connection
+ * @return the channels
+ */
+static struct channel_set_t *channels_of(struct connection_t *connection)
+{
+    return connection->session != NULL ? &connection->session->channels :
+        &connection->channels;
+}
+
+/**
+ * Joins or leaves the channel of a FRAME_TYPE_JOIN or FRAME_TYPE_LEAVE frame
+ *
+ * @param connection connection that sent the frame
+ * @param h header of the frame
+ */
+static void handle_channel(struct connection_t *connection,
+        const struct frame_header_t *h)
+{
+    struct channel_set_t *channels = channels_of(connection);
+    if (h->type == FRAME_TYPE_LEAVE) {
+        channel_leave(channels, h->channel);
+    } else if (channel_join(channels, h->channel) == -1) {
+        fprintf(stderr, "handle_channel: too many channels joined\n");
+    }
+}
+
+/**
+ * Tags a chunk received from the client with the id of the message it is a
+ * chunk of, that the first chunk of the message gets. The messages sent in
+ * a single frame are tagged with 0.
+ *
+ * @param connection connection the chunk was received from
+ * @param message chunk received
+ */
+static void tag_chunk(struct connection_t *connection,
+        struct message_t *message)
+{
+    uint64_t *chunked = &connection->chunked;
+    uint16_t *channel = &connection->chunked_channel;
+    // a message sent in chunks goes on after the client resumes its session
+    if (connection->session != NULL) {
+        chunked = &connection->session->chunked;
+        channel = &connection->session->chunked_channel;
+    }
+    int more = message_has_more(message);
+    message->continued = *chunked != 0;
+    if (*chunked == 0 && more) {
+        *chunked = __atomic_add_fetch(&last_chunked, 1, __ATOMIC_RELAXED);
+    }
+    message->chunked = *chunked;
+    *channel = message_channel(message);
+    if (!more) {
+        *chunked = 0;
+    }
+}
+
+/**
+ * Handles every complete frame stored in the reader of the connection,
+ * showing each message received and relaying it to the rest of the chat room,
+ * echoing the pings back and writing the stream chunks to the stream output
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success, -1 if the connection was closed because a frame was
+ * malformed or the echo of a ping couldn't be sent, or if it was handed over
+ * to the shard owning the session it resumes
+ */
+int process_frames(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct frame_header_t h;
+    const char *payload;
+    int ret;
+    for (;;) {
+        if (connection->stream_remaining > 0) {
+            // the reader is left empty while a stream chunk is incomplete,
+            // so that the rest of it can bypass the reader
+            size_t length = frame_reader_take(&connection->reader, &payload,
+                    connection->stream_remaining);
+            if (length == 0) {
+                return 0;
+            }
+            if (consume_stream(server, fd, payload, length) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if ((ret = frame_reader_next(&connection->reader, &h, &payload)) != 1) {
+            break;
+        }
+        metrics_count(METRIC_MESSAGES_RECEIVED, 1);
+        if (h.type == FRAME_TYPE_STREAM) {
+            connection->stream_remaining = h.length;
+            if (h.length == 0) {
+                print_progress("stream of %llu bytes received\n",
+                        (unsigned long long) connection->stream_received);
+                connection->stream_received = 0;
+            }
+            continue;
+        }
+        const char *compressed = NULL;
+        uint32_t compressed_length = 0;
+        if (h.flags & FRAME_FLAG_COMPRESSED) {
+            compressed = payload;
+            compressed_length = h.length;
+            if (connection->codec == COMPRESS_CODEC_NONE ||
+                    compress_inflate(compressed, compressed_length, &payload,
+                        &h.length) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+        if (h.type == FRAME_TYPE_PING) {
+            // echoed only to the sender, and without showing it
+            struct message_t *pong = message_create(FRAME_TYPE_PONG, payload,
+                    h.length);
+            if (pong != NULL) {
+                int closed = send_to_connection(server, fd, pong) == -1;
+                message_unref(pong);
+                if (closed) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+        if (h.type == FRAME_TYPE_HELLO) {
+            if (handle_hello(server, fd, payload, h.length) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (h.type == FRAME_TYPE_HISTORY) {
+            if (handle_history(server, fd, payload, h.length) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (h.type == FRAME_TYPE_CODEC) {
+            if (handle_codec(server, fd, payload, h.length) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (h.type == FRAME_TYPE_JOIN || h.type == FRAME_TYPE_LEAVE) {
+            handle_channel(connection, &h);
+            continue;
+        }
+        if (h.type == FRAME_TYPE_ACK) {
+            uint64_t received;
+            if (connection->session != NULL && session_decode_ack(payload,
+                        h.length, &received) == 0) {
+                session_acked(connection->session, received);
+            }
+            continue;
+        }
+        if (h.type != FRAME_TYPE_DATA) {
+            continue;
+        }
+        // the payload is copied once, every member of the room shares that
+        // copy
+        struct message_t *message = message_create(FRAME_TYPE_DATA, payload,
+                h.length);
+        if (message == NULL) {
+            fprintf(stderr, "process_frames: out of memory\n");
+            continue;
+        }
+        if (compressed != NULL) {
+            // both ends share the dictionary, so the frame received is
+            // relayed as it is instead of compressing it again
+            message->compressed = message_create(FRAME_TYPE_DATA, compressed,
+                    compressed_length);
+            if (message->compressed != NULL) {
+                h.length = compressed_length;
+                frame_encode_header(&h, message->compressed->frame);
+            }
+        }
+        if (h.flags & FRAME_FLAG_MORE) {
+            message_set_more(message);
+        }
+        message_set_channel(message, h.channel);
+        // the chunks of a message are relayed as they arrive
+        tag_chunk(connection, message);
+        // shown by the output thread, the terminal never delays the loop
+        output_push(server->output, server->shard_id, message);
+        broadcast_message(server, message, fd);
+        metrics_record(METRIC_PROCESSING_TIME, metrics_now() -
+                message->created);
+        message_unref(message);
+        if (connection->session != NULL &&
+                session_received(connection->session)) {
+            struct message_t *ack = session_ack(connection->session);
+            if (ack != NULL) {
+                int closed = send_to_connection(server, fd, ack) == -1;
+                message_unref(ack);
+                if (closed) {
+                    return -1;
+                }
+            }
+        }
+    }
+    if (ret == -1) {
+        fprintf(stderr, "process_frames: malformed frame\n");
+        close_connection(server, fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int flush_connection(struct server_t *server, int fd);
+static int flush_shm(struct server_t *server, int fd);
+
+/**
+ * Tells whether the client of the connection must not be read from, because
+ * it doesn't read what it's sent: reading pauses once the bytes queued for it
+ * reach SEND_QUEUE_HIGH_WATERMARK, and resumes once they drain below
+ * SEND_QUEUE_LOW_WATERMARK.
+ *
+ * @param connection connection
+ * @return 1 if reading is paused, 0 otherwise
+ */
+int pause_input(struct connection_t *connection)
+{
+    size_t bytes = connection->send_queue.bytes;
+    if (bytes >= SEND_QUEUE_HIGH_WATERMARK) {
+        connection->paused = 1;
+    } else if (bytes <= SEND_QUEUE_LOW_WATERMARK) {
+        connection->paused = 0;
+    }
+    return connection->paused;
+}
+
+/**
+ * Handles every frame the client of a shm connection wrote to its ring, and
+ * arms the waiter of the ring before returning, so that the client wakes the
+ * shard up through the socket once it writes again. The messages queued for
+ * the connection are flushed as well, as the client may have made room for
+ * them. While reading is paused the frames are left in the ring, and the
+ * client blocks once it's full.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success, -1 if the connection was closed or handed over to
+ * another shard
+ */
+int process_shm(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct shm_ring_t *ring = &connection->shm->to_server;
+    for (;;) {
+        if (pause_input(connection)) {
+            // the client wakes the shard up once it reads from a full ring,
+            // so draining the queue below the low watermark resumes reading
+            flush_shm(server, fd);
+            if (pause_input(connection)) {
+                return 0;
+            }
+        }
+        const char *bytes;
+        size_t available = shm_ring_peek(ring, &bytes);
+        if (available == 0) {
+            // the client may have written right before the waiter was armed
+            if (shm_ring_arm_data(ring)) {
+                break;
+            }
+            continue;
+        }
+        ssize_t length;
+        if (connection->stream_remaining > 0) {
+            length = consume_stream(server, fd, bytes, available);
+            if (length == -1) {
+                return -1;
+            }
+        } else {
+            length = frame_reader_feed(&connection->reader, bytes, available);
+            if (length == 0) {
+                fprintf(stderr, "process_shm: out of memory\n");
+                close_connection(server, fd);
+                return -1;
+            }
+        }
+        shm_ring_consume(ring, length);
+        metrics_count(METRIC_BYTES_RECEIVED, length);
+        TRACE_INSTANT(TRACE_RECV, fd, length);
+        shm_futex_wake(&ring->space_waiter);
+        if (connection->stream_remaining == 0 &&
+                process_frames(server, fd) == -1) {
+            return -1;
+        }
+    }
+    frame_reader_shrink(&connection->reader);
+    return connection->send_queue.count > 0 ? flush_connection(server, fd) :
+        0;
+}
+
+/**
+ * Drains the bytes the client of a shm connection wrote to the socket to wake
+ * the shard up, and handles the frames of its ring. The bytes carry nothing,
+ * so a single wakeup handles however many were written.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection that is readable
+ */
+static void read_shm_tokens(struct server_t *server, int fd)
+{
+    char tokens[64];
+    for (;;) {
+        ssize_t status = recv(fd, tokens, sizeof(tokens), 0);
+        if (status > 0) {
+            continue;
+        }
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
+        if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            process_shm(server, fd);
+            return;
+        }
+        if (status == -1) {
+            metrics_count(METRIC_RECEIVE_ERRORS, 1);
+            if (errno != ECONNRESET) {
+                perror("read_shm_tokens-recv()");
+            }
+        }
+        close_connection(server, fd);
+        return;
+    }
+}
+
+/**
+ * Reads everything available on the socket of the connection and handles the
+ * frames received. Stream chunks are spliced to the stream output instead.
+ * As connections are watched in edge-triggered mode, the socket is read until
+ * it would block, or until reading is paused because the client doesn't read
+ * what it's sent, in which case it's read again by resume_input.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection that is readable
+ */
+static void read_connection(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    if (connection->shm != NULL) {
+        read_shm_tokens(server, fd);
+        return;
+    }
+    for (;;) {
+        // what isn't read stays in the socket, so the kernel makes the
+        // client wait as well
+        if (pause_input(connection)) {
+            return;
+        }
+        ssize_t status;
+        TRACE_BEGIN(span);
+        if (connection->stream_remaining > 0) {
+            status = splice_stream(server, fd);
+            TRACE_END(span, TRACE_RECV, fd, status);
+            if (status > 0) {
+                metrics_count(METRIC_BYTES_RECEIVED, status);
+                continue;
+            }
+        } else {
+            status = frame_reader_read(&connection->reader, fd);
+            TRACE_END(span, TRACE_RECV, fd, status);
+            if (status > 0) {
+                metrics_count(METRIC_BYTES_RECEIVED, status);
+                if (process_frames(server, fd) == -1) {
+                    return;
+                }
+                continue;
+            }
+        }
+        if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            frame_reader_shrink(&connection->reader);
+            return;
+        }
+        if (status == -1) {
+            metrics_count(METRIC_RECEIVE_ERRORS, 1);
+        }
+        // a reset is just a client going away without saying goodbye
+        if (status == -1 && errno != ECONNRESET) {
+            perror("read_connection-recv()");
+        }
+        close_connection(server, fd);
+        return;
+    }
+}
+
+/**
+ * Returns the channel whose bytes queued for the client account for the
+ * message
+ *
+ * @param connection connection queuing the message
+ * @param message message queued
+ * @return the channel, or NULL if none accounts for the message
+ */
+static struct channel_t *queued_channel(struct connection_t *connection,
+        const struct message_t *message)
+{
+    struct frame_header_t h;
+    frame_decode_header(message->frame, &h);
+    if (h.type != FRAME_TYPE_DATA) {
+        return NULL;
+    }
+    return channel_find(channels_of(connection), h.channel);
+}
+
+/**
+ * Appends the message to the send queue of the connection, compressed if its
+ * client agreed on it, and accounts for it in its channel
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param message message to queue
+ * @return 0 on success, -1 if there's no memory
+ */
+static int queue_message(struct server_t *server, int fd,
+        struct message_t *message)
+{
+    struct connection_t *connection = server->connections[fd];
+    if (connection->codec != COMPRESS_CODEC_NONE &&
+            message->compressed != NULL) {
+        message = message->compressed;
+    }
+    if (send_queue_push(&connection->send_queue, message) == -1) {
+        return -1;
+    }
+    metrics_gauge(METRIC_SEND_QUEUE_DEPTH, 1);
+    struct channel_t *channel = queued_channel(connection, message);
+    if (channel != NULL) {
+        channel->queued += message->length;
+    }
+    TRACE_INSTANT(TRACE_ENQUEUE, fd, connection->send_queue.count);
+    return 0;
+}
+
+/**
+ * Queues the messages waiting in the backlogs of the channels of a client
+ * with a session, as far as the window of each channel allows, recording
+ * them in the session as they are queued
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ */
+static void drain_backlogs(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct channel_set_t *channels = &connection->session->channels;
+    for (size_t i = 0; i < channels->count; ++i) {
+        struct channel_t *channel = &channels->channels[i];
+        while (channel->backlog.count > 0 &&
+                channel->queued < server->window) {
+            struct message_t *message = send_queue_front(&channel->backlog);
+            // the rest waits for the next bytes sent
+            if (queue_message(server, fd, message) == -1) {
+                fprintf(stderr, "drain_backlogs: out of memory\n");
+                return;
+            }
+            session_record(connection->session, message);
+            send_queue_pop(&channel->backlog);
+        }
+    }
+}
+
+/**
+ * Drops the bytes sent from the send queue of the connection, accounting for
+ * the bytes and the messages sent and for how long the messages sent
+ * completely waited since they were created. The backlogs of the channels
+ * that drained are queued then, and once a batch of the history replayed is
+ * sent the next one is queued.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param bytes number of bytes sent
+ */
+void consume_sent(struct server_t *server, int fd, size_t bytes)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct send_queue_t *queue = &connection->send_queue;
+    uint64_t now = metrics_now();
+    size_t remaining = queue->offset + bytes;
+    size_t sent = 0;
+    int replayed = 0;
+    while (sent < queue->count) {
+        struct message_t *message = send_queue_at(queue, sent);
+        if (remaining < message->length) {
+            break;
+        }
+        if (message == connection->history_batch) {
+            replayed = 1;
+        }
+        remaining -= message->length;
+        metrics_record(METRIC_SEND_QUEUE_WAIT, now - message->created);
+        // a channel left and joined again may have been queued less
+        struct channel_t *channel = queued_channel(connection, message);
+        if (channel != NULL) {
+            channel->queued -= message->length < channel->queued ?
+                message->length : channel->queued;
+        }
+        sent++;
+    }
+    metrics_count(METRIC_BYTES_SENT, bytes);
+    metrics_count(METRIC_MESSAGES_SENT, sent);
+    metrics_gauge(METRIC_SEND_QUEUE_DEPTH, -(int64_t) sent);
+    TRACE_INSTANT(TRACE_DEQUEUE, fd, sent);
+    send_queue_consume(queue, bytes);
+    if (connection->session != NULL && !connection->closing) {
+        drain_backlogs(server, fd);
+    }
+    if (queue->bytes <= SEND_QUEUE_LOW_WATERMARK) {
+        connection->congested_since = 0;
+        connection->lossy = 0;
+    }
+    if (!replayed || connection->closing) {
+        return;
+    }
+    // the callers keep flushing while the queue isn't empty
+    connection->history_batch = NULL;
+    struct message_t *next = next_replay(server, connection);
+    if (next == NULL) {
+        connection->history_end = 0;
+        return;
+    }
+    if (send_queue_push(queue, next) == 0) {
+        metrics_gauge(METRIC_SEND_QUEUE_DEPTH, 1);
+    } else {
+        connection->history_end = 0;
+        connection->history_batch = NULL;
+    }
+    message_unref(next);
+}
+
+/**
+ * Writes as many of the queued messages of a shm connection as fit in the
+ * ring of its client, and wakes the client up if it waits for them. When the
+ * ring is full its waiter is armed, so that the client wakes the shard up
+ * through the socket once it makes room.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0, writing to the ring doesn't fail
+ */
+static int flush_shm(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct send_queue_t *queue = &connection->send_queue;
+    struct shm_ring_t *ring = &connection->shm->to_client;
+    struct iovec iov[SEND_BATCH_MAX];
+    // a connection being closed or handed over isn't written by this shard
+    if (connection->closing) {
+        return 0;
+    }
+    while (queue->count > 0) {
+        int iovcnt = send_queue_iov(queue, iov, SEND_BATCH_MAX);
+        TRACE_BEGIN(span);
+        size_t written = shm_ring_write(ring, iov, iovcnt);
+        TRACE_END(span, TRACE_SEND, fd, written);
+        if (written == 0) {
+            // the client may have made room right before the waiter was
+            // armed
+            if (shm_ring_arm_space(ring)) {
+                return 0;
+            }
+            continue;
+        }
+        consume_sent(server, fd, written);
+        shm_futex_wake(&ring->data_waiter);
+    }
+    return 0;
+}
+
+/**
+ * Sends as many of the queued messages of the connection as the socket
+ * accepts. The messages are gathered in batches of up to SEND_BATCH_MAX
+ * written with a single sendmsg, and every batch followed by another one is
+ * sent with MSG_MORE so that the kernel doesn't push a small segment in
+ * between.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success (even if messages remain queued), -1 if the connection
+ * was closed because of an error
+ */
+static int flush_connection(struct server_t *server, int fd)
+{
+    if (server->connections[fd]->shm != NULL) {
+        return flush_shm(server, fd);
+    }
+#ifdef USE_IO_URING
+    return uring_flush_connection(server, fd);
+#endif
+    struct send_queue_t *queue = &server->connections[fd]->send_queue;
+    struct iovec iov[SEND_BATCH_MAX];
+    while (queue->count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = send_queue_iov(queue, iov, SEND_BATCH_MAX);
+        int flags = MSG_NOSIGNAL;
+        if (msg.msg_iovlen < queue->count) {
+            flags |= MSG_MORE;
+        }
+        TRACE_BEGIN(span);
+        ssize_t sent = sendmsg(fd, &msg, flags);
+        TRACE_END(span, TRACE_SEND, fd, sent);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE && errno != ECONNRESET) {
+                perror("flush_connection-sendmsg()");
+            }
+            metrics_count(METRIC_SEND_ERRORS, 1);
+            close_connection(server, fd);
+            return -1;
+        }
+        consume_sent(server, fd, sent);
+    }
+    return 0;
+}
+
+/**
+ * Reads again from the connection once the messages queued for its client
+ * drained below SEND_QUEUE_LOW_WATERMARK, as the socket isn't reported
+ * readable again. The shm clients wake the shard up on their own, and
+ * io_uring arms the recv again when a sendmsg completes instead.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection that was flushed
+ */
+static void resume_input(struct server_t *server, int fd)
+{
+#ifndef USE_IO_URING
+    struct connection_t *connection = server->connections[fd];
+    if (connection != NULL && connection->paused &&
+            connection->shm == NULL && !pause_input(connection)) {
+        read_connection(server, fd);
+    }
+#else
+    (void) server;
+    (void) fd;
+#endif
+}
+
+/**
+ * Flushes every connection that had messages queued since the last call. It
+ * is called once per iteration of the event loop, so all the messages queued
+ * for a connection while handling a burst are written together. The messages
+ * left unfinished by the clients that went away are ended first.
+ *
+ * @param server server holding the connections
+ */
+void flush_scheduled_connections(struct server_t *server)
+{
+    // ending a message may evict a client that leaves another one unfinished
+    while (server->ended.count > 0) {
+        struct send_queue_t ended = server->ended;
+        send_queue_init(&server->ended);
+        for (size_t i = 0; i < ended.count; ++i) {
+            broadcast_message(server, send_queue_at(&ended, i), -1);
+        }
+        send_queue_clear(&ended);
+    }
+    for (size_t i = 0; i < server->flush_count; ++i) {
+        int fd = server->flush_list[i];
+        struct connection_t *connection = server->connections[fd];
+        // the connection may have been closed after being scheduled
+        if (connection != NULL && connection->flush_scheduled) {
+            connection->flush_scheduled = 0;
+            if (flush_connection(server, fd) == 0) {
+                resume_input(server, fd);
+            }
+        }
+    }
+    server->flush_count = 0;
+}
+
+/**
+ * Queues the message to be sent through the connection, after the ones
+ * already queued. It is written when the event loop flushes the connection.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param message message to send
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int send_to_connection(struct server_t *server, int fd,
+        struct message_t *message)
+{
+    struct connection_t *connection = server->connections[fd];
+    if (queue_message(server, fd, message) == -1) {
+        fprintf(stderr, "send_to_connection: out of memory\n");
+        close_connection(server, fd);
+        return -1;
+    }
+    if (connection->flush_scheduled) {
+        return 0;
+    }
+    if (server->flush_count == server->flush_capacity) {
+        size_t capacity = server->flush_capacity * 2;
+        int *flush_list = (int *) realloc(server->flush_list, capacity *
+                sizeof(*flush_list));
+        if (flush_list == NULL) {
+            fprintf(stderr, "send_to_connection: out of memory\n");
+            close_connection(server, fd);
+            return -1;
+        }
+        server->flush_list = flush_list;
+        server->flush_capacity = capacity;
+    }
+    server->flush_list[server->flush_count++] = fd;
+    connection->flush_scheduled = 1;
+    return 0;
+}
+
+/**
+ * Decides whether a message relayed from another client is queued for the
+ * connection. Once the bytes queued for its client cross
+ * SEND_QUEUE_HIGH_WATERMARK the messages are skipped, until they drain below
+ * SEND_QUEUE_LOW_WATERMARK, so that a slow client only loses its own
+ * messages. A client resuming a session counts every message it receives,
+ * so they are queued anyway and its session replays what was lost once it
+ * comes back. Clients that stay above the high watermark for longer than
+ * SLOW_CONSUMER_TIMEOUT, or that reach SEND_QUEUE_LIMIT, are evicted. The
+ * messages of a channel with the window of the server queued or held for
+ * a client without session are skipped too, so that the other channels of
+ * the client go on. A client with a session gets them later instead, see
+ * send_to_session.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param channel channel of the message, joined by the client
+ * @return 1 if the message is to be queued, 0 if it's skipped, -1 if the
+ * connection was closed
+ */
+static int admit_relayed(struct server_t *server, int fd,
+        const struct channel_t *channel)
+{
+    struct connection_t *connection = server->connections[fd];
+    size_t bytes = connection->send_queue.bytes;
+    if (bytes < SEND_QUEUE_HIGH_WATERMARK) {
+        if (connection->lossy || (connection->session == NULL &&
+                    channel->queued + channel->held.bytes >=
+                    server->window)) {
+            metrics_count(METRIC_MESSAGES_SKIPPED, 1);
+            return 0;
+        }
+        return 1;
+    }
+    time_t now = monotonic_seconds();
+    if (connection->congested_since == 0) {
+        connection->congested_since = now;
+    }
+    if (bytes >= SEND_QUEUE_LIMIT ||
+            now - connection->congested_since > SLOW_CONSUMER_TIMEOUT) {
+        metrics_count(METRIC_SLOW_EVICTIONS, 1);
+        close_connection(server, fd);
+        return -1;
+    }
+    if (connection->session != NULL) {
+        return 1;
+    }
+    connection->lossy = 1;
+    metrics_count(METRIC_MESSAGES_SKIPPED, 1);
+    return 0;
+}
+
+/**
+ * Queues a message relayed to a client with a session, recording it in the
+ * session. Once the window of the channel is queued for the client, the
+ * messages of the channel wait in its backlog instead, and are queued and
+ * recorded as the channel drains, so that the session replays them in the
+ * order they're sent. A client whose backlog reaches SEND_QUEUE_LIMIT is
+ * evicted. The messages skipped for a connection going away are only
+ * recorded, for the replay.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param channel channel of the message, kept by the session
+ * @param message message relayed
+ */
+static void send_to_session(struct server_t *server, int fd,
+        struct channel_t *channel, struct message_t *message)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct session_t *session = connection->session;
+    // nothing overtakes the backlog, it's recorded when the connection goes
+    if (channel->backlog.count == 0 && (channel->skipping ||
+                channel->queued < server->window)) {
+        session_record(session, message);
+        if (!channel->skipping) {
+            send_to_connection(server, fd, message);
+        }
+        return;
+    }
+    if (send_queue_push(&channel->backlog, message) == -1) {
+        fprintf(stderr, "send_to_session: out of memory\n");
+        close_connection(server, fd);
+        session_record(session, message);
+        return;
+    }
+    if (channel->backlog.bytes >= SEND_QUEUE_LIMIT && !connection->closing) {
+        metrics_count(METRIC_SLOW_EVICTIONS, 1);
+        close_connection(server, fd);
+    }
+}
+
+/**
+ * Relays a message to a connection that joined its channel, along with the
+ * messages the channel held back until then. Whether the client keeps up is
+ * decided by admit_relayed once per message, and every chunk of the message
+ * is queued or skipped alike. The session of a client that has one records
+ * them anyway, see send_to_session.
+ *
+ * @param server shard holding the connection
+ * @param fd socket of the connection
+ * @param channel channel of the message, joined by the client
+ * @param message message relayed
  */
-void start_server(char *port, struct server_t *server)
+static void relay_to_connection(struct server_t *server, int fd,
+        struct channel_t *channel, struct message_t *message)
 {
-    struct addrinfo hints;
-    initialize_hints(&hints, SERVER);
+    struct connection_t *connection = server->connections[fd];
+    struct session_t *session = connection->session;
+    uint64_t chunked = channel->chunked;
+    struct send_queue_t ready;
+    send_queue_init(&ready);
+    int cut = channel_relay(channel, message, server->window, &ready);
+    if (cut == 1) {
+        metrics_count(METRIC_MESSAGES_CUT, 1);
+    } else if (cut == -1) {
+        // the client can't be told the message ends, nothing was released
+        close_connection(server, fd);
+    }
+    for (size_t i = 0; i < ready.count; ++i) {
+        struct message_t *chunk = send_queue_at(&ready, i);
+        if (server->connections[fd] != NULL && (chunk->chunked == 0 ||
+                    chunk->chunked != chunked)) {
+            int admitted = connection->closing ? 0 : admit_relayed(server, fd,
+                    channel);
+            // the channel of a connection without session is gone with it
+            if (server->connections[fd] != NULL) {
+                channel->skipping = admitted != 1;
+            }
+        }
+        chunked = message_has_more(chunk) ? chunk->chunked : 0;
+        if (server->connections[fd] == NULL) {
+            // kept for the replay, the session is detached already
+            if (session != NULL) {
+                session_record(session, chunk);
+            }
+        } else if (session != NULL) {
+            send_to_session(server, fd, channel, chunk);
+        } else if (!channel->skipping) {
+            send_to_connection(server, fd, chunk);
+        }
+    }
+    send_queue_clear(&ready);
+}
 
-    // getaddrinfo
-    struct addrinfo *result;
-    get_addrinfo_list(NULL, port, &hints, &result);
+/**
+ * Records a message in a session whose client went away, along with the
+ * messages its channel held back until then
+ *
+ * @param session session without connection
+ * @param channel channel of the message, joined by the session
+ * @param window max number of bytes held by the channel
+ * @param message message relayed
+ */
+static void relay_to_session(struct session_t *session,
+        struct channel_t *channel, size_t window, struct message_t *message)
+{
+    struct send_queue_t ready;
+    send_queue_init(&ready);
+    // a message that couldn't be cut short is cut by the next one relayed
+    if (channel_relay(channel, message, window, &ready) == 1) {
+        metrics_count(METRIC_MESSAGES_CUT, 1);
+    }
+    for (size_t i = 0; i < ready.count; ++i) {
+        session_record(session, send_queue_at(&ready, i));
+    }
+    send_queue_clear(&ready);
+}
+
+/**
+ * Sends the message to every connection of the shard except the one on the
+ * socket except_fd. The clients that don't keep up are sent only what
+ * admit_relayed lets through. Only the connections that joined the channel
+ * of the message are sent it, and the chunks of a message are never mixed
+ * with the other messages of the channel.
+ *
+ * @param server shard holding the connections
+ * @param message message to send
+ * @param except_fd socket of the connection that sent the message, or -1 to
+ * send it to all of them
+ */
+static void broadcast_to_shard(struct server_t *server,
+        struct message_t *message, int except_fd)
+{
+    uint16_t id = message_channel(message);
+    // the sessions whose client went away keep what it misses, the ones
+    // detached while relaying already got the message
+    for (size_t i = 0; i < server->sessions_count; ++i) {
+        struct session_t *session = server->sessions[i];
+        struct channel_t *channel = channel_find(&session->channels, id);
+        if (session->fd == -1 && channel != NULL) {
+            relay_to_session(session, channel, server->window, message);
+        }
+    }
+    for (size_t fd = 0; fd < server->connections_capacity; ++fd) {
+        struct connection_t *connection = server->connections[fd];
+        if (connection == NULL || (int) fd == except_fd) {
+            continue;
+        }
+        struct channel_t *channel = channel_find(channels_of(connection), id);
+        if (channel != NULL) {
+            relay_to_connection(server, fd, channel, message);
+        }
+    }
+}
+
+/**
+ * Posts the message to the inbox of another shard, waking up its event loop
+ * if the inbox was empty
+ *
+ * @param shard shard that receives the message
+ * @param message message, the inbox takes a new reference to it
+ */
+static void post_to_shard(struct server_t *shard, struct message_t *message)
+{
+    pthread_mutex_lock(&shard->inbox_lock);
+    int was_empty = shard->inbox.count == 0;
+    int status = send_queue_push(&shard->inbox, message);
+    pthread_mutex_unlock(&shard->inbox_lock);
+    if (status == -1) {
+        fprintf(stderr, "post_to_shard: out of memory\n");
+        return;
+    }
+    // a shard draining its inbox reads inbox_fd before taking the messages,
+    // so the messages posted after a wakeup are never left behind
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(shard->inbox_fd, &one, sizeof(one)) == -1) {
+            perror("post_to_shard-write()");
+        }
+    }
+}
 
-    // socket
-    server->socket_listening = find_socket(result);
+/**
+ * Sends the message to every member of the chat room except the connection on
+ * the socket except_fd. Every connection queues a reference to the same
+ * message, that is written when the event loop flushes the connection. The
+ * message is posted to the inbox of every other shard, that sends it to its
+ * own connections. When compression is enabled it is compressed once, before
+ * any other thread can see it, for the connections that agreed on it. The
+ * message is appended to the history first, if the server keeps one. The
+ * chunks of a message are relayed one by one, as they arrive.
+ *
+ * @param server server holding the connections
+ * @param message message to send
+ * @param except_fd socket of the connection that sent the message, or -1 to
+ * send it to everybody
+ */
+void broadcast_message(struct server_t *server, struct message_t *message,
+        int except_fd)
+{
+    if (server->history != NULL) {
+        history_append(server->history, message);
+    }
+    if (message->compressed == NULL &&
+            compress_codecs() != COMPRESS_CODEC_NONE) {
+        message->compressed = compress_message(message);
+    }
+    broadcast_to_shard(server, message, except_fd);
+    for (size_t i = 0; i < server->shard_count; ++i) {
+        if (server->shards[i] != server) {
+            post_to_shard(server->shards[i], message);
+        }
+    }
+}
 
-    // bind
-    bind_socket(server->socket_listening, port, result);
+/**
+ * Sends the messages posted to the inbox of the shard by the other shards to
+ * all its connections, and adopts the connections they handed over
+ *
+ * @param server shard whose inbox_fd was signaled
+ */
+void drain_inbox(struct server_t *server)
+{
+    // the messages are taken all at once, so that the other shards can keep
+    // posting while they are sent
+    pthread_mutex_lock(&server->inbox_lock);
+    struct send_queue_t inbox = server->inbox;
+    send_queue_init(&server->inbox);
+    struct connection_t *handoffs = server->handoffs;
+    server->handoffs = NULL;
+    pthread_mutex_unlock(&server->inbox_lock);
+    while (handoffs != NULL) {
+        struct connection_t *next = handoffs->next_handoff;
+        adopt_connection(server, handoffs);
+        handoffs = next;
+    }
+    while (inbox.count > 0) {
+        broadcast_to_shard(server, send_queue_front(&inbox), -1);
+        send_queue_pop(&inbox);
+    }
+    send_queue_clear(&inbox);
+}
 
-    // free structure returned
-    freeaddrinfo(result);
+/**
+ * Reads a line typed on stdin and sends it to every client. When stdin is
+ * closed it stops being watched and the server keeps serving its clients.
+ *
+ * @param server server sending the message
+ */
+static void read_console(struct server_t *server)
+{
+    ssize_t status = read(STDIN_FILENO, server->send_buffer, BUFFER_SIZE - 1);
+    if (status <= 0) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        return;
+    }
+    server->send_buffer[status] = '\0';
+    send_message(server, SERVER);
+}
 
-    // listen
-    listen_socket(server->socket_listening, port, BACKLOG_CONNECTIONS);
+/**
+ * Reads the counter of inbox_fd and sends the messages posted to the inbox
+ *
+ * @param server shard whose inbox_fd is readable
+ */
+static void read_inbox(struct server_t *server)
+{
+    uint64_t counter;
+    if (read(server->inbox_fd, &counter, sizeof(counter)) == -1) {
+        perror("read_inbox-read()");
+    }
+    drain_inbox(server);
+}
 
-    // accept
-    struct sockaddr_storage addr;
-    server->socket_connected = accept_connection(server->socket_listening,&addr);
-    assert(server->socket_connected > -1);
+/**
+ * Initializes a shard: creates its listening socket bound to the port with
+ * SO_REUSEPORT when there are several shards, its connection table, its pipe
+ * for the streams and its inbox. Exits the program on failure.
+ *
+ * @param options arguments given in the command line
+ * @param server shard to initialize
+ * @param shards array of every shard of the server
+ * @param shard_id index of the shard in shards
+ */
+static void start_shard(struct options_t *options, struct server_t *server,
+        struct server_t **shards, size_t shard_id)
+{
+    // a unix socket is named by its path instead of a port
+    char *port = options->hostname != NULL ? options->hostname :
+        options->port;
+    server->shm = resolver_is_shm(options->hostname);
+    if (shard_id > 0 && shards[0]->family == AF_UNIX) {
+        // unix sockets can't share a path with SO_REUSEPORT, the shards
+        // accept from the socket of the first one instead
+        server->socket_listening = fcntl(shards[0]->socket_listening,
+                F_DUPFD_CLOEXEC, 0);
+        if (server->socket_listening == -1) {
+            perror("start_shard-fcntl()");
+            exit(EXIT_FAILURE);
+        }
+        server->family = AF_UNIX;
+    } else {
+        struct addrinfo hints;
+        initialize_hints(&hints, SERVER);
+
+        // getaddrinfo
+        struct addrinfo *result;
+        get_addrinfo_list(options->hostname, options->port, &hints, &result);
+
+        // socket
+        server->socket_listening = find_socket(result);
+        server->family = result->ai_family;
+        if (options->shards > 1 && server->family != AF_UNIX) {
+            int yes = 1;
+            if (setsockopt(server->socket_listening, SOL_SOCKET,
+                        SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+                perror("start_shard-setsockopt()");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // bind
+        bind_socket(server->socket_listening, port, result);
+
+        // free structure returned
+        resolver_free(result);
+
+        // listen
+        listen_socket(server->socket_listening, port, options->backlog);
+        set_nonblocking(server->socket_listening);
+    }
+
+    // connection table
+    server->connections_capacity = INITIAL_CONNECTIONS_CAPACITY;
+    server->connections_count = 0;
+    server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (server->spare_fd == -1) {
+        perror("start_shard-open()");
+        exit(EXIT_FAILURE);
+    }
+    server->connections = (struct connection_t **) calloc(
+            server->connections_capacity, sizeof(*server->connections));
+    server->flush_capacity = INITIAL_CONNECTIONS_CAPACITY;
+    server->flush_count = 0;
+    server->flush_list = (int *) malloc(server->flush_capacity *
+            sizeof(*server->flush_list));
+    if (server->connections == NULL || server->flush_list == NULL) {
+        perror("start_shard-calloc()");
+        exit(EXIT_FAILURE);
+    }
+    pool_init(&server->pool);
+    open_stream_pipe(server);
+
+    // shards and inbox
+    server->shard_id = shard_id;
+    server->shard_count = options->shards;
+    server->shards = shards;
+    server->window = options->window;
+    server->inbox_fd = eventfd(0, EFD_CLOEXEC);
+    if (server->inbox_fd == -1) {
+        perror("start_shard-eventfd()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&server->inbox_lock, NULL);
+    send_queue_init(&server->inbox);
+    server->handoffs = NULL;
+    send_queue_init(&server->ended);
+
+    // sessions
+    server->sessions = NULL;
+    server->sessions_count = 0;
+    server->sessions_capacity = 0;
+}
+
+/**
+ * Creates the epoll instance of the shard, or its io_uring instance, and
+ * registers the listening socket, the inbox and, in the first shard, stdin.
+ * It is called by the thread that runs the event loop of the shard.
+ *
+ * @param server shard started with start_shard
+ */
+static void start_event_loop(struct server_t *server)
+{
+#ifdef USE_IO_URING
+    start_server_uring(server);
+#else
+    // epoll
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd == -1) {
+        perror("start_event_loop-epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+    watch_fd(server, server->socket_listening, EPOLLIN | EPOLLET);
+    watch_fd(server, server->inbox_fd, EPOLLIN);
+    if (server->shard_id != 0) {
+        return;
+    }
+    // stdin can't be watched when it is redirected from a regular file, the
+    // server then runs without console
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = STDIN_FILENO;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+#endif
+}
+
+/**
+ * Starts the server, creating options->shards non-blocking listening sockets
+ * bound to the same port with SO_REUSEPORT, so that the kernel balances the
+ * new connections among them, each one with its own epoll instance that
+ * multiplexes it together with every connection it accepts later on. The
+ * first shard also watches stdin. The server structure passed is initialized
+ * as the first shard and holds the rest of them. The streams sent by the
+ * clients are written to options->output_path, or discarded if there is none.
+ *
+ * @param options arguments given in the command line, with the port number
+ * to listen to, the number of shards and the backlog of each of them
+ * @param server server_t instance that holds all the information to maintain
+ * the communication and transmission of messages to/from the clients
+ */
+void start_server(struct options_t *options, struct server_t *server)
+{
+    raise_file_limit();
+
+    if (options->shards == 0) {
+        options->shards = sysconf(_SC_NPROCESSORS_ONLN);
+        if (options->shards < 1) {
+            options->shards = 1;
+        }
+    }
+    struct server_t **shards = (struct server_t **) malloc(options->shards *
+            sizeof(*shards));
+    if (shards == NULL) {
+        perror("start_server-malloc()");
+        exit(EXIT_FAILURE);
+    }
+    shards[0] = server;
+    for (long i = 1; i < options->shards; ++i) {
+        shards[i] = (struct server_t *) malloc(sizeof(struct server_t));
+        if (shards[i] == NULL) {
+            perror("start_server-malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int stream_fd = open_stream_output(options->output_path);
+    struct output_t *output = (struct output_t *) malloc(sizeof(*output));
+    if (output == NULL) {
+        perror("start_server-malloc()");
+        exit(EXIT_FAILURE);
+    }
+    output_start(output, options->shards, SERVER);
+    struct history_t *history = NULL;
+    if (options->history_path != NULL) {
+        history = (struct history_t *) malloc(sizeof(*history));
+        if (history == NULL) {
+            perror("start_server-malloc()");
+            exit(EXIT_FAILURE);
+        }
+        history_open(history, options->history_path, options->window);
+    }
+    for (long i = 0; i < options->shards; ++i) {
+        start_shard(options, shards[i], shards, i);
+        shards[i]->stream_fd = stream_fd;
+        shards[i]->output = output;
+        shards[i]->history = history;
+    }
+
+    // the event loops of the other shards are started by their own threads
+    start_event_loop(server);
+    print_progress("accepting connections...\n");
+}
+
+/**
+ * Runs the event loop of the shard: accepts new connections, shows the
+ * messages received from its clients, relays the messages posted by the other
+ * shards and, in the first shard, sends what is typed in stdin. It never
+ * returns.
+ *
+ * @param server shard whose event loop is started
+ */
+static void run_event_loop(struct server_t *server)
+{
+#ifdef USE_IO_URING
+    run_server_uring(server);
+    return;
+#endif
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    for (;;) {
+        int n = epoll_wait(server->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("run_event_loop-epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == server->socket_listening) {
+                accept_pending_connections(server);
+            } else if (fd == server->inbox_fd) {
+                read_inbox(server);
+            } else if (fd == STDIN_FILENO) {
+                read_console(server);
+            } else if (server->connections[fd] != NULL) {
+                if (events[i].events & EPOLLOUT) {
+                    if (flush_connection(server, fd) == -1) {
+                        continue;
+                    }
+                    resume_input(server, fd);
+                    if (server->connections[fd] == NULL) {
+                        continue;
+                    }
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                            EPOLLERR)) {
+                    read_connection(server, fd);
+                }
+            }
+        }
+        flush_scheduled_connections(server);
+    }
+}
+
+/**
+ * Entry point of the threads running the shards other than the first one
+ *
+ * @param arg shard to run
+ * @return never returns
+ */
+static void *run_shard(void *arg)
+{
+    struct server_t *server = (struct server_t *) arg;
+    start_event_loop(server);
+    run_event_loop(server);
+    return NULL;
+}
+
+/**
+ * Runs the event loop of the server: accepts new connections, shows the
+ * messages received from every client and sends what is typed in stdin to all
+ * of them. Every shard but the first one runs its event loop in a thread of
+ * its own, the first one runs in the calling thread. It never returns.
+ *
+ * @param server server started with start_server
+ */
+void run_server(struct server_t *server)
+{
+    for (size_t i = 1; i < server->shard_count; ++i) {
+        struct server_t *shard = server->shards[i];
+        if (pthread_create(&shard->thread, NULL, run_shard, shard) != 0) {
+            perror("run_server-pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    run_event_loop(server);
 }
@@ -0,0 +1,535 @@
+#include "server.h"
+
+#include <poll.h>
+
+/** operations identified in the user data of the submissions */
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_CONSOLE 4
+#define URING_OP_INBOX 5
+#define URING_OP_CANCEL 6
+#define URING_OP_LISTEN 7
+
+/**
+ * Packs the operation and the file descriptor it works on into the user data
+ * of a submission
+ *
+ * @param op one of the URING_OP_ macros
+ * @param fd file descriptor
+ * @return the user data
+ */
+static uint64_t encode_user_data(uint32_t op, int fd)
+{
+    return ((uint64_t) op << 32) | (uint32_t) fd;
+}
+
+/**
+ * Returns a submission entry, exiting the program if the ring can't take any
+ * more of them
+ *
+ * @param server server holding the io_uring instance
+ * @return the submission entry
+ */
+static struct io_uring_sqe *get_sqe(struct server_t *server)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->uring);
+    if (sqe == NULL) {
+        perror("get_sqe-io_uring_enter()");
+        exit(EXIT_FAILURE);
+    }
+    return sqe;
+}
+
+/**
+ * Arms a multishot accept on the listening socket, which completes once for
+ * every connection accepted
+ *
+ * @param server server with the listening socket
+ */
+static void arm_accept(struct server_t *server)
+{
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->socket_listening;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = encode_user_data(URING_OP_ACCEPT, server->socket_listening);
+}
+
+/**
+ * Arms a poll on the listening socket, which completes once a connection is
+ * pending. An accept failing for lack of descriptors fails again as soon as
+ * it is armed, so it waits for the next connection to shed instead.
+ *
+ * @param server server with the listening socket
+ */
+static void arm_listen(struct server_t *server)
+{
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server->socket_listening;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = encode_user_data(URING_OP_LISTEN, server->socket_listening);
+}
+
+/**
+ * Arms a multishot recv on the connection, which completes every time data
+ * arrives, in a buffer picked by the kernel from the provided buffer ring
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ */
+static void arm_recv(struct server_t *server, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = encode_user_data(URING_OP_RECV, fd);
+    server->connections[fd]->recv_armed = 1;
+}
+
+/**
+ * Cancels the multishot recv of a connection. It completes with -ECANCELED,
+ * or right away if the recv had already ended.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ */
+static void cancel_recv(struct server_t *server, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = encode_user_data(URING_OP_RECV, fd);
+    sqe->user_data = encode_user_data(URING_OP_CANCEL, fd);
+}
+
+/**
+ * Tells whether the recv of a connection must stay disarmed because its
+ * client doesn't read what it's sent. The socket of a shm client only wakes
+ * the shard up, and its ring is paused by process_shm instead.
+ *
+ * @param connection connection
+ * @return 1 if receiving is paused, 0 otherwise
+ */
+static int recv_paused(struct connection_t *connection)
+{
+    return connection->shm == NULL && pause_input(connection);
+}
+
+/**
+ * Arms the read of a line typed in the console
+ *
+ * @param server server holding the console buffer
+ */
+static void arm_console(struct server_t *server)
+{
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = STDIN_FILENO;
+    sqe->addr = (uint64_t) (uintptr_t) server->send_buffer;
+    sqe->len = BUFFER_SIZE - 1;
+    // read from the current position of stdin
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = encode_user_data(URING_OP_CONSOLE, STDIN_FILENO);
+}
+
+/**
+ * Arms the read of the counter of the inbox of the shard, which completes
+ * when other shards post messages to it
+ *
+ * @param server shard holding the inbox
+ */
+static void arm_inbox(struct server_t *server)
+{
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = server->inbox_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &server->inbox_counter;
+    sqe->len = sizeof(server->inbox_counter);
+    sqe->user_data = encode_user_data(URING_OP_INBOX, server->inbox_fd);
+}
+
+/**
+ * Releases a connection that is being closed, or handed over to another
+ * shard, once no operation refers to it anymore
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ */
+static void release_if_idle(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    if (connection->recv_armed || connection->send_in_flight) {
+        return;
+    }
+    if (connection->handoff_to != NULL) {
+        release_handoff(server, fd);
+    } else {
+        close_connection(server, fd);
+    }
+}
+
+/**
+ * Starts closing the connection: the socket is shut down so that the
+ * operations in flight complete, and the connection is released when the
+ * last one does.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 if operations are still in flight, -1 if the connection can be
+ * released right away
+ */
+int uring_close_connection(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    if (!connection->recv_armed && !connection->send_in_flight) {
+        return -1;
+    }
+    if (!connection->closing) {
+        connection->closing = 1;
+        shutdown(fd, SHUT_RDWR);
+    }
+    return 0;
+}
+
+/**
+ * Starts handing the connection over to another shard: its multishot recv is
+ * cancelled, and the connection is released when the operations in flight
+ * complete.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 if operations are still in flight, -1 if the connection can be
+ * released right away
+ */
+int uring_handoff_connection(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    // unlike a close the socket stays usable, nothing else is received nor
+    // sent through this shard
+    connection->closing = 1;
+    if (connection->recv_armed) {
+        cancel_recv(server, fd);
+    }
+    return connection->recv_armed || connection->send_in_flight ? 0 : -1;
+}
+
+/**
+ * Starts receiving on a connection handed over by another shard
+ *
+ * @param server shard adopting the connection
+ * @param fd socket of the connection
+ */
+void uring_adopt_connection(struct server_t *server, int fd)
+{
+    arm_recv(server, fd);
+}
+
+/**
+ * Submits a sendmsg of the first URING_SEND_BATCH_MAX queued messages of the
+ * connection, unless one is already in flight. The submission is batched with
+ * every other one prepared in the same iteration of the event loop.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @return 0 on success, -1 if the connection was closed
+ */
+int uring_flush_connection(struct server_t *server, int fd)
+{
+    struct connection_t *connection = server->connections[fd];
+    struct send_queue_t *queue = &connection->send_queue;
+    if (queue->count == 0 || connection->send_in_flight ||
+            connection->closing) {
+        return 0;
+    }
+    // the message header and the buffers must stay valid until the sendmsg
+    // completes, so they live in the connection
+    memset(&connection->send_msg, 0, sizeof(connection->send_msg));
+    connection->send_msg.msg_iov = connection->send_iov;
+    connection->send_msg.msg_iovlen = send_queue_iov(queue,
+            connection->send_iov, URING_SEND_BATCH_MAX);
+    struct io_uring_sqe *sqe = get_sqe(server);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) &connection->send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = encode_user_data(URING_OP_SEND, fd);
+    connection->send_in_flight = 1;
+    return 0;
+}
+
+/**
+ * Handles the completion of the multishot accept
+ *
+ * @param server server with the listening socket
+ * @param res socket accepted or -errno
+ * @param flags flags of the completion
+ */
+static void handle_accept(struct server_t *server, int res, unsigned flags)
+{
+    if (res >= 0) {
+        // a multishot accept has nowhere to store the address of each
+        // client
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        metrics_count(METRIC_ACCEPTS, 1);
+        TRACE_INSTANT(TRACE_ACCEPT, server->socket_listening, res);
+        if (add_connection(server, res, &addr) == 0) {
+            arm_recv(server, res);
+        }
+    } else {
+        fprintf(stderr, "handle_accept-accept(): %s\n", strerror(-res));
+        metrics_count(METRIC_ACCEPT_ERRORS, 1);
+        // out of descriptors, the connections pending are shed and the
+        // accept waits for the next one
+        if (res == -EMFILE || res == -ENFILE) {
+            while (shed_connection(server) == 0) {
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                arm_listen(server);
+            }
+            return;
+        }
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        arm_accept(server);
+    }
+}
+
+/**
+ * Handles a completion of the multishot recv of a connection, feeding the
+ * bytes received to its frame reader and giving the buffer back to the kernel.
+ * The recv is cancelled while reading from the client is paused.
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param res number of bytes received or -errno
+ * @param flags flags of the completion, holding the id of the buffer used
+ */
+static void handle_recv(struct server_t *server, int fd, int res,
+        unsigned flags)
+{
+    struct connection_t *connection = server->connections[fd];
+    // the recv itself happens in the kernel, only its completion is seen
+    TRACE_INSTANT(TRACE_RECV, fd, res);
+    if (res > 0) {
+        metrics_count(METRIC_BYTES_RECEIVED, res);
+        uint16_t buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buffer = uring_buf_ring_buffer(&server->buf_ring, buffer_id);
+        // the bytes a shm client writes to the socket only wake the shard
+        // up, its frames are in the ring
+        size_t offset = connection->shm != NULL ? (size_t) res : 0;
+        while (!connection->closing && offset < (size_t) res) {
+            // the reader is empty while a stream chunk is incomplete, so the
+            // chunk is written straight from the provided buffer
+            if (connection->stream_remaining > 0) {
+                ssize_t length = consume_stream(server, fd, buffer + offset,
+                        res - offset);
+                if (length == -1) {
+                    break;
+                }
+                offset += length;
+                continue;
+            }
+            size_t length = frame_reader_feed(&connection->reader,
+                    buffer + offset, res - offset);
+            if (length == 0) {
+                fprintf(stderr, "handle_recv: out of memory\n");
+                close_connection(server, fd);
+                break;
+            }
+            offset += length;
+            if (process_frames(server, fd) == -1) {
+                break;
+            }
+        }
+        uring_buf_ring_recycle(&server->buf_ring, buffer_id);
+        if (connection->shm != NULL && !connection->closing) {
+            process_shm(server, fd);
+        }
+        if (!connection->closing) {
+            frame_reader_shrink(&connection->reader);
+        }
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        connection->recv_armed = 0;
+    }
+    // running out of provided buffers only requires arming the recv again,
+    // and so does a recv cancelled while reading was paused
+    if (res <= 0 && res != -ENOBUFS && res != -ECANCELED &&
+            !connection->closing) {
+        if (res < 0) {
+            metrics_count(METRIC_RECEIVE_ERRORS, 1);
+        }
+        if (res < 0 && res != -ECONNRESET) {
+            fprintf(stderr, "handle_recv-recv(): %s\n", strerror(-res));
+        }
+        close_connection(server, fd);
+        return;
+    }
+    if (connection->closing) {
+        release_if_idle(server, fd);
+    } else if (recv_paused(connection)) {
+        // the bytes left in the socket make the kernel hold the client back
+        if (connection->recv_armed) {
+            cancel_recv(server, fd);
+        }
+    } else if (!connection->recv_armed) {
+        arm_recv(server, fd);
+    }
+}
+
+/**
+ * Handles the completion of a sendmsg of a connection, submitting the next
+ * one if there are more messages queued, and arming the recv again if
+ * reading was paused until the queue drained
+ *
+ * @param server server holding the connection
+ * @param fd socket of the connection
+ * @param res number of bytes sent or -errno
+ */
+static void handle_send(struct server_t *server, int fd, int res)
+{
+    struct connection_t *connection = server->connections[fd];
+    connection->send_in_flight = 0;
+    TRACE_INSTANT(TRACE_SEND, fd, res);
+    // a connection handed over to another shard carries on from there
+    if (res > 0) {
+        consume_sent(server, fd, res);
+    }
+    if (connection->closing) {
+        release_if_idle(server, fd);
+        return;
+    }
+    if (res < 0) {
+        if (res != -EPIPE && res != -ECONNRESET) {
+            fprintf(stderr, "handle_send-sendmsg(): %s\n", strerror(-res));
+        }
+        metrics_count(METRIC_SEND_ERRORS, 1);
+        close_connection(server, fd);
+        return;
+    }
+    // receiving resumes once the queue drained below the low watermark
+    if (!connection->recv_armed && !recv_paused(connection)) {
+        arm_recv(server, fd);
+    }
+    uring_flush_connection(server, fd);
+}
+
+/**
+ * Handles the completion of the read of the console, sending the line typed
+ * to every client. When stdin is closed the server keeps serving its clients.
+ *
+ * @param server server holding the console buffer
+ * @param res number of bytes read or -errno
+ */
+static void handle_console(struct server_t *server, int res)
+{
+    if (res <= 0) {
+        return;
+    }
+    server->send_buffer[res] = '\0';
+    send_message(server, SERVER);
+    arm_console(server);
+}
+
+/**
+ * Handles the completion of the read of the counter of the inbox, sending
+ * the messages posted by the other shards
+ *
+ * @param server shard holding the inbox
+ * @param res number of bytes read or -errno
+ */
+static void handle_inbox(struct server_t *server, int res)
+{
+    if (res < 0) {
+        fprintf(stderr, "handle_inbox-read(): %s\n", strerror(-res));
+    }
+    drain_inbox(server);
+    arm_inbox(server);
+}
+
+/**
+ * Creates the io_uring instance of the shard, provides it the buffers for
+ * receiving and arms the multishot accept, the read of the inbox and, in the
+ * first shard, the read of the console. It must be called by the thread that
+ * runs the event loop of the shard, as the ring only accepts submissions from
+ * the thread that created it. Fails and exits the program if io_uring is not
+ * available.
+ *
+ * @param server shard with its listening socket ready
+ */
+void start_server_uring(struct server_t *server)
+{
+    server->epoll_fd = -1;
+    if (uring_init(&server->uring, URING_ENTRIES) == -1) {
+        perror("start_server_uring-io_uring_setup()");
+        exit(EXIT_FAILURE);
+    }
+    if (uring_buf_ring_init(&server->uring, &server->buf_ring,
+                URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE) == -1) {
+        perror("start_server_uring-io_uring_register()");
+        exit(EXIT_FAILURE);
+    }
+    arm_accept(server);
+    arm_inbox(server);
+    if (server->shard_id == 0) {
+        arm_console(server);
+    }
+}
+
+/**
+ * Runs the event loop of the server on io_uring. It never returns.
+ *
+ * @param server server started with start_server
+ */
+void run_server_uring(struct server_t *server)
+{
+    for (;;) {
+        // everything prepared while handling the previous completions is
+        // submitted with a single system call
+        if (uring_submit_and_wait(&server->uring, 1) == -1 &&
+                errno != EBUSY) {
+            perror("run_server_uring-io_uring_enter()");
+            exit(EXIT_FAILURE);
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&server->uring)) != NULL) {
+            uint32_t op = cqe->user_data >> 32;
+            int fd = (int) (uint32_t) cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&server->uring);
+            switch (op) {
+                case URING_OP_ACCEPT:
+                    handle_accept(server, res, flags);
+                    break;
+                case URING_OP_RECV:
+                    handle_recv(server, fd, res, flags);
+                    break;
+                case URING_OP_SEND:
+                    handle_send(server, fd, res);
+                    break;
+                case URING_OP_CONSOLE:
+                    handle_console(server, res);
+                    break;
+                case URING_OP_INBOX:
+                    handle_inbox(server, res);
+                    break;
+                case URING_OP_LISTEN:
+                    arm_accept(server);
+                    break;
+                case URING_OP_CANCEL:
+                    // the recv cancelled completes on its own
+                    break;
+            }
+        }
+        flush_scheduled_connections(server);
+    }
+}
@@ -0,0 +1,197 @@
+#include "session.h"
+
+#include <endian.h>
+
+/**
+ * Writes a 64 bits field in network byte order
+ *
+ * @param out where the field is written
+ * @param value value of the field
+ */
+static void encode_u64(char *out, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+/**
+ * Reads a 64 bits field in network byte order
+ *
+ * @param in where the field is read from
+ * @return value of the field
+ */
+static uint64_t decode_u64(const char *in)
+{
+    uint64_t value;
+    memcpy(&value, in, sizeof(value));
+    return be64toh(value);
+}
+
+/**
+ * Initializes a session with nothing sent nor received
+ *
+ * @param session session
+ * @param id id of the session
+ */
+void session_init(struct session_t *session, uint64_t id)
+{
+    session->id = id;
+    session->sent = 0;
+    session->received = 0;
+    session->acked = 0;
+    send_queue_init(&session->unacked);
+    session->chunked = 0;
+    session->chunked_channel = CHANNEL_DEFAULT;
+    channel_set_init(&session->channels);
+    session->fd = -1;
+    session->detached_at = 0;
+}
+
+/**
+ * Keeps a reference to a frame sent in the session until the peer
+ * acknowledges it. The oldest frame is dropped when there are already
+ * SESSION_REPLAY_MAX of them.
+ *
+ * @param session session
+ * @param message frame sent
+ * @return 0 on success, -1 if there's no memory
+ */
+int session_record(struct session_t *session, struct message_t *message)
+{
+    session->sent++;
+    if (session->unacked.count == SESSION_REPLAY_MAX) {
+        send_queue_pop(&session->unacked);
+    }
+    // a frame that couldn't be kept is reported as lost if it's replayed
+    if (send_queue_push(&session->unacked, message) == -1) {
+        send_queue_clear(&session->unacked);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Counts a frame received in the session
+ *
+ * @param session session
+ * @return 1 if it's time to acknowledge the frames received, 0 otherwise
+ */
+int session_received(struct session_t *session)
+{
+    session->received++;
+    return session->received - session->acked >= SESSION_ACK_INTERVAL;
+}
+
+/**
+ * Drops the frames the peer acknowledged having received
+ *
+ * @param session session
+ * @param received number of frames received by the peer
+ */
+void session_acked(struct session_t *session, uint64_t received)
+{
+    // the frames kept are the last ones sent, numbered up to sent
+    uint64_t first = session->sent - session->unacked.count + 1;
+    while (session->unacked.count > 0 && first <= received) {
+        send_queue_pop(&session->unacked);
+        first++;
+    }
+}
+
+/**
+ * Prepares the replay after the peer reconnected: the frames it received are
+ * dropped, and the ones left in unacked are those to send again.
+ *
+ * @param session session
+ * @param received number of frames received by the peer
+ * @return number of frames the peer is missing that can't be replayed
+ */
+uint64_t session_resume(struct session_t *session, uint64_t received)
+{
+    session_acked(session, received);
+    uint64_t missing = received < session->sent ? session->sent - received : 0;
+    return missing - session->unacked.count;
+}
+
+/**
+ * Drops every frame kept by the session, and the messages held by its
+ * channels
+ *
+ * @param session session
+ */
+void session_clear(struct session_t *session)
+{
+    send_queue_clear(&session->unacked);
+    channel_set_clear(&session->channels);
+}
+
+/**
+ * Creates the FRAME_TYPE_HELLO frame that opens or resumes the session
+ *
+ * @param session session
+ * @param lost number of frames that can't be replayed
+ * @return the frame, or NULL if there's no memory
+ */
+struct message_t *session_hello(const struct session_t *session,
+        uint64_t lost)
+{
+    char payload[SESSION_HELLO_SIZE];
+    encode_u64(payload, session->id);
+    encode_u64(payload + 8, session->received);
+    encode_u64(payload + 16, lost);
+    return message_create(FRAME_TYPE_HELLO, payload, sizeof(payload));
+}
+
+/**
+ * Creates the FRAME_TYPE_ACK frame acknowledging the frames received
+ *
+ * @param session session, whose received count is marked as acknowledged
+ * @return the frame, or NULL if there's no memory
+ */
+struct message_t *session_ack(struct session_t *session)
+{
+    char payload[SESSION_ACK_SIZE];
+    encode_u64(payload, session->received);
+    session->acked = session->received;
+    return message_create(FRAME_TYPE_ACK, payload, sizeof(payload));
+}
+
+/**
+ * Decodes the payload of a FRAME_TYPE_HELLO frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param id id of the session
+ * @param received number of frames received by the sender
+ * @param lost number of frames the sender can't replay
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int session_decode_hello(const char *payload, uint32_t length, uint64_t *id,
+        uint64_t *received, uint64_t *lost)
+{
+    if (length != SESSION_HELLO_SIZE) {
+        return -1;
+    }
+    *id = decode_u64(payload);
+    *received = decode_u64(payload + 8);
+    *lost = decode_u64(payload + 16);
+    return 0;
+}
+
+/**
+ * Decodes the payload of a FRAME_TYPE_ACK frame
+ *
+ * @param payload payload of the frame
+ * @param length number of bytes of the payload
+ * @param received number of frames received by the sender
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int session_decode_ack(const char *payload, uint32_t length,
+        uint64_t *received)
+{
+    if (length != SESSION_ACK_SIZE) {
+        return -1;
+    }
+    *received = decode_u64(payload);
+    return 0;
+}
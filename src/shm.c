@@ -0,0 +1,468 @@
+#include "shm.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Creates a region of shared memory with empty rings, backed by an anonymous
+ * file
+ *
+ * @param fd file descriptor of the region, to be passed to the client and
+ * closed
+ * @return the region mapped, or NULL on error
+ */
+struct shm_region_t *shm_create(int *fd)
+{
+    *fd = memfd_create("client_server-shm", MFD_CLOEXEC);
+    if (*fd == -1) {
+        perror("shm_create-memfd_create()");
+        return NULL;
+    }
+    if (ftruncate(*fd, sizeof(struct shm_region_t)) == -1) {
+        perror("shm_create-ftruncate()");
+        close(*fd);
+        return NULL;
+    }
+    struct shm_region_t *region = (struct shm_region_t *) mmap(NULL,
+            sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (region == MAP_FAILED) {
+        perror("shm_create-mmap()");
+        close(*fd);
+        return NULL;
+    }
+    // a new file is zero filled, so both rings are already empty, and the
+    // server waits for the first frames of the client
+    region->magic = SHM_MAGIC;
+    region->to_server.data_waiter = 1;
+    return region;
+}
+
+/**
+ * Maps a region created by the server
+ *
+ * @param fd file descriptor of the region, can be closed afterwards
+ * @return the region mapped, or NULL on error or if it isn't a region
+ */
+struct shm_region_t *shm_map(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("shm_map-fstat()");
+        return NULL;
+    }
+    if ((size_t) st.st_size != sizeof(struct shm_region_t)) {
+        fprintf(stderr, "shm_map: not a region of this version\n");
+        return NULL;
+    }
+    struct shm_region_t *region = (struct shm_region_t *) mmap(NULL,
+            sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        perror("shm_map-mmap()");
+        return NULL;
+    }
+    if (region->magic != SHM_MAGIC) {
+        fprintf(stderr, "shm_map: not a region of this version\n");
+        munmap(region, sizeof(*region));
+        return NULL;
+    }
+    return region;
+}
+
+/**
+ * Unmaps a region
+ *
+ * @param region region, may be NULL
+ */
+void shm_unmap(struct shm_region_t *region)
+{
+    if (region != NULL) {
+        munmap(region, sizeof(*region));
+    }
+}
+
+/**
+ * Passes the file descriptor of a region through a unix socket
+ *
+ * @param socketfd connected unix socket
+ * @param fd file descriptor passed
+ * @return 0 on success, -1 on error
+ */
+int shm_send_fd(int socketfd, int fd)
+{
+    // a control message needs at least a byte of data to go with
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(socketfd, &msg, MSG_NOSIGNAL) != 1) {
+        perror("shm_send_fd-sendmsg()");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receives the file descriptor of a region passed through a unix socket
+ *
+ * @param socketfd connected blocking unix socket
+ * @return the file descriptor received, or -1 on error
+ */
+int shm_recv_fd(int socketfd)
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t received;
+    do {
+        received = recvmsg(socketfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+    if (received <= 0) {
+        if (received == -1) {
+            perror("shm_recv_fd-recvmsg()");
+        }
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        fprintf(stderr, "shm_recv_fd: the server isn't a shm endpoint\n");
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * Returns the bytes of the ring that can be read without wrapping around.
+ * Only called by the consumer.
+ *
+ * @param ring ring
+ * @param bytes first byte that can be read
+ * @return number of bytes that can be read from bytes
+ */
+size_t shm_ring_peek(struct shm_ring_t *ring, const char **bytes)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = ring->head & (SHM_RING_SIZE - 1);
+    size_t available = tail - ring->head;
+    if (available > SHM_RING_SIZE - offset) {
+        available = SHM_RING_SIZE - offset;
+    }
+    *bytes = ring->bytes + offset;
+    return available;
+}
+
+/**
+ * Marks bytes returned by shm_ring_peek as read. Only called by the consumer.
+ *
+ * @param ring ring
+ * @param length number of bytes read
+ */
+void shm_ring_consume(struct shm_ring_t *ring, size_t length)
+{
+    __atomic_store_n(&ring->head, ring->head + length, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies as many bytes of iov as fit in the ring. Only called by the
+ * producer.
+ *
+ * @param ring ring
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @return number of bytes written
+ */
+size_t shm_ring_write(struct shm_ring_t *ring, const struct iovec *iov,
+        int iovcnt)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    size_t room = SHM_RING_SIZE - (tail - head);
+    size_t written = 0;
+    for (int i = 0; i < iovcnt && room > 0; ++i) {
+        const char *base = (const char *) iov[i].iov_base;
+        size_t length = iov[i].iov_len < room ? iov[i].iov_len : room;
+        size_t offset = (tail + written) & (SHM_RING_SIZE - 1);
+        size_t first = length < SHM_RING_SIZE - offset ? length :
+            SHM_RING_SIZE - offset;
+        memcpy(ring->bytes + offset, base, first);
+        memcpy(ring->bytes, base + first, length - first);
+        written += length;
+        room -= length;
+    }
+    if (written > 0) {
+        __atomic_store_n(&ring->tail, tail + written, __ATOMIC_RELEASE);
+    }
+    return written;
+}
+
+/**
+ * Arms the waiter of the consumer unless the ring has bytes to read. Called
+ * by a consumer that found the ring empty before it sleeps.
+ *
+ * @param ring ring
+ * @return 1 if the waiter is armed, 0 if there are bytes to read after all
+ */
+int shm_ring_arm_data(struct shm_ring_t *ring)
+{
+    __atomic_store_n(&ring->data_waiter, 1, __ATOMIC_RELAXED);
+    // pairs with the fence of shm_take_waiter: either the producer sees the
+    // waiter armed or the consumer sees the bytes written
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+        __atomic_store_n(&ring->data_waiter, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Arms the waiter of the producer unless the ring has room. Called by a
+ * producer that found the ring full before it sleeps.
+ *
+ * @param ring ring
+ * @return 1 if the waiter is armed, 0 if there's room after all
+ */
+int shm_ring_arm_space(struct shm_ring_t *ring)
+{
+    __atomic_store_n(&ring->space_waiter, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <
+            SHM_RING_SIZE) {
+        __atomic_store_n(&ring->space_waiter, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Disarms a waiter after the ring changed under it
+ *
+ * @param waiter data_waiter or space_waiter of a ring
+ * @return 1 if it was armed and its side has to be woken up, 0 otherwise
+ */
+int shm_take_waiter(uint32_t *waiter)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // a plain read first, so that a busy ring doesn't bounce the cache line
+    if (__atomic_load_n(waiter, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    return __atomic_exchange_n(waiter, 0, __ATOMIC_ACQ_REL) != 0;
+}
+
+/**
+ * Wakes up the client sleeping on a waiter, if it's armed
+ *
+ * @param waiter data_waiter or space_waiter of a ring
+ */
+void shm_futex_wake(uint32_t *waiter)
+{
+    if (shm_take_waiter(waiter)) {
+        // not FUTEX_PRIVATE_FLAG: the sleeper is another process
+        syscall(SYS_futex, waiter, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Tells whether the server closed its end of the socket
+ *
+ * @param socketfd socket connected to the server
+ * @return 1 if it's gone, 0 otherwise
+ */
+static int server_gone(int socketfd)
+{
+    struct pollfd pfd = {socketfd, POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) == 1 &&
+        (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+/**
+ * Sleeps until the waiter is disarmed by the other side or SHM_WAIT_TIMEOUT
+ * passes
+ *
+ * @param waiter armed data_waiter or space_waiter of a ring
+ * @param socketfd socket connected to the server
+ * @return 0 when woken up or after the timeout, -1 if the server is gone
+ */
+static int wait_waiter(uint32_t *waiter, int socketfd)
+{
+    struct timespec timeout = {0, SHM_WAIT_TIMEOUT * 1000000L};
+    if (syscall(SYS_futex, waiter, FUTEX_WAIT, 1, &timeout, NULL, 0) == -1 &&
+            errno == ETIMEDOUT && server_gone(socketfd)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wakes up the server through the socket, one byte being enough however many
+ * frames are waiting
+ *
+ * @param socketfd socket connected to the server
+ * @return 0 on success, -1 if the server is gone
+ */
+static int wake_server(int socketfd)
+{
+    char token = 0;
+    ssize_t sent;
+    do {
+        sent = send(socketfd, &token, 1, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent == 1 ? 0 : -1;
+}
+
+/**
+ * Writes all the bytes to the ring of the client, sleeping while it's full,
+ * and wakes up the server through socketfd when it waits for them
+ *
+ * @param ring to_server ring
+ * @param socketfd socket connected to the server
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @return 1 on success, -1 if the server is gone
+ */
+int shm_send_all(struct shm_ring_t *ring, int socketfd, struct iovec *iov,
+        int iovcnt)
+{
+    int spins = 0;
+    while (iovcnt > 0) {
+        size_t written = shm_ring_write(ring, iov, iovcnt);
+        if (written > 0) {
+            spins = 0;
+            if (shm_take_waiter(&ring->data_waiter) &&
+                    wake_server(socketfd) == -1) {
+                return -1;
+            }
+        }
+        // skips the buffers written, and what was written of the next one
+        while (iovcnt > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt == 0) {
+            break;
+        }
+        iov->iov_base = (char *) iov->iov_base + written;
+        iov->iov_len -= written;
+        if (++spins < SHM_SPIN_COUNT) {
+            continue;
+        }
+        if (shm_ring_arm_space(ring) &&
+                wait_waiter(&ring->space_waiter, socketfd) == -1) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Reads exactly length bytes from the ring of the client, sleeping while
+ * it's empty
+ *
+ * @param ring to_client ring
+ * @param socketfd socket connected to the server
+ * @param buffer where the bytes are stored
+ * @param length number of bytes to read
+ * @return 1 on success, 0 if the server is gone
+ */
+static int ring_read_all(struct shm_ring_t *ring, int socketfd, char *buffer,
+        size_t length)
+{
+    int spins = 0;
+    while (length > 0) {
+        const char *bytes;
+        size_t available = shm_ring_peek(ring, &bytes);
+        if (available > 0) {
+            size_t count = available < length ? available : length;
+            memcpy(buffer, bytes, count);
+            shm_ring_consume(ring, count);
+            buffer += count;
+            length -= count;
+            spins = 0;
+            // the server waits for room to send the rest of its queue
+            if (shm_take_waiter(&ring->space_waiter) &&
+                    wake_server(socketfd) == -1) {
+                return 0;
+            }
+            continue;
+        }
+        if (++spins < SHM_SPIN_COUNT) {
+            continue;
+        }
+        if (shm_ring_arm_data(ring) &&
+                wait_waiter(&ring->data_waiter, socketfd) == -1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Receives a whole frame from the ring of the client, sleeping while it's
+ * empty, as recv_frame_pooled does from a socket
+ *
+ * @param ring to_client ring
+ * @param socketfd socket connected to the server
+ * @param h header of the frame received
+ * @param pool pool the buffers are taken from
+ * @param payload buffer of the pool where the payload is stored, or NULL
+ * @param capacity size of *payload
+ * @return 1 on success, 0 if the server is gone, -1 on error or if the frame
+ * is bigger than FRAME_MAX_PAYLOAD
+ */
+int shm_recv_frame_pooled(struct shm_ring_t *ring, int socketfd,
+        struct frame_header_t *h, struct buffer_pool_t *pool, char **payload,
+        size_t *capacity)
+{
+    char header[FRAME_HEADER_SIZE];
+    if (!ring_read_all(ring, socketfd, header, FRAME_HEADER_SIZE)) {
+        return 0;
+    }
+    frame_decode_header(header, h);
+    if (h->length > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (*payload == NULL || *capacity < h->length + 1) {
+        pool_free(pool, *payload, *capacity);
+        *payload = (char *) pool_alloc(pool, h->length + 1, capacity);
+        if (*payload == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    (*payload)[h->length] = '\0';
+    return ring_read_all(ring, socketfd, *payload, h->length);
+}
@@ -0,0 +1,99 @@
+#include "spsc.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/**
+ * Initializes an empty ring
+ *
+ * @param ring ring
+ * @param capacity max number of items, a power of 2
+ * @return 0 on success, -1 if there's no memory
+ */
+int spsc_ring_init(struct spsc_ring_t *ring, size_t capacity)
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    ring->slots = (void **) malloc(capacity * sizeof(*ring->slots));
+    if (ring->slots == NULL) {
+        return -1;
+    }
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->cached_tail = 0;
+    ring->tail = 0;
+    ring->cached_head = 0;
+    return 0;
+}
+
+/**
+ * Frees the slots of the ring. The items still in it are not freed.
+ *
+ * @param ring ring
+ */
+void spsc_ring_destroy(struct spsc_ring_t *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/**
+ * Appends an item to the ring. Only called by the producer.
+ *
+ * @param ring ring
+ * @param item item
+ * @return 1 if the item was pushed, 0 if the ring is full
+ */
+int spsc_ring_push(struct spsc_ring_t *ring, void *item)
+{
+    size_t tail = ring->tail;
+    if (tail - ring->cached_head > ring->mask) {
+        // the acquire pairs with the release of the consumer, so the slot is
+        // not overwritten before it has been read
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head > ring->mask) {
+            return 0;
+        }
+    }
+    ring->slots[tail & ring->mask] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Removes up to max items from the front of the ring. Only called by the
+ * consumer.
+ *
+ * @param ring ring
+ * @param items where the items are stored
+ * @param max max number of items to remove
+ * @return number of items removed
+ */
+size_t spsc_ring_pop(struct spsc_ring_t *ring, void **items, size_t max)
+{
+    size_t head = ring->head;
+    if (ring->cached_tail - head < max) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    size_t count = ring->cached_tail - head;
+    if (count > max) {
+        count = max;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        items[i] = ring->slots[(head + i) & ring->mask];
+    }
+    if (count > 0) {
+        __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+/**
+ * Tells whether the ring is empty. Only called by the consumer.
+ *
+ * @param ring ring
+ * @return 1 if empty, 0 otherwise
+ */
+int spsc_ring_empty(struct spsc_ring_t *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
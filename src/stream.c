@@ -0,0 +1,303 @@
+#include "stream.h"
+#include "frame.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+/**
+ * Sends the header of a FRAME_TYPE_STREAM frame announcing a chunk of length
+ * bytes. It is sent with MSG_MORE as the chunk follows right away.
+ *
+ * @param socketfd connected socket
+ * @param length number of bytes of the chunk
+ * @return 1 on success, -1 on error
+ */
+static int send_stream_header(int socketfd, uint32_t length)
+{
+    struct frame_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.length = length;
+    h.type = FRAME_TYPE_STREAM;
+    char header[FRAME_HEADER_SIZE];
+    frame_encode_header(&h, header);
+    size_t sent = 0;
+    while (sent < FRAME_HEADER_SIZE) {
+        ssize_t status = send(socketfd, header + sent, FRAME_HEADER_SIZE - sent,
+                MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0));
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += status;
+    }
+    return 1;
+}
+
+/**
+ * Streams the regular file fd with sendfile, from its current offset to its
+ * end, in chunks of up to FRAME_MAX_STREAM_CHUNK bytes
+ *
+ * @param socketfd connected socket
+ * @param fd regular file
+ * @param size size of the file
+ * @param sent incremented with the number of bytes sent
+ * @return 1 on success, -1 on error
+ */
+static int send_file_chunks(int socketfd, int fd, off_t size, uint64_t *sent)
+{
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1) {
+        return -1;
+    }
+    while (offset < size) {
+        size_t chunk = size - offset;
+        if (chunk > FRAME_MAX_STREAM_CHUNK) {
+            chunk = FRAME_MAX_STREAM_CHUNK;
+        }
+        if (send_stream_header(socketfd, chunk) == -1) {
+            return -1;
+        }
+        while (chunk > 0) {
+            ssize_t status = sendfile(socketfd, fd, &offset, chunk);
+            if (status == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (status == 0) {
+                // the file was truncated after the header was sent, the
+                // receiver would wait forever for the rest of the chunk
+                errno = EIO;
+                return -1;
+            }
+            chunk -= status;
+            *sent += status;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Streams fd by reading it into a buffer, for descriptors that can't be
+ * spliced
+ *
+ * @param socketfd connected socket
+ * @param fd readable descriptor
+ * @param sent incremented with the number of bytes sent
+ * @return 1 on success, -1 on error
+ */
+static int send_copied_chunks(int socketfd, int fd, uint64_t *sent)
+{
+    char *buffer = (char *) malloc(STREAM_COPY_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    int ret = 1;
+    for (;;) {
+        ssize_t length = read(fd, buffer, STREAM_COPY_SIZE);
+        if (length == -1 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            ret = length == 0 ? 1 : -1;
+            break;
+        }
+        struct iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = length;
+        if (send_stream_header(socketfd, length) == -1 ||
+                send_all(socketfd, &iov, 1) == -1) {
+            ret = -1;
+            break;
+        }
+        *sent += length;
+    }
+    free(buffer);
+    return ret;
+}
+
+/**
+ * Streams fd by splicing it into an intermediate pipe, which tells the length
+ * of every chunk before it is spliced from the pipe into the socket. Falls
+ * back to copying when fd can't be spliced.
+ *
+ * @param socketfd connected socket
+ * @param fd pipe, socket or any other readable descriptor
+ * @param sent incremented with the number of bytes sent
+ * @return 1 on success, -1 on error
+ */
+static int send_spliced_chunks(int socketfd, int fd, uint64_t *sent)
+{
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    // a bigger pipe means fewer headers and system calls, the default size
+    // is used if it can't be resized
+    fcntl(pipefd[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    int ret = 1;
+    for (;;) {
+        ssize_t length = splice(fd, NULL, pipefd[1], NULL, STREAM_PIPE_SIZE,
+                SPLICE_F_MOVE);
+        if (length == -1 && errno == EINTR) {
+            continue;
+        }
+        if (length == -1 && errno == EINVAL && *sent == 0) {
+            ret = send_copied_chunks(socketfd, fd, sent);
+            break;
+        }
+        if (length <= 0) {
+            ret = length == 0 ? 1 : -1;
+            break;
+        }
+        if (send_stream_header(socketfd, length) == -1) {
+            ret = -1;
+            break;
+        }
+        size_t remaining = length;
+        while (remaining > 0) {
+            ssize_t status = splice(pipefd[0], NULL, socketfd, NULL, remaining,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (status == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ret = -1;
+                break;
+            }
+            remaining -= status;
+        }
+        if (ret == -1) {
+            break;
+        }
+        *sent += length;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret;
+}
+
+/**
+ * Sends everything that can be read from fd through the blocking socket
+ * socketfd as a stream, ending it with an empty FRAME_TYPE_STREAM frame
+ *
+ * @param socketfd connected socket
+ * @param fd regular file, pipe or any other readable descriptor
+ * @param sent set to the number of bytes of the stream sent
+ * @return 1 on success, -1 on error
+ */
+int send_stream(int socketfd, int fd, uint64_t *sent)
+{
+    *sent = 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    int status = S_ISREG(st.st_mode) ?
+        send_file_chunks(socketfd, fd, st.st_size, sent) :
+        send_spliced_chunks(socketfd, fd, sent);
+    if (status == -1) {
+        return -1;
+    }
+    return send_stream_header(socketfd, 0);
+}
+
+/**
+ * Streams the file options->send_path, or stdin if it is "-", to the server
+ * through the connected client and prints the number of bytes sent. Exits
+ * the program if the file can't be opened or the stream fails.
+ *
+ * @param client client connected to the server
+ * @param options arguments given in the command line
+ */
+void run_send(struct client_t *client, struct options_t *options)
+{
+    // the kernel moves the stream from the file to a socket, there is no
+    // such shortcut to a ring
+    if (client->shm != NULL) {
+        fprintf(stderr, "Streams can't be sent to a shm endpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = STDIN_FILENO;
+    if (strcmp(options->send_path, "-") != 0) {
+        fd = open(options->send_path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror("run_send-open()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // sendfile and splice have no MSG_NOSIGNAL, a server going away must be
+    // reported as an error instead of killing the program
+    signal(SIGPIPE, SIG_IGN);
+    uint64_t sent;
+    if (send_stream(client->socket_connected, fd, &sent) == -1) {
+        perror("run_send-send_stream()");
+        exit(EXIT_FAILURE);
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    printf("%llu bytes sent\n", (unsigned long long) sent);
+}
+
+/**
+ * Writes all the bytes to the blocking descriptor fd, resuming after short
+ * writes
+ *
+ * @param fd descriptor
+ * @param bytes bytes to write
+ * @param length number of bytes to write
+ * @return 1 on success, -1 on error
+ */
+int write_all(int fd, const char *bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t status = write(fd, bytes, length);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += status;
+        length -= status;
+    }
+    return 1;
+}
+
+/**
+ * Moves exactly length bytes out of the pipe pipefd into the blocking
+ * descriptor fd with splice, copying them through user space only if fd
+ * can't be spliced (i.e. a terminal)
+ *
+ * @param pipefd read end of a pipe holding at least length bytes
+ * @param fd descriptor to write to
+ * @param length number of bytes to move
+ * @return 1 on success, -1 on error
+ */
+int drain_pipe(int pipefd, int fd, size_t length)
+{
+    while (length > 0) {
+        ssize_t status = splice(pipefd, NULL, fd, NULL, length, SPLICE_F_MOVE);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
+        if (status == -1 && errno == EINVAL) {
+            char buffer[4096];
+            size_t count = length < sizeof(buffer) ? length : sizeof(buffer);
+            status = read(pipefd, buffer, count);
+            if (status <= 0 || write_all(fd, buffer, status) == -1) {
+                return -1;
+            }
+        } else if (status <= 0) {
+            return -1;
+        }
+        length -= status;
+    }
+    return 1;
+}
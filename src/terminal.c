@@ -0,0 +1,399 @@
+#include "terminal.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/**
+ * Writes the whole buffer, resuming after short writes
+ *
+ * @param fd file descriptor
+ * @param buffer bytes to write
+ * @param length number of bytes
+ * @return 1 on success, -1 on error
+ */
+static int write_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 1;
+}
+
+/**
+ * Reads the size of the terminal
+ *
+ * @param terminal renderer drawing on a terminal
+ * @return 1 if it changed since the last time, 0 otherwise
+ */
+static int update_size(struct terminal_t *terminal)
+{
+    struct winsize w;
+    if (ioctl(terminal->fd, TIOCGWINSZ, &w) == -1) {
+        return 0;
+    }
+    if (w.ws_row == terminal->rows && w.ws_col == terminal->cols) {
+        return 0;
+    }
+    terminal->rows = w.ws_row;
+    terminal->cols = w.ws_col;
+    return 1;
+}
+
+/**
+ * Makes sure that the frame has room for length more bytes
+ *
+ * @param terminal renderer
+ * @param length number of bytes to append
+ * @return 0 on success, -1 if there's no memory
+ */
+static int reserve_frame(struct terminal_t *terminal, size_t length)
+{
+    size_t needed = terminal->frame_length + length;
+    if (needed <= terminal->frame_capacity) {
+        return 0;
+    }
+    size_t capacity = terminal->frame_capacity > 0 ?
+        terminal->frame_capacity : TERMINAL_FRAME_SIZE;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    char *frame = (char *) realloc(terminal->frame, capacity);
+    if (frame == NULL) {
+        return -1;
+    }
+    terminal->frame = frame;
+    terminal->frame_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Appends bytes to the frame
+ *
+ * @param terminal renderer
+ * @param bytes bytes to append
+ * @param length number of bytes
+ * @return 0 on success, -1 if there's no memory
+ */
+static int append(struct terminal_t *terminal, const char *bytes,
+        size_t length)
+{
+    if (reserve_frame(terminal, length) == -1) {
+        return -1;
+    }
+    memcpy(terminal->frame + terminal->frame_length, bytes, length);
+    terminal->frame_length += length;
+    return 0;
+}
+
+/**
+ * Appends the text of a line to the frame, without its trailing newline,
+ * replacing the control characters
+ *
+ * @param terminal renderer drawing on a terminal
+ * @param text text of the line
+ * @param length number of bytes of the text
+ * @return 0 on success, -1 if there's no memory
+ */
+static int append_text(struct terminal_t *terminal, const char *text,
+        size_t length)
+{
+    if (length > 0 && text[length - 1] == '\n') {
+        length--;
+    }
+    // only the end of a line longer than the screen stays on it
+    size_t limit = (size_t) terminal->rows * terminal->cols;
+    if (length > limit) {
+        text += length - limit;
+        length = limit;
+    }
+    // every newline can turn into two bytes
+    if (reserve_frame(terminal, 2 * length) == -1) {
+        return -1;
+    }
+    char *out = terminal->frame + terminal->frame_length;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = (unsigned char) text[i];
+        if (c == '\n') {
+            *out++ = '\r';
+            *out++ = '\n';
+        } else if ((c < 0x20 && c != '\t') || c == 0x7f) {
+            *out++ = '?';
+        } else {
+            *out++ = (char) c;
+        }
+    }
+    terminal->frame_length = out - terminal->frame;
+    return 0;
+}
+
+/**
+ * Returns a line of the scrollback
+ *
+ * @param terminal renderer
+ * @param age 0 for the newest line, 1 for the one before, and so on
+ * @return the line
+ */
+static struct terminal_line_t *line_at(struct terminal_t *terminal,
+        size_t age)
+{
+    return &terminal->lines[(terminal->first + terminal->count - 1 - age) %
+        TERMINAL_SCROLLBACK];
+}
+
+/**
+ * Appends the prefix of a line to the frame, followed by the channel of its
+ * message unless it's CHANNEL_DEFAULT. A line going on with the one before
+ * has none.
+ *
+ * @param terminal renderer
+ * @param line line of the scrollback
+ * @return 0 on success, -1 if there's no memory
+ */
+static int append_prefix(struct terminal_t *terminal,
+        struct terminal_line_t *line)
+{
+    if (line->continued) {
+        return 0;
+    }
+    if (append(terminal, line->prefix, strlen(line->prefix)) == -1) {
+        return -1;
+    }
+    uint16_t channel = message_channel(line->message);
+    if (channel == CHANNEL_DEFAULT) {
+        return 0;
+    }
+    char label[16];
+    snprintf(label, sizeof(label), "#%u ", (unsigned int) channel);
+    return append(terminal, label, strlen(label));
+}
+
+/**
+ * Composes a frame with the lines pending as they were received. A line
+ * left open by a message that didn't go on is ended before the next one.
+ *
+ * @param terminal renderer not drawing on a terminal
+ * @return 0 on success, -1 if there's no memory
+ */
+static int compose_plain(struct terminal_t *terminal)
+{
+    for (size_t age = terminal->pending; age-- > 0;) {
+        struct terminal_line_t *line = line_at(terminal, age);
+        size_t length = line->message->length - FRAME_HEADER_SIZE;
+        const char *text = message_payload(line->message);
+        if ((terminal->open && !line->continued &&
+                    append(terminal, "\n", 1) == -1) ||
+                append_prefix(terminal, line) == -1 ||
+                append(terminal, text, length) == -1) {
+            return -1;
+        }
+        terminal->open = length == 0 || text[length - 1] != '\n';
+    }
+    return 0;
+}
+
+/**
+ * Composes a frame scrolling the lines pending into the region above the
+ * last row, or drawing the whole region again after a resize
+ *
+ * @param terminal renderer drawing on a terminal
+ * @return 0 on success, -1 if there's no memory
+ */
+static int compose_ansi(struct terminal_t *terminal)
+{
+    char sequence[32];
+    size_t region = terminal->rows - 1;
+    size_t count = terminal->redraw ? terminal->count : terminal->pending;
+    if (count > region) {
+        count = region;
+    }
+    // the cursor is left where the line is being typed
+    if (append(terminal, "\0337", 2) == -1) {
+        return -1;
+    }
+    if (terminal->redraw) {
+        snprintf(sequence, sizeof(sequence), "\033[1;%zur", region);
+        if (append(terminal, sequence, strlen(sequence)) == -1) {
+            return -1;
+        }
+    }
+    snprintf(sequence, sizeof(sequence), "\033[%zu;1H", region);
+    if (append(terminal, sequence, strlen(sequence)) == -1) {
+        return -1;
+    }
+    // every newline at the bottom of the region scrolls it up, so redrawing
+    // starts by scrolling out what was left there
+    for (size_t i = terminal->redraw ? count : region; i < region; ++i) {
+        if (append(terminal, "\n", 1) == -1) {
+            return -1;
+        }
+    }
+    for (size_t age = count; age-- > 0;) {
+        struct terminal_line_t *line = line_at(terminal, age);
+        if (append(terminal, "\n\r", 2) == -1 ||
+                append_prefix(terminal, line) == -1 ||
+                append_text(terminal, message_payload(line->message),
+                    line->message->length - FRAME_HEADER_SIZE) == -1) {
+            return -1;
+        }
+    }
+    return append(terminal, "\0338", 2);
+}
+
+/**
+ * Initializes a renderer with an empty scrollback. ANSI sequences are only
+ * used when asked to and fd is a terminal.
+ *
+ * @param terminal renderer
+ * @param fd where the frames are written
+ * @param ansi 1 to draw with ANSI sequences if fd is a terminal, 0 not to
+ */
+void terminal_init(struct terminal_t *terminal, int fd, int ansi)
+{
+    terminal->fd = fd;
+    terminal->rows = 0;
+    terminal->cols = 0;
+    terminal->ansi = ansi && isatty(fd);
+    if (terminal->ansi) {
+        update_size(terminal);
+        // there must be a row for the messages and another one to type
+        terminal->ansi = terminal->rows >= 2 && terminal->cols > 0;
+    }
+    terminal->first = 0;
+    terminal->count = 0;
+    terminal->pending = 0;
+    terminal->more = 0;
+    terminal->channel = CHANNEL_DEFAULT;
+    terminal->prefix = "";
+    terminal->open = 0;
+    terminal->redraw = 1;
+    terminal->last_frame = 0;
+    terminal->frame = NULL;
+    terminal->frame_capacity = 0;
+    terminal->frame_length = 0;
+}
+
+/**
+ * Adds a line to the scrollback, to be drawn by the next frame. When the
+ * output isn't a terminal, the lines are written before the scrollback drops
+ * any of them. A chunk going on with the message of the line before is
+ * drawn without prefix, and not at all if it's empty.
+ *
+ * @param terminal renderer
+ * @param message message holding the text, the renderer takes the reference
+ * @param prefix shown before the text, must outlive the renderer
+ */
+void terminal_add(struct terminal_t *terminal, struct message_t *message,
+        const char *prefix)
+{
+    int continued = terminal->more && terminal->channel ==
+        message_channel(message) && strcmp(terminal->prefix, prefix) == 0;
+    terminal->more = message_has_more(message);
+    terminal->channel = message_channel(message);
+    terminal->prefix = prefix;
+    // the last chunk of a message cut short only ends it
+    if (continued && message->length == FRAME_HEADER_SIZE) {
+        message_unref(message);
+        return;
+    }
+    if (!terminal->ansi && terminal->pending == TERMINAL_SCROLLBACK) {
+        terminal_render(terminal);
+    }
+    if (terminal->count == TERMINAL_SCROLLBACK) {
+        message_unref(terminal->lines[terminal->first].message);
+        terminal->first = (terminal->first + 1) % TERMINAL_SCROLLBACK;
+        terminal->count--;
+    }
+    struct terminal_line_t *line = &terminal->lines[(terminal->first +
+            terminal->count) % TERMINAL_SCROLLBACK];
+    line->message = message;
+    line->prefix = prefix;
+    line->continued = continued;
+    terminal->count++;
+    // on a terminal, the lines dropped unseen had scrolled out anyway
+    if (terminal->pending < TERMINAL_SCROLLBACK) {
+        terminal->pending++;
+    }
+}
+
+/**
+ * Returns how long to wait before the next frame can be drawn
+ *
+ * @param terminal renderer with lines pending
+ * @return nanoseconds, 0 if it can be drawn now
+ */
+uint64_t terminal_frame_wait(struct terminal_t *terminal)
+{
+    uint64_t elapsed = metrics_now() - terminal->last_frame;
+    return elapsed >= TERMINAL_FRAME_INTERVAL ? 0 :
+        TERMINAL_FRAME_INTERVAL - elapsed;
+}
+
+/**
+ * Draws the lines added since the last frame with a single write
+ *
+ * @param terminal renderer
+ * @return 1 on success, -1 on error
+ */
+int terminal_render(struct terminal_t *terminal)
+{
+    terminal->frame_length = 0;
+    if (terminal->ansi && update_size(terminal)) {
+        terminal->redraw = 1;
+    }
+    int status = terminal->ansi && terminal->rows >= 2 ?
+        compose_ansi(terminal) : compose_plain(terminal);
+    terminal->pending = 0;
+    terminal->redraw = 0;
+    terminal->last_frame = metrics_now();
+    if (status == -1) {
+        fprintf(stderr, "terminal_render: out of memory\n");
+        return -1;
+    }
+    return write_all(terminal->fd, terminal->frame, terminal->frame_length);
+}
+
+/**
+ * Clears the last row, once the line typed there was read
+ *
+ * @param terminal renderer
+ */
+void terminal_clear_input(struct terminal_t *terminal)
+{
+    static const char clear[] = "\r\033[2K";
+    if (terminal->ansi) {
+        write_all(terminal->fd, clear, sizeof(clear) - 1);
+    }
+}
+
+/**
+ * Gives the whole screen back to the terminal and frees the scrollback
+ *
+ * @param terminal renderer
+ */
+void terminal_destroy(struct terminal_t *terminal)
+{
+    // resetting the scroll region moves the cursor, which is put back
+    static const char reset[] = "\0337\033[r\0338";
+    if (terminal->ansi && terminal->last_frame != 0) {
+        write_all(terminal->fd, reset, sizeof(reset) - 1);
+    }
+    for (size_t i = 0; i < terminal->count; ++i) {
+        message_unref(terminal->lines[(terminal->first + i) %
+                TERMINAL_SCROLLBACK].message);
+    }
+    terminal->count = 0;
+    free(terminal->frame);
+    terminal->frame = NULL;
+}
@@ -0,0 +1,219 @@
+#include "trace.h"
+#include "stream.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/** protects the list of rings */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** rings of every thread that recorded an event */
+static struct trace_ring_t *rings;
+
+/** number of rings of the list */
+static uint32_t rings_count;
+
+/** ring of the calling thread, NULL until it records an event */
+static __thread struct trace_ring_t *local_ring;
+
+/**
+ * Returns the ring of the calling thread, registering it on first use. A ring
+ * is never freed, so that the events of the threads that finished are still
+ * part of the dumps.
+ *
+ * @return the ring, or NULL if there's no memory
+ */
+static struct trace_ring_t *thread_ring()
+{
+    if (local_ring != NULL) {
+        return local_ring;
+    }
+    struct trace_ring_t *ring = (struct trace_ring_t *) calloc(1,
+            sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    rings_count++;
+    pthread_mutex_unlock(&rings_lock);
+    local_ring = ring;
+    return ring;
+}
+
+/**
+ * Returns the current monotonic time in nanoseconds
+ *
+ * @return nanoseconds
+ */
+uint64_t trace_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Records an event in the ring of the calling thread, overwriting the oldest
+ * one when it's full
+ *
+ * @param type one of the TRACE_ events
+ * @param start monotonic nanoseconds the event started at
+ * @param duration nanoseconds it lasted, 0 for an instant
+ * @param fd socket the event happened on, -1 if none
+ * @param arg value that depends on the kind of event
+ */
+void trace_record(uint32_t type, uint64_t start, uint64_t duration, int fd,
+        int64_t arg)
+{
+    struct trace_ring_t *ring = thread_ring();
+    if (ring == NULL) {
+        return;
+    }
+    struct trace_event_t *event = &ring->events[ring->head &
+        (TRACE_RING_SIZE - 1)];
+    event->start = start;
+    event->duration = duration;
+    event->arg = arg;
+    event->fd = fd;
+    event->type = type;
+    // publishes the event to the dumps
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the events of a ring, oldest first, leaving out the ones the owning
+ * thread may have overwritten meanwhile
+ *
+ * @param ring ring to copy
+ * @param events where the events are copied, room for TRACE_RING_SIZE
+ * @return number of events copied
+ */
+static uint32_t copy_ring(struct trace_ring_t *ring,
+        struct trace_event_t *events)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < head; ++i) {
+        events[i - first] = ring->events[i & (TRACE_RING_SIZE - 1)];
+    }
+    // like a seqlock: the slots written since the copy started, and the one
+    // being written now, may hold a mix of two events
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t last = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t valid = last >= TRACE_RING_SIZE ? last - TRACE_RING_SIZE + 1 : 0;
+    if (valid <= first) {
+        return head - first;
+    }
+    if (valid >= head) {
+        return 0;
+    }
+    memmove(events, events + (valid - first), (head - valid) *
+            sizeof(*events));
+    return head - valid;
+}
+
+/**
+ * Writes a dump of the rings of every thread to fd. The events a thread
+ * records while its ring is being dumped may overwrite the oldest ones, that
+ * are left out of the dump then.
+ *
+ * @param fd file or socket the dump is written to
+ * @return 0 on success, -1 on error
+ */
+int trace_dump(int fd)
+{
+    struct trace_event_t *events = (struct trace_event_t *) malloc(
+            TRACE_RING_SIZE * sizeof(*events));
+    if (events == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&rings_lock);
+    struct trace_dump_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.pid = getpid();
+    header.rings = rings_count;
+    int status = write_all(fd, (const char *) &header, sizeof(header));
+    for (struct trace_ring_t *ring = rings; ring != NULL && status != -1;
+            ring = ring->next) {
+        struct trace_ring_header_t ring_header;
+        ring_header.tid = ring->tid;
+        ring_header.count = copy_ring(ring, events);
+        status = write_all(fd, (const char *) &ring_header,
+                sizeof(ring_header));
+        if (status != -1) {
+            status = write_all(fd, (const char *) events, ring_header.count *
+                    sizeof(*events));
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    free(events);
+    return status == -1 ? -1 : 0;
+}
+
+/**
+ * Body of the thread dumping the trace: waits for TRACE_SIGNAL and writes
+ * the dump to client_server-PID.trace, replacing the previous one
+ *
+ * @param arg set of signals waited for
+ * @return never returns
+ */
+static void *run_trace(void *arg)
+{
+    sigset_t *signals = (sigset_t *) arg;
+    char path[64];
+    snprintf(path, sizeof(path), "client_server-%d.trace", (int) getpid());
+    for (;;) {
+        int number;
+        if (sigwait(signals, &number) != 0) {
+            continue;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror("run_trace-open()");
+            continue;
+        }
+        if (trace_dump(fd) == -1) {
+            perror("run_trace-write()");
+        } else {
+            fprintf(stderr, "trace written to %s\n", path);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the thread that dumps the trace every time the process gets
+ * TRACE_SIGNAL. The signal is blocked in the calling thread and in every
+ * thread created afterwards, so it must be called before creating any.
+ * Exits the program on failure.
+ */
+void trace_start()
+{
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, TRACE_SIGNAL);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        perror("trace_start-pthread_sigmask()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, run_trace, &signals) != 0) {
+        perror("trace_start-pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&attr);
+}
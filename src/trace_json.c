@@ -0,0 +1,127 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** names of the events and of their argument, indexed by TRACE_ */
+static const char *event_names[TRACE_EVENTS][2] = {
+    {"accept", "socket"},
+    {"recv", "bytes"},
+    {"send", "bytes"},
+    {"enqueue", "depth"},
+    {"dequeue", "messages"}
+};
+
+/**
+ * Reads exactly length bytes from in
+ *
+ * @param in stream the dump is read from
+ * @param out where the bytes are stored
+ * @param length number of bytes to read
+ * @return 1 on success, 0 if the dump is truncated
+ */
+static int read_exactly(FILE *in, void *out, size_t length)
+{
+    return length == 0 || fread(out, length, 1, in) == 1;
+}
+
+/**
+ * Writes an event in the Chrome trace format: spans as complete events
+ * and instants as thread scoped instant events, with times in microseconds
+ *
+ * @param out stream the JSON is written to
+ * @param event event recorded
+ * @param pid process that recorded the event
+ * @param tid thread that recorded the event
+ * @param first whether it's the first event written
+ */
+static void write_event(FILE *out, const struct trace_event_t *event,
+        uint32_t pid, uint32_t tid, int first)
+{
+    const char *name = event->type < TRACE_EVENTS ?
+        event_names[event->type][0] : "unknown";
+    const char *arg = event->type < TRACE_EVENTS ?
+        event_names[event->type][1] : "arg";
+    fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"net\",", first ? "" : ",",
+            name);
+    if (event->duration > 0) {
+        fprintf(out, "\"ph\":\"X\",\"dur\":%.3f,", event->duration / 1e3);
+    } else {
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",");
+    }
+    fprintf(out, "\"ts\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"fd\":%d,"
+            "\"%s\":%lld}}", event->start / 1e3, pid, tid, event->fd, arg,
+            (long long) event->arg);
+}
+
+/**
+ * Converts the trace dump read from in to the JSON format of the Chrome trace
+ * viewer
+ *
+ * @param in stream the dump is read from
+ * @param out stream the JSON is written to
+ * @return 0 on success, -1 if the dump is malformed
+ */
+static int convert(FILE *in, FILE *out)
+{
+    struct trace_dump_header_t header;
+    if (!read_exactly(in, &header, sizeof(header)) ||
+            memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "not a trace dump\n");
+        return -1;
+    }
+    struct trace_event_t *events = (struct trace_event_t *) malloc(
+            TRACE_RING_SIZE * sizeof(*events));
+    if (events == NULL) {
+        perror("convert-malloc()");
+        return -1;
+    }
+    int first = 1;
+    int status = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint32_t i = 0; i < header.rings; ++i) {
+        struct trace_ring_header_t ring;
+        if (!read_exactly(in, &ring, sizeof(ring)) ||
+                ring.count > TRACE_RING_SIZE ||
+                !read_exactly(in, events, ring.count * sizeof(*events))) {
+            fprintf(stderr, "truncated trace dump\n");
+            status = -1;
+            break;
+        }
+        for (uint32_t k = 0; k < ring.count; ++k) {
+            write_event(out, &events[k], header.pid, ring.tid, first);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(events);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: client_server_trace DUMP [OUTPUT]\n"
+                "Converts a trace dump to the Chrome trace format, written to "
+                "OUTPUT or stdout\n");
+        return EXIT_FAILURE;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (out == NULL) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    int status = convert(in, out);
+    fclose(in);
+    if (fclose(out) != 0) {
+        perror("fclose");
+        return EXIT_FAILURE;
+    }
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
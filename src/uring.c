@@ -0,0 +1,284 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * Maps the submission and completion rings and the submission entries of the
+ * io_uring instance described by params
+ *
+ * @param uring io_uring instance, with ring_fd set
+ * @param params parameters filled in by io_uring_setup
+ * @return 0 on success, -1 on error
+ */
+static int map_rings(struct uring_t *uring, struct io_uring_params *params)
+{
+    uring->sq_ring_size = params->sq_off.array + params->sq_entries *
+        sizeof(unsigned);
+    uring->cq_ring_size = params->cq_off.cqes + params->cq_entries *
+        sizeof(struct io_uring_cqe);
+    // newer kernels map both rings with a single mmap
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        return -1;
+    }
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ |
+                PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+                IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED) {
+            munmap(uring->sq_ring, uring->sq_ring_size);
+            return -1;
+        }
+    }
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = (struct io_uring_sqe *) mmap(NULL, uring->sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+            IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        if (uring->cq_ring != uring->sq_ring) {
+            munmap(uring->cq_ring, uring->cq_ring_size);
+        }
+        munmap(uring->sq_ring, uring->sq_ring_size);
+        return -1;
+    }
+
+    char *sq = (char *) uring->sq_ring;
+    char *cq = (char *) uring->cq_ring;
+    uring->sq_head = (unsigned *) (sq + params->sq_off.head);
+    uring->sq_tail = (unsigned *) (sq + params->sq_off.tail);
+    uring->sq_mask = *(unsigned *) (sq + params->sq_off.ring_mask);
+    uring->sq_entries = params->sq_entries;
+    uring->cq_head = (unsigned *) (cq + params->cq_off.head);
+    uring->cq_tail = (unsigned *) (cq + params->cq_off.tail);
+    uring->cq_mask = *(unsigned *) (cq + params->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+
+    // the indirection array is never used, entry i is always sqes[i]
+    unsigned *array = (unsigned *) (sq + params->sq_off.array);
+    for (unsigned i = 0; i < params->sq_entries; ++i) {
+        array[i] = i;
+    }
+    uring->sqe_tail = *uring->sq_tail;
+    return 0;
+}
+
+/**
+ * Creates an io_uring instance with room for entries submissions
+ *
+ * @param uring io_uring instance
+ * @param entries number of entries of the submission ring
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int uring_init(struct uring_t *uring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // only one thread submits and it processes completions itself, which
+    // saves the kernel from interrupting it to run task work
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    uring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (uring->ring_fd == -1 && errno == EINVAL) {
+        // older kernel without those flags
+        memset(&params, 0, sizeof(params));
+        uring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (uring->ring_fd == -1) {
+        return -1;
+    }
+    if (map_rings(uring, &params) == -1) {
+        int saved_errno = errno;
+        close(uring->ring_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Unmaps the rings and closes the io_uring instance
+ *
+ * @param uring io_uring instance
+ */
+void uring_exit(struct uring_t *uring)
+{
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->ring_fd);
+}
+
+/**
+ * Returns a zeroed submission entry to prepare. When the submission ring is
+ * full the entries prepared so far are submitted first.
+ *
+ * @param uring io_uring instance
+ * @return the submission entry, or NULL if the ring couldn't be submitted
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *uring)
+{
+    unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (uring->sqe_tail - head >= uring->sq_entries) {
+        if (uring_submit_and_wait(uring, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+        if (uring->sqe_tail - head >= uring->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &uring->sqes[uring->sqe_tail & uring->sq_mask];
+    uring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Submits all the entries prepared with a single system call and waits until
+ * at least wait_nr completions are available
+ *
+ * @param uring io_uring instance
+ * @param wait_nr number of completions to wait for
+ * @return number of entries submitted, or -1 on error (errno is set)
+ */
+int uring_submit_and_wait(struct uring_t *uring, unsigned wait_nr)
+{
+    unsigned to_submit = uring->sqe_tail - *uring->sq_tail;
+    // publish the new entries before the kernel looks at the tail
+    __atomic_store_n(uring->sq_tail, uring->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit,
+                wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        return ret;
+    }
+}
+
+/**
+ * Returns the next completion without waiting
+ *
+ * @param uring io_uring instance
+ * @return the completion, or NULL if there are none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *uring)
+{
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &uring->cqes[head & uring->cq_mask];
+}
+
+/**
+ * Marks the completion returned by uring_peek_cqe as consumed
+ *
+ * @param uring io_uring instance
+ */
+void uring_cqe_seen(struct uring_t *uring)
+{
+    __atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocates entries buffers of buffer_size bytes and registers them as the
+ * provided buffer group group_id
+ *
+ * @param uring io_uring instance
+ * @param buf_ring buffer ring
+ * @param group_id buffer group id
+ * @param entries number of buffers, a power of 2
+ * @param buffer_size size of each buffer
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int uring_buf_ring_init(struct uring_t *uring, struct uring_buf_ring_t
+        *buf_ring, uint16_t group_id, unsigned entries, unsigned buffer_size)
+{
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+    // the ring has to be page aligned
+    buf_ring->ring = (struct io_uring_buf_ring *) mmap(NULL, ring_size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring->ring == MAP_FAILED) {
+        return -1;
+    }
+    buf_ring->buffers = (char *) malloc((size_t) entries * buffer_size);
+    if (buf_ring->buffers == NULL) {
+        munmap(buf_ring->ring, ring_size);
+        errno = ENOMEM;
+        return -1;
+    }
+    buf_ring->entries = entries;
+    buf_ring->buffer_size = buffer_size;
+    buf_ring->group_id = group_id;
+    buf_ring->tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) buf_ring->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group_id;
+    if (syscall(__NR_io_uring_register, uring->ring_fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int saved_errno = errno;
+        free(buf_ring->buffers);
+        munmap(buf_ring->ring, ring_size);
+        errno = saved_errno;
+        return -1;
+    }
+    for (unsigned i = 0; i < entries; ++i) {
+        uring_buf_ring_recycle(buf_ring, i);
+    }
+    return 0;
+}
+
+/**
+ * Returns the buffer with id buffer_id to the kernel
+ *
+ * @param buf_ring buffer ring
+ * @param buffer_id id of the buffer, taken from the flags of the completion
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring_t *buf_ring,
+        uint16_t buffer_id)
+{
+    struct io_uring_buf *buf = &buf_ring->ring->bufs[buf_ring->tail &
+        (buf_ring->entries - 1)];
+    buf->addr = (uint64_t) (uintptr_t) uring_buf_ring_buffer(buf_ring,
+            buffer_id);
+    buf->len = buf_ring->buffer_size;
+    buf->bid = buffer_id;
+    buf_ring->tail++;
+    __atomic_store_n(&buf_ring->ring->tail, buf_ring->tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the memory of the buffer with id buffer_id
+ *
+ * @param buf_ring buffer ring
+ * @param buffer_id id of the buffer
+ * @return first byte of the buffer
+ */
+char *uring_buf_ring_buffer(struct uring_buf_ring_t *buf_ring,
+        uint16_t buffer_id)
+{
+    return buf_ring->buffers + (size_t) buffer_id * buf_ring->buffer_size;
+}
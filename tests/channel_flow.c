@@ -0,0 +1,223 @@
+/**
+ * Checks that a channel flooding a client with a session doesn't hold back
+ * its other channels: the client joins the channels 1 and 2 and doesn't read
+ * while another client floods the channel 1, then sends a message in the
+ * channel 2. That message must overtake the flood queued above the window,
+ * and every message of the channel 1 must still arrive, in order.
+ *
+ * Usage: channel_flow SERVER_BINARY
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "session.h"
+
+/** messages flooding the channel 1 */
+#define FLOOD_COUNT 6000
+
+/** bytes of each message of the flood */
+#define FLOOD_SIZE 1024
+
+/** window of the server, in bytes */
+#define WINDOW "65536"
+
+/**
+ * Connects to the server on the loopback, retrying while it starts
+ *
+ * @param port port of the server
+ * @param rcvbuf receive buffer of the socket, 0 for the default one
+ * @return the connected socket, -1 if the server never listened
+ */
+static int connect_server(uint16_t port, int rcvbuf)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int attempt = 0; attempt < 50; ++attempt) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        if (rcvbuf != 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(100000);
+    }
+    return -1;
+}
+
+/**
+ * Sends a frame
+ *
+ * @param fd connected socket
+ * @param type type of the frame
+ * @param channel channel of the frame
+ * @param payload payload of the frame
+ * @param length bytes of the payload
+ * @return 1 on success, -1 on error
+ */
+static int send_test_frame(int fd, uint8_t type, uint16_t channel,
+        const void *payload, uint32_t length)
+{
+    struct frame_header_t h = {length, type, 0, channel};
+    char header[FRAME_HEADER_SIZE];
+    frame_encode_header(&h, header);
+    struct iovec iov[2] = {
+        {header, FRAME_HEADER_SIZE},
+        {(void *) payload, length},
+    };
+    return send_all(fd, iov, 2);
+}
+
+/**
+ * Receives a frame, its payload truncated to the size of the buffer
+ *
+ * @param fd connected socket
+ * @param h header received
+ * @param payload where the start of the payload is stored
+ * @param size size of payload
+ * @return 1 on success, 0 if the server closed the connection, -1 on error
+ */
+static int recv_test_frame(int fd, struct frame_header_t *h, char *payload,
+        size_t size)
+{
+    char header[FRAME_HEADER_SIZE];
+    int status = recv_all(fd, header, FRAME_HEADER_SIZE);
+    if (status != 1) {
+        return status;
+    }
+    frame_decode_header(header, h);
+    char rest[FLOOD_SIZE];
+    size_t kept = h->length < size ? h->length : size;
+    if (kept > 0 && (status = recv_all(fd, payload, kept)) != 1) {
+        return status;
+    }
+    for (size_t left = h->length - kept; left > 0; ) {
+        size_t chunk = left < sizeof(rest) ? left : sizeof(rest);
+        if ((status = recv_all(fd, rest, chunk)) != 1) {
+            return status;
+        }
+        left -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * Floods the channel 1 and checks what the client with a session receives
+ *
+ * @param port port of the server
+ * @return 0 if the channel 2 overtook the flood and nothing was lost, 1
+ * otherwise
+ */
+static int run(uint16_t port)
+{
+    int client = connect_server(port, 4096);
+    int producer = connect_server(port, 0);
+    if (client == -1 || producer == -1) {
+        fprintf(stderr, "run: can't connect to the server\n");
+        return 1;
+    }
+    char hello[SESSION_HELLO_SIZE];
+    memset(hello, 0, sizeof(hello));
+    struct frame_header_t h;
+    char payload[16];
+    if (send_test_frame(client, FRAME_TYPE_HELLO, 0, hello,
+                sizeof(hello)) != 1 ||
+            recv_test_frame(client, &h, payload, sizeof(payload)) != 1 ||
+            h.type != FRAME_TYPE_HELLO ||
+            send_test_frame(client, FRAME_TYPE_JOIN, 1, NULL, 0) != 1 ||
+            send_test_frame(client, FRAME_TYPE_JOIN, 2, NULL, 0) != 1) {
+        fprintf(stderr, "run: can't open a session\n");
+        return 1;
+    }
+    // the joins are handled before the flood comes from another client
+    usleep(200000);
+    char message[FLOOD_SIZE];
+    memset(message, 'x', sizeof(message));
+    for (int i = 0; i < FLOOD_COUNT; ++i) {
+        snprintf(message, sizeof(message), "%05d", i);
+        if (send_test_frame(producer, FRAME_TYPE_DATA, 1, message,
+                    sizeof(message)) != 1) {
+            fprintf(stderr, "run: can't flood the channel 1\n");
+            return 1;
+        }
+    }
+    if (send_test_frame(producer, FRAME_TYPE_DATA, 2, "two", 3) != 1) {
+        fprintf(stderr, "run: can't send in the channel 2\n");
+        return 1;
+    }
+    usleep(500000);
+    int received = 0, overtaken = -1;
+    while (received < FLOOD_COUNT || overtaken == -1) {
+        if (recv_test_frame(client, &h, payload, sizeof(payload)) != 1) {
+            fprintf(stderr, "run: connection lost after %d messages\n",
+                    received);
+            return 1;
+        }
+        if (h.type != FRAME_TYPE_DATA) {
+            continue;
+        }
+        if (h.channel == 2) {
+            overtaken = received;
+            continue;
+        }
+        payload[5] = '\0';
+        if (h.channel != 1 || atoi(payload) != received) {
+            fprintf(stderr, "run: message %d of the channel 1 missing\n",
+                    received);
+            return 1;
+        }
+        received++;
+    }
+    printf("channel 2 received after %d of %d messages of the channel 1\n",
+            overtaken, FLOOD_COUNT);
+    close(client);
+    close(producer);
+    return overtaken < FLOOD_COUNT ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s SERVER_BINARY\n", argv[0]);
+        return 2;
+    }
+    uint16_t port = 20000 + getpid() % 20000;
+    char port_string[8];
+    snprintf(port_string, sizeof(port_string), "%u", port);
+    pid_t server = fork();
+    if (server == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (server == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        execl(argv[1], argv[1], "server", port_string, "-w", WINDOW,
+                (char *) NULL);
+        perror("execl");
+        _exit(127);
+    }
+    int status = run(port);
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    return status;
+}